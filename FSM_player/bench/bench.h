@@ -0,0 +1,72 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+// Sections of the host benchmark program, each runs in the scratch SD root dir
+
+// Audio streaming: throughput, underruns, gapless loops, AUDIO_FINISHED
+void bench_audio(const char* dir);
+
+// Core split: SPSC queues and the audio engine across two threads
+void bench_engine(const char* dir);
+
+// Format conversion kernels: speed and bit-exactness against references
+void bench_convert(const char* dir);
+
+// Crossfade mixer: bit-exactness against a reference mix, fades through the engine
+void bench_mix(const char* dir);
+
+// Config reload: state and audio carried over, swap cost, bad configs kept out
+void bench_reload(const char* dir);
+
+// Condition programs: against a plain evaluation of the JSON, shows with and without them
+void bench_program(const char* dir);
+
+// Built-in state table: same image as the sample config, boot time and RAM, same show
+void bench_builtin(const char* dir, const std::string& sample);
+
+// Timer wheel: against a list of deadlines, cost per tick, cue timing through the FSM
+void bench_timer(const char* dir);
+
+// LED sequencer: patterns against reference waveforms, the state LED through the FSM
+void bench_led(const char* dir);
+
+// Flash cache and state journal: boot time, resume after a power cut, appends cut off part way
+void bench_journal(const char* dir);
+
+// Serial protocol: framing with bits flipped, a controller through the FSM in virtual time
+void bench_serial(const char* dir);
+
+// Telemetry: cost of a sample and an event, dumps while the other core records
+void bench_telemetry(const char* dir);
+
+// Counts a check that failed (ok false), returns ok. The program exits with
+// 1 if any check of any section failed, so a script or CI run sees it.
+bool bench_check(bool ok);
+
+// A generated .wav file
+struct WavSpec {
+    const char* name;
+    uint16_t channels;
+    uint16_t bitsPerSample; // 4: IMA-ADPCM
+    uint32_t sampleRate;
+    uint32_t frames;
+    uint32_t extraChunk;    // size of a LIST chunk before "data", moves the samples off the usual offset
+};
+
+// Writes a .wav of pseudo-random samples, returns the sample bytes. An
+// IMA-ADPCM file ends in a short block, its last word filled up with samples.
+std::vector<uint8_t> write_wav(const std::string& path, const WavSpec& spec);
+
+// CRC of the first bytes bytes the output gets from a file's samples played
+// over and over, converted to outRate (0: the file's) and mono as
+// AudioConverter does it, worked out by the reference conversion
+uint32_t converted_crc(const std::vector<uint8_t>& data, const WavSpec& spec, uint32_t outRate, bool mono, uint64_t bytes);
+
+// Bytes the output gets from one play of the file
+uint64_t converted_bytes(const WavSpec& spec, uint32_t outRate, bool mono);
+
+#endif // BENCH_H
@@ -0,0 +1,479 @@
+// Host benchmark for AudioStream (env:native).
+//
+// Streams generated .wav files into the PcmFileSink on the virtual clock, the
+// way loop() services the stream on the Pico, and checks that the sink got
+// exactly the samples of the file, in order, for every pass of a loop. Then
+// measures trigger-to-sound latency with and without the prefetch cache, on
+// a card that takes time to answer.
+
+#include <Arduino.h>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "native_hal.h"
+#include "pcm_file_sink.h"
+#include "audio_stream.h"
+#include "audio_engine.h"
+#include "FSM.h"
+#include "sd_layout.h"
+#include "adpcm.h"
+#include "scheduler.h"
+#include "bench.h"
+
+typedef std::chrono::steady_clock bench_clock;
+
+static void put16(std::vector<uint8_t>& out, uint16_t v) {
+    out.push_back(v & 0xFF);
+    out.push_back(v >> 8);
+}
+
+static void put32(std::vector<uint8_t>& out, uint32_t v) {
+    put16(out, v & 0xFFFF);
+    put16(out, v >> 16);
+}
+
+std::vector<uint8_t> write_wav(const std::string& path, const WavSpec& spec) {
+    // IMA-ADPCM: blocks of random nibbles with valid headers, the last one short
+    bool adpcm = spec.bitsPerSample == 4;
+    uint16_t blockAlign = adpcm ? adpcm_block_align(spec.sampleRate, spec.channels) : spec.channels * (spec.bitsPerSample / 8);
+    uint16_t unit = 4 * spec.channels;
+    uint16_t perBlock = adpcm ? adpcm_samples_per_block(blockAlign, spec.channels) : 1;
+    uint32_t rest = spec.frames % perBlock;
+    size_t size = adpcm ? (size_t)(spec.frames / perBlock) * blockAlign + (rest ? (1 + (rest + 6) / 8) * unit : 0)
+                        : (size_t)spec.frames * blockAlign;
+    std::vector<uint8_t> data(size);
+    uint32_t x = 12345;
+    for (uint8_t& b : data) {
+        x = x * 1103515245 + 12345;
+        b = x >> 24;
+    }
+    for (size_t block = 0; adpcm && block < data.size(); block += blockAlign) {
+        for (uint16_t c = 0; c < spec.channels; c++) {
+            data[block + 4 * c + 2] %= ADPCM_MAX_INDEX + 1;
+            data[block + 4 * c + 3] = 0;
+        }
+    }
+
+    std::vector<uint8_t> out;
+    out.insert(out.end(), {'R', 'I', 'F', 'F'});
+    put32(out, 4 + (adpcm ? 28 : 24) + (spec.extraChunk ? 8 + spec.extraChunk : 0) + 8 + data.size());
+    out.insert(out.end(), {'W', 'A', 'V', 'E', 'f', 'm', 't', ' '});
+    put32(out, adpcm ? 20 : 16);
+    put16(out, adpcm ? WAV_FORMAT_IMA_ADPCM : WAV_FORMAT_PCM);
+    put16(out, spec.channels);
+    put32(out, spec.sampleRate);
+    put32(out, (uint32_t)((uint64_t)spec.sampleRate * blockAlign / perBlock));
+    put16(out, blockAlign);
+    put16(out, spec.bitsPerSample);
+    if (adpcm) {
+        put16(out, 2);
+        put16(out, perBlock);
+    }
+    if (spec.extraChunk) {
+        out.insert(out.end(), {'L', 'I', 'S', 'T'});
+        put32(out, spec.extraChunk);
+        out.insert(out.end(), spec.extraChunk, 0);
+    }
+    out.insert(out.end(), {'d', 'a', 't', 'a'});
+    put32(out, data.size());
+    out.insert(out.end(), data.begin(), data.end());
+
+    FILE* f = fopen(path.c_str(), "wb");
+    if (!f || fwrite(out.data(), 1, out.size(), f) != out.size()) {
+        perror(path.c_str());
+        exit(1);
+    }
+    fclose(f);
+    return data;
+}
+
+// Plays one file for at most seconds of virtual time, servicing the stream
+// every serviceMs, converted to outRate (0: the file's own) and mono. With
+// cached the file's start is in the prefetch cache when it starts, and is
+// read from there on every pass.
+static void run_stream(const char* dir, const WavSpec& spec, bool repeat, unsigned long serviceMs, unsigned long seconds,
+                       uint32_t outRate = 0, bool mono = false, bool cached = false) {
+    std::string path = std::string(dir) + "/bench.wav";
+    std::vector<uint8_t> data = write_wav(path, spec);
+
+    PcmFileSink sink;
+    AudioStream stream;
+    AudioPrefetch cache;
+    stream.setOutput(outRate, mono);
+    if (cached) {
+        stream.setPrefetch(&cache);
+    }
+    stream.begin(sd, sink);
+    if (cached) {
+        const char* paths[] = {"/bench.wav"};
+        stream.prefetchNext(paths, 1);
+        while (cache.service()) {
+        }
+    }
+
+    uint64_t start = native_micros();
+    uint64_t end = start + seconds * 1000000ULL;
+    double hostNs = 0;
+    bool finished = false;
+    stream.play("/bench.wav", repeat);
+    while (stream.isPlaying() && native_micros() < end) {
+        bench_clock::time_point t = bench_clock::now();
+        stream.service();
+        hostNs += std::chrono::duration<double, std::nano>(bench_clock::now() - t).count();
+        finished |= stream.takeFinished();
+        delay(serviceMs);
+    }
+    finished |= stream.takeFinished();
+    stream.stop();
+    unlink(path.c_str());
+
+    bool intact = sink.getCrc() == converted_crc(data, spec, outRate, mono, sink.getBytesWritten());
+    char result[24];
+    if (!bench_check(intact)) {
+        snprintf(result, sizeof(result), "CORRUPT");
+    } else if (repeat) {
+        snprintf(result, sizeof(result), "%lu loops", (unsigned long)stream.getLoops());
+    } else {
+        bool complete = sink.getBytesWritten() == converted_bytes(spec, outRate, mono) && finished;
+        snprintf(result, sizeof(result), bench_check(complete) ? "complete" : "SHORT");
+    }
+    std::string name = std::string(spec.name) + (cached ? ", cached" : "");
+    printf("%-32s %6s %5lu %7lu %9.1f %10.1f %10lu %10s\n", name.c_str(), repeat ? "loop" : "once", serviceMs,
+           (unsigned long)stream.getReads(), stream.getReads() ? stream.getBytesRead() / 1024.0 / stream.getReads() : 0.0,
+           stream.getBytesRead() / (hostNs * 1e-9) / 1e6, (unsigned long)sink.getUnderruns(), result);
+}
+
+// Card timing for the layout and latency runs: 1 ms per access, 2 MB/s
+#define SD_ACCESS_US    1000
+#define SD_BYTES_PER_MS 2000
+
+// Plays a file on a card with access and transfer times, stored in one piece
+// or split into fragments of fragmentBytes, optionally repacked before it
+// plays. Reports how busy the card was and whether the samples got through.
+static void run_layout(const char* dir, const WavSpec& spec, uint32_t fragmentBytes, bool repack) {
+    std::string path = std::string(dir) + "/layout.wav";
+    std::vector<uint8_t> data = write_wav(path, spec);
+    native_sd_fragment("/layout.wav", fragmentBytes);
+    const char* problem = repack ? sd_repack(sd, "/layout.wav") : nullptr;
+    FileLayout layout = sd_file_layout(sd, "/layout.wav");
+
+    PcmFileSink sink;
+    AudioStream stream;
+    stream.begin(sd, sink);
+    native_sd_timing(SD_ACCESS_US, SD_BYTES_PER_MS);
+    uint64_t start = native_micros();
+    uint64_t busy = native_sd_busy_us();
+    stream.play("/layout.wav", false);
+    while (stream.isPlaying() && native_micros() - start < 30000000ULL) {
+        stream.service();
+        delay(AUDIO_SERVICE_MS);
+    }
+    double load = 100.0 * (native_sd_busy_us() - busy) / (native_micros() - start);
+    native_sd_timing(0, 0);
+    stream.stop();
+    native_sd_fragment("/layout.wav", 0);
+    unlink(path.c_str());
+
+    char stored[24];
+    if (fragmentBytes) {
+        snprintf(stored, sizeof(stored), "%lu KB pieces%s", (unsigned long)fragmentBytes / 1024, repack ? ", repacked" : "");
+    } else {
+        snprintf(stored, sizeof(stored), "contiguous");
+    }
+    bool intact = sink.getCrc() == converted_crc(data, spec, 0, false, sink.getBytesWritten()) &&
+                  sink.getBytesWritten() == converted_bytes(spec, 0, false);
+    printf("%-24s %-22s %-10s %7lu %7lu %8.1f%% %10lu %10s\n", spec.name, stored,
+           !bench_check(!problem) ? "REPACK" : layout == LAYOUT_CONTIGUOUS ? "raw" : "fat",
+           (unsigned long)stream.getReads(), (unsigned long)stream.getRawReads(), load,
+           (unsigned long)sink.getUnderruns(), bench_check(intact) ? "complete" : "CORRUPT");
+}
+
+#define INDEX_FILES 300
+
+// Mean and longest time from play() on a folder to its first sample at the
+// output, over plays plays of a stream with or without the folder index
+static void run_folder_start(const char* path, AudioIndex* index, unsigned long plays) {
+    PcmFileSink sink;
+    AudioStream stream;
+    stream.setIndex(index);
+    stream.begin(sd, sink);
+    double sum = 0;
+    uint64_t longest = 0;
+    for (unsigned long k = 0; k < plays; k++) {
+        uint64_t start = native_micros();
+        stream.play(path, false);
+        while (stream.isPlaying() && sink.getFirstSoundUs() < start) {
+            stream.service();
+            delay(1);
+        }
+        uint64_t latency = sink.getFirstSoundUs() - start;
+        sum += latency;
+        longest = std::max(longest, latency);
+        stream.stop();
+        delay(100);
+    }
+    printf("%-24s %10.2f %10.2f\n", index ? "index" : "directory scan", sum / plays / 1000.0, longest / 1000.0);
+}
+
+// Builds the index of a folder of INDEX_FILES short clips, boots again with
+// it unchanged and after adding a file, then compares how long a track takes
+// to start with and without it
+static void run_index(const char* dir) {
+    std::string folder = std::string(dir) + "/clips";
+    mkdir(folder.c_str(), 0755);
+    WavSpec spec = {"", 1, 16, 22050, 4410, 0};
+    char name[32];
+    for (int i = 0; i < INDEX_FILES; i++) {
+        snprintf(name, sizeof(name), "/clip_%03d.wav", i);
+        write_wav(folder + name, spec);
+    }
+
+    printf("\nFolder index, %d files in one folder, card at %d us per access and %d KB/s\n\n",
+           INDEX_FILES, SD_ACCESS_US, SD_BYTES_PER_MS);
+    printf("%-24s %10s %10s\n", "boot", "ms", "rescanned");
+    const char* path = "/clips/";
+    uint8_t mode = AUDIO_SELECT_SEQUENTIAL;
+    AudioIndex index;
+    native_sd_timing(SD_ACCESS_US, SD_BYTES_PER_MS);
+    const char* boots[] = {"no index yet", "unchanged", "one file added"};
+    for (int b = 0; b < 3; b++) {
+        if (b == 2) {
+            write_wav(folder + "/clip_new.wav", spec);
+        }
+        uint64_t start = native_micros();
+        bool ok = index.begin(sd, &path, &mode, 1);
+        printf("%-24s %10.1f %10u%s\n", boots[b], (native_micros() - start) / 1000.0, index.getRescanned(),
+               bench_check(ok && index.getNumFiles() == (uint32_t)INDEX_FILES + (b == 2)) ? "" : "  FAILED");
+    }
+
+    printf("\n%-24s %10s %10s\n", "track start", "mean_ms", "max_ms");
+    run_folder_start(path, nullptr, 20);
+    run_folder_start(path, &index, 20);
+    native_sd_timing(0, 0);
+
+    index.begin(sd, nullptr, nullptr, 0);
+    for (int i = 0; i < INDEX_FILES; i++) {
+        snprintf(name, sizeof(name), "/clip_%03d.wav", i);
+        unlink((folder + name).c_str());
+    }
+    unlink((folder + "/clip_new.wav").c_str());
+    rmdir(folder.c_str());
+    unlink((std::string(dir) + AUDIO_INDEX_PATH).c_str());
+}
+
+// The FSM and the audio engine take turns in one thread, in virtual time.
+// The scheduler sleeps until either has something due, or the engine notifies.
+static unsigned long earliest(unsigned long a, unsigned long b) {
+    return (long)(a - b) < 0 ? a : b;
+}
+
+// Runs a two state config where state 0 plays a file once and moves on with
+// AUDIO_FINISHED, returns how long after the file started the transition came
+static void run_audio_finished(const char* dir) {
+    std::string folder = std::string(dir) + "/audio_finished";
+    mkdir(folder.c_str(), 0755);
+    WavSpec spec = {"", 1, 16, 22050, 22050 * 3 / 2, 0};
+    std::string wav = folder + "/take.wav";
+    write_wav(wav, spec);
+
+    std::string config = std::string(dir) + "/FSM_Config.json";
+    FILE* f = fopen(config.c_str(), "w");
+    fprintf(f, "{\"states\":["
+               "{\"id\":0,\"audioFile\":\"/audio_finished/\",\"repeat\":false,\"blinkCount\":1,\"transitions\":"
+               "[{\"targetState\":1,\"conditions\":[{\"type\":\"AUDIO_FINISHED\"}]}]},"
+               "{\"id\":1,\"audioFile\":\"\",\"repeat\":false,\"blinkCount\":2,\"transitions\":[]}]}\n");
+    fclose(f);
+
+    PcmFileSink sink;
+    AudioStream stream;
+    FSM fsm;
+    fsm.loadConfiguration();
+    stream.begin(sd, sink);
+    AudioEngine engine;
+    engine.begin(stream, Scheduler::notify);
+    fsm.setAudio(&engine);
+    fsm.begin();
+    Scheduler scheduler;
+    scheduler.begin(fsm.getInputGpioMask());
+
+    uint64_t start = native_micros();
+    while (fsm.getCurrentState() == 0 && native_micros() - start < 5000000) {
+        fsm.update();
+        engine.run();
+        scheduler.sleepUntil(earliest(fsm.nextDeadline(), engine.nextDeadline()));
+    }
+    double ms = (native_micros() - start) / 1000.0;
+    printf("\nAUDIO_FINISHED: 1500.0 ms file, transition after %.1f ms (%s), %lu wake-ups\n",
+           ms, bench_check(fsm.getCurrentState() == 1) ? "ok" : "MISSING", scheduler.getWakeups());
+
+    unlink(wav.c_str());
+    rmdir(folder.c_str());
+    unlink(config.c_str());
+}
+
+#define PREFETCH_STATES 8
+
+// Plays a chain of states, each with its own folder of audio, moving on when
+// a sensor closes. Reports the time from the sensor's first edge to the first
+// sample of the new state's audio playing, after what the output still held.
+static void run_prefetch(const char* dir, bool usePrefetch) {
+    std::string config = std::string(dir) + "/FSM_Config.json";
+    FILE* f = fopen(config.c_str(), "w");
+    fprintf(f, "{\"debounceMode\":\"leading\",\"states\":[");
+    for (int i = 0; i < PREFETCH_STATES; i++) {
+        fprintf(f, "%s{\"id\":%d,\"audioFile\":\"/prefetch/state_%d/\",\"repeat\":true,\"blinkCount\":1,\"transitions\":"
+                   "[{\"targetState\":%d,\"conditions\":[{\"type\":\"SENSOR\",\"data\":{\"sensorPin\":%d,\"state\":false}}]}]}",
+                i ? "," : "", i, i, (i + 1) % PREFETCH_STATES, i % 8);
+    }
+    fprintf(f, "]}\n");
+    fclose(f);
+
+    PcmFileSink sink;
+    AudioStream stream;
+    AudioPrefetch cache;
+    FSM fsm;
+    fsm.loadConfiguration();
+    if (usePrefetch) {
+        stream.setPrefetch(&cache);
+    }
+    stream.begin(sd, sink);
+    AudioEngine engine;
+    engine.begin(stream, Scheduler::notify);
+    fsm.setAudio(&engine);
+    fsm.begin();
+    Scheduler scheduler;
+    scheduler.begin(fsm.getInputGpioMask());
+    native_sd_timing(SD_ACCESS_US, SD_BYTES_PER_MS);
+
+    // A press every 1.2 s, on the sensor the current state waits for
+    const unsigned long presses = 40;
+    uint64_t start = native_micros();
+    std::vector<uint64_t> pressAt;
+    for (unsigned long k = 0; k < presses; k++) {
+        uint64_t at = start + 1000000 + k * 1200000 + (k * 7919) % 100000;
+        native_schedule_pin(at, k % 8, LOW);
+        native_schedule_pin(at + 80000, k % 8, HIGH);
+        pressAt.push_back(at);
+    }
+
+    unsigned long heard = 0;
+    double latencySum = 0;
+    uint64_t latencyMax = 0;
+    uint64_t end = pressAt.back() + 1000000;
+    while (native_micros() < end) {
+        fsm.update();
+        engine.run();
+        // Sound of press k: the first write after it, once the state has moved on
+        if (heard < presses && fsm.getCurrentState() == (heard + 1) % PREFETCH_STATES &&
+            sink.getFirstSoundUs() >= pressAt[heard]) {
+            uint64_t latency = sink.getFirstSoundUs() - pressAt[heard];
+            latencySum += latency;
+            latencyMax = std::max(latencyMax, latency);
+            heard++;
+        }
+        scheduler.sleepUntil(earliest(fsm.nextDeadline(), engine.nextDeadline()));
+    }
+    native_sd_timing(0, 0);
+    bench_check(heard == presses && sink.getUnderruns() == 0);
+
+    printf("%-10s %8lu %8lu %12.2f %12.2f %6lu %7lu %10lu\n", usePrefetch ? "prefetch" : "cold",
+           presses, heard, heard ? latencySum / heard / 1000.0 : 0.0, latencyMax / 1000.0,
+           (unsigned long)cache.getHits(), (unsigned long)cache.getMisses(), (unsigned long)sink.getUnderruns());
+}
+
+static void prefetch_files(const char* dir, bool create) {
+    std::string root = std::string(dir) + "/prefetch";
+    if (create) {
+        mkdir(root.c_str(), 0755);
+    }
+    for (int i = 0; i < PREFETCH_STATES; i++) {
+        std::string folder = root + "/state_" + std::to_string(i);
+        std::string wav = folder + "/take_" + std::to_string(i) + ".wav";
+        std::string other = folder + "/notes.txt";
+        if (create) {
+            mkdir(folder.c_str(), 0755);
+            WavSpec spec = {"", 1, 16, 22050, 22050 * 3, 0};
+            write_wav(wav, spec);
+            FILE* f = fopen(other.c_str(), "w");
+            fclose(f);
+        } else {
+            unlink(wav.c_str());
+            unlink(other.c_str());
+            rmdir(folder.c_str());
+        }
+    }
+    if (!create) {
+        rmdir(root.c_str());
+    }
+}
+
+void bench_audio(const char* dir) {
+    printf("\nAudio streaming, %d x %d byte ring, 35 ms sink buffer\n\n", AUDIO_RING_BLOCKS, AUDIO_BLOCK_SIZE);
+    printf("%-32s %6s %5s %7s %9s %10s %10s %10s\n",
+           "file", "play", "svc", "reads", "KB/read", "host_MB/s", "underruns", "result");
+
+    const WavSpec mono = {"16-bit mono 22.05 kHz", 1, 16, 22050, 22050 * 10, 0};
+    const WavSpec stereo = {"16-bit stereo 44.1 kHz", 2, 16, 44100, 44100 * 10, 0};
+    const WavSpec wide = {"24-bit stereo 48 kHz", 2, 24, 48000, 48000 * 10, 26};   // frames straddle blocks
+    const WavSpec shortLoop = {"16-bit stereo 0.37 s", 2, 16, 44100, 16317, 0};
+    const WavSpec monoUp = {"22.05k mono to 44.1k", 1, 16, 22050, 22050 * 10, 0};
+    const WavSpec wideDown = {"24-bit 48k to 44.1k mono", 2, 24, 48000, 48000 * 10, 26};
+    const WavSpec adpcm = {"ADPCM stereo 44.1 kHz", 2, 4, 44100, 44100 * 10 + 300, 0};    // short last block
+    const WavSpec adpcmDown = {"ADPCM 48k to 44.1k mono", 2, 4, 48000, 48000 * 10, 26};
+
+    run_stream(dir, mono, false, AUDIO_SERVICE_MS, 20);
+    run_stream(dir, stereo, false, AUDIO_SERVICE_MS, 20);
+    run_stream(dir, wide, false, AUDIO_SERVICE_MS, 20);
+    run_stream(dir, shortLoop, true, AUDIO_SERVICE_MS, 10);
+    run_stream(dir, wide, true, AUDIO_SERVICE_MS, 30);
+    run_stream(dir, stereo, false, 50, 20);     // serviced too rarely for the sink buffer
+    run_stream(dir, monoUp, false, AUDIO_SERVICE_MS, 20, 44100, false);
+    run_stream(dir, wideDown, false, AUDIO_SERVICE_MS, 20, 44100, true);
+    run_stream(dir, wideDown, true, AUDIO_SERVICE_MS, 30, 44100, true);
+    run_stream(dir, adpcm, false, AUDIO_SERVICE_MS, 20);
+    run_stream(dir, adpcm, true, AUDIO_SERVICE_MS, 30);
+    run_stream(dir, adpcmDown, true, AUDIO_SERVICE_MS, 30, 44100, true);
+    run_stream(dir, stereo, false, AUDIO_SERVICE_MS, 20, 0, false, true);
+    run_stream(dir, shortLoop, true, AUDIO_SERVICE_MS, 10, 0, false, true);
+    run_stream(dir, wide, true, AUDIO_SERVICE_MS, 30, 0, false, true);
+    run_stream(dir, adpcm, false, AUDIO_SERVICE_MS, 20, 0, false, true);
+
+    printf("\nCard layout, card at %d us per access and %d KB/s\n\n", SD_ACCESS_US, SD_BYTES_PER_MS);
+    printf("%-24s %-22s %-10s %7s %7s %9s %10s %10s\n",
+           "file", "stored", "path", "reads", "raw", "card", "underruns", "result");
+    run_layout(dir, stereo, 0, false);
+    run_layout(dir, stereo, 4096, false);
+    run_layout(dir, stereo, 4096, true);
+    run_layout(dir, wide, 0, false);
+    run_layout(dir, wide, 4096, false);
+    run_layout(dir, adpcm, 0, false);
+    run_layout(dir, adpcm, 4096, false);
+
+    run_index(dir);
+
+    run_audio_finished(dir);
+
+    printf("\nTrigger to sound, %d states with a folder of audio each, card at %d us per access and %d KB/s,\n"
+           "cache of %d x %u bytes, %d ms of %d bytes/s\n\n",
+           PREFETCH_STATES, SD_ACCESS_US, SD_BYTES_PER_MS, AUDIO_PREFETCH_SLOTS, (unsigned)AUDIO_PREFETCH_BYTES,
+           AUDIO_PREFETCH_LEAD_MS, AUDIO_PREFETCH_RATE);
+    printf("%-10s %8s %8s %12s %12s %6s %7s %10s\n", "audio", "presses", "heard", "mean_ms", "max_ms", "hits",
+           "misses", "underruns");
+    prefetch_files(dir, true);
+    run_prefetch(dir, false);
+    run_prefetch(dir, true);
+    prefetch_files(dir, false);
+    unlink((std::string(dir) + "/FSM_Config.json").c_str());
+
+    printf("\ncached: the file's start was in the prefetch cache, reads counts the card reads after it\n");
+    printf("svc: ms of virtual time between service() calls\n");
+    printf("result: complete/loops when the sink got exactly the file's samples in order, every pass\n"
+           "        (converted ones as the reference conversion in bench_convert.cpp makes them)\n");
+    printf("path: raw sector reads for a contiguous file, reads through the FAT for a fragmented one\n");
+    printf("card: share of virtual time the card was busy with the file, less is more headroom\n");
+    printf("mean/max_ms: sensor's first edge to the new state's first sample at the output, virtual time;\n"
+           "            copying a cached start from RAM is not charged, card accesses are. The output\n"
+           "            runs on from state to state, so the old audio it still held plays first\n");
+}
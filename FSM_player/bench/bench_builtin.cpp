@@ -0,0 +1,151 @@
+// Host benchmark for the state table built into the firmware (env:native).
+//
+// include/fsm_builtin_config.h is generated from the sample FSM_Config.json.
+// Checks that it is the image the player compiles from that JSON byte for
+// byte, then compares booting from the JSON, from its compiled .bin and from
+// the built-in table: the time loadConfiguration takes on the host and the
+// RAM the state table takes. Last the same visitors walk through the FSM
+// booted from the JSON and from the built-in table, which must reach every
+// state at the same millisecond.
+
+#include <Arduino.h>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <unistd.h>
+#include "native_hal.h"
+#include "FSM.h"
+#include "fsm_builtin_config.h"
+#include "bench.h"
+
+typedef std::chrono::steady_clock bench_clock;
+
+#define BUILTIN_RUN_MS 60000
+#define BUILTIN_LOADS  50
+
+static uint32_t builtin_seed;
+
+static uint32_t builtin_random(uint32_t n) {
+    builtin_seed = builtin_seed * 1103515245UL + 12345UL;
+    return (builtin_seed >> 8) % n;
+}
+
+// Mean microseconds of a boot: loadConfiguration(), or with builtin the card
+// and the built-in table, as loadConfiguration() does it in FSM_BUILTIN_CONFIG builds
+static double time_boot(bool builtin) {
+    bench_clock::time_point start = bench_clock::now();
+    for (int i = 0; i < BUILTIN_LOADS; i++) {
+        FSM fsm;
+        if (builtin) {
+            sd.begin(SdSpiConfig(SS, DEDICATED_SPI, SD_SCK_MHZ(50)));
+            fsm.useBuiltin(fsm_builtin.bytes());
+        } else {
+            fsm.loadConfiguration();
+        }
+    }
+    return std::chrono::duration<double, std::micro>(bench_clock::now() - start).count() / BUILTIN_LOADS;
+}
+
+// Visitors pressing the sample's sensors at random, the state at every millisecond
+static std::vector<uint8_t> run_visitors(bool builtin, double& updateNs) {
+    for (uint8_t p = 0; p < 8; p++) {
+        native_set_pin(p, HIGH);
+    }
+    FSM fsm;
+    if (builtin) {
+        fsm.useBuiltin(fsm_builtin.bytes());
+    } else {
+        fsm.loadConfiguration();
+    }
+    native_set_micros(0);
+    fsm.begin();
+
+    builtin_seed = 0xB017;
+    std::vector<uint8_t> states;
+    states.reserve(BUILTIN_RUN_MS);
+    unsigned long nextPress = 300;
+    int8_t pressed = -1;
+    unsigned long releaseAt = 0;
+    double ns = 0;
+    for (unsigned long ms = 0; ms < BUILTIN_RUN_MS; ms++) {
+        if (pressed < 0 && ms >= nextPress) {
+            pressed = builtin_random(fsm_builtin.header.numInputs);
+            native_set_pin(fsm_builtin.header.inputPins[pressed], LOW);
+            releaseAt = ms + 50 + builtin_random(300);
+        } else if (pressed >= 0 && ms >= releaseAt) {
+            native_set_pin(fsm_builtin.header.inputPins[pressed], HIGH);
+            pressed = -1;
+            nextPress = ms + 100 + builtin_random(800);
+        }
+        bench_clock::time_point start = bench_clock::now();
+        fsm.update();
+        ns += std::chrono::duration<double, std::nano>(bench_clock::now() - start).count();
+        states.push_back(fsm.getCurrentState());
+        native_advance_micros(1000);
+    }
+    updateNs = ns / BUILTIN_RUN_MS;
+    return states;
+}
+
+void bench_builtin(const char* dir, const std::string& json) {
+    printf("\nBuilt-in state table (include/fsm_builtin_config.h), FSM_USES 0x%02X\n\n", fsm_builtin_uses(fsm_builtin));
+
+    // The sample config on the card, as at boot
+    FILE* f = fopen((std::string(dir) + "/FSM_Config.json").c_str(), "wb");
+    fwrite(json.data(), 1, json.size(), f);
+    fclose(f);
+    DynamicJsonDocument doc(json.size() * 8 + 4096);
+    deserializeJson(doc, json.data(), json.size(), DeserializationOption::NestingLimit(FSM_JSON_NESTING));
+    const char* problem = nullptr;
+    uint32_t size = fsm_image_compile(doc.as<JsonObject>(), nullptr, 0, &problem);
+    std::vector<uint8_t> image(size);
+    if (size) {
+        size = fsm_image_compile(doc.as<JsonObject>(), image.data(), size, &problem);
+    }
+    const char* check = fsm_image_check(fsm_builtin.bytes(), fsm_builtin.header.imageSize);
+    bool same = size == fsm_builtin.header.imageSize && memcmp(image.data(), fsm_builtin.bytes(), size) == 0;
+    printf("image check: %s, same as the compiled FSM_Config.json: %s\n", check ? check : "ok", same ? "yes" : "no");
+    if (!bench_check(!check)) {
+        printf("FAIL: the generated table does not pass the image check\n");
+        return;
+    }
+    if (!same) {
+        printf("(generated from another config, run fsm_codegen again to compare)\n");
+        return;
+    }
+
+    // Boot, the same card each time
+    std::string bin = std::string(dir) + "/FSM_Config.bin";
+    unlink(bin.c_str());
+    double jsonUs = time_boot(false);
+    f = fopen(bin.c_str(), "wb");
+    fwrite(image.data(), 1, size, f);
+    fclose(f);
+    double binUs = time_boot(false);
+    unlink(bin.c_str());
+    double builtinUs = time_boot(true);
+
+    printf("\n%-22s %10s %12s\n", "boot from", "load_us", "table_RAM_B");
+    printf("%-22s %10.1f %12lu\n", "FSM_Config.json", jsonUs, (unsigned long)size);
+    printf("%-22s %10.1f %12lu\n", "FSM_Config.bin", binUs, (unsigned long)size);
+    printf("%-22s %10.1f %12d\n", "built in", builtinUs, 0);
+
+    // The same show either way
+    double jsonNs, builtinNs;
+    std::vector<uint8_t> fromJson = run_visitors(false, jsonNs);
+    std::vector<uint8_t> fromBuiltin = run_visitors(true, builtinNs);
+    unsigned long changes = 0;
+    long firstDiff = -1;
+    for (size_t ms = 0; ms < fromJson.size(); ms++) {
+        changes += ms > 0 && fromJson[ms] != fromJson[ms - 1];
+        if (firstDiff < 0 && fromJson[ms] != fromBuiltin[ms]) {
+            firstDiff = ms;
+        }
+    }
+    printf("\n%d s of visitors: %lu state changes, update %.0f ns from JSON, %.0f ns built in, %s\n",
+           BUILTIN_RUN_MS / 1000, changes, jsonNs, builtinNs, bench_check(firstDiff < 0) ? "same states" : "FAIL");
+    if (firstDiff >= 0) {
+        printf("FAIL: the built-in table is in state %u at %ld ms, the JSON in state %u\n", fromBuiltin[firstDiff],
+               firstDiff, fromJson[firstDiff]);
+    }
+}
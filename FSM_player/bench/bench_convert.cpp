@@ -0,0 +1,496 @@
+// Host benchmark for the format conversion kernels (env:native).
+//
+// Runs each kernel of audio_convert.h over a few million random samples, in
+// the pieces AudioStream hands it, and compares every output sample with a
+// reference implementation written sample by sample from the definitions in
+// audio_convert.h, in 64-bit arithmetic. The references only share the
+// resampler's coefficient table with the kernels. bench_audio.cpp uses the
+// same references to check what the stream plays from converted files.
+
+#include <Arduino.h>
+#include <chrono>
+#include <math.h>
+#include <string>
+#include <vector>
+#include "audio_convert.h"
+#include "adpcm.h"
+#include "fsm_image.h"
+#include "bench.h"
+
+typedef std::chrono::steady_clock bench_clock;
+
+#define CONVERT_SAMPLES (1 << 21)
+
+static uint32_t ref_xorshift(uint32_t& x) {
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return x;
+}
+
+static int16_t ref_clamp(int64_t x) {
+    return x > 32767 ? 32767 : x < -32768 ? -32768 : (int16_t)x;
+}
+
+static int64_t ref_floor_div(int64_t a, int64_t b) {
+    return a >= 0 ? a / b : -((-a + b - 1) / b);
+}
+
+// IMA-ADPCM as the standard describes it, one nibble at a time
+static const int16_t ref_adpcm_steps[89] = {
+    7, 8, 9, 10, 11, 12, 13, 14, 16, 17, 19, 21, 23, 25, 28, 31, 34, 37, 41, 45,
+    50, 55, 60, 66, 73, 80, 88, 97, 107, 118, 130, 143, 157, 173, 190, 209, 230,
+    253, 279, 307, 337, 371, 408, 449, 494, 544, 598, 658, 724, 796, 876, 963,
+    1060, 1166, 1282, 1411, 1552, 1707, 1878, 2066, 2272, 2499, 2749, 3024, 3327,
+    3660, 4026, 4428, 4871, 5358, 5894, 6484, 7132, 7845, 8630, 9493, 10442, 11487,
+    12635, 13899, 15289, 16818, 18500, 20350, 22385, 24623, 27086, 29794, 32767
+};
+
+static int16_t ref_adpcm_nibble(int32_t& predictor, int32_t& index, uint8_t nibble) {
+    static const int ref_index_change[16] = {-1, -1, -1, -1, 2, 4, 6, 8, -1, -1, -1, -1, 2, 4, 6, 8};
+    int32_t step = ref_adpcm_steps[index];
+    int32_t difference = step >> 3;
+    if (nibble & 4) {
+        difference += step;
+    }
+    if (nibble & 2) {
+        difference += step >> 1;
+    }
+    if (nibble & 1) {
+        difference += step >> 2;
+    }
+    predictor += (nibble & 8) ? -difference : difference;
+    predictor = predictor > 32767 ? 32767 : predictor < -32768 ? -32768 : predictor;
+    index += ref_index_change[nibble];
+    index = index < 0 ? 0 : index > 88 ? 88 : index;
+    return (int16_t)predictor;
+}
+
+// All samples of IMA-ADPCM data, interleaved, every nibble of a short last block included
+static std::vector<int16_t> ref_adpcm_decode(const uint8_t* data, size_t size, uint16_t channels, uint16_t blockAlign) {
+    std::vector<int16_t> out;
+    for (size_t block = 0; block < size; block += blockAlign) {
+        size_t end = block + blockAlign < size ? block + blockAlign : size;
+        int32_t predictor[2];
+        int32_t index[2];
+        for (uint16_t c = 0; c < channels; c++) {
+            const uint8_t* header = data + block + 4 * c;
+            predictor[c] = (int16_t)(header[0] | (header[1] << 8));
+            index[c] = header[2] > 88 ? 88 : header[2];
+            out.push_back((int16_t)predictor[c]);
+        }
+        for (size_t word = block + 4 * channels; word < end; word += 4 * channels) {
+            int16_t samples[2][8];
+            for (uint16_t c = 0; c < channels; c++) {
+                for (int i = 0; i < 8; i++) {
+                    uint8_t byte = data[word + 4 * c + i / 2];
+                    samples[c][i] = ref_adpcm_nibble(predictor[c], index[c], i % 2 ? byte >> 4 : byte & 0x0F);
+                }
+            }
+            for (int i = 0; i < 8; i++) {
+                for (uint16_t c = 0; c < channels; c++) {
+                    out.push_back(samples[c][i]);
+                }
+            }
+        }
+    }
+    return out;
+}
+
+// Frames one pass of a generated file plays
+static uint32_t played_frames(const WavSpec& spec) {
+    if (spec.bitsPerSample != 4) {
+        return spec.frames;
+    }
+    uint16_t perBlock = adpcm_samples_per_block(adpcm_block_align(spec.sampleRate, spec.channels), spec.channels);
+    uint32_t rest = spec.frames % perBlock;
+    return spec.frames / perBlock * perBlock + (rest ? 1 + (rest + 6) / 8 * 8 : 0);
+}
+
+// A sample scaled to 32 bits, to 16 bits with TPDF dither and rounding
+static int16_t ref_dither(int64_t x, uint32_t& dither) {
+    uint32_t r = ref_xorshift(dither);
+    int64_t r1 = r & 0xFFFF;
+    int64_t r2 = r >> 16;
+    return ref_clamp(ref_floor_div(x + r1 + r2 - 65536 + 32768, 65536));
+}
+
+// Sample i of a file's sample bytes as a 16-bit sample (8 and 16-bit) or
+// scaled to 32 bits (24 and 32-bit)
+static int64_t ref_sample(const uint8_t* data, uint16_t bits, size_t i) {
+    const uint8_t* p = data + i * (bits / 8);
+    switch (bits) {
+        case 8:
+            return ((int64_t)p[0] - 128) * 256;
+        case 16:
+            return (int16_t)(p[0] | (p[1] << 8));
+        case 24: {
+            int64_t v = p[0] | (p[1] << 8) | (p[2] << 16);
+            return (v >= (1 << 23) ? v - (1 << 24) : v) * 256;
+        }
+        default:
+            return (int32_t)((uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24));
+    }
+}
+
+// Decodes a file's frames one after the other, from the start again after
+// the last, into 16-bit frames of the output's channel count
+class RefDecoder {
+    public:
+        RefDecoder(const std::vector<uint8_t>& data_, const WavSpec& spec_, bool mono)
+            : data(data_), spec(spec_), outChannels(mono ? 1 : spec_.channels), frames(played_frames(spec_)), frame(0),
+              dither(AUDIO_DITHER_SEED) {
+            if (spec.bitsPerSample == 4) {
+                adpcm = ref_adpcm_decode(data.data(), data.size(), spec.channels,
+                                         adpcm_block_align(spec.sampleRate, spec.channels));
+            }
+        }
+
+        uint16_t channels() const { return outChannels; }
+
+        void next(int16_t* out) {
+            int64_t s[2];
+            for (uint16_t c = 0; c < spec.channels; c++) {
+                size_t i = (size_t)frame * spec.channels + c;
+                if (spec.bitsPerSample == 4) {
+                    s[c] = adpcm[i];
+                } else {
+                    int64_t x = ref_sample(data.data(), spec.bitsPerSample, i);
+                    s[c] = spec.bitsPerSample > 16 ? ref_dither(x, dither) : x;
+                }
+            }
+            if (outChannels < spec.channels) {
+                out[0] = (int16_t)ref_floor_div(s[0] + s[1], 2);
+            } else {
+                for (uint16_t c = 0; c < spec.channels; c++) {
+                    out[c] = (int16_t)s[c];
+                }
+            }
+            frame = (frame + 1) % frames;
+        }
+
+    private:
+        const std::vector<uint8_t>& data;
+        const WavSpec& spec;
+        uint16_t outChannels;
+        uint32_t frames;
+        uint32_t frame;
+        uint32_t dither;
+        std::vector<int16_t> adpcm;     // IMA-ADPCM, decoded up front
+};
+
+// Output frame n of the resampler: the phase row at n * step over the input
+// frames up to the one there, silence before the first
+static void ref_resample(const Resampler& table, const std::vector<int16_t>& in, uint16_t channels, uint64_t n, int16_t* out) {
+    uint64_t position = n * table.getStep();
+    int64_t newest = (int64_t)(position >> 32);
+    const int16_t* row = table.getPhase((uint32_t)position >> (32 - AUDIO_RESAMPLE_PHASE_BITS));
+    for (uint16_t c = 0; c < channels; c++) {
+        int64_t acc = 0;
+        for (int k = 0; k < AUDIO_RESAMPLE_TAPS; k++) {
+            int64_t i = newest - (AUDIO_RESAMPLE_TAPS - 1) + k;
+            acc += i < 0 ? 0 : (int64_t)row[k] * in[i * channels + c];
+        }
+        out[c] = ref_clamp(ref_floor_div(acc + 16384, 32768));
+    }
+}
+
+// The first frames output frames of the file played over and over
+static std::vector<int16_t> ref_convert(const std::vector<uint8_t>& data, const WavSpec& spec, uint32_t outRate, bool mono,
+                                        uint64_t frames) {
+    RefDecoder decoder(data, spec, mono);
+    uint16_t channels = decoder.channels();
+    std::vector<int16_t> out(frames * channels);
+    if (!outRate || outRate == spec.sampleRate) {
+        for (uint64_t n = 0; n < frames; n++) {
+            decoder.next(&out[n * channels]);
+        }
+        return out;
+    }
+
+    Resampler table;
+    table.begin(spec.sampleRate, outRate, channels);
+    uint64_t needed = frames ? ((frames - 1) * table.getStep() >> 32) + 1 : 0;
+    std::vector<int16_t> in(needed * channels);
+    for (uint64_t m = 0; m < needed; m++) {
+        decoder.next(&in[m * channels]);
+    }
+    for (uint64_t n = 0; n < frames; n++) {
+        ref_resample(table, in, channels, n, &out[n * channels]);
+    }
+    return out;
+}
+
+uint32_t converted_crc(const std::vector<uint8_t>& data, const WavSpec& spec, uint32_t outRate, bool mono, uint64_t bytes) {
+    uint16_t frame = (mono ? 1 : spec.channels) * 2;
+    if (spec.bitsPerSample == 16 && !mono && (!outRate || outRate == spec.sampleRate)) {
+        // Nothing to convert, the file's bytes over and over
+        uint32_t crc = 0;
+        for (; bytes >= data.size(); bytes -= data.size()) {
+            crc = fsm_crc32(data.data(), data.size(), crc);
+        }
+        return fsm_crc32(data.data(), bytes, crc);
+    }
+    std::vector<int16_t> out = ref_convert(data, spec, outRate, mono, bytes / frame);
+    return fsm_crc32((const uint8_t*)out.data(), bytes - bytes % frame, 0);
+}
+
+uint64_t converted_bytes(const WavSpec& spec, uint32_t outRate, bool mono) {
+    uint16_t frame = (mono ? 1 : spec.channels) * 2;
+    uint64_t frames = played_frames(spec);
+    if (!outRate || outRate == spec.sampleRate) {
+        return frames * frame;
+    }
+    // Output frames whose position is inside the file: n * step < frames
+    uint64_t step = ((uint64_t)spec.sampleRate << 32) / outRate;
+    return (((frames << 32) + step - 1) / step) * frame;
+}
+
+static std::vector<uint8_t> random_bytes(size_t n, uint32_t seed) {
+    std::vector<uint8_t> bytes(n);
+    for (uint8_t& b : bytes) {
+        seed = seed * 1103515245 + 12345;
+        b = seed >> 24;
+    }
+    return bytes;
+}
+
+static void print_kernel(const char* name, size_t samples, double ns, long mismatch) {
+    char result[32];
+    if (bench_check(mismatch < 0)) {
+        snprintf(result, sizeof(result), "bit-exact");
+    } else {
+        snprintf(result, sizeof(result), "MISMATCH at %ld", mismatch);
+    }
+    printf("%-30s %10lu %12.1f %14s\n", name, (unsigned long)samples, samples / ns * 1e3, result);
+}
+
+static long first_difference(const int16_t* a, const int16_t* b, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        if (a[i] != b[i]) {
+            return (long)i;
+        }
+    }
+    return -1;
+}
+
+// Sample-format kernels over the input in AUDIO_CONVERT_FRAMES pieces, the
+// first one starting off a word boundary when offset is set
+static void run_decode(const char* name, uint16_t bits, bool downmix, size_t offset) {
+    size_t samples = CONVERT_SAMPLES;
+    std::vector<uint8_t> bytes = random_bytes(samples * (bits / 8) + offset + 4, bits);
+    const uint8_t* in = bytes.data() + offset;
+    std::vector<int16_t> out(samples + 2);
+    int16_t* dst = out.data() + offset / 2;
+    size_t outSamples = downmix ? samples / 2 : samples;
+
+    double best = 1e30;
+    for (int rep = 0; rep < 5; rep++) {
+        uint32_t dither = AUDIO_DITHER_SEED;
+        bench_clock::time_point start = bench_clock::now();
+        for (size_t done = 0; done < samples;) {
+            size_t piece = samples - done < AUDIO_CONVERT_FRAMES * 2 ? samples - done : AUDIO_CONVERT_FRAMES * 2;
+            const uint8_t* src = in + done * (bits / 8);
+            int16_t* to = dst + (downmix ? done / 2 : done);
+            switch (bits) {
+                case 8: pcm_8_to_16(src, to, piece); break;
+                case 16: pcm_downmix16((const int16_t*)src, to, piece / 2); break;
+                case 24: pcm_24_to_16(src, to, piece, dither); break;
+                default: pcm_32_to_16(src, to, piece, dither); break;
+            }
+            done += piece;
+        }
+        best = std::min(best, std::chrono::duration<double, std::nano>(bench_clock::now() - start).count());
+    }
+
+    std::vector<int16_t> expected(outSamples);
+    uint32_t dither = AUDIO_DITHER_SEED;
+    for (size_t i = 0; i < outSamples; i++) {
+        if (downmix) {
+            expected[i] = (int16_t)ref_floor_div(ref_sample(in, bits, 2 * i) + ref_sample(in, bits, 2 * i + 1), 2);
+        } else {
+            int64_t x = ref_sample(in, bits, i);
+            expected[i] = bits > 16 ? ref_dither(x, dither) : (int16_t)x;
+        }
+    }
+    print_kernel(name, outSamples, best, first_difference(dst, expected.data(), outSamples));
+}
+
+// The resampler fed and drained in pieces of changing sizes, as the sink's
+// room and the ring's blocks come
+static void run_resample(const char* name, uint32_t inRate, uint32_t outRate, uint16_t channels) {
+    size_t inFrames = CONVERT_SAMPLES / channels;
+    std::vector<uint8_t> bytes = random_bytes(inFrames * channels * 2, inRate);
+    const int16_t* in = (const int16_t*)bytes.data();
+    size_t outFrames = (size_t)((uint64_t)inFrames * outRate / inRate) + 16;
+    std::vector<int16_t> out(outFrames * channels);
+
+    Resampler resampler;
+    double best = 1e30;
+    size_t produced = 0;
+    for (int rep = 0; rep < 5; rep++) {
+        resampler.begin(inRate, outRate, channels);
+        produced = 0;
+        size_t taken = 0;
+        uint32_t x = 1;
+        bench_clock::time_point start = bench_clock::now();
+        while (taken < inFrames) {
+            x = x * 1103515245 + 12345;
+            size_t give = 1 + (x >> 16) % 300;
+            size_t room = 1 + (x >> 8) % AUDIO_CONVERT_FRAMES;
+            if (give > inFrames - taken) {
+                give = inFrames - taken;
+            }
+            if (room > outFrames - produced) {
+                room = outFrames - produced;
+            }
+            size_t used;
+            produced += resampler.process(in + taken * channels, give, out.data() + produced * channels, room, used);
+            taken += used;
+        }
+        best = std::min(best, std::chrono::duration<double, std::nano>(bench_clock::now() - start).count());
+    }
+
+    std::vector<int16_t> input(in, in + inFrames * channels);
+    std::vector<int16_t> expected(channels);
+    long mismatch = -1;
+    for (size_t n = 0; n < produced && mismatch < 0; n++) {
+        ref_resample(resampler, input, channels, n, expected.data());
+        if (first_difference(out.data() + n * channels, expected.data(), channels) >= 0) {
+            mismatch = (long)n;
+        }
+    }
+    // Every output whose position is inside the input has to come out
+    uint64_t expectedFrames = (((uint64_t)inFrames << 32) + resampler.getStep() - 1) / resampler.getStep();
+    if (mismatch < 0 && produced != expectedFrames) {
+        mismatch = (long)produced;
+    }
+    print_kernel(name, produced * channels, best, mismatch);
+}
+
+// AudioConverter decoding random IMA-ADPCM blocks, fed and drained in
+// pieces of changing sizes as AudioStream does, partly decoded words and all
+static void run_adpcm(const char* name, uint16_t channels) {
+    WavFormat format = {};
+    format.channels = channels;
+    format.bitsPerSample = 4;
+    format.formatTag = WAV_FORMAT_IMA_ADPCM;
+    format.sampleRate = 44100;
+    format.blockAlign = adpcm_block_align(format.sampleRate, channels);
+    format.dataSize = CONVERT_SAMPLES / 4 / format.blockAlign * format.blockAlign;
+    std::vector<uint8_t> bytes = random_bytes(format.dataSize, channels);
+    std::vector<int16_t> expected = ref_adpcm_decode(bytes.data(), bytes.size(), channels, format.blockAlign);
+    std::vector<int16_t> out(expected.size());
+
+    AudioConverter converter;
+    WavFormat output;
+    double best = 1e30;
+    size_t produced = 0;
+    for (int rep = 0; rep < 5; rep++) {
+        converter.begin(format, 0, false, output);
+        produced = 0;
+        size_t taken = 0;
+        uint32_t x = 1;
+        bench_clock::time_point start = bench_clock::now();
+        while (taken < bytes.size()) {
+            x = x * 1103515245 + 12345;
+            size_t give = (1 + (x >> 16) % 64) * converter.getInputUnit();
+            size_t room = 1 + (x >> 8) % AUDIO_CONVERT_FRAMES;
+            if (give > bytes.size() - taken) {
+                give = bytes.size() - taken;
+            }
+            if (room > out.size() / channels - produced) {
+                room = out.size() / channels - produced;
+            }
+            size_t used;
+            produced += converter.convert(bytes.data() + taken, give, out.data() + produced * channels, room, used);
+            taken += used;
+        }
+        best = std::min(best, std::chrono::duration<double, std::nano>(bench_clock::now() - start).count());
+    }
+
+    long mismatch = first_difference(out.data(), expected.data(), produced * channels);
+    if (mismatch < 0 && produced * channels != expected.size()) {
+        mismatch = (long)(produced * channels);
+    }
+    print_kernel(name, produced * channels, best, mismatch);
+}
+
+// Test signals for the encoder, mono at 44.1 kHz
+static int16_t test_signal(int kind, size_t n, uint32_t& noise) {
+    double t = n / 44100.0;
+    double white = (int32_t)ref_xorshift(noise) / 2147483648.0;
+    switch (kind) {
+        case 0:
+            return (int16_t)(16384 * sin(2 * M_PI * 1000 * t));
+        case 1: {
+            // 20 Hz to 20 kHz over 10 s, exponentially
+            double k = log(1000.0) / 10;
+            return (int16_t)(16384 * sin(2 * M_PI * 20 * (exp(k * t) - 1) / k));
+        }
+        case 2:
+            return (int16_t)(8192 * sin(2 * M_PI * 220 * t) + 4096 * sin(2 * M_PI * 1320 * t) + 2048 * sin(2 * M_PI * 5280 * t) +
+                             328 * white);
+        default:
+            return (int16_t)(8192 * white);
+    }
+}
+
+// Encodes each test signal with adpcm_encode_block(), decodes it with the
+// reference decoder and compares it with the 16-bit original
+static void run_adpcm_quality() {
+    static const char* names[] = {"sine 1 kHz, -6 dBFS", "sweep 20 Hz-20 kHz, -6 dBFS", "3 tones + noise", "white noise, -12 dBFS"};
+    size_t frames = 44100 * 10;
+    uint16_t blockAlign = adpcm_block_align(44100, 1);
+    uint16_t perBlock = adpcm_samples_per_block(blockAlign, 1);
+
+    printf("\nIMA-ADPCM against 16-bit PCM, 44.1 kHz mono, 10 s signals, %u-byte blocks\n\n", blockAlign);
+    printf("%-30s %10s %10s %8s %8s\n", "signal", "pcm_bytes", "adpcm", "ratio", "SNR_dB");
+    for (int kind = 0; kind < 4; kind++) {
+        std::vector<int16_t> pcm(frames);
+        uint32_t noise = 1;
+        for (size_t n = 0; n < frames; n++) {
+            pcm[n] = test_signal(kind, n, noise);
+        }
+        std::vector<uint8_t> adpcm;
+        std::vector<uint8_t> block(blockAlign);
+        AdpcmChannel state = {};
+        for (size_t first = 0; first < frames; first += perBlock) {
+            size_t count = frames - first < perBlock ? frames - first : perBlock;
+            size_t bytes = adpcm_encode_block(&state, 1, &pcm[first], count, block.data());
+            adpcm.insert(adpcm.end(), block.begin(), block.begin() + bytes);
+        }
+        std::vector<int16_t> decoded = ref_adpcm_decode(adpcm.data(), adpcm.size(), 1, blockAlign);
+        double signal = 0;
+        double error = 0;
+        for (size_t n = 0; n < frames; n++) {
+            double d = (double)pcm[n] - decoded[n];
+            signal += (double)pcm[n] * pcm[n];
+            error += d * d;
+        }
+        printf("%-30s %10lu %10lu %7.2fx %8.1f\n", names[kind], (unsigned long)frames * 2, (unsigned long)adpcm.size(),
+               frames * 2.0 / adpcm.size(), 10 * log10(signal / error));
+    }
+    printf("\npcm_bytes, adpcm: card bytes of the signal, SNR_dB: against the 16-bit original\n");
+}
+
+void bench_convert(const char* dir) {
+    (void)dir;
+    printf("\nFormat conversion kernels, host speed, %d-frame pieces\n\n", AUDIO_CONVERT_FRAMES);
+    printf("%-30s %10s %12s %14s\n", "kernel", "samples", "Msamples/s", "result");
+    run_decode("downmix 16-bit stereo", 16, true, 0);
+    run_decode("downmix 16-bit, unaligned", 16, true, 2);
+    run_decode("8-bit to 16", 8, false, 0);
+    run_decode("24-bit to 16, dither", 24, false, 0);
+    run_decode("32-bit to 16, dither", 32, false, 0);
+    run_resample("resample 22.05k to 44.1k mono", 22050, 44100, 1);
+    run_resample("resample 48k to 44.1k stereo", 48000, 44100, 2);
+    run_resample("resample 32k to 44.1k stereo", 32000, 44100, 2);
+    run_adpcm("IMA-ADPCM decode mono", 1);
+    run_adpcm("IMA-ADPCM decode stereo", 2);
+
+    printf("\nsamples: output samples per run, Msamples/s: best of 5 runs\n");
+    printf("result: bit-exact when every output sample equals the reference implementation's\n");
+
+    run_adpcm_quality();
+}
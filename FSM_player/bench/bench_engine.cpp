@@ -0,0 +1,176 @@
+// Host stress test for the core0/core1 split (env:native).
+//
+// Runs both ends of the SPSC queues and of the AudioEngine on two real
+// std::threads, standing in for the RP2040 cores, and checks that nothing is
+// lost, reordered or torn on the way across.
+
+#include <Arduino.h>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "native_hal.h"
+#include "spsc_queue.h"
+#include "FSM.h"
+#include "bench.h"
+
+typedef std::chrono::steady_clock bench_clock;
+
+// Command-sized item, the same number at both ends so a torn copy shows
+struct Item {
+    uint32_t first;
+    uint8_t payload[16];
+    uint32_t last;
+};
+
+// One thread pushes count items, the other pops them and checks the sequence
+static void run_queue(unsigned long count) {
+    SpscQueue<Item, 16> queue;
+    unsigned long errors = 0;
+
+    bench_clock::time_point start = bench_clock::now();
+    std::thread producer([&queue, count]() {
+        for (uint32_t i = 0; i < count; i++) {
+            Item item;
+            item.first = i;
+            memset(item.payload, i & 0xFF, sizeof(item.payload));
+            item.last = i;
+            while (!queue.push(item)) {
+                std::this_thread::yield();
+            }
+        }
+    });
+
+    for (uint32_t expect = 0; expect < count; expect++) {
+        Item item;
+        while (!queue.pop(item)) {
+            std::this_thread::yield();
+        }
+        if (item.first != expect || item.last != expect || item.payload[7] != (expect & 0xFF)) {
+            errors++;
+        }
+    }
+    producer.join();
+    double seconds = std::chrono::duration<double>(bench_clock::now() - start).count();
+
+    bench_check(errors == 0);
+    printf("%-28s %12lu %14.0f %10lu\n", "SpscQueue<Item, 16>", count, count / seconds, errors);
+}
+
+// Takes everything straight away, so files finish as fast as they can be read
+class NullSink : public AudioSink {
+    public:
+        bool begin(const WavFormat& format) override { (void)format; return true; }
+        size_t availableForWrite() override { return 1 << 20; }
+        size_t write(uint8_t* data, size_t bytes) override { (void)data; return bytes; }
+        void end() override {}
+        uint32_t getUnderruns() const override { return 0; }
+};
+
+static void write_small_wav(const std::string& path, uint32_t frames) {
+    uint32_t dataSize = frames * 2;
+    uint8_t header[44] = {'R', 'I', 'F', 'F', 0, 0, 0, 0, 'W', 'A', 'V', 'E', 'f', 'm', 't', ' ',
+                          16, 0, 0, 0, 1, 0, 1, 0, 0x22, 0x56, 0, 0, 0x44, 0xAC, 0, 0, 2, 0, 16, 0,
+                          'd', 'a', 't', 'a'};
+    uint32_t riffSize = 36 + dataSize;
+    memcpy(header + 4, &riffSize, 4);
+    memcpy(header + 40, &dataSize, 4);
+    FILE* f = fopen(path.c_str(), "wb");
+    fwrite(header, 1, sizeof(header), f);
+    std::vector<uint8_t> data(dataSize, 0);
+    fwrite(data.data(), 1, data.size(), f);
+    fclose(f);
+}
+
+// The FSM side posts plays, stops and prefetches as fast as the queue takes
+// them while the audio side runs the engine. Events must come back in play
+// order and never about a play that wasn't posted yet.
+static void run_engine(const char* dir, unsigned long plays) {
+    std::string folder = std::string(dir) + "/engine";
+    mkdir(folder.c_str(), 0755);
+    const char* paths[] = {"/engine/a.wav", "/engine/b.wav", "/engine/c.wav", "/engine/missing.wav"};
+    write_small_wav(folder + "/a.wav", 100);
+    write_small_wav(folder + "/b.wav", 3000);
+    write_small_wav(folder + "/c.wav", 20000);
+
+    native_sd_timing(0, 0);         // the card model's clock isn't shared between threads
+    NullSink sink;
+    AudioStream stream;
+    AudioPrefetch cache;
+    stream.setPrefetch(&cache);
+    stream.begin(sd, sink);
+    AudioEngine engine;
+    engine.begin(stream);
+
+    std::atomic<bool> done(false);
+    std::thread core1([&engine, &done]() {
+        while (!done.load()) {
+            engine.run();
+        }
+        engine.run();
+    });
+
+    unsigned long posted = 0, finished = 0, failed = 0, errors = 0, stale = 0;
+    uint16_t lastSeq = 0;
+    bench_clock::time_point start = bench_clock::now();
+    uint32_t x = 1;
+    for (uint16_t seq = 1; posted < plays; ) {
+        x = x * 1103515245 + 12345;
+        uint8_t pick = (x >> 16) % 4;
+        bool ok;
+        if ((x >> 24) % 8 == 0) {
+            ok = engine.prefetch(paths, 3);
+        } else if ((x >> 24) % 8 == 1) {
+            ok = engine.stop();
+        } else {
+            ok = engine.play(paths[pick], false, seq);
+            if (ok) {
+                seq++;
+                posted++;
+            }
+        }
+        if (!ok) {
+            std::this_thread::yield();
+        }
+
+        AudioEvent event;
+        while (engine.poll(event)) {
+            if (event.seq < lastSeq || event.seq >= seq) {
+                errors++;                   // out of order, or about a play not posted yet
+            } else if (event.seq != seq - 1) {
+                stale++;                    // about an earlier play, the FSM would ignore it
+            }
+            lastSeq = event.seq;
+            if (event.type == AUDIO_EVENT_FINISHED) finished++;
+            if (event.type == AUDIO_EVENT_FAILED) failed++;
+        }
+    }
+    done.store(true);
+    core1.join();
+    double seconds = std::chrono::duration<double>(bench_clock::now() - start).count();
+
+    AudioEvent event;
+    while (engine.poll(event)) {
+        if (event.type == AUDIO_EVENT_FINISHED) finished++;
+        if (event.type == AUDIO_EVENT_FAILED) failed++;
+    }
+    bench_check(errors == 0);
+    printf("%-28s %12lu %14.0f %10lu   finished %lu, failed %lu, stale %lu, cache hits %lu\n",
+           "AudioEngine play/stop", posted, posted / seconds, errors, finished, failed, stale,
+           (unsigned long)cache.getHits());
+
+    unlink((folder + "/a.wav").c_str());
+    unlink((folder + "/b.wav").c_str());
+    unlink((folder + "/c.wav").c_str());
+    rmdir(folder.c_str());
+}
+
+void bench_engine(const char* dir) {
+    printf("\nCore split, FSM and audio on two threads\n\n");
+    printf("%-28s %12s %14s %10s\n", "test", "items", "items/s", "errors");
+    run_queue(2000000);
+    run_engine(dir, 4000);
+}
@@ -0,0 +1,416 @@
+// Host benchmark for the flash cache and the state journal (env:native).
+//
+// The onboard flash is a scratch directory on the host. A show of four
+// states, each with a folder of clips, boots the way setup() does it with
+// the card at 1000 us per access and 2000 KB/s: the first time with nothing
+// in the flash, then after a power cut part way through the show, with the
+// reset button held, and after the JSON was changed. The virtual time each
+// boot takes up to the first update() is compared, and a resumed boot must
+// be in the state the show was in with the variables it had. Then the power
+// is cut at random bytes of thousands of journal appends: after every cut the
+// journal must give back the last record that was written whole, never a
+// torn one or an older one, and go on appending from there. Last, a show
+// plays its states' audio while every flash write stalls everything else,
+// as it pauses the audio core on the board, and the output's underruns are
+// counted with the journal written on the tick of each state change and
+// FSM_JOURNAL_DELAY_MS after it.
+
+#include <Arduino.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include <string.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "native_hal.h"
+#include "FSM.h"
+#include "audio_index.h"
+#include "flash_cache.h"
+#include "state_journal.h"
+#include "pcm_file_sink.h"
+#include "audio_engine.h"
+#include "scheduler.h"
+#include "bench.h"
+
+#define JOURNAL_STATES       4
+#define JOURNAL_CLIPS        40         // per state folder
+#define JOURNAL_PRESSES      7          // before the power cut
+#define JOURNAL_PRESS_MS     200        // down, then as long up
+#define JOURNAL_CUTS         2000
+#define JOURNAL_SD_ACCESS_US 1000       // as SD_ACCESS_US and SD_BYTES_PER_MS in bench_audio.cpp
+#define JOURNAL_SD_BYTES_MS  2000
+#define JOURNAL_PLAY_PRESSES 40         // state changes of the show with audio
+
+static uint32_t journal_seed = 0x10C0FFEE;
+
+static uint32_t journal_random(uint32_t n) {
+    journal_seed = journal_seed * 1103515245UL + 12345UL;
+    return (journal_seed >> 8) % n;
+}
+
+// State i goes on to the next one when pin i goes low and counts the visit in var 0
+static void write_journal_config(const char* dir, uint8_t blinks) {
+    std::string json = "{\"states\":[";
+    for (int i = 0; i < JOURNAL_STATES; i++) {
+        char state[320];
+        snprintf(state, sizeof(state),
+                 "%s{\"id\":%d,\"audioFile\":\"/journal/state_%d/\",\"repeat\":false,\"blinkCount\":%u,"
+                 "\"transitions\":[{\"targetState\":%d,\"conditions\":[{\"type\":\"SENSOR\",\"data\":"
+                 "{\"sensorPin\":%d,\"state\":false}}],\"actions\":[{\"var\":0,\"add\":1}]}]}",
+                 i ? "," : "", i, i, blinks, (i + 1) % JOURNAL_STATES, i);
+        json += state;
+    }
+    json += "]}";
+    std::string path = std::string(dir) + "/FSM_Config.json";
+    FILE* f = fopen(path.c_str(), "wb");
+    fputs(json.c_str(), f);
+    fclose(f);
+}
+
+static void write_journal_card(const char* dir) {
+    std::string top = std::string(dir) + "/journal";
+    mkdir(top.c_str(), 0755);
+    WavSpec spec = {"", 1, 16, 22050, 2205, 0};
+    for (int i = 0; i < JOURNAL_STATES; i++) {
+        std::string folder = top + "/state_" + std::to_string(i);
+        mkdir(folder.c_str(), 0755);
+        for (int k = 0; k < JOURNAL_CLIPS; k++) {
+            char name[32];
+            snprintf(name, sizeof(name), "/clip_%02d.wav", k);
+            write_wav(folder + name, spec);
+        }
+    }
+    write_journal_config(dir, 1);
+}
+
+static void remove_tree(const std::string& path) {
+    DIR* d = opendir(path.c_str());
+    if (d) {
+        while (struct dirent* e = readdir(d)) {
+            std::string name = e->d_name;
+            if (name != "." && name != "..") {
+                remove_tree(path + "/" + name);
+            }
+        }
+        closedir(d);
+        rmdir(path.c_str());
+    } else {
+        unlink(path.c_str());
+    }
+}
+
+struct JournalBoot {
+    double ms;                  // virtual time from power on to the first update()
+    uint16_t hits;
+    uint16_t misses;
+    bool resumed;
+    uint8_t state;
+    int32_t var;
+};
+
+// Boots as setup() does, the reset button held or not, and leaves the show running in fsm
+static JournalBoot boot(FSM& fsm, AudioIndex& index, StateJournal& journal, bool resetHeld) {
+    JournalBoot result = {};
+    uint16_t hits = flashCache.getHits(), misses = flashCache.getMisses();
+    uint64_t start = native_micros();
+    flashCache.begin();
+    JournalRecord last;
+    bool resuming = journal.begin() && journal.last(last) && !resetHeld;
+    fsm.loadConfiguration();
+    fsm.indexAudio(index, resuming);
+    if (!resuming) {
+        fsm.checkAudioFiles(index);
+    }
+    fsm.setJournal(&journal);
+    fsm.begin();
+    result.resumed = resuming && fsm.resume(journal);
+    fsm.update();
+    result.ms = (native_micros() - start) / 1000.0;
+    result.hits = flashCache.getHits() - hits;
+    result.misses = flashCache.getMisses() - misses;
+    result.state = fsm.getCurrentState();
+    result.var = fsm.getVar(0);
+    return result;
+}
+
+// Presses the current state's sensor presses times, held down long enough for the debouncer
+static void press(FSM& fsm, int presses) {
+    for (int i = 0; i < presses; i++) {
+        uint8_t pin = fsm.getCurrentState();
+        for (int half = 0; half < 2; half++) {
+            native_set_pin(pin, half ? HIGH : LOW);
+            for (int ms = 0; ms < JOURNAL_PRESS_MS; ms += 5) {
+                native_advance_micros(5000);
+                fsm.update();
+            }
+        }
+    }
+}
+
+static void print_boot(const char* name, const JournalBoot& b, bool resumed, uint8_t state, int32_t var) {
+    bool ok = b.resumed == resumed && b.state == state && b.var == var;
+    printf("%-26s %8.1f %6u %6u %8s %6u %6ld %8s\n", name, b.ms, b.hits, b.misses, b.resumed ? "yes" : "no",
+           b.state, (long)b.var, bench_check(ok) ? "ok" : "FAIL");
+}
+
+static void run_boots(const char* dir) {
+    write_journal_card(dir);
+    for (uint8_t p = 0; p < JOURNAL_STATES; p++) {
+        native_set_pin(p, HIGH);
+    }
+    native_sd_timing(JOURNAL_SD_ACCESS_US, JOURNAL_SD_BYTES_MS);
+
+    printf("\nBoots with the flash cache and the journal, %d states of %d clips, card at %d us per access and %d KB/s\n\n",
+           JOURNAL_STATES, JOURNAL_CLIPS, JOURNAL_SD_ACCESS_US, JOURNAL_SD_BYTES_MS);
+    printf("%-26s %8s %6s %6s %8s %6s %6s %8s\n", "boot", "ms", "hits", "misses", "resumed", "state", "var", "result");
+
+    // Nothing in the flash yet: the card is read as it always was, the show starts at 0
+    uint32_t appends = 0;
+    uint64_t written = 0;
+    {
+        FSM fsm;
+        AudioIndex index;
+        StateJournal journal;
+        print_boot("first, empty flash", boot(fsm, index, journal, false), false, 0, 0);
+        uint64_t before = native_flash_written();
+        press(fsm, JOURNAL_PRESSES);
+        written = native_flash_written() - before;
+        appends = journal.getAppends();
+    }
+
+    // Power cut: the show goes on where it was
+    {
+        FSM fsm;
+        AudioIndex index;
+        StateJournal journal;
+        print_boot("after a power cut", boot(fsm, index, journal, false), true, JOURNAL_PRESSES % JOURNAL_STATES,
+                   JOURNAL_PRESSES);
+        press(fsm, 1);
+    }
+
+    // Reset held: back to state 0, the cached table is still used
+    {
+        FSM fsm;
+        AudioIndex index;
+        StateJournal journal;
+        print_boot("reset held", boot(fsm, index, journal, true), false, 0, 0);
+    }
+
+    // Another JSON: the cached table and the journal are of the old one
+    write_journal_config(dir, 2);
+    {
+        FSM fsm;
+        AudioIndex index;
+        StateJournal journal;
+        print_boot("JSON changed", boot(fsm, index, journal, false), false, 0, 0);
+        press(fsm, 2);
+    }
+    {
+        FSM fsm;
+        AudioIndex index;
+        StateJournal journal;
+        print_boot("power cut after that", boot(fsm, index, journal, false), true, 2, 2);
+    }
+    native_sd_timing(0, 0);
+
+    printf("\n%lu journal appends for %d state changes and the start, %.1f flash bytes per state change\n",
+           (unsigned long)appends, JOURNAL_PRESSES, (double)written / JOURNAL_PRESSES);
+    if (!bench_check(appends == JOURNAL_PRESSES)) {
+        printf("FAIL: expected one append per state change, the start going in with the first one\n");
+    }
+
+    remove_tree(std::string(dir) + "/journal");
+    unlink((std::string(dir) + "/FSM_Config.json").c_str());
+    unlink((std::string(dir) + AUDIO_INDEX_PATH).c_str());
+}
+
+// Appends with the power cut at a random byte, then boots the journal again
+static void run_cuts(const std::string& flash) {
+    remove_tree(flash);
+    native_flash_root(flash.c_str());
+    StateJournal journal;
+    journal.begin();
+    JournalRecord complete = {};        // the last append that went through
+    bool any = false;
+    int32_t vars[FSM_MAX_VARS] = {};
+    unsigned long tries = 0, cutWrites = 0, wrong = 0, damaged = 0, longest = 0;
+    uint64_t before = native_flash_written();
+
+    for (int cut = 0; cut < JOURNAL_CUTS; cut++) {
+        // A few appends go through, the power goes part way through one of the next
+        native_flash_cut_after(journal_random(5 * sizeof(JournalRecord)));
+        for (int k = 0; k < 5; k++) {
+            vars[k % FSM_MAX_VARS] = journal_random(1000);
+            uint8_t state = journal_random(JOURNAL_STATES);
+            tries++;
+            if (journal.append(0xC0FFEE, state, vars)) {
+                journal.last(complete);
+                any = true;
+            } else {
+                cutWrites++;
+            }
+        }
+        native_flash_cut_after(~0ULL);
+
+        journal = StateJournal();
+        journal.begin();
+        damaged += journal.getDamaged();
+        JournalRecord found;
+        bool has = journal.last(found);
+        if (has != any || (any && memcmp(&found, &complete, sizeof(found)) != 0)) {
+            wrong++;
+        }
+    }
+
+    // Neither file grows past JOURNAL_RECORDS
+    for (int i = 0; i < 2; i++) {
+        struct stat st;
+        std::string path = flash + (i ? "/journal.1" : "/journal.0");
+        if (stat(path.c_str(), &st) == 0) {
+            longest = std::max(longest, (unsigned long)(st.st_size / sizeof(JournalRecord)));
+        }
+    }
+
+    printf("\nJournal, %d power cuts at random bytes of %lu appends\n\n", JOURNAL_CUTS, tries);
+    printf("%10s %10s %10s %10s %10s %12s %8s\n", "appended", "cut", "damaged", "wrong", "longest", "bytes/append",
+           "result");
+    bool ok = wrong == 0 && longest <= JOURNAL_RECORDS && complete.seq > 2 * JOURNAL_RECORDS;
+    printf("%10lu %10lu %10lu %10lu %10lu %12.1f %8s\n", tries - cutWrites, cutWrites, damaged, wrong, longest,
+           (double)(native_flash_written() - before) / tries, bench_check(ok) ? "ok" : "FAIL");
+    if (wrong) {
+        printf("FAIL: the journal gave back another record than the last one written whole\n");
+    }
+}
+
+// The FSM and the audio engine take turns in one thread, in virtual time, as in bench_audio.cpp
+static unsigned long journal_earliest(unsigned long a, unsigned long b) {
+    return (long)(a - b) < 0 ? a : b;
+}
+
+// Plays four states of repeating audio, moving on at a sensor press every
+// 0.3 to 1.5 s, with every flash write taking stallUs. onTick: the journal is
+// appended right after the update() that changed the state, before the audio
+// engine gets to start the new state's file, as the FSM used to do it.
+static void run_audio_writes(const char* dir, uint32_t stallUs, bool onTick, bool usePrefetch) {
+    std::string config = std::string(dir) + "/FSM_Config.json";
+    FILE* f = fopen(config.c_str(), "w");
+    fprintf(f, "{\"debounceMode\":\"leading\",\"states\":[");
+    for (int i = 0; i < JOURNAL_STATES; i++) {
+        fprintf(f, "%s{\"id\":%d,\"audioFile\":\"/journal_audio/state_%d/\",\"repeat\":true,\"blinkCount\":1,"
+                   "\"transitions\":[{\"targetState\":%d,\"conditions\":[{\"type\":\"SENSOR\",\"data\":"
+                   "{\"sensorPin\":%d,\"state\":false}}]}]}",
+                i ? "," : "", i, i, (i + 1) % JOURNAL_STATES, i);
+    }
+    fprintf(f, "]}\n");
+    fclose(f);
+
+    PcmFileSink sink;
+    AudioPrefetch cache;
+    AudioStream stream;
+    if (usePrefetch) {
+        stream.setPrefetch(&cache);
+    }
+    stream.begin(sd, sink);
+    AudioEngine engine;
+    engine.begin(stream, Scheduler::notify);
+    StateJournal journal;
+    journal.begin();
+    FSM fsm;
+    fsm.loadConfiguration();
+    fsm.setAudio(&engine);
+    fsm.setJournal(onTick ? nullptr : &journal);
+    fsm.begin();
+    Scheduler scheduler;
+    scheduler.begin(fsm.getInputGpioMask());
+    native_sd_timing(JOURNAL_SD_ACCESS_US, JOURNAL_SD_BYTES_MS);
+    native_flash_stall(stallUs);
+
+    std::vector<uint64_t> pressAt;
+    uint64_t at = native_micros() + 1000000;
+    for (int k = 0; k < JOURNAL_PLAY_PRESSES; k++) {
+        native_schedule_pin(at, k % JOURNAL_STATES, LOW);
+        native_schedule_pin(at + 80000, k % JOURNAL_STATES, HIGH);
+        pressAt.push_back(at);
+        at += 300000 + journal_random(1200) * 1000;
+    }
+    uint8_t state = 0xFF;
+    int32_t vars[FSM_MAX_VARS] = {};
+    unsigned long heard = 0;
+    double latencySum = 0;
+    while (native_micros() < at + 1000000) {
+        fsm.update();
+        if (onTick && fsm.getCurrentState() != state) {
+            journal.append(0, fsm.getCurrentState(), vars);
+        }
+        state = fsm.getCurrentState();
+        engine.run();
+        // Sound of press k: the first sample of the state it led to
+        if (heard < JOURNAL_PLAY_PRESSES && state == (heard + 1) % JOURNAL_STATES &&
+            sink.getFirstSoundUs() >= pressAt[heard]) {
+            latencySum += sink.getFirstSoundUs() - pressAt[heard];
+            heard++;
+        }
+        scheduler.sleepUntil(journal_earliest(fsm.nextDeadline(), engine.nextDeadline()));
+    }
+    native_flash_stall(0);
+    native_sd_timing(0, 0);
+
+    // Spaced further apart than the delay, every change is written once.
+    // A write the output's buffer outlasts by a service interval never makes
+    // it run dry, wherever it falls.
+    bool ok = journal.getAppends() == JOURNAL_PLAY_PRESSES + 1 && heard == JOURNAL_PLAY_PRESSES &&
+              (stallUs > 20000 || sink.getUnderruns() == 0);
+    printf("%-26s %-9s %8.1f %8lu %10lu %10.2f %8s\n", onTick ? "on the change's tick" : "after the delay",
+           usePrefetch ? "prefetch" : "cold", stallUs / 1000.0, (unsigned long)journal.getAppends(),
+           (unsigned long)sink.getUnderruns(), heard ? latencySum / heard / 1000.0 : 0.0, bench_check(ok) ? "ok" : "FAIL");
+    unlink(config.c_str());
+}
+
+static void run_audio_stalls(const char* dir, const std::string& flash) {
+    std::string top = std::string(dir) + "/journal_audio";
+    mkdir(top.c_str(), 0755);
+    for (int i = 0; i < JOURNAL_STATES; i++) {
+        std::string folder = top + "/state_" + std::to_string(i);
+        mkdir(folder.c_str(), 0755);
+        WavSpec spec = {"", 1, 16, 44100, 44100 * 2, 0};
+        write_wav(folder + "/take.wav", spec);
+    }
+
+    printf("\nJournal writes against the audio, %d state changes, card at %d us per access and %d KB/s\n\n",
+           JOURNAL_PLAY_PRESSES, JOURNAL_SD_ACCESS_US, JOURNAL_SD_BYTES_MS);
+    printf("%-26s %-9s %8s %8s %10s %10s %8s\n", "journal written", "start", "stall_ms", "appends", "underruns",
+           "mean_ms", "result");
+    const uint32_t stalls[] = {5000, 10000, 20000, 30000, 45000};
+    for (int usePrefetch = 0; usePrefetch < 2; usePrefetch++) {
+        for (uint32_t stallUs : stalls) {
+            for (int onTick = 1; onTick >= 0; onTick--) {
+                remove_tree(flash);
+                native_flash_root(flash.c_str());
+                run_audio_writes(dir, stallUs, onTick, usePrefetch);
+            }
+        }
+    }
+    remove_tree(top);
+    unlink((std::string(dir) + AUDIO_INDEX_PATH).c_str());
+}
+
+void bench_journal(const char* dir) {
+    char flash[] = "/tmp/fsm_flash_XXXXXX";
+    if (!mkdtemp(flash)) {
+        perror("mkdtemp");
+        return;
+    }
+    native_flash_root(flash);
+    run_boots(dir);
+    run_cuts(flash);
+    run_audio_stalls(dir, flash);
+
+    flashCache.end();
+    native_flash_root(nullptr);
+    remove_tree(flash);
+    printf("\nms: virtual time up to the first update(), hits/misses: flash cache lookups of the boot\n");
+    printf("damaged: boots that found a record cut off part way, passed over for the one before it\n");
+    printf("stall_ms: virtual time each flash write takes, in which the audio engine doesn't run;\n"
+           "          the output holds 35 ms, a sector erase takes around 45 ms\n");
+}
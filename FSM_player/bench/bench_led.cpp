@@ -0,0 +1,263 @@
+// Host benchmark for the LED sequencer (env:native).
+//
+// First every pattern the player blinks plays in virtual time on the stand-in
+// alarm, which runs its callbacks as late as an interrupt might, sampled
+// each millisecond against a reference waveform worked out from the
+// pattern's steps, with a pin write counted for every edge and none more. Then a show of four states with 0 to 3 blinks runs through the FSM,
+// woken by the scheduler as loop() is, while a sampling alarm checks the
+// state LED against the blink of the state it is in, started when the state
+// was entered, and the mode LED against the "loaded" blink. The old
+// blinkLED() wrote the state LED on every update() and woke the loop for
+// every edge; with the sequencer the pins only change at an edge and the
+// FSM only wakes for its own work.
+
+#include <Arduino.h>
+#include <string>
+#include <vector>
+#include <unistd.h>
+#include "native_hal.h"
+#include "led_sequencer.h"
+#include "gpio_utils.h"
+#include "scheduler.h"
+#include "FSM.h"
+#include "bench.h"
+
+#define LED_SHOW_S      60
+#define LED_BLINK_MS    200     // as BLINK_MS and BLINK_WAIT_MS in FSM.cpp
+#define LED_WAIT_MS     1500
+#define LED_LATENCY_US  40      // interrupt latency of the alarms, edges mustn't drift by it
+
+static const uint8_t bench_led_pins[LED_CHANNELS] = {led_status_pin, led_mode_pin, led_state_pin};
+
+static uint64_t led_seed = 0x1EDB1111;
+
+static uint64_t led_random(uint64_t range) {
+    led_seed ^= led_seed << 13;
+    led_seed ^= led_seed >> 7;
+    led_seed ^= led_seed << 17;
+    return led_seed % range;
+}
+
+// Level a pattern has us after it started: on for [start, start + onMs) of
+// each repetition, off for the rest, off for good after a pattern that doesn't loop
+static bool reference_level(const LedPattern& pattern, uint64_t us) {
+    uint64_t cycle = 0;
+    for (uint8_t i = 0; i < pattern.count; i++) {
+        const LedStep& step = pattern.steps[i];
+        cycle += (step.onMs + step.offMs) * 1000ULL * (step.times ? step.times : 1);
+    }
+    if (us >= cycle) {
+        if (!pattern.loop) {
+            return false;
+        }
+        us %= cycle;
+    }
+    for (uint8_t i = 0; i < pattern.count; i++) {
+        const LedStep& step = pattern.steps[i];
+        uint64_t period = (step.onMs + step.offMs) * 1000ULL;
+        uint64_t length = period * (step.times ? step.times : 1);
+        if (us < length) {
+            return us % period < step.onMs * 1000ULL;
+        }
+        us -= length;
+    }
+    return false;
+}
+
+struct LedCase {
+    const char* name;
+    uint8_t channel;
+    const LedPattern* pattern;      // nullptr: a blink of count
+    uint8_t count;
+    uint32_t ms;
+};
+
+// Plays one case from a random us, all three waiting patterns together
+// for the first, and samples it every ms in the middle of the ms
+static void run_case(const LedCase& c) {
+    native_advance_micros(led_random(1000000));
+    for (uint8_t i = 0; i < LED_CHANNELS; i++) {
+        leds.set(i, false);
+    }
+    uint32_t writesBefore[LED_CHANNELS];
+    for (uint8_t i = 0; i < LED_CHANNELS; i++) {
+        writesBefore[i] = native_pin_writes(bench_led_pins[i]);
+    }
+
+    // The pattern each channel plays, blink() as the sequencer builds it
+    LedStep blinkSteps[2] = {{LED_BLINK_MS, LED_BLINK_MS, c.count}, {0, LED_WAIT_MS, 1}};
+    LedPattern blinkPattern = {blinkSteps, 2, true};
+    const LedPattern* playing[LED_CHANNELS] = {};
+    uint64_t start = native_micros();
+    if (c.pattern == led_waiting) {
+        for (uint8_t i = 0; i < LED_CHANNELS; i++) {
+            leds.play(i, led_waiting[i]);
+            playing[i] = &led_waiting[i];
+        }
+    } else if (c.pattern) {
+        leds.play(c.channel, *c.pattern);
+        playing[c.channel] = c.pattern;
+    } else {
+        leds.blink(c.channel, c.count, LED_BLINK_MS, LED_BLINK_MS, LED_WAIT_MS);
+        playing[c.channel] = &blinkPattern;
+    }
+
+    unsigned long edges = 0, writes = 0, wrong = 0;
+    bool last[LED_CHANNELS] = {};
+    for (uint32_t ms = 0; ms < c.ms; ms++) {
+        native_advance_micros(ms ? 1000 : 500);
+        for (uint8_t i = 0; i < LED_CHANNELS; i++) {
+            bool expect = playing[i] && reference_level(*playing[i], native_micros() - start);
+            if (expect != last[i]) {
+                edges++;
+                last[i] = expect;
+            }
+            if ((native_get_pin(bench_led_pins[i]) == HIGH) != expect || leds.isOn(i) != expect) {
+                wrong++;
+            }
+        }
+    }
+    for (uint8_t i = 0; i < LED_CHANNELS; i++) {
+        writes += native_pin_writes(bench_led_pins[i]) - writesBefore[i];
+        leds.set(i, false);
+    }
+
+    bool ok = wrong == 0 && writes == edges;
+    printf("%-26s %8.1f %8lu %8lu %8lu %8s\n", c.name, c.ms / 1000.0, edges, writes, wrong, bench_check(ok) ? "ok" : "FAIL");
+}
+
+// Four states in a ring, each with its number of blinks: pressing sensor 0
+// moves on, letting go of it moves on again
+static void write_led_config(const char* dir) {
+    std::string json = "{\"debounceMode\":\"leading\",\"states\":[";
+    for (int i = 0; i < 4; i++) {
+        char state[256];
+        snprintf(state, sizeof(state),
+                 "%s{\"id\":%d,\"audioFile\":\"\",\"repeat\":false,\"blinkCount\":%d,\"transitions\":["
+                 "{\"targetState\":%d,\"conditions\":[{\"type\":\"SENSOR\",\"data\":{\"sensorPin\":0,\"state\":%s}}]}]}",
+                 i ? "," : "", i, i, (i + 1) % 4, i % 2 ? "true" : "false");
+        json += state;
+    }
+    json += "]}";
+    std::string path = std::string(dir) + "/FSM_Config.json";
+    FILE* f = fopen(path.c_str(), "wb");
+    fputs(json.c_str(), f);
+    fclose(f);
+    unlink((std::string(dir) + "/FSM_Config.bin").c_str());
+}
+
+// What the sampling alarm checks against, kept up by the loop
+struct LedWatch {
+    uint8_t blinks;             // of the state the FSM is in
+    uint64_t enteredUs;         // when the loop saw it change
+    uint64_t loadedUs;          // when loadConfiguration() returned
+    unsigned long samples;
+    unsigned long stateEdges;
+    unsigned long wrong;
+    bool stateLast;
+};
+
+static int64_t sample_leds(alarm_id_t id, void* user) {
+    (void)id;
+    // Judged at the time it was due, as the sequencer times its edges. A state
+    // the loop entered since then has started its blink already, it isn't judged
+    LedWatch* w = (LedWatch*)user;
+    uint64_t now = native_micros() - LED_LATENCY_US;
+    if (now < w->enteredUs) {
+        return -1000;
+    }
+    LedStep blinkSteps[2] = {{LED_BLINK_MS, LED_BLINK_MS, w->blinks}, {0, LED_WAIT_MS, 1}};
+    LedPattern blinkPattern = {blinkSteps, 2, true};
+    bool state = w->blinks && reference_level(blinkPattern, now - w->enteredUs);
+    bool mode = reference_level(led_loaded, now - w->loadedUs);
+    if (state != w->stateLast) {
+        w->stateEdges++;
+        w->stateLast = state;
+    }
+    if ((native_get_pin(led_state_pin) == HIGH) != state || (native_get_pin(led_mode_pin) == HIGH) != mode) {
+        w->wrong++;
+    }
+    w->samples++;
+    return -1000;                                       // every ms from the first, however late it runs
+}
+
+static void run_show(const char* dir) {
+    write_led_config(dir);
+    native_set_pin(0, HIGH);
+    leds.begin();
+    uint32_t stateWritesBefore = native_pin_writes(led_state_pin);
+
+    FSM fsm;
+    uint64_t loadStart = native_micros();
+    fsm.loadConfiguration();
+    LedWatch watch = {};
+    watch.loadedUs = native_micros();
+    fsm.begin();
+    Scheduler scheduler;
+    scheduler.begin(fsm.getInputGpioMask());
+
+    // Presses at any us, held down for a few seconds at most
+    uint64_t end = native_micros() + LED_SHOW_S * 1000000ULL;
+    for (uint64_t at = native_micros() + 100000; at < end; at += 300000 + led_random(4000000)) {
+        native_schedule_pin(at, 0, LOW);
+        at += 30000 + led_random(3000000);
+        native_schedule_pin(at, 0, HIGH);
+    }
+
+    // The first update() starts the state's blink
+    fsm.update();
+    watch.blinks = fsm.getCurrentState();
+    watch.enteredUs = native_micros();
+    alarm_id_t sampler = add_alarm_at(from_us_since_boot(native_micros() + 500), sample_leds, &watch, true);
+
+    unsigned long updates = 1, changes = 0;
+    uint8_t state = fsm.getCurrentState();
+    while (native_micros() < end) {
+        scheduler.sleepUntilUs(fsm.nextDeadlineUs());
+        fsm.update();
+        updates++;
+        if (fsm.getCurrentState() != state) {
+            state = fsm.getCurrentState();
+            watch.blinks = state;       // state n blinks n times
+            watch.enteredUs = native_micros();
+            changes++;
+        }
+    }
+    cancel_alarm(sampler);
+    uint32_t writes = native_pin_writes(led_state_pin) - stateWritesBefore;
+
+    printf("\nLEDs through the FSM, %d s of presses, four states blinking 0 to 3 times, virtual time\n\n", LED_SHOW_S);
+    printf("%8s %8s %8s %10s %10s %10s %8s %8s\n", "load_ms", "updates", "changes", "edges", "writes", "before", "wrong", "result");
+    bool ok = watch.wrong == 0 && writes == watch.stateEdges && changes > 0;
+    printf("%8.1f %8lu %8lu %10lu %10u %10lu %8lu %8s\n", (watch.loadedUs - loadStart) / 1000.0, updates, changes,
+           watch.stateEdges, writes, updates, watch.wrong, bench_check(ok) ? "ok" : "FAIL");
+    if (!bench_check(watch.loadedUs - loadStart < 100000)) {
+        printf("FAIL: loadConfiguration() still waits for the loaded blink\n");
+    }
+}
+
+void bench_led(const char* dir) {
+    printf("\nLED patterns against their reference waveforms, sampled every ms in virtual time\n\n");
+    printf("%-26s %8s %8s %8s %8s %8s\n", "pattern", "seconds", "edges", "writes", "wrong", "result");
+    const LedCase cases[] = {
+        {"waiting, all three", LED_STATUS, led_waiting, 0, 3000},
+        {"loaded", LED_MODE, &led_loaded, 0, 2000},
+        {"reset held", LED_MODE, &led_reset_held, 0, 3000},
+        {"state, 1 blink", LED_STATE, nullptr, 1, 8000},
+        {"state, 5 blinks", LED_STATE, nullptr, 5, 12000},
+        {"error: card", LED_STATUS, nullptr, LED_ERROR_SD, 8000},
+        {"error: config", LED_STATUS, nullptr, LED_ERROR_CONFIG, 8000},
+    };
+    leds.begin();
+    native_alarm_latency(LED_LATENCY_US);
+    for (const LedCase& c : cases) {
+        run_case(c);
+    }
+
+    run_show(dir);
+    native_alarm_latency(0);
+    printf("\nedges: level changes of the reference, writes: digitalWrite() of the LED pins, one per edge\n");
+    printf("wrong: samples off the reference; every alarm runs %d us late, an edge timed from the one\n", LED_LATENCY_US);
+    printf("       before's interrupt instead of its due time would drift out of step\n");
+    printf("before: state LED writes of the old blinkLED(), one per update()\n");
+}
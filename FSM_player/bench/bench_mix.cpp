@@ -0,0 +1,258 @@
+// Host benchmark for the crossfade mixer (env:native).
+//
+// Feeds the mixer's inputs random samples in pieces of changing sizes while
+// an output of changing room takes them, and compares every output sample
+// with a reference mix worked out from the gain ramps as audio_mixer.h
+// defines them. Then plays a crossfade and a fade out through the audio
+// engine with two streams in virtual time and compares the output with the
+// golden CRC of that run.
+
+#include <Arduino.h>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <unistd.h>
+#include "native_hal.h"
+#include "pcm_file_sink.h"
+#include "audio_engine.h"
+#include "FSM.h"
+#include "bench.h"
+
+typedef std::chrono::steady_clock bench_clock;
+
+// CRC of the output of run_engine_fades(), recorded from a run whose level
+// envelope was checked window by window (the arithmetic itself is checked
+// against the reference mix). Changes to the mixer, the ramps, the
+// conversion or the engine's timing change it.
+#define MIX_GOLDEN_CRC 0xCE2F3E75UL
+
+#define MIX_RATE 44100
+
+// Output that keeps everything it gets, with room that changes from call to call
+class CaptureSink : public AudioSink {
+    public:
+        std::vector<int16_t> samples;
+        uint16_t frameBytes = 2;
+        size_t room = 0;
+
+        bool begin(const WavFormat& format) override {
+            frameBytes = format.channels * 2;
+            return true;
+        }
+        size_t availableForWrite() override { return room * frameBytes; }
+        size_t write(uint8_t* data, size_t bytes) override {
+            if (bytes > room * frameBytes) {
+                bytes = room * frameBytes;
+            }
+            bytes -= bytes % frameBytes;
+            samples.insert(samples.end(), (const int16_t*)data, (const int16_t*)(data + bytes));
+            room -= bytes / frameBytes;
+            return bytes;
+        }
+        void end() override {}
+        uint32_t getUnderruns() const override { return 0; }
+};
+
+// An input's gain at frame n after setGain(from) and fade(to, ms) at frame 0
+static int32_t ref_gain(uint16_t from, uint16_t to, uint32_t ms, uint64_t n) {
+    int64_t frames = (int64_t)ms * MIX_RATE / 1000;
+    if ((int64_t)n >= frames) {
+        return to;
+    }
+    int64_t step = (((int64_t)to << 15) - ((int64_t)from << 15)) / frames;
+    return (int32_t)((((int64_t)from << 15) + (int64_t)n * step) >> 15);
+}
+
+static int16_t ref_clamp(int64_t x) {
+    return x > 32767 ? 32767 : x < -32768 ? -32768 : (int16_t)x;
+}
+
+static std::vector<int16_t> random_samples(size_t n, uint32_t seed) {
+    std::vector<int16_t> samples(n);
+    for (int16_t& s : samples) {
+        seed = seed * 1103515245 + 12345;
+        s = (int16_t)(seed >> 16);
+    }
+    return samples;
+}
+
+struct MixCase {
+    const char* name;
+    uint16_t channels;
+    uint32_t framesA;       // Input A, 0 for none
+    uint16_t gainA;         // A starts at gainA and fades to endA over msA
+    uint16_t endA;
+    uint32_t msA;
+    uint32_t framesB;       // Input B, 0 for none
+    uint16_t gainB;
+    uint16_t endB;
+    uint32_t msB;
+};
+
+// Both inputs start at output frame 0, A leaves the mix after its last frame
+static void run_mix(const MixCase& c) {
+    std::vector<int16_t> a = random_samples((size_t)c.framesA * c.channels, 1);
+    std::vector<int16_t> b = random_samples((size_t)c.framesB * c.channels, 2);
+    WavFormat format = {};
+    format.channels = c.channels;
+    format.bitsPerSample = 16;
+    format.sampleRate = MIX_RATE;
+    format.blockAlign = c.channels * 2;
+
+    CaptureSink sink;
+    AudioMixer mixer;
+    double best = 1e30;
+    for (int rep = 0; rep < 5; rep++) {
+        mixer.begin(sink);
+        sink.samples.clear();
+        sink.samples.reserve((size_t)std::max(c.framesA, c.framesB) * c.channels);
+        AudioMixer::Input& inA = mixer.getInput(0);
+        AudioMixer::Input& inB = mixer.getInput(1);
+        if (c.framesA) {
+            inA.begin(format);
+            inA.setGain(c.gainA);
+            inA.fade(c.endA, c.msA);
+        }
+        if (c.framesB) {
+            inB.begin(format);
+            inB.setGain(c.gainB);
+            inB.fade(c.endB, c.msB);
+        }
+
+        // The inputs scale in place, so they get copies
+        std::vector<int16_t> workA = a;
+        std::vector<int16_t> workB = b;
+        size_t doneA = 0;
+        size_t doneB = 0;
+        uint32_t x = 1;
+        bench_clock::time_point start = bench_clock::now();
+        while (doneA < c.framesA || doneB < c.framesB) {
+            x = x * 1103515245 + 12345;
+            sink.room += 1 + (x >> 8) % 200;
+            size_t piece = 1 + (x >> 20) % 300;
+            if (doneA < c.framesA) {
+                size_t n = std::min(piece, c.framesA - doneA);
+                doneA += inA.write((uint8_t*)&workA[doneA * c.channels], n * c.channels * 2) / (c.channels * 2);
+                if (doneA == c.framesA) {
+                    inA.finish();
+                }
+            }
+            if (doneB < c.framesB) {
+                size_t n = std::min(piece * 3 / 4 + 1, c.framesB - doneB);
+                doneB += inB.write((uint8_t*)&workB[doneB * c.channels], n * c.channels * 2) / (c.channels * 2);
+                if (doneB == c.framesB) {
+                    inB.finish();
+                }
+            }
+        }
+        best = std::min(best, std::chrono::duration<double, std::nano>(bench_clock::now() - start).count());
+    }
+
+    size_t frames = std::max(c.framesA, c.framesB);
+    long mismatch = sink.samples.size() == frames * c.channels ? -1 : (long)sink.samples.size();
+    for (size_t n = 0; n < frames && mismatch < 0; n++) {
+        int32_t gA = n < c.framesA ? ref_gain(c.gainA, c.endA, c.msA, n) : 0;
+        int32_t gB = n < c.framesB ? ref_gain(c.gainB, c.endB, c.msB, n) : 0;
+        for (uint16_t ch = 0; ch < c.channels; ch++) {
+            size_t i = n * c.channels + ch;
+            int64_t sum = (n < c.framesA ? (int64_t)a[i] * gA : 0) + (n < c.framesB ? (int64_t)b[i] * gB : 0);
+            if (sink.samples[i] != ref_clamp((sum + 16384) >> 15)) {
+                mismatch = (long)i;
+                break;
+            }
+        }
+    }
+
+    char result[40];
+    if (bench_check(mismatch < 0)) {
+        snprintf(result, sizeof(result), "bit-exact");
+    } else {
+        snprintf(result, sizeof(result), "MISMATCH at %ld", mismatch);
+    }
+    printf("%-30s %10lu %10lu %12.1f %14s\n", c.name, (unsigned long)frames, (unsigned long)mixer.getMixedFrames(),
+           frames * c.channels / best * 1e3, result);
+}
+
+// Plays a on the engine with a fade in, crossfades into b, then fades b out,
+// servicing the engine every AUDIO_SERVICE_MS as core1 does
+static void run_engine_fades(const char* dir) {
+    const WavSpec specA = {"", 1, 16, 22050, 22050 * 3, 0};
+    const WavSpec specB = {"", 2, 24, 48000, 48000 * 3, 0};
+    write_wav(std::string(dir) + "/mix_a.wav", specA);
+    write_wav(std::string(dir) + "/mix_b.wav", specB);
+
+    PcmFileSink sink;
+    AudioMixer mixer;
+    AudioStream first;
+    AudioStream second;
+    mixer.begin(sink);
+    first.setOutput(MIX_RATE, true);
+    second.setOutput(MIX_RATE, true);
+    first.begin(sd, mixer.getInput(0));
+    second.begin(sd, mixer.getInput(1));
+    AudioEngine engine;
+    engine.begin(mixer, first, second);
+
+    // a at 0.75 fading in over 100 ms, b crossfading over 500 ms after 1.5 s,
+    // faded out over 300 ms at 3 s
+    engine.play("/mix_a.wav", true, 1, AUDIO_GAIN_UNITY * 3 / 4, 100, 0);
+    double hostNs = 0;
+    unsigned long runs = 0;
+    uint64_t start = native_micros();
+    bool crossfaded = false;
+    bool stopped = false;
+    while (native_micros() - start < 4000000) {
+        if (!crossfaded && native_micros() - start >= 1500000) {
+            engine.play("/mix_b.wav", true, 2, AUDIO_GAIN_UNITY, 500, 500);
+            crossfaded = true;
+        }
+        if (!stopped && native_micros() - start >= 3000000) {
+            engine.stop(300);
+            stopped = true;
+        }
+        bench_clock::time_point t = bench_clock::now();
+        engine.run();
+        hostNs += std::chrono::duration<double, std::nano>(bench_clock::now() - t).count();
+        runs++;
+        delay(AUDIO_SERVICE_MS);
+    }
+    unlink((std::string(dir) + "/mix_a.wav").c_str());
+    unlink((std::string(dir) + "/mix_b.wav").c_str());
+
+    // Everything from the first sample to the end of the fade out: 3.3 s of output
+    double seconds = sink.getBytesWritten() / 2.0 / MIX_RATE;
+    char result[40];
+    if (bench_check(sink.getCrc() == MIX_GOLDEN_CRC)) {
+        snprintf(result, sizeof(result), "golden");
+    } else {
+        snprintf(result, sizeof(result), "DIFFERS %08lx", (unsigned long)sink.getCrc());
+    }
+    printf("%-30s %10.2f %10lu %12.1f %10lu %14s\n", "fade in, crossfade, fade out", seconds,
+           (unsigned long)mixer.getMixedFrames(), hostNs / runs / 1000, (unsigned long)sink.getUnderruns(), result);
+}
+
+void bench_mix(const char* dir) {
+    printf("\nMixer, host speed, inputs written in random pieces\n\n");
+    printf("%-30s %10s %10s %12s %14s\n", "case", "frames", "mixed", "Msamples/s", "result");
+    const uint32_t n = 1 << 20;
+    const uint16_t unity = AUDIO_GAIN_UNITY;
+    const MixCase cases[] = {
+        {"one input, unity gain", 1, 0, 0, 0, 0, n, unity, unity, 0},
+        {"one input, gain 0.3", 1, 0, 0, 0, 0, n, 9830, 9830, 0},
+        {"one input, fade in 2 s", 1, 0, 0, 0, 0, n, 0, unity, 2000},
+        {"crossfade mono, 2 s", 1, n / 2, unity, 0, 2000, n, 0, unity, 2000},
+        {"crossfade stereo, 2 s", 2, n / 2, unity, 0, 2000, n, 0, unity, 2000},
+        {"two inputs at unity, clipping", 2, n / 2, unity, unity, 0, n, unity, unity, 0},
+        {"fade out 0.5 s, long tail", 1, n, unity, 0, 500, n / 4, 0, unity, 500},
+    };
+    for (const MixCase& c : cases) {
+        run_mix(c);
+    }
+    printf("\nframes: output frames per run, mixed: of them summed from both inputs, Msamples/s: best of 5 runs\n");
+    printf("result: bit-exact when every output sample equals the reference mix's\n");
+
+    printf("\nFades through the audio engine, two streams to 44.1 kHz mono, virtual time\n\n");
+    printf("%-30s %10s %10s %12s %10s %14s\n", "sequence", "seconds", "mixed", "host_us/run", "underruns", "result");
+    run_engine_fades(dir);
+    printf("\nresult: golden when the output's CRC matches the recorded one\n");
+}
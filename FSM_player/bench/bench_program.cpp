@@ -0,0 +1,469 @@
+// Host check of the condition programs (env:native).
+//
+// Compiles random condition trees (groups, edges, holds, counters, variables)
+// and compares what a transition makes of random inputs, through its masks
+// and its program, with a plain evaluation of the JSON. The time a program
+// asks to be woken at is checked too: nothing may change before it. Then two
+// shows are run through the FSM in virtual time, once written with duplicated
+// transitions and states the way configs had to be, once with the new
+// conditions, and the two have to reach every step at the same moment.
+
+#include <Arduino.h>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <unistd.h>
+#include "native_hal.h"
+#include "FSM.h"
+#include "bench.h"
+
+typedef std::chrono::steady_clock bench_clock;
+
+#define PROGRAM_CASES    20000
+#define PROGRAM_CONTEXTS 50
+#define SHOW_RUN_MS      120000
+#define SHOW_STEPS       8
+
+static uint32_t program_seed = 0x5EED0017;
+
+static uint32_t program_random(uint32_t range) {
+    program_seed = program_seed * 1664525 + 1013904223;
+    return (program_seed >> 8) % range;
+}
+
+static const char* const compares[] = {"==", "!=", "<", "<=", ">", ">="};
+
+// A random condition, groups down to depth levels
+static std::string random_condition(int depth) {
+    char text[160];
+    uint32_t kind = program_random(depth > 0 ? 11 : 8);
+    uint32_t pin = program_random(8);
+    switch (kind) {
+        case 0:
+            snprintf(text, sizeof(text), "{\"type\":\"SENSOR\",\"data\":{\"sensorPin\":%lu,\"state\":%s}}",
+                     (unsigned long)pin, program_random(2) ? "true" : "false");
+            return text;
+        case 1:
+            snprintf(text, sizeof(text), "{\"type\":\"SENSOR_%s\",\"data\":{\"sensorPin\":%lu}}",
+                     program_random(2) ? "ROSE" : "FELL", (unsigned long)pin);
+            return text;
+        case 2:
+            snprintf(text, sizeof(text), "{\"type\":\"SENSOR_HELD\",\"data\":{\"sensorPin\":%lu,\"state\":%s,\"duration\":%lu}}",
+                     (unsigned long)pin, program_random(2) ? "true" : "false", (unsigned long)program_random(1000));
+            return text;
+        case 3:
+            snprintf(text, sizeof(text), "{\"type\":\"TIME_PASSED\",\"data\":{\"duration\":%lu}}",
+                     (unsigned long)program_random(2000));
+            return text;
+        case 4:
+            return "{\"type\":\"AUDIO_FINISHED\"}";
+        case 5:
+            snprintf(text, sizeof(text), "{\"type\":\"COUNT\",\"data\":{\"sensorPin\":%lu,\"edge\":\"%s\",\"count\":%lu}}",
+                     (unsigned long)pin, program_random(2) ? "rising" : "falling", (unsigned long)program_random(4) + 1);
+            return text;
+        case 6:
+            snprintf(text, sizeof(text), "{\"type\":\"VAR\",\"data\":{\"var\":%lu,\"op\":\"%s\",\"value\":%ld}}",
+                     (unsigned long)program_random(4), compares[program_random(6)], (long)program_random(5) - 2);
+            return text;
+        case 7:
+            snprintf(text, sizeof(text), "{\"type\":\"TIMER\",\"data\":{\"timer\":%lu}}", (unsigned long)program_random(8));
+            return text;
+        default: {
+            static const char* const groups[] = {"ALL", "ANY", "NOT"};
+            std::string group = std::string("{\"type\":\"") + groups[kind - 8] + "\",\"conditions\":[";
+            uint32_t count = program_random(4);
+            for (uint32_t i = 0; i < count; i++) {
+                group += (i ? "," : "") + random_condition(depth - 1);
+            }
+            return group + "]}";
+        }
+    }
+}
+
+// A one-state config whose first transition has count conditions and actions
+static std::string random_config() {
+    std::string conditions;
+    uint32_t count = program_random(4) + 1;
+    for (uint32_t i = 0; i < count; i++) {
+        conditions += (i ? "," : "") + random_condition(3);
+    }
+    std::string actions;
+    count = program_random(4);
+    for (uint32_t i = 0; i < count; i++) {
+        char text[64];
+        if (program_random(3) == 0) {
+            uint32_t timer = program_random(4);
+            uint32_t what = program_random(3);
+            if (what == 2) {
+                snprintf(text, sizeof(text), "%s{\"timer\":%lu,\"stop\":true}", i ? "," : "", (unsigned long)timer);
+            } else {
+                snprintf(text, sizeof(text), "%s{\"timer\":%lu,\"%s\":%lu}", i ? "," : "", (unsigned long)timer,
+                         what ? "restart" : "start", (unsigned long)program_random(100000) + 1);
+            }
+        } else {
+            snprintf(text, sizeof(text), "%s{\"var\":%lu,\"%s\":%ld}", i ? "," : "", (unsigned long)program_random(4),
+                     program_random(2) ? "set" : "add", (long)program_random(5) - 2);
+        }
+        actions += text;
+    }
+    return "{\"states\":[{\"id\":0,\"audioFile\":\"\",\"repeat\":false,\"blinkCount\":0,\"transitions\":"
+           "[{\"targetState\":0,\"conditions\":[" + conditions + "],\"actions\":[" + actions + "]}]}]}";
+}
+
+// What a condition says, straight from the JSON
+static bool reference(JsonObject condition, const FsmProgramContext& x) {
+    const char* type = condition["type"] | "";
+    JsonObject data = condition["data"];
+    uint8_t pin = data["sensorPin"] | 0;
+    bool state = data["state"];
+    bool level = (x.inputs >> pin) & 1;
+    if (strcmp(type, "ALL") == 0 || strcmp(type, "NOT") == 0) {
+        bool all = true;
+        for (JsonObject c : condition["conditions"].as<JsonArray>()) {
+            all = all && reference(c, x);
+        }
+        return type[0] == 'N' ? !all : all;
+    } else if (strcmp(type, "ANY") == 0) {
+        bool any = false;
+        for (JsonObject c : condition["conditions"].as<JsonArray>()) {
+            any = any || reference(c, x);
+        }
+        return any;
+    } else if (strcmp(type, "SENSOR") == 0) {
+        return level == state;
+    } else if (strcmp(type, "SENSOR_ROSE") == 0) {
+        return (x.rose >> pin) & 1;
+    } else if (strcmp(type, "SENSOR_FELL") == 0) {
+        return (x.fell >> pin) & 1;
+    } else if (strcmp(type, "SENSOR_HELD") == 0) {
+        return level == state && x.now - x.inputSince[pin] > (unsigned long)(data["duration"] | 0);
+    } else if (strcmp(type, "TIME_PASSED") == 0) {
+        return x.elapsed > (unsigned long)(data["duration"] | 0);
+    } else if (strcmp(type, "AUDIO_FINISHED") == 0) {
+        return x.events & EVENT_AUDIO_FINISHED;
+    } else if (strcmp(type, "COUNT") == 0) {
+        bool falling = strcmp(data["edge"] | "rising", "falling") == 0;
+        return (falling ? x.falls : x.rises)[pin] >= (uint16_t)(data["count"] | 1);
+    } else if (strcmp(type, "TIMER") == 0) {
+        return (x.timers >> (data["timer"] | 0)) & 1;
+    }
+    int32_t var = x.vars[data["var"] | 0];
+    int32_t value = data["value"] | 0;
+    const char* op = data["op"] | "==";
+    return strcmp(op, "==") == 0 ? var == value : strcmp(op, "!=") == 0 ? var != value :
+           strcmp(op, "<") == 0 ? var < value : strcmp(op, "<=") == 0 ? var <= value :
+           strcmp(op, ">") == 0 ? var > value : var >= value;
+}
+
+static bool reference_all(JsonArray conditions, const FsmProgramContext& x) {
+    for (JsonObject c : conditions) {
+        if (!reference(c, x)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// The transition as changeState evaluates it, timeout as it would be left
+static bool compiled(const uint8_t* image, const Transition& t, const FsmProgramContext& x, unsigned long& timeout) {
+    timeout = 0xFFFFFFFFUL;
+    bool fires = false;
+    if ((x.inputs & t.careMask) == t.valueMask && (t.needs & ~x.events) == 0) {
+        fires = x.elapsed >= t.minElapsed &&
+                (!t.program || fsm_program_test(fsm_image_code(image) + t.program, x, timeout));
+    }
+    if (t.minElapsed > x.elapsed && t.minElapsed < timeout) {
+        timeout = t.minElapsed;
+    }
+    return fires;
+}
+
+static void random_context(FsmProgramContext& x, unsigned long* since, uint16_t* rises, uint16_t* falls, int32_t* vars) {
+    x.inputs = program_random(256);
+    uint32_t changed = program_random(256) & program_random(256);
+    x.rose = changed & x.inputs;
+    x.fell = changed & ~x.inputs;
+    x.events = program_random(2) ? EVENT_AUDIO_FINISHED : 0;
+    x.now = 100000;
+    x.elapsed = program_random(2500);
+    for (uint8_t i = 0; i < FSM_MAX_INPUTS; i++) {
+        since[i] = x.now - ((changed >> i) & 1 ? 0 : program_random(1500));
+        rises[i] = program_random(6);
+        falls[i] = program_random(6);
+    }
+    for (uint8_t i = 0; i < FSM_MAX_VARS; i++) {
+        vars[i] = (int32_t)program_random(7) - 3;
+    }
+    x.inputSince = since;
+    x.rises = rises;
+    x.falls = falls;
+    x.vars = vars;
+    x.timers = program_random(256);
+}
+
+static void run_differential() {
+    unsigned long evaluations = 0;
+    unsigned long wrong = 0;
+    unsigned long early = 0;
+    unsigned long actionsWrong = 0;
+    unsigned long badImages = 0;
+    unsigned long programBytes = 0;
+    unsigned long programs = 0;
+    double testNs = 0;
+    unsigned long tests = 0;
+    unsigned long mutatedKept = 0;
+    unsigned long mutatedRan = 0;
+
+    for (unsigned long n = 0; n < PROGRAM_CASES; n++) {
+        std::string json = random_config();
+        DynamicJsonDocument doc(16384);
+        deserializeJson(doc, json.c_str(), DeserializationOption::NestingLimit(FSM_JSON_NESTING));
+        const char* problem = nullptr;
+        uint32_t size = fsm_image_compile(doc.as<JsonObject>(), nullptr, 0, &problem);
+        std::vector<uint8_t> image(size);
+        if (size == 0 || fsm_image_compile(doc.as<JsonObject>(), image.data(), size, &problem) == 0) {
+            badImages++;
+            continue;
+        }
+        const Transition& t = fsm_image_transitions(image.data())[0];
+        JsonArray conditions = doc["states"][0]["transitions"][0]["conditions"];
+        JsonArray actions = doc["states"][0]["transitions"][0]["actions"];
+        if (t.program) {
+            programBytes += fsm_program_size(fsm_image_code(image.data()) + t.program);
+            programs++;
+        }
+
+        for (uint8_t k = 0; k < PROGRAM_CONTEXTS; k++) {
+            FsmProgramContext x;
+            unsigned long since[FSM_MAX_INPUTS];
+            uint16_t rises[FSM_MAX_INPUTS];
+            uint16_t falls[FSM_MAX_INPUTS];
+            int32_t vars[FSM_MAX_VARS];
+            random_context(x, since, rises, falls, vars);
+
+            unsigned long timeout;
+            bench_clock::time_point start = bench_clock::now();
+            bool fires = compiled(image.data(), t, x, timeout);
+            testNs += std::chrono::duration<double, std::nano>(bench_clock::now() - start).count();
+            tests++;
+            bool expect = reference_all(conditions, x);
+            evaluations++;
+            wrong += fires != expect;
+
+            // Nothing changes between now and the wake-up, with the inputs as they are
+            if (timeout != 0xFFFFFFFFUL && timeout > x.elapsed + 1) {
+                FsmProgramContext later = x;
+                unsigned long ahead = 1 + program_random(timeout - x.elapsed - 1);
+                later.elapsed += ahead;
+                later.now += ahead;
+                later.rose = later.fell = 0;        // the edges were at this snapshot only
+                FsmProgramContext edgeless = x;
+                edgeless.rose = edgeless.fell = 0;
+                early += reference_all(conditions, later) != reference_all(conditions, edgeless);
+            }
+
+            // The actions do to the variables and show timers what the JSON says,
+            // some of the timers running when they start
+            if (fires && t.actions) {
+                int32_t expectVars[FSM_MAX_VARS];
+                memcpy(expectVars, vars, sizeof(vars));
+                TimerWheel timers;
+                timers.begin(0);
+                uint64_t expectAt[FSM_MAX_TIMERS] = {};
+                for (uint8_t i = 0; i < FSM_MAX_TIMERS; i++) {
+                    if (program_random(2)) {
+                        expectAt[i] = 1 + program_random(100000) * 1000ULL;
+                        timers.arm(i, expectAt[i]);
+                    }
+                }
+                for (JsonObject a : actions) {
+                    if (a.containsKey("timer")) {
+                        uint8_t timer = a["timer"] | 0;
+                        if (a.containsKey("restart") || (a.containsKey("start") && !expectAt[timer])) {
+                            expectAt[timer] = (a[a.containsKey("start") ? "start" : "restart"] | 0UL) * 1000ULL;
+                        } else if (a.containsKey("stop")) {
+                            expectAt[timer] = 0;
+                        }
+                        continue;
+                    }
+                    uint8_t v = a["var"] | 0;
+                    if (a.containsKey("set")) {
+                        expectVars[v] = a["set"] | 0;
+                    } else {
+                        expectVars[v] += a["add"] | 0;
+                    }
+                }
+                fsm_program_act(fsm_image_code(image.data()) + t.actions, vars, timers);
+                actionsWrong += memcmp(vars, expectVars, sizeof(vars)) != 0;
+                for (uint8_t i = 0; i < FSM_MAX_TIMERS; i++) {
+                    actionsWrong += timers.armed(i) != (expectAt[i] != 0) || (expectAt[i] && timers.deadline(i) != expectAt[i]);
+                }
+            }
+        }
+
+        // A damaged program with a good CRC, as a .bin could bring: the check
+        // keeps it out, or it is one that runs within its bounds
+        FsmImageHeader* header = (FsmImageHeader*)image.data();
+        if (t.program) {
+            uint8_t* code = image.data() + header->codeOffset;
+            code[t.program + program_random(fsm_program_size(code + t.program))] ^= 1 << program_random(8);
+            header->crc = fsm_crc32(image.data() + header->headerSize, size - header->headerSize);
+            if (fsm_image_check(image.data(), size) == nullptr) {
+                FsmProgramContext x;
+                unsigned long since[FSM_MAX_INPUTS];
+                uint16_t rises[FSM_MAX_INPUTS];
+                uint16_t falls[FSM_MAX_INPUTS];
+                int32_t vars[FSM_MAX_VARS];
+                random_context(x, since, rises, falls, vars);
+                unsigned long timeout;
+                compiled(image.data(), t, x, timeout);
+                mutatedRan++;
+            } else {
+                mutatedKept++;
+            }
+        }
+    }
+
+    bool ok = wrong == 0 && early == 0 && actionsWrong == 0 && badImages == 0;
+    printf("\nCondition programs against the JSON, %d random transitions x %d random inputs\n\n", PROGRAM_CASES,
+           PROGRAM_CONTEXTS);
+    printf("%12s %12s %10s %10s %12s %14s %10s %7s\n", "evaluations", "programs", "avg_bytes", "wrong",
+           "woke_late", "actions_wrong", "eval_ns", "result");
+    printf("%12lu %12lu %10.1f %10lu %12lu %14lu %10.1f %7s\n", evaluations, programs,
+           programs ? (double)programBytes / programs : 0.0, wrong, early, actionsWrong, testNs / tests,
+           bench_check(ok) ? "ok" : "FAIL");
+    printf("damaged programs: %lu kept out by the image check, %lu still valid and run\n", mutatedKept, mutatedRan);
+    if (badImages) {
+        printf("%lu configs didn't compile FAIL\n", badImages);
+    }
+}
+
+// A show of SHOW_STEPS steps in a ring, written both ways
+enum ShowKind : uint8_t {
+    SHOW_ANY_DOOR,          // next step when someone is at any of the 8 doors, at most once a second
+    SHOW_THREE_PRESSES      // next step after the button on input 0 was pressed three times
+};
+
+static std::string show_config(ShowKind kind, bool programs, uint8_t& statesPerStep) {
+    std::string states;
+    statesPerStep = kind == SHOW_THREE_PRESSES && !programs ? 6 : 1;
+    uint16_t numStates = SHOW_STEPS * statesPerStep;
+    for (uint16_t s = 0; s < numStates; s++) {
+        char head[160];
+        snprintf(head, sizeof(head), "%s{\"id\":%u,\"audioFile\":\"\",\"repeat\":false,\"blinkCount\":%u,\"transitions\":[",
+                 s ? "," : "", s, s / statesPerStep + 1);
+        states += head;
+        uint16_t next = (s + 1) % numStates;
+        std::string target = "{\"targetState\":" + std::to_string(next) + ",\"conditions\":[";
+        if (kind == SHOW_ANY_DOOR && programs) {
+            states += target + "{\"type\":\"TIME_PASSED\",\"data\":{\"duration\":1000}},{\"type\":\"ANY\",\"conditions\":[";
+            for (uint8_t d = 0; d < 8; d++) {
+                states += std::string(d ? "," : "") + "{\"type\":\"SENSOR\",\"data\":{\"sensorPin\":" +
+                          std::to_string(d) + ",\"state\":false}}";
+            }
+            states += "]}]}";
+        } else if (kind == SHOW_ANY_DOOR) {
+            // No OR: a transition per door
+            for (uint8_t d = 0; d < 8; d++) {
+                states += std::string(d ? "," : "") + target + "{\"type\":\"TIME_PASSED\",\"data\":{\"duration\":1000}},"
+                          "{\"type\":\"SENSOR\",\"data\":{\"sensorPin\":" + std::to_string(d) + ",\"state\":false}}]}";
+            }
+        } else if (programs) {
+            states += target + "{\"type\":\"COUNT\",\"data\":{\"sensorPin\":0,\"edge\":\"falling\",\"count\":3}}]}";
+        } else {
+            // No counters: wait for released, pressed, released, pressed, released, pressed, a state each
+            states += target + "{\"type\":\"SENSOR\",\"data\":{\"sensorPin\":0,\"state\":" +
+                      (s % 2 ? "false" : "true") + "}}]}";
+        }
+        states += "]}";
+    }
+    return "{\"states\":[" + states + "]}\n";
+}
+
+struct ShowResult {
+    uint16_t numStates;
+    uint32_t imageBytes;
+    double updateNs;
+    std::vector<unsigned long> steps;   // ms at which each step was entered
+};
+
+static ShowResult run_show(const char* dir, ShowKind kind, bool programs) {
+    ShowResult result = {};
+    uint8_t statesPerStep;
+    std::string json = show_config(kind, programs, statesPerStep);
+    FILE* f = fopen((std::string(dir) + "/FSM_Config.json").c_str(), "w");
+    fputs(json.c_str(), f);
+    fclose(f);
+
+    DynamicJsonDocument doc(262144);
+    deserializeJson(doc, json.c_str());
+    const char* problem = nullptr;
+    result.imageBytes = fsm_image_compile(doc.as<JsonObject>(), nullptr, 0, &problem);
+
+    // The same visitors both times
+    for (uint8_t p = 0; p < 8; p++) {
+        native_set_pin(p, HIGH);             // inputs 0-7 are GPIO0-7
+    }
+    FSM fsm;
+    fsm.loadConfiguration();
+    native_set_micros(0);
+    fsm.begin();
+    result.numStates = fsm.getNumStates();
+
+    program_seed = 0x5110E;
+    unsigned long nextPress = 500;
+    int8_t pressed = -1;
+    unsigned long releaseAt = 0;
+    double ns = 0;
+    uint8_t lastState = 0;
+    for (unsigned long ms = 0; ms < SHOW_RUN_MS; ms++) {
+        if (pressed < 0 && ms >= nextPress) {
+            pressed = kind == SHOW_ANY_DOOR ? program_random(8) : 0;
+            native_set_pin(pressed, LOW);
+            releaseAt = ms + 80 + program_random(300);
+        } else if (pressed >= 0 && ms >= releaseAt) {
+            native_set_pin(pressed, HIGH);
+            pressed = -1;
+            nextPress = ms + 100 + program_random(kind == SHOW_ANY_DOOR ? 1500 : 400);
+        }
+        bench_clock::time_point start = bench_clock::now();
+        fsm.update();
+        ns += std::chrono::duration<double, std::nano>(bench_clock::now() - start).count();
+        if (fsm.getCurrentState() != lastState) {
+            lastState = fsm.getCurrentState();
+            if (lastState % statesPerStep == 0) {
+                result.steps.push_back(millis());
+            }
+        }
+        native_advance_micros(1000);
+    }
+    result.updateNs = ns / SHOW_RUN_MS;
+    return result;
+}
+
+void bench_program(const char* dir) {
+    run_differential();
+
+    printf("\nShows written without and with condition programs, %d s of visitors in virtual time\n\n",
+           SHOW_RUN_MS / 1000);
+    printf("%-28s %7s %11s %10s %7s %7s\n", "show", "states", "image_bytes", "update_ns", "steps", "result");
+    const struct {
+        const char* name;
+        ShowKind kind;
+    } shows[] = {{"any of 8 doors", SHOW_ANY_DOOR}, {"three presses", SHOW_THREE_PRESSES}};
+    for (const auto& show : shows) {
+        ShowResult before = run_show(dir, show.kind, false);
+        ShowResult after = run_show(dir, show.kind, true);
+        bool same = before.steps == after.steps && !after.steps.empty();
+        printf("%-28s %7u %11lu %10.1f %7lu %7s\n", (std::string(show.name) + ", duplicated").c_str(),
+               before.numStates, (unsigned long)before.imageBytes, before.updateNs, (unsigned long)before.steps.size(), "");
+        printf("%-28s %7u %11lu %10.1f %7lu %7s\n", (std::string(show.name) + ", program").c_str(),
+               after.numStates, (unsigned long)after.imageBytes, after.updateNs, (unsigned long)after.steps.size(),
+               bench_check(same) ? "ok" : "FAIL");
+    }
+    unlink((std::string(dir) + "/FSM_Config.json").c_str());
+
+    printf("\nwoke_late: the inputs held as they were, the answer changed before the time the program asked to be\n"
+           "        woken at. eval_ns: host time of the masks and the program of one transition\n"
+           "steps: show steps reached, at the same ms both ways or the program row fails\n");
+}
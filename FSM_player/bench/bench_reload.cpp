@@ -0,0 +1,248 @@
+// Host benchmark for reloading the config while the FSM runs (env:native).
+//
+// Runs the FSM and the audio engine (two streams through the mixer) in
+// virtual time, changes the config files on the card half a second in and
+// follows the reload: when the new config goes in, how long the ticks that
+// compile and swap it take on the host, which state the FSM is in after it
+// and whether the audio played on without a break, checked byte for byte
+// against the file it plays.
+
+#include <Arduino.h>
+#include <chrono>
+#include <functional>
+#include <string>
+#include <vector>
+#include <unistd.h>
+#include "native_hal.h"
+#include "pcm_file_sink.h"
+#include "audio_engine.h"
+#include "scheduler.h"
+#include "FSM.h"
+#include "bench.h"
+
+typedef std::chrono::steady_clock bench_clock;
+
+#define RELOAD_RATE     44100
+#define RELOAD_RUN_MS   4000
+#define RELOAD_CHANGE_MS 500
+
+// What a case expects of the reload
+enum ReloadAudio : uint8_t {
+    AUDIO_PLAYS_ON,         // the same file, not a sample missed or repeated
+    AUDIO_CHANGES           // the state's new audio, crossfaded
+};
+
+struct ReloadCase {
+    const char* name;
+    const char* before;                 // FSM_Config.json at boot
+    std::function<void(FSM&)> change;   // at RELOAD_CHANGE_MS
+    bool fails;                         // the new config is bad and must be kept out
+    uint8_t stateAfter;                 // right after the swap (or the failure)
+    uint32_t transitionMs;              // the first transition after it is due then (ms after boot), 0: none
+    int8_t pressPin;                    // GPIO pulled low at 2.5 s, -1: none
+    ReloadAudio audio;
+};
+
+static std::string reload_dir;
+
+static void write_text(const std::string& name, const char* text) {
+    FILE* f = fopen((reload_dir + name).c_str(), "w");
+    fputs(text, f);
+    fclose(f);
+}
+
+// A one-state-and-a-spare config: state 0 plays a.wav and goes to state 1
+// after ms, or when input 0 goes low when sensor is set
+static std::string chain_config(uint32_t ms, const char* inputs = nullptr) {
+    char text[512];
+    snprintf(text, sizeof(text),
+             "{%s%s%s\"states\":["
+             "{\"id\":0,\"audioFile\":\"/reload_a.wav\",\"repeat\":true,\"blinkCount\":1,\"fadeOut\":200,\"transitions\":"
+             "[{\"targetState\":1,\"conditions\":[{\"type\":\"%s\",\"data\":{%s}}]}]},"
+             "{\"id\":1,\"audioFile\":\"\",\"repeat\":false,\"blinkCount\":2,\"transitions\":[]}]}\n",
+             inputs ? "\"inputs\":" : "", inputs ? inputs : "", inputs ? "," : "",
+             inputs ? "SENSOR" : "TIME_PASSED",
+             inputs ? "\"sensorPin\":0,\"state\":false" : ("\"duration\":" + std::to_string(ms)).c_str());
+    return text;
+}
+
+// Three states that get to state 2 (b.wav) 200 ms after boot
+static const char* three_states =
+    "{\"states\":["
+    "{\"id\":0,\"audioFile\":\"/reload_a.wav\",\"repeat\":true,\"blinkCount\":1,\"transitions\":"
+    "[{\"targetState\":1,\"conditions\":[{\"type\":\"TIME_PASSED\",\"data\":{\"duration\":100}}]}]},"
+    "{\"id\":1,\"audioFile\":\"/reload_a.wav\",\"repeat\":true,\"blinkCount\":1,\"transitions\":"
+    "[{\"targetState\":2,\"conditions\":[{\"type\":\"TIME_PASSED\",\"data\":{\"duration\":100}}]}]},"
+    "{\"id\":2,\"audioFile\":\"/reload_b.wav\",\"repeat\":true,\"blinkCount\":3,\"fadeOut\":300,\"transitions\":[]}]}\n";
+
+// Two states, state 0 fading a.wav in
+static const char* two_states =
+    "{\"states\":["
+    "{\"id\":0,\"audioFile\":\"/reload_a.wav\",\"repeat\":true,\"blinkCount\":1,\"fadeIn\":300,\"transitions\":[]},"
+    "{\"id\":1,\"audioFile\":\"\",\"repeat\":false,\"blinkCount\":2,\"transitions\":[]}]}\n";
+
+// Compiles a JSON config into FSM_Config.bin, as fsm_compile does
+static void write_image(const std::string& json) {
+    DynamicJsonDocument doc(16384);
+    deserializeJson(doc, json.c_str());
+    const char* problem = nullptr;
+    uint32_t size = fsm_image_compile(doc.as<JsonObject>(), nullptr, 0, &problem);
+    std::vector<uint8_t> image(size);
+    fsm_image_compile(doc.as<JsonObject>(), image.data(), size, &problem);
+    FILE* f = fopen((reload_dir + "/FSM_Config.bin").c_str(), "wb");
+    fwrite(image.data(), 1, image.size(), f);
+    fclose(f);
+}
+
+static void run_reload(const ReloadCase& c, const std::vector<uint8_t>& dataA, const WavSpec& specA) {
+    write_text("/FSM_Config.json", c.before);
+
+    PcmFileSink sink;
+    AudioMixer mixer;
+    AudioStream first;
+    AudioStream second;
+    mixer.begin(sink);
+    first.setOutput(RELOAD_RATE, true);
+    second.setOutput(RELOAD_RATE, true);
+    first.begin(sd, mixer.getInput(0));
+    second.begin(sd, mixer.getInput(1));
+    AudioEngine engine;
+    engine.begin(mixer, first, second);
+
+    FSM fsm;
+    fsm.loadConfiguration();
+    fsm.setAudio(&engine);
+    native_set_micros(0);           // boot over, the loader's LED blinks took virtual time
+    fsm.begin();
+    Scheduler scheduler;
+    scheduler.begin(fsm.getInputGpioMask());
+
+    // What the change found and what the reload made of it
+    bool changed = false;
+    uint8_t stateBefore = 0;
+    uint64_t swapUs = 0;            // virtual time of the swap (or of the failure)
+    double swapHostUs = 0;          // host time of the tick that swapped
+    double slowestUs = 0;           // slowest tick, the compile is in one of them
+    uint8_t stateAfter = 0xFF;
+    uint64_t transitionUs = 0;
+    uint32_t plainCrc = 0;          // output while the audio should be untouched
+    uint64_t plainBytes = 0;
+    bool watched = false;
+    if (c.pressPin >= 0) {
+        native_schedule_pin(2500000, c.pressPin, LOW);
+    }
+
+    while (native_micros() < RELOAD_RUN_MS * 1000ULL) {
+        uint64_t now = native_micros();
+        if (!changed && now >= RELOAD_CHANGE_MS * 1000ULL) {
+            stateBefore = fsm.getCurrentState();
+            c.change(fsm);
+            changed = true;
+        }
+
+        uint16_t done = fsm.getReloads() + fsm.getReloadFailures();
+        uint8_t state = fsm.getCurrentState();
+        bench_clock::time_point t = bench_clock::now();
+        fsm.update();
+        double hostUs = std::chrono::duration<double, std::micro>(bench_clock::now() - t).count();
+        slowestUs = std::max(slowestUs, hostUs);
+        if (fsm.takeReloaded()) {
+            scheduler.watch(fsm.getInputGpioMask());
+            watched = true;
+        }
+        if (!swapUs && fsm.getReloads() + fsm.getReloadFailures() != done) {
+            swapUs = now;
+            swapHostUs = hostUs;
+            stateAfter = fsm.getCurrentState();
+        } else if (swapUs && !transitionUs && fsm.getCurrentState() != state) {
+            transitionUs = now;
+        }
+        engine.run();
+
+        // Up to the first transition after the change the audio of the state
+        // the change found should play on (where the case says it does)
+        if (!transitionUs) {
+            plainCrc = sink.getCrc();
+            plainBytes = sink.getBytesWritten();
+        }
+        delay(AUDIO_SERVICE_MS);
+    }
+    if (c.pressPin >= 0) {
+        native_set_pin(c.pressPin, HIGH);
+    }
+    unlink((reload_dir + "/FSM_Config.bin").c_str());
+
+    bool ok = swapUs != 0 && stateAfter == c.stateAfter && sink.getUnderruns() == 0 &&
+              (fsm.getReloadFailures() == 1) == c.fails && (fsm.getReloads() == 1) == !c.fails;
+    const char* audio;
+    if (c.audio == AUDIO_PLAYS_ON) {
+        bool intact = plainCrc == converted_crc(dataA, specA, RELOAD_RATE, true, plainBytes);
+        audio = intact ? "plays on" : "BROKEN";
+        ok = ok && intact && mixer.getMixedFrames() == 0;
+    } else {
+        audio = mixer.getMixedFrames() > 0 ? "crossfaded" : "CUT";
+        ok = ok && mixer.getMixedFrames() > 0;
+    }
+    if (c.transitionMs) {
+        // Ticks are AUDIO_SERVICE_MS apart, a sensor takes a debounce on top
+        long late = (long)(transitionUs / 1000) - (long)c.transitionMs;
+        ok = ok && transitionUs && late >= 0 && late <= 40;
+    } else {
+        ok = ok && !transitionUs;
+    }
+    if (c.pressPin >= 0) {
+        ok = ok && watched;
+    }
+
+    char states[16];
+    snprintf(states, sizeof(states), "%u -> %u", stateBefore, stateAfter);
+    char transition[16];
+    snprintf(transition, sizeof(transition), transitionUs ? "%.0f" : "-", transitionUs / 1000.0);
+    printf("%-30s %9.0f %10.1f %10.1f %8s %10s %11s %10lu %7s\n", c.name,
+           swapUs ? (swapUs / 1000.0 - RELOAD_CHANGE_MS) : -1.0, swapHostUs, slowestUs, states, transition, audio,
+           (unsigned long)sink.getUnderruns(), bench_check(ok) ? "ok" : "FAIL");
+}
+
+void bench_reload(const char* dir) {
+    reload_dir = dir;
+    const WavSpec specA = {"", 1, 16, RELOAD_RATE, RELOAD_RATE * 3, 0};
+    const WavSpec specB = {"", 1, 16, RELOAD_RATE, RELOAD_RATE * 2, 0};
+    std::vector<uint8_t> dataA = write_wav(reload_dir + "/reload_a.wav", specA);
+    write_wav(reload_dir + "/reload_b.wav", specB);
+    std::string slow = chain_config(60000);
+    std::string faster = chain_config(3000);
+    std::string sensor = chain_config(0, "[12]");
+
+    const ReloadCase cases[] = {
+        {"edited, state and audio kept", slow.c_str(),
+         [&](FSM&) { write_text("/FSM_Config.json", faster.c_str()); }, false, 0, 3000, -1, AUDIO_PLAYS_ON},
+        {"precompiled image added", slow.c_str(),
+         [&](FSM&) { write_image(faster); }, false, 0, 3000, -1, AUDIO_PLAYS_ON},
+        {"asked for, files unchanged", slow.c_str(),
+         [](FSM& fsm) { fsm.requestReload(); }, false, 0, 0, -1, AUDIO_PLAYS_ON},
+        {"state gone, back to state 0", three_states,
+         [](FSM&) { write_text("/FSM_Config.json", two_states); }, false, 0, 0, -1, AUDIO_CHANGES},
+        {"inputs moved to GPIO12", slow.c_str(),
+         [&](FSM&) { write_text("/FSM_Config.json", sensor.c_str()); }, false, 0, 2500, 12, AUDIO_PLAYS_ON},
+        {"broken JSON, config kept", slow.c_str(),
+         [](FSM&) { write_text("/FSM_Config.json", "{\"states\":[{\"id\":0,"); }, true, 0, 0, -1, AUDIO_PLAYS_ON},
+    };
+
+    printf("\nConfig reload while playing, two streams to 44.1 kHz mono, virtual time, change at %d ms\n\n",
+           RELOAD_CHANGE_MS);
+    printf("%-30s %9s %10s %10s %8s %10s %11s %10s %7s\n", "case", "swap_ms", "swap_us", "slowest_us", "state",
+           "next_ms", "audio", "underruns", "result");
+    for (const ReloadCase& c : cases) {
+        run_reload(c, dataA, specA);
+    }
+    write_text("/FSM_Config.json", "{}");
+    unlink((reload_dir + "/reload_a.wav").c_str());
+    unlink((reload_dir + "/reload_b.wav").c_str());
+
+    printf("\nswap_ms: virtual time from the change to the new config going in (or being turned down),\n"
+           "        the files are looked at every %d ms. swap_us: host time of the tick that swapped,\n"
+           "        slowest_us: of the slowest tick, the one that compiled the JSON\n"
+           "state: before the change -> right after the swap. next_ms: first transition after it, ms after boot\n"
+           "audio: plays on when the output up to that transition is the file's, byte for byte\n",
+           FSM_RELOAD_POLL_MS);
+}
@@ -0,0 +1,524 @@
+// Host benchmark for the binary serial protocol (env:native).
+//
+// First the framing on its own: thousands of random messages, a quarter of
+// them with a bit flipped on the way, go through the player's SerialReader
+// (commands, with text lines typed in between) and the host's SerialClient
+// (long replies, fed in pieces of random size). No message that was changed
+// may come out, and every one that wasn't must come out as it went in, the
+// one right after a changed one too.
+//
+// Then the loopback: a show controller made of SerialClient talks to the FSM
+// through the stand-in serial port of env:native while the loop sleeps on
+// the Scheduler in virtual time, the same as loop() on the Pico. Every
+// command must get its answer, the state the controller keeps from the
+// pushes must always be the FSM's, and the virtual time from a command
+// arriving to its answer (and to the push of the state a pressed input moved
+// the FSM to) is what a controller waits for. At the end the port stops
+// taking bytes: the pushes that didn't fit must be counted, and a query puts
+// the controller right again.
+
+#include <Arduino.h>
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <string.h>
+#include <unistd.h>
+#include "native_hal.h"
+#include "FSM.h"
+#include "scheduler.h"
+#include "serial_client.h"
+#include "bench.h"
+
+#define SERIAL_MESSAGES  20000          // each way
+#define SERIAL_REPLY_MAX 1200           // longest body of a reply, several COBS blocks
+#define SERIAL_STATES    4
+#define SERIAL_SHOW_S    300
+#define SERIAL_DROPPED   5              // state changes while the port takes nothing
+
+typedef std::chrono::steady_clock serial_clock;
+
+static uint32_t serial_seed = 0x5E41A1;
+
+static uint32_t serial_random(uint32_t n) {
+    serial_seed = serial_seed * 1103515245UL + 12345UL;
+    return (serial_seed >> 8) % n;
+}
+
+// Random bytes, a third of them zeros so COBS has work to do
+static std::vector<uint8_t> random_body(size_t size) {
+    std::vector<uint8_t> body(size);
+    for (uint8_t& b : body) {
+        b = serial_random(3) == 0 ? 0 : 1 + serial_random(255);
+    }
+    return body;
+}
+
+// Flips a bit of the encoded message, never of its delimiters
+static void corrupt(std::vector<uint8_t>& bytes) {
+    bytes[1 + serial_random(bytes.size() - 2)] ^= 1 << serial_random(8);
+}
+
+struct FramingResult {
+    unsigned long messages;
+    unsigned long corrupted;
+    unsigned long acceptedBad;      // changed on the way and came out anyway
+    unsigned long wrong;            // came out other than it went in
+    unsigned long lost;             // not changed and didn't come out
+    unsigned long textLines;
+    unsigned long textWrong;
+    double nsPerByte;
+};
+
+static void print_framing(const char* side, const FramingResult& r) {
+    bool ok = r.acceptedBad == 0 && r.wrong == 0 && r.lost == 0 && r.textWrong == 0;
+    printf("%-8s %9lu %9lu %12lu %7lu %7lu %10lu %9.2f %8s\n", side, r.messages, r.corrupted, r.acceptedBad, r.wrong,
+           r.lost, r.textLines, r.nsPerByte, bench_check(ok) ? "ok" : "FAIL");
+}
+
+// Commands into the player's SerialReader, text lines between them as the serial monitor sends them
+static FramingResult run_player_framing() {
+    FramingResult r = {};
+    SerialClient host;
+    SerialReader reader;
+    std::string line;
+    uint64_t bytes = 0;
+    double ns = 0;
+
+    for (int i = 0; i < SERIAL_MESSAGES; i++) {
+        uint8_t type = 1 + serial_random(SERIAL_RELOAD);
+        std::vector<uint8_t> body = random_body(serial_random(SERIAL_COMMAND_MAX - sizeof(SerialHeader) - 4 + 1));
+        std::vector<uint8_t> wire = host.command(type, body.data(), body.size());
+        uint8_t seq = host.lastSeq();
+        bool bad = serial_random(4) == 0;
+        if (bad) {
+            corrupt(wire);
+            r.corrupted++;
+        }
+        std::string text;
+        if (serial_random(8) == 0) {
+            text = "line " + std::to_string(i) + "\n";
+            wire.insert(wire.end(), text.begin(), text.end());
+        }
+
+        bool got = false;
+        serial_clock::time_point start = serial_clock::now();
+        for (uint8_t byte : wire) {
+            SerialByte kind = reader.feed(byte);
+            if (kind == SERIAL_BYTE_MESSAGE) {
+                const uint8_t* m = reader.message();
+                bool same = reader.messageLength() == sizeof(SerialHeader) + body.size() && m[0] == type &&
+                            m[1] == seq && memcmp(m + sizeof(SerialHeader), body.data(), body.size()) == 0;
+                if (bad) {
+                    r.acceptedBad++;
+                } else if (!same) {
+                    r.wrong++;
+                }
+                got = true;
+            } else if (kind == SERIAL_BYTE_FRAME) {
+                line.clear();                           // as checkSerial() does
+            } else if (byte == '\n') {
+                r.textLines++;
+                if (line + "\n" != text && !bad) {
+                    r.textWrong++;
+                }
+                line.clear();
+            } else {
+                line += (char)byte;
+            }
+        }
+        ns += std::chrono::duration<double, std::nano>(serial_clock::now() - start).count();
+        bytes += wire.size();
+
+        if (!bad) {
+            r.messages++;
+            if (!got) {
+                r.lost++;
+            }
+        }
+    }
+    r.nsPerByte = ns / bytes;
+    return r;
+}
+
+// Long replies into the host's SerialClient, in pieces of random size
+static FramingResult run_host_framing() {
+    FramingResult r = {};
+    SerialClient player;                // encodes, the same SerialWriter the firmware uses
+    SerialClient host;
+    uint64_t bytes = 0;
+    double ns = 0;
+
+    for (int i = 0; i < SERIAL_MESSAGES; i++) {
+        uint8_t type = SERIAL_ACK + serial_random(4);
+        // Sizes around the ends of COBS blocks as often as any other
+        size_t size = serial_random(4) == 0 ? 254 * (1 + serial_random(4)) - 8 + serial_random(16)
+                                            : serial_random(SERIAL_REPLY_MAX + 1);
+        std::vector<uint8_t> body = random_body(size);
+        std::vector<uint8_t> wire = player.command(type, body.data(), body.size());
+        uint8_t seq = player.lastSeq();
+        bool bad = serial_random(4) == 0;
+        if (bad) {
+            corrupt(wire);
+            r.corrupted++;
+        }
+        std::string text;
+        if (serial_random(8) == 0) {
+            text = "line " + std::to_string(i) + "\n";
+            wire.insert(wire.end(), text.begin(), text.end());
+        }
+
+        serial_clock::time_point start = serial_clock::now();
+        for (size_t at = 0; at < wire.size();) {
+            size_t piece = std::min(wire.size() - at, (size_t)1 + serial_random(300));
+            host.receive(wire.data() + at, piece);
+            at += piece;
+        }
+        ns += std::chrono::duration<double, std::nano>(serial_clock::now() - start).count();
+        bytes += wire.size();
+
+        SerialMessage message;
+        bool got = false;
+        while (host.take(seq, message)) {
+            if (bad) {
+                r.acceptedBad++;
+            } else if (message.type != type || message.body != body) {
+                r.wrong++;
+            }
+            got = true;
+        }
+        if (!bad) {
+            r.messages++;
+            if (!got) {
+                r.lost++;
+            }
+        }
+        std::string came = host.takeText();
+        if (!text.empty()) {
+            r.textLines++;
+            if (!bad && came != text) {
+                r.textWrong++;
+            }
+        }
+    }
+    r.nsPerByte = ns / bytes;
+    return r;
+}
+
+// State i goes on to the next one when pin i goes low, starts show timer 0 and counts the visit in var 0
+static void write_serial_config(const char* dir) {
+    std::string json = "{\"states\":[";
+    for (int i = 0; i < SERIAL_STATES; i++) {
+        char state[360];
+        snprintf(state, sizeof(state),
+                 "%s{\"id\":%d,\"audioFile\":\"/serial/state_%d.wav\",\"repeat\":false,\"blinkCount\":%d,"
+                 "\"transitions\":[{\"targetState\":%d,\"conditions\":[{\"type\":\"SENSOR\",\"data\":"
+                 "{\"sensorPin\":%d,\"state\":false}}],\"actions\":[{\"var\":0,\"add\":1},"
+                 "{\"timer\":0,\"start\":600000}]}]}",
+                 i ? "," : "", i, i, i, (i + 1) % SERIAL_STATES, i);
+        json += state;
+    }
+    json += "]}";
+    std::string path = std::string(dir) + "/FSM_Config.json";
+    FILE* f = fopen(path.c_str(), "wb");
+    fputs(json.c_str(), f);
+    fclose(f);
+}
+
+// The command waiting for its answer
+struct SerialPending {
+    bool active;
+    uint8_t seq;
+    uint8_t type;
+    uint8_t reply;                  // SERIAL_ACK, SERIAL_PONG, ...
+    uint8_t result;                 // for SERIAL_ACK
+    uint8_t moveTo;                 // state a pressed input must move the FSM to, 0xFF: none
+    uint64_t sentUs;
+};
+
+struct SerialLoopback {
+    unsigned long commands;
+    unsigned long answered;
+    unsigned long wrong;            // answer of the wrong type or result
+    unsigned long unanswered;
+    unsigned long pushes;
+    unsigned long stale;            // ticks the controller's state wasn't the FSM's
+    unsigned long presses;
+    unsigned long missedMoves;      // presses the FSM didn't move on
+    unsigned long corruptSent;
+    unsigned long reloads;          // text reloads typed in between
+    unsigned long reloadPushes;
+    unsigned long textMissing;
+    uint64_t latencySum;
+    uint64_t latencyMax;
+    double handleNs;                // host time of the updates that handled a command
+    unsigned long handled;
+};
+
+// Makes the next command, the kind at random; an input that was pressed is released first
+static std::vector<uint8_t> next_command(SerialClient& client, FSM& fsm, SerialPending& p, int& heldInput,
+                                         SerialLoopback& s) {
+    p.moveTo = 0xFF;
+    uint8_t current = fsm.getCurrentState();
+    std::vector<uint8_t> wire;
+    if (heldInput >= 0) {
+        wire = client.input(heldInput, SERIAL_LEVEL_RELEASE);
+        heldInput = -1;
+        p.type = SERIAL_INPUT;
+        p.reply = SERIAL_ACK;
+        p.result = SERIAL_OK;
+    } else {
+        switch (serial_random(9)) {
+            case 0:
+                wire = client.ping();
+                p.type = SERIAL_PING;
+                p.reply = SERIAL_PONG;
+                break;
+            case 1:
+                wire = client.query();
+                p.type = SERIAL_QUERY;
+                p.reply = SERIAL_STATUS;
+                break;
+            case 2:
+                wire = client.setState(serial_random(SERIAL_STATES));
+                p.type = SERIAL_SET_STATE;
+                p.reply = SERIAL_ACK;
+                p.result = SERIAL_OK;
+                break;
+            case 3:
+                wire = client.setState(SERIAL_STATES + serial_random(100));
+                p.type = SERIAL_SET_STATE;
+                p.reply = SERIAL_ACK;
+                p.result = SERIAL_BAD_ARGUMENT;
+                break;
+            case 4:
+            case 5:
+                // Sensor i moves state i on
+                wire = client.input(current, SERIAL_LEVEL_LOW);
+                heldInput = current;
+                p.type = SERIAL_INPUT;
+                p.reply = SERIAL_ACK;
+                p.result = SERIAL_OK;
+                p.moveTo = (current + 1) % SERIAL_STATES;
+                s.presses++;
+                break;
+            case 6:
+                wire = client.input(31, SERIAL_LEVEL_LOW);
+                p.type = SERIAL_INPUT;
+                p.reply = SERIAL_ACK;
+                p.result = SERIAL_BAD_ARGUMENT;
+                break;
+            case 7:
+                wire = client.telemetry();
+                p.type = SERIAL_TELEMETRY;
+                p.reply = SERIAL_TELEMETRY_DUMP;
+                break;
+            default: {
+                // A state number too long, or a command this firmware doesn't have
+                bool unknown = serial_random(2);
+                uint8_t body[2] = {1, 2};
+                p.type = unknown ? 0x40 : SERIAL_SET_STATE;
+                wire = client.command(p.type, body, sizeof(body));
+                p.reply = SERIAL_ACK;
+                p.result = unknown ? SERIAL_UNKNOWN : SERIAL_BAD_LENGTH;
+                break;
+            }
+        }
+    }
+    p.seq = client.lastSeq();
+    p.active = true;
+
+    // Now and then a copy with a bit flipped goes first, or a reload typed on the serial monitor
+    if (serial_random(25) == 0) {
+        std::vector<uint8_t> bad = wire;
+        corrupt(bad);
+        wire.insert(wire.begin(), bad.begin(), bad.end());
+        s.corruptSent++;
+    }
+    if (serial_random(40) == 0) {
+        const char* reload = "reload\n";
+        wire.insert(wire.begin(), reload, reload + strlen(reload));
+        s.reloads++;
+    }
+    s.commands++;
+    return wire;
+}
+
+// Checks the answer against what the command was
+static bool answer_ok(const SerialMessage& m, const SerialPending& p, FSM& fsm, const SerialLoopback& s) {
+    if (m.type != p.reply) {
+        return false;
+    }
+    SerialAckBody ack;
+    SerialPongBody pong;
+    SerialStatusBody status;
+    switch (p.reply) {
+        case SERIAL_ACK:
+            return serial_ack(m, ack) && ack.command == p.type && ack.result == p.result;
+        case SERIAL_PONG:
+            return serial_pong(m, pong) && pong.version == SERIAL_PROTOCOL_VERSION && pong.badFrames == s.corruptSent;
+        case SERIAL_STATUS:
+            return serial_status(m, status) && status.reason == SERIAL_REASON_QUERY &&
+                   status.state == fsm.getCurrentState() && status.numStates == SERIAL_STATES &&
+                   status.vars[0] == fsm.getVar(0) && status.held == 0;
+        default:
+            return !m.body.empty();
+    }
+}
+
+// Moves what the player sent over to the controller, and the pushes into its state
+static void drain(SerialClient& client, int& hostState, SerialLoopback& s) {
+    uint8_t buffer[4096];
+    size_t n;
+    while ((n = native_serial_take(buffer, sizeof(buffer))) > 0) {
+        client.receive(buffer, n);
+    }
+    SerialMessage m;
+    SerialStatusBody status;
+    while (client.next(m)) {
+        if (!serial_status(m, status)) {
+            s.wrong++;
+            continue;
+        }
+        s.pushes++;
+        if (status.reason == SERIAL_REASON_STATE || status.reason == SERIAL_REASON_RELOAD) {
+            hostState = status.state;
+        }
+        if (status.reason == SERIAL_REASON_RELOAD) {
+            s.reloadPushes++;
+        }
+    }
+}
+
+static void run_loopback(const char* dir) {
+    write_serial_config(dir);
+    for (uint8_t p = 0; p < SERIAL_STATES; p++) {
+        native_set_pin(p, HIGH);
+    }
+    native_serial_capture(true);
+    SerialLoopback s = {};
+    SerialClient client;
+
+    FSM fsm;
+    fsm.loadConfiguration();
+    fsm.begin();
+    Scheduler scheduler;
+    scheduler.begin(fsm.getInputGpioMask());
+    fsm.update();
+    int hostState = fsm.getCurrentState();
+
+    // Subscribe, then one command at a time, each a while after the last was answered
+    SerialPending p = {};
+    std::vector<uint8_t> wire = client.subscribe(true);
+    p = {true, client.lastSeq(), SERIAL_SUBSCRIBE, SERIAL_ACK, SERIAL_OK, 0xFF, native_micros() + 1000};
+    native_schedule_serial(p.sentUs, wire.data(), wire.size());
+    s.commands++;
+    int heldInput = -1;
+    unsigned long reloadsSeen = 0;
+
+    // Runs on until the last command is answered, nothing is left scheduled for the benches after
+    uint64_t end = native_micros() + SERIAL_SHOW_S * 1000000ULL;
+    while (native_micros() < end || p.active) {
+        scheduler.sleepUntilUs(fsm.nextDeadlineUs());
+        bool arrived = Serial.available() > 0;
+        serial_clock::time_point start = serial_clock::now();
+        fsm.update();
+        if (arrived) {
+            s.handleNs += std::chrono::duration<double, std::nano>(serial_clock::now() - start).count();
+            s.handled++;
+        }
+        drain(client, hostState, s);
+
+        SerialMessage m;
+        if (p.active && client.take(p.seq, m)) {
+            uint64_t latency = native_micros() - p.sentUs;
+            s.latencySum += latency;
+            s.latencyMax = std::max(s.latencyMax, latency);
+            s.answered++;
+            if (!answer_ok(m, p, fsm, s)) {
+                s.wrong++;
+            }
+            if (p.moveTo != 0xFF && fsm.getCurrentState() != p.moveTo) {
+                s.missedMoves++;
+            }
+            p.active = false;
+            if (native_micros() < end) {
+                wire = next_command(client, fsm, p, heldInput, s);
+                p.sentUs = native_micros() + 20000 + serial_random(200000);
+                native_schedule_serial(p.sentUs, wire.data(), wire.size());
+            }
+        } else if (p.active && native_micros() > p.sentUs + 1000000) {
+            s.unanswered++;
+            p.active = false;
+        }
+        if (hostState != fsm.getCurrentState()) {
+            s.stale++;
+        }
+        std::string text = client.takeText();
+        for (size_t at = text.find("Config reloaded"); at != std::string::npos; at = text.find("Config reloaded", at + 1)) {
+            reloadsSeen++;
+        }
+    }
+    s.textMissing = s.reloads - std::min(s.reloads, reloadsSeen);
+
+    // The port takes nothing: the state changes can't be pushed, the answers
+    // still go out (the bench's port keeps them all)
+    native_serial_tx_space(0);
+    uint16_t dropped = 0;
+    for (int i = 0; i < SERIAL_DROPPED; i++) {
+        wire = client.setState((fsm.getCurrentState() + 1) % SERIAL_STATES);
+        native_serial_input(wire.data(), wire.size());
+        fsm.update();
+        drain(client, hostState, s);
+    }
+    native_serial_tx_space(4096);
+    bool staleAfter = hostState != fsm.getCurrentState();
+    wire = client.query();
+    native_serial_input(wire.data(), wire.size());
+    fsm.update();
+    drain(client, hostState, s);
+    SerialMessage m;
+    SerialStatusBody status = {};
+    bool putRight = false;
+    while (client.take(client.lastSeq(), m)) {
+        if (serial_status(m, status)) {
+            dropped = status.pushesDropped;
+            hostState = status.state;
+            putRight = hostState == fsm.getCurrentState();
+        }
+    }
+    native_serial_capture(false);
+    unlink((std::string(dir) + "/FSM_Config.json").c_str());
+
+    printf("\nController loopback, %d s of virtual time, one command at a time 20 to 220 ms apart\n\n", SERIAL_SHOW_S);
+    printf("%9s %9s %7s %11s %8s %8s %8s %8s %11s %11s %8s\n", "commands", "answered", "wrong", "unanswered", "pushes",
+           "stale", "presses", "missed", "mean_us", "max_us", "result");
+    bool ok = s.answered == s.commands && s.wrong == 0 && s.unanswered == 0 && s.stale == 0 && s.missedMoves == 0 &&
+              s.latencyMax < 1000 && s.reloadPushes == s.reloads && s.textMissing == 0;
+    printf("%9lu %9lu %7lu %11lu %8lu %8lu %8lu %8lu %11.1f %11llu %8s\n", s.commands, s.answered, s.wrong, s.unanswered,
+           s.pushes, s.stale, s.presses, s.missedMoves, s.answered ? (double)s.latencySum / s.answered : 0.0,
+           (unsigned long long)s.latencyMax, bench_check(ok) ? "ok" : "FAIL");
+    printf("\n%lu frames sent with a bit flipped, all dropped by the player; %lu reloads typed in between, %lu pushed\n",
+           s.corruptSent, s.reloads, s.reloadPushes);
+    printf("%.0f ns host time for an update() that handles a command\n", s.handled ? s.handleNs / s.handled : 0.0);
+    if (s.latencyMax >= 1000) {
+        printf("FAIL: a command waited for the loop to come round instead of waking it\n");
+    }
+
+    bool dropOk = dropped == SERIAL_DROPPED && staleAfter && putRight;
+    printf("\nPort full for %d state changes: %u pushes dropped, controller behind %s, put right by a query %s\n",
+           SERIAL_DROPPED, dropped, staleAfter ? "yes" : "no", bench_check(dropOk) ? "ok" : "FAIL");
+}
+
+void bench_serial(const char* dir) {
+    printf("\nSerial framing, %d messages each way, a quarter with a bit flipped\n\n", SERIAL_MESSAGES);
+    printf("%-8s %9s %9s %12s %7s %7s %10s %9s %8s\n", "side", "messages", "corrupted", "accepted_bad", "wrong", "lost",
+           "text", "ns/byte", "result");
+    print_framing("player", run_player_framing());
+    print_framing("host", run_host_framing());
+    printf("\ntext: lines between the messages, the ones after a message with a bit flipped may be lost with it\n");
+
+    run_loopback(dir);
+    printf("\nmean_us/max_us: virtual time from a command arriving to its answer, the same tick for a press and its push\n");
+    printf("stale: ticks the state the controller has from the pushes wasn't the FSM's\n");
+}
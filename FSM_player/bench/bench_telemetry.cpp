@@ -0,0 +1,179 @@
+// Host check of the telemetry (env:native).
+//
+// Times a sample and an event against printing a line, the way transitions
+// used to be logged, and records events on one std::thread while the other
+// dumps over and over, checking every frame's CRC and that each event comes
+// out once, in order, or is counted as dropped.
+
+#include <Arduino.h>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include "telemetry.h"
+#include "fsm_image.h"
+#include "bench.h"
+
+typedef std::chrono::steady_clock bench_clock;
+
+#define TELEMETRY_EVENTS 500000
+
+// Keeps what is written, like the serial port would pass it on
+class CapturePrint : public Print {
+    public:
+        size_t write(uint8_t c) override { bytes.push_back(c); return 1; }
+        size_t write(const uint8_t* buffer, size_t size) override {
+            bytes.insert(bytes.end(), buffer, buffer + size);
+            return size;
+        }
+        std::vector<uint8_t> bytes;
+};
+
+// Throws everything away, so only the formatting is timed
+class NullPrint : public Print {
+    public:
+        size_t write(uint8_t c) override { (void)c; return 1; }
+        size_t write(const uint8_t* buffer, size_t size) override { (void)buffer; return size; }
+};
+
+// A frame checked like the decoder does, false if it isn't one
+static bool parse_frame(const std::vector<uint8_t>& bytes, TelemetryDumpHeader& header,
+                        std::vector<TelemetryRecord>& records) {
+    if (bytes.size() < sizeof(header)) {
+        return false;
+    }
+    memcpy(&header, bytes.data(), sizeof(header));
+    uint32_t crc;
+    if (header.magic != TELEMETRY_MAGIC || header.size != bytes.size() ||
+        header.size != sizeof(header) + TELEMETRY_METRICS * sizeof(TelemetryHistogram) +
+                       header.numRecords * sizeof(TelemetryRecord) + sizeof(crc)) {
+        return false;
+    }
+    memcpy(&crc, bytes.data() + header.size - sizeof(crc), sizeof(crc));
+    if (fsm_crc32(bytes.data(), header.size - sizeof(crc)) != crc) {
+        return false;
+    }
+    records.resize(header.numRecords);
+    memcpy(records.data(), bytes.data() + sizeof(header) + TELEMETRY_METRICS * sizeof(TelemetryHistogram),
+           header.numRecords * sizeof(TelemetryRecord));
+    return true;
+}
+
+static void run_costs() {
+    Telemetry local;
+    NullPrint out;
+    const unsigned long calls = 10000000;
+
+    bench_clock::time_point start = bench_clock::now();
+    for (unsigned long i = 0; i < calls; i++) {
+        local.sample(TELEMETRY_UPDATE_US, i & 0xFFF);
+    }
+    double sampleNs = std::chrono::duration<double, std::nano>(bench_clock::now() - start).count() / calls;
+
+    // Batches that fit the ring, emptied by a dump in between that isn't timed
+    bench_clock::duration recording(0);
+    unsigned long recorded = 0;
+    while (recorded < calls) {
+        start = bench_clock::now();
+        for (unsigned long j = 0; j < TELEMETRY_RING - 1; j++, recorded++) {
+            local.record(TELEMETRY_FSM_CORE, TELEMETRY_TRANSITION, recorded & 0xFF, (recorded + 1) & 0xFF, 0);
+        }
+        recording += bench_clock::now() - start;
+        local.dump(out);
+    }
+    double recordNs = std::chrono::duration<double, std::nano>(recording).count() / recorded;
+    bool dropped = local.getCounter(TELEMETRY_DROPPED_FSM) != 0;
+
+    // What changeState() used to do for every transition
+    const unsigned long lines = calls / 10;
+    start = bench_clock::now();
+    for (unsigned long i = 0; i < lines; i++) {
+        out.println("Transition successful: ");
+        out.print("From state ");
+        out.print(i & 0xFF);
+        out.print(" to ");
+        out.print((i + 1) & 0xFF);
+        out.print(" when input ");
+        out.print(i & 7);
+        out.println(" is HIGH");
+    }
+    double printNs = std::chrono::duration<double, std::nano>(bench_clock::now() - start).count() / lines;
+
+    // The biggest frame there is
+    for (uint16_t i = 0; i < TELEMETRY_RING - 1; i++) {
+        local.record(TELEMETRY_FSM_CORE, TELEMETRY_TRANSITION);
+        local.record(TELEMETRY_AUDIO_CORE, TELEMETRY_UNDERRUN);
+    }
+    CapturePrint frame;
+    size_t frameBytes = local.dump(frame);
+    printf("\nTelemetry, host time per call\n\n");
+    printf("%-34s %10s\n", "call", "ns");
+    printf("%-34s %10.1f\n", "sample()", sampleNs);
+    printf("%-34s %10.1f %s\n", "record()", recordNs, !bench_check(!dropped) ? "FAIL" : "");
+    printf("%-34s %10.1f\n", "transition printed (before)", printNs);
+    printf("dump with both rings full: %lu bytes\n", (unsigned long)frameBytes);
+}
+
+// One thread records numbered events and samples, the other dumps until all are through
+static void run_concurrent() {
+    Telemetry* local = new Telemetry();
+    std::atomic<bool> done(false);
+
+    bench_clock::time_point start = bench_clock::now();
+    std::thread producer([local, &done]() {
+        for (uint32_t i = 0; i < TELEMETRY_EVENTS; i++) {
+            local->sample(TELEMETRY_SD_READ_US, i & 0x3FF);
+            local->record(TELEMETRY_AUDIO_CORE, TELEMETRY_UNDERRUN, 0, 0, i);
+            if ((i & 63) == 63) {
+                // Bursts, like a core that has other work between events; some still find the ring full
+                std::this_thread::sleep_for(std::chrono::microseconds(20));
+            }
+        }
+        done.store(true);
+    });
+
+    unsigned long frames = 0;
+    unsigned long badFrames = 0;
+    unsigned long received = 0;
+    unsigned long outOfOrder = 0;
+    long last = -1;
+    TelemetryDumpHeader header = {};
+    bool finished = false;
+    while (!finished) {
+        finished = done.load();     // one more dump after the producer is done takes the rest
+        CapturePrint frame;
+        size_t size = local->dump(frame);
+        std::vector<TelemetryRecord> records;
+        if (size != frame.bytes.size() || !parse_frame(frame.bytes, header, records)) {
+            badFrames++;
+            continue;
+        }
+        frames++;
+        for (const TelemetryRecord& r : records) {
+            if ((long)r.value <= last || r.event != TELEMETRY_UNDERRUN) {
+                outOfOrder++;
+            }
+            last = r.value;
+            received++;
+        }
+    }
+    producer.join();
+    double seconds = std::chrono::duration<double>(bench_clock::now() - start).count();
+
+    unsigned long dropped = header.counters[TELEMETRY_DROPPED_AUDIO];
+    bool ok = badFrames == 0 && outOfOrder == 0 && received + dropped == TELEMETRY_EVENTS &&
+              local->getHistogram(TELEMETRY_SD_READ_US).count == TELEMETRY_EVENTS;
+    printf("\nTelemetry across two threads, %d events recorded while dumping\n\n", TELEMETRY_EVENTS);
+    printf("%10s %10s %12s %12s %12s %12s %7s\n", "frames", "bad", "received", "dropped", "reordered", "events/s",
+           "result");
+    printf("%10lu %10lu %12lu %12lu %12lu %12.0f %7s\n", frames, badFrames, received, dropped, outOfOrder,
+           TELEMETRY_EVENTS / seconds, bench_check(ok) ? "ok" : "FAIL");
+    delete local;
+}
+
+void bench_telemetry(const char* dir) {
+    (void)dir;
+    run_costs();
+    run_concurrent();
+    printf("\nreceived + dropped has to be every event, each frame passes its CRC check\n");
+}
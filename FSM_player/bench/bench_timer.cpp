@@ -0,0 +1,284 @@
+// Host benchmark for the timer wheel (env:native).
+//
+// First the wheel against a plain list of deadlines: random arms, re-arms,
+// cancels and jumps of the clock from a microsecond to half the 32-bit
+// counter, half the runs starting just before it wraps. Every advance() must
+// fire exactly the timers the list says ran out, and nextExpiry() must name
+// the earliest deadline. Then what a tick costs with timers armed, the wheel
+// against testing every deadline as changeState used to test every
+// TIME_PASSED threshold.
+//
+// Last a show of timed cues runs through the FSM, woken by the scheduler to
+// the millisecond (sleepUntil) and to the microsecond (sleepUntilUs, what
+// loop() does): a button press at any microsecond starts a chain of
+// TIME_PASSED states and a show timer that ends the show 10 s after the
+// first press whatever state it is in. Reports how late each cue came after
+// the microsecond it was due; to the microsecond they must all be on time.
+
+#include <Arduino.h>
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <unistd.h>
+#include "native_hal.h"
+#include "timer_wheel.h"
+#include "scheduler.h"
+#include "FSM.h"
+#include "bench.h"
+
+typedef std::chrono::steady_clock bench_clock;
+
+#define WHEEL_RUNS       200
+#define WHEEL_STEPS      20000
+#define COST_TICKS       2000000
+#define CUE_RUN_S        120
+#define CUE_SHOW_MS      10000
+#define CUE_REST_MS      2000
+
+static uint64_t timer_seed = 0x71AE5EED;
+
+static uint64_t timer_random(uint64_t range) {
+    timer_seed ^= timer_seed << 13;
+    timer_seed ^= timer_seed >> 7;
+    timer_seed ^= timer_seed << 17;
+    return timer_seed % range;
+}
+
+// The wheel and a list of deadlines through the same random operations
+static void run_reference() {
+    unsigned long arms = 0, advances = 0, fired = 0, wraps = 0, wrong = 0, wrongNext = 0;
+    for (int run = 0; run < WHEEL_RUNS; run++) {
+        uint32_t start = run % 2 ? 0xFFFFFFFFUL - (uint32_t)timer_random(2000000) : (uint32_t)timer_random(1ULL << 32);
+        TimerWheel wheel;
+        wheel.begin(start);
+        uint64_t now = start;
+        uint64_t deadlines[TIMER_WHEEL_TIMERS];
+        uint8_t state[TIMER_WHEEL_TIMERS] = {};     // 0 idle, 1 armed, 2 ran out
+
+        for (int step = 0; step < WHEEL_STEPS; step++) {
+            uint8_t id = timer_random(TIMER_WHEEL_TIMERS);
+            uint32_t op = timer_random(10);
+            if (op < 3) {
+                // Due in a few us to over a day, or already past
+                static const uint64_t ranges[] = {100, 100000, 1ULL << 32, 1ULL << 40};
+                uint32_t kind = timer_random(5);
+                uint64_t at = kind < 4 ? now + timer_random(ranges[kind]) : now - timer_random(50);
+                wheel.arm(id, at);
+                deadlines[id] = at;
+                state[id] = 1;
+                arms++;
+            } else if (op < 4) {
+                wheel.cancel(id);
+                state[id] = 0;
+            } else {
+                static const uint32_t steps[] = {10, 10000, 1UL << 28, 0x7FFFFFFFUL};
+                uint64_t to = now + timer_random(steps[timer_random(4)]);
+                uint32_t expect = 0;
+                for (uint8_t i = 0; i < TIMER_WHEEL_TIMERS; i++) {
+                    if (state[i] == 1 && deadlines[i] <= to) {
+                        expect |= 1UL << i;
+                        state[i] = 2;
+                    }
+                }
+                wraps += (to >> 32) != (now >> 32);
+                uint32_t got = wheel.advance((uint32_t)to);
+                now = to;
+                wrong += got != expect || wheel.now() != now;
+                fired += __builtin_popcount(expect);
+                advances++;
+            }
+
+            uint64_t earliest = ~0ULL;
+            for (uint8_t i = 0; i < TIMER_WHEEL_TIMERS; i++) {
+                if (state[i] == 1 && deadlines[i] < earliest) {
+                    earliest = deadlines[i];
+                }
+                wrong += wheel.armed(i) != (state[i] == 1) || wheel.expired(i) != (state[i] == 2);
+            }
+            uint64_t at;
+            bool any = wheel.nextExpiry(at);
+            wrongNext += any != (earliest != ~0ULL) || (any && at != earliest);
+        }
+    }
+
+    printf("\nTimer wheel against a list of deadlines, %d runs x %d operations, half across the 32-bit wrap\n\n",
+           WHEEL_RUNS, WHEEL_STEPS);
+    printf("%10s %10s %10s %8s %8s %11s %7s\n", "arms", "advances", "fired", "wraps", "wrong", "wrong_next", "result");
+    printf("%10lu %10lu %10lu %8lu %8lu %11lu %7s\n", arms, advances, fired, wraps, wrong, wrongNext,
+           bench_check(wrong == 0 && wrongNext == 0) ? "ok" : "FAIL");
+}
+
+// Host ns of a 1 ms tick with count timers armed seconds to minutes ahead, so a
+// few run out during the run and are armed again, as the FSM's would be
+static void run_cost(uint8_t count) {
+    uint64_t deadlines[TIMER_WHEEL_TIMERS];
+    TimerWheel wheel;
+    wheel.begin(0);
+    for (uint8_t i = 0; i < count; i++) {
+        deadlines[i] = 1000000 + timer_random(120000000);
+        wheel.arm(i, deadlines[i]);
+    }
+
+    // Testing every deadline at every tick
+    unsigned long pollFired = 0;
+    uint64_t now = 0;
+    bench_clock::time_point start = bench_clock::now();
+    for (unsigned long t = 0; t < COST_TICKS; t++) {
+        now += 1000;
+        for (uint8_t i = 0; i < count; i++) {
+            if (deadlines[i] <= now) {
+                pollFired++;
+                deadlines[i] = now + 60000000;
+            }
+        }
+    }
+    double pollNs = std::chrono::duration<double, std::nano>(bench_clock::now() - start).count() / COST_TICKS;
+
+    // The wheel, only what ran out is touched
+    unsigned long wheelFired = 0;
+    now = 0;
+    start = bench_clock::now();
+    for (unsigned long t = 0; t < COST_TICKS; t++) {
+        now += 1000;
+        for (uint32_t ran = wheel.advance((uint32_t)now); ran; ran &= ran - 1) {
+            wheelFired++;
+            wheel.armIn(__builtin_ctz(ran), 60000000);
+        }
+    }
+    double wheelNs = std::chrono::duration<double, std::nano>(bench_clock::now() - start).count() / COST_TICKS;
+
+    printf("%8u %10.1f %10.1f %8lu %8s\n", count, pollNs, wheelNs, wheelFired, bench_check(wheelFired == pollFired) ? "ok" : "FAIL");
+}
+
+// Press a button to start: three TIME_PASSED cues and back to waiting. The
+// first press also starts the show timer, every state leaves for the rest
+// state when it runs out, the cue chain or not.
+static void write_cue_config(const char* dir) {
+    char json[3072];
+    const char* showOver = "{\"targetState\":4,\"conditions\":[{\"type\":\"TIMER\",\"data\":{\"timer\":0}}],"
+                           "\"actions\":[{\"timer\":0,\"stop\":true}]}";
+    snprintf(json, sizeof(json),
+        "{\"debounceMode\":\"leading\",\"states\":["
+        "{\"id\":0,\"audioFile\":\"\",\"repeat\":false,\"blinkCount\":0,\"transitions\":[%s,"
+        "{\"targetState\":1,\"conditions\":[{\"type\":\"SENSOR\",\"data\":{\"sensorPin\":0,\"state\":false}}],"
+        "\"actions\":[{\"timer\":0,\"start\":%d}]}]},"
+        "{\"id\":1,\"audioFile\":\"\",\"repeat\":false,\"blinkCount\":0,\"transitions\":[%s,"
+        "{\"targetState\":2,\"conditions\":[{\"type\":\"TIME_PASSED\",\"data\":{\"duration\":250}}]}]},"
+        "{\"id\":2,\"audioFile\":\"\",\"repeat\":false,\"blinkCount\":0,\"transitions\":[%s,"
+        "{\"targetState\":3,\"conditions\":[{\"type\":\"TIME_PASSED\",\"data\":{\"duration\":40}}]}]},"
+        "{\"id\":3,\"audioFile\":\"\",\"repeat\":false,\"blinkCount\":0,\"transitions\":[%s,"
+        "{\"targetState\":0,\"conditions\":[{\"type\":\"TIME_PASSED\",\"data\":{\"duration\":7}}]}]},"
+        "{\"id\":4,\"audioFile\":\"\",\"repeat\":false,\"blinkCount\":0,\"transitions\":["
+        "{\"targetState\":0,\"conditions\":[{\"type\":\"TIME_PASSED\",\"data\":{\"duration\":%d}}]}]}]}",
+        showOver, CUE_SHOW_MS, showOver, showOver, showOver, CUE_REST_MS);
+    std::string path = std::string(dir) + "/FSM_Config.json";
+    FILE* f = fopen(path.c_str(), "wb");
+    fputs(json, f);
+    fclose(f);
+    unlink((std::string(dir) + "/FSM_Config.bin").c_str());
+}
+
+struct CueResult {
+    unsigned long cues;         // timed transitions checked
+    unsigned long shows;        // show timer endings
+    double meanLateUs;
+    uint64_t maxLateUs;
+    unsigned long updates;
+    std::vector<uint8_t> path;  // the states gone through
+};
+
+// The cue show for CUE_RUN_S of virtual time across the 32-bit us wrap,
+// woken to the us or to the ms
+static CueResult run_cues(bool toTheUs) {
+    // TIME_PASSED duration of each state, 0: left by a sensor
+    static const uint32_t durations[] = {0, 250, 40, 7, CUE_REST_MS};
+
+    native_set_micros(0x100000000ULL - 30000000);
+    native_set_pin(0, HIGH);
+    FSM fsm;
+    fsm.loadConfiguration();
+    fsm.begin();
+    Scheduler scheduler;
+    scheduler.begin(fsm.getInputGpioMask());
+
+    // Presses at any us, the button held down for 30 ms
+    timer_seed = 0xC0E5;
+    uint64_t end = native_micros() + CUE_RUN_S * 1000000ULL;
+    for (uint64_t at = native_micros() + 100000; at < end; at += 200000 + timer_random(1300000)) {
+        native_schedule_pin(at, 0, LOW);
+        native_schedule_pin(at + 30000, 0, HIGH);
+    }
+
+    CueResult r = {};
+    double lateSum = 0;
+    uint8_t state = fsm.getCurrentState();
+    uint64_t entered = native_micros();
+    uint64_t showStart = 0;
+    bool showRunning = false;
+    while (native_micros() < end) {
+        fsm.update();
+        r.updates++;
+        uint8_t now = fsm.getCurrentState();
+        if (now != state) {
+            // When it was due: TIME_PASSED is more than duration ms in the state,
+            // the show timer CUE_SHOW_MS after it started
+            uint64_t due = 0;
+            if (now == 4) {
+                due = showStart + CUE_SHOW_MS * 1000ULL;
+                showRunning = false;
+                r.shows++;
+            } else if (durations[state]) {
+                due = entered + (durations[state] + 1) * 1000ULL;
+            }
+            if (due) {
+                uint64_t late = native_micros() - due;
+                lateSum += late;
+                r.maxLateUs = std::max(r.maxLateUs, late);
+                r.cues++;
+            }
+            if (now == 1 && !showRunning) {
+                showStart = native_micros();
+                showRunning = true;
+            }
+            r.path.push_back(now);
+            state = now;
+            entered = native_micros();
+        }
+        if (toTheUs) {
+            scheduler.sleepUntilUs(fsm.nextDeadlineUs());
+        } else {
+            scheduler.sleepUntil(fsm.nextDeadline());
+        }
+    }
+    r.meanLateUs = r.cues ? lateSum / r.cues : 0;
+    return r;
+}
+
+void bench_timer(const char* dir) {
+    run_reference();
+
+    printf("\nCost of a 1 ms tick, every deadline tested vs the wheel, host ns\n\n");
+    printf("%8s %10s %10s %8s %8s\n", "timers", "poll_ns", "wheel_ns", "fired", "result");
+    const uint8_t counts[] = {1, 4, 9, 16};
+    for (uint8_t count : counts) {
+        run_cost(count);
+    }
+
+    write_cue_config(dir);
+    CueResult ms = run_cues(false);
+    CueResult us = run_cues(true);
+    printf("\nTimed cues through the FSM, %d s of presses at any us across the 32-bit wrap, show timer %d s\n\n",
+           CUE_RUN_S, CUE_SHOW_MS / 1000);
+    printf("%-14s %8s %8s %12s %12s %10s\n", "woken", "cues", "shows", "mean_late_us", "max_late_us", "updates");
+    printf("%-14s %8lu %8lu %12.1f %12llu %10lu\n", "to the ms", ms.cues, ms.shows, ms.meanLateUs,
+           (unsigned long long)ms.maxLateUs, ms.updates);
+    printf("%-14s %8lu %8lu %12.1f %12llu %10lu\n", "to the us", us.cues, us.shows, us.meanLateUs,
+           (unsigned long long)us.maxLateUs, us.updates);
+    if (!bench_check(us.maxLateUs == 0 && us.shows > 0)) {
+        printf("FAIL: a cue woken to the us came late or the show timer never ran out\n");
+    }
+    if (!bench_check(ms.path == us.path)) {
+        printf("FAIL: the two took different paths through the states\n");
+    }
+}
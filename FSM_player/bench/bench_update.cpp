@@ -0,0 +1,431 @@
+// Host benchmark for FSM::update (env:native).
+//
+// Loads the sample FSM_Config.json and a set of generated configs through the
+// normal FSM::loadConfiguration path, then drives update() against the virtual
+// clock and pins from native_hal.h, the same way loop() does on the Pico.
+// Also compares loading each config from JSON with loading its compiled image,
+// and the event-driven Scheduler with the old fixed delay(5) loop on scripted
+// sensor presses in virtual time. Audio streaming is in bench_audio.cpp,
+// format conversion in bench_convert.cpp, the crossfade mixer in bench_mix.cpp,
+// config reloads in bench_reload.cpp, telemetry in bench_telemetry.cpp,
+// condition programs in bench_program.cpp, the built-in state table in
+// bench_builtin.cpp, the timer wheel in bench_timer.cpp, the LED sequencer in
+// bench_led.cpp, the flash cache and the state journal in bench_journal.cpp,
+// the serial protocol in bench_serial.cpp.
+//
+//   pio run -e native && .pio/build/native/program [--sd <dir>] [--calls <n>]
+//
+// Every section checks its results as well, a failed check shows in the table
+// (FAIL, CORRUPT, ...) and makes the program exit with 1.
+//
+// Times are host wall-clock, so they are only comparable with each other and
+// not with the RP2040, but they show what an optimisation buys us.
+
+#include <Arduino.h>
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "native_hal.h"
+#include "FSM.h"
+#include "fsm_image.h"
+#include "scheduler.h"
+#include "led_sequencer.h"
+#include "bench.h"
+
+#define LOOP_DELAY_MS 5   // matches delay(5) in loop()
+
+static unsigned long bench_failures = 0;
+
+bool bench_check(bool ok) {
+    if (!ok) {
+        bench_failures++;
+    }
+    return ok;
+}
+
+static uint8_t sensorPins[8] = {0, 1, 2, 3, 4, 5, 6, 7};     // default inputs of a config
+
+struct Scenario {
+    const char* name;
+    bool active;    // toggle sensors so transitions actually fire
+};
+
+struct Result {
+    uint8_t numStates;
+    double mean_ns;
+    double p50_ns;
+    double p99_ns;
+    double max_ns;
+    double calls_per_s;
+    unsigned long transitions;
+};
+
+typedef std::chrono::steady_clock bench_clock;
+
+static double ns_since(bench_clock::time_point start) {
+    return std::chrono::duration<double, std::nano>(bench_clock::now() - start).count();
+}
+
+// Sets the sensor pins for tick number i. Idle leaves every sensor open (HIGH)
+// so every transition is evaluated and none fires, which is the worst case
+// for a single tick. Active closes one sensor at a time for a few ticks.
+static void drive_inputs(bool active, unsigned long i) {
+    for (uint8_t p = 0; p < 8; p++) {
+        native_set_pin(sensorPins[p], HIGH);
+    }
+    if (active && (i % 20) < 4) {
+        native_set_pin(sensorPins[(i / 20) % 8], LOW);
+    }
+}
+
+static Result run(const Scenario& scenario, unsigned long calls) {
+    FSM fsm;
+    fsm.loadConfiguration();
+    fsm.begin();
+
+    Result result = {};
+    result.numStates = fsm.getNumStates();
+    std::vector<double> samples;
+    samples.reserve(calls);
+
+    // Per-call cost, one timestamp pair around every update()
+    uint8_t lastState = fsm.getCurrentState();
+    for (unsigned long i = 0; i < calls; i++) {
+        drive_inputs(scenario.active, i);
+        bench_clock::time_point start = bench_clock::now();
+        fsm.update();
+        samples.push_back(ns_since(start));
+        delay(LOOP_DELAY_MS);
+
+        if (fsm.getCurrentState() != lastState) {
+            lastState = fsm.getCurrentState();
+            result.transitions++;
+        }
+    }
+
+    // Loop throughput, no timing inside the loop
+    fsm.begin();
+    bench_clock::time_point start = bench_clock::now();
+    for (unsigned long i = 0; i < calls; i++) {
+        drive_inputs(scenario.active, i);
+        fsm.update();
+        delay(LOOP_DELAY_MS);
+    }
+    result.calls_per_s = calls / (ns_since(start) * 1e-9);
+
+    double sum = 0;
+    for (double s : samples) sum += s;
+    std::sort(samples.begin(), samples.end());
+    result.mean_ns = sum / samples.size();
+    result.p50_ns = samples[samples.size() / 2];
+    result.p99_ns = samples[(samples.size() * 99) / 100];
+    result.max_ns = samples.back();
+    return result;
+}
+
+static void print_result(const char* config, int numTransitions, const Scenario& scenario, const Result& r) {
+    printf("%-22s %-7s %6d %6d %9.1f %9.1f %9.1f %10.1f %12.0f %8lu %7.4f%%\n",
+           config, scenario.name, r.numStates, numTransitions,
+           r.mean_ns, r.p50_ns, r.p99_ns, r.max_ns, r.calls_per_s, r.transitions,
+           100.0 * r.mean_ns / (LOOP_DELAY_MS * 1e6));
+}
+
+// Writes a config with numStates states, each with numTransitions transitions.
+// Transitions mix SENSOR and TIME_PASSED conditions, with long durations so
+// the timed ones never fire inside a run.
+static void write_config(const char* dir, int numStates, int numTransitions) {
+    std::string path = std::string(dir) + "/FSM_Config.json";
+    FILE* f = fopen(path.c_str(), "w");
+    if (!f) {
+        perror(path.c_str());
+        exit(1);
+    }
+    fprintf(f, "{\"states\":[");
+    for (int i = 0; i < numStates; i++) {
+        fprintf(f, "%s{\"id\":%d,\"audioFile\":\"/music/state_%d/\",\"repeat\":false,\"blinkCount\":%d,\"transitions\":[",
+                i ? "," : "", i, i, (i % 5) + 1);
+        for (int j = 0; j < numTransitions; j++) {
+            fprintf(f, "%s{\"targetState\":%d,\"conditions\":[", j ? "," : "", (i + 1 + j) % numStates);
+            fprintf(f, "{\"type\":\"SENSOR\",\"data\":{\"sensorPin\":%d,\"state\":false}}", j % 8);
+            if (j % 3 == 1) {
+                fprintf(f, ",{\"type\":\"SENSOR\",\"data\":{\"sensorPin\":%d,\"state\":true}}", (j + 3) % 8);
+            }
+            if (j % 3 == 2) {
+                fprintf(f, ",{\"type\":\"TIME_PASSED\",\"data\":{\"duration\":%d}}", 3600000 + j);
+            }
+            fprintf(f, "]}");
+        }
+        fprintf(f, "]}");
+    }
+    fprintf(f, "]}\n");
+    fclose(f);
+}
+
+static std::string read_file(const std::string& path) {
+    std::string data;
+    FILE* f = fopen(path.c_str(), "rb");
+    if (!f) {
+        perror(path.c_str());
+        exit(1);
+    }
+    char chunk[4096];
+    size_t n;
+    while ((n = fread(chunk, 1, sizeof(chunk), f)) > 0) {
+        data.append(chunk, n);
+    }
+    fclose(f);
+    return data;
+}
+
+static void write_file(const std::string& path, const void* data, size_t size) {
+    FILE* f = fopen(path.c_str(), "wb");
+    if (!f || fwrite(data, 1, size, f) != size) {
+        perror(path.c_str());
+        exit(1);
+    }
+    fclose(f);
+}
+
+// Compiles dir/FSM_Config.json into dir/FSM_Config.bin, returns the image size
+static uint32_t write_image(const char* dir) {
+    std::string json = read_file(std::string(dir) + "/FSM_Config.json");
+    DynamicJsonDocument doc(json.size() * 8 + 4096);
+    deserializeJson(doc, json.data(), json.size());
+    const char* problem = nullptr;
+    uint32_t size = fsm_image_compile(doc.as<JsonObject>(), nullptr, 0, &problem);
+    std::vector<uint8_t> image(size);
+    if (size == 0 || !fsm_image_compile(doc.as<JsonObject>(), image.data(), size, &problem)) {
+        fprintf(stderr, "compile failed: %s\n", problem);
+        exit(1);
+    }
+    write_file(std::string(dir) + "/FSM_Config.bin", image.data(), size);
+    return size;
+}
+
+// Mean FSM::loadConfiguration time in microseconds over n loads
+static double time_load(int n) {
+    bench_clock::time_point start = bench_clock::now();
+    for (int i = 0; i < n; i++) {
+        FSM fsm;
+        fsm.loadConfiguration();
+    }
+    return ns_since(start) / n / 1000.0;
+}
+
+// Times loading dir/FSM_Config.json from JSON and from its compiled image
+static void run_load(const char* config, const char* dir) {
+    std::string json = std::string(dir) + "/FSM_Config.json";
+    std::string bin = std::string(dir) + "/FSM_Config.bin";
+    const int loads = 50;
+
+    unlink(bin.c_str());
+    double json_us = time_load(loads);
+    uint32_t imageSize = write_image(dir);
+    double image_us = time_load(loads);
+    unlink(bin.c_str());
+
+    printf("%-22s %10lu %10.1f %10lu %10.1f %8.1fx\n", config, (unsigned long)read_file(json).size(), json_us,
+           (unsigned long)imageSize, image_us, json_us / image_us);
+}
+
+// Writes a chain of 8 states, state i moves on when sensor i closes, with the
+// given debounce mode
+static void write_chain_config(const char* dir, const char* debounceMode) {
+    std::string path = std::string(dir) + "/FSM_Config.json";
+    FILE* f = fopen(path.c_str(), "w");
+    if (!f) {
+        perror(path.c_str());
+        exit(1);
+    }
+    fprintf(f, "{\"debounceMode\":\"%s\",\"states\":[", debounceMode);
+    for (int i = 0; i < 8; i++) {
+        fprintf(f, "%s{\"id\":%d,\"audioFile\":\"\",\"repeat\":false,\"blinkCount\":%d,\"transitions\":["
+                   "{\"targetState\":%d,\"conditions\":[{\"type\":\"SENSOR\",\"data\":{\"sensorPin\":%d,\"state\":false}}]},"
+                   "{\"targetState\":0,\"conditions\":[{\"type\":\"TIME_PASSED\",\"data\":{\"duration\":600000}}]}]}",
+                i ? "," : "", i, (i % 3) + 1, (i + 1) % 8, i);
+    }
+    fprintf(f, "]}\n");
+    fclose(f);
+}
+
+#define PRESS_PERIOD_US 250000ULL   // one sensor press every 250 ms, plus jitter
+#define PRESS_HOLD_US   60000ULL    // held for 60 ms
+
+// Scripts press k of a run starting at start: sensor k % 8 closes with a couple
+// of bounces, stays closed, then opens again with a couple of bounces. Returns
+// the time of the first edge.
+static uint64_t script_press(uint64_t start, unsigned long k) {
+    uint64_t at = start + 100000 + k * PRESS_PERIOD_US + (k * 7919) % 100000;  // sub-ms offsets too
+    uint8_t pin = sensorPins[k % 8];
+    native_schedule_pin(at, pin, LOW);
+    native_schedule_pin(at + 150, pin, HIGH);
+    native_schedule_pin(at + 400, pin, LOW);
+    native_schedule_pin(at + PRESS_HOLD_US, pin, HIGH);
+    native_schedule_pin(at + PRESS_HOLD_US + 200, pin, LOW);
+    native_schedule_pin(at + PRESS_HOLD_US + 500, pin, HIGH);
+    return at;
+}
+
+// Runs the chain config for seconds of virtual time, either polling with
+// delay(5) like the old loop() or sleeping on the Scheduler like the new one
+static void run_scheduler(const char* mode, bool useScheduler, unsigned long seconds) {
+    FSM fsm;
+    fsm.loadConfiguration();
+    fsm.begin();
+
+    uint64_t start = native_micros();
+    uint64_t end = start + seconds * 1000000ULL;
+    unsigned long presses = (seconds * 1000000ULL - 200000) / PRESS_PERIOD_US;
+    std::vector<uint64_t> pressAt;
+    for (unsigned long k = 0; k < presses; k++) {
+        pressAt.push_back(script_press(start, k));
+    }
+
+    Scheduler scheduler;
+    scheduler.begin(fsm.getInputGpioMask());
+
+    unsigned long updates = 0;
+    unsigned long transitions = 0;
+    double latencySum = 0;
+    uint64_t latencyMax = 0;
+    uint8_t lastState = fsm.getCurrentState();
+    while (native_micros() < end) {
+        fsm.update();
+        updates++;
+        if (fsm.getCurrentState() != lastState) {
+            lastState = fsm.getCurrentState();
+            if (transitions < presses) {
+                uint64_t latency = native_micros() - pressAt[transitions];
+                latencySum += latency;
+                latencyMax = std::max(latencyMax, latency);
+            }
+            transitions++;
+        }
+        if (useScheduler) {
+            scheduler.sleepUntilUs(fsm.nextDeadlineUs());
+        } else {
+            delay(LOOP_DELAY_MS);
+        }
+    }
+
+    double elapsed = native_micros() - start;
+    char idle[16] = "-";
+    if (useScheduler) {
+        snprintf(idle, sizeof(idle), "%.2f%%", 100.0 * scheduler.getSleptUs() / elapsed);
+    }
+    printf("%-8s %-10s %8lu %8lu %10.1f %12.1f %12.1f %8s\n", mode, useScheduler ? "scheduler" : "delay(5)",
+           presses, transitions, updates / (elapsed * 1e-6),
+           transitions ? latencySum / std::min(transitions, presses) : 0.0, (double)latencyMax, idle);
+}
+
+int main(int argc, char** argv) {
+    const char* sdRoot = ".";
+    unsigned long calls = 200000;
+    bool verbose = false;
+
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--sd" && i + 1 < argc) sdRoot = argv[++i];
+        else if (arg == "--calls" && i + 1 < argc) calls = strtoul(argv[++i], nullptr, 10);
+        else if (arg == "--verbose") verbose = true;
+        else {
+            fprintf(stderr, "usage: %s [--sd <dir>] [--calls <n>] [--verbose]\n", argv[0]);
+            return 2;
+        }
+    }
+    native_serial_output(verbose ? stdout : nullptr);
+    leds.begin();
+
+    const Scenario scenarios[] = {
+        {"idle", false},
+        {"active", true},
+    };
+
+    printf("FSM::update benchmark, %lu calls per run, %d ms virtual loop period\n\n", calls, LOOP_DELAY_MS);
+    printf("%-22s %-7s %6s %6s %9s %9s %9s %10s %12s %8s %8s\n",
+           "config", "inputs", "states", "trans", "mean_ns", "p50_ns", "p99_ns", "max_ns", "calls/s", "changes", "budget");
+
+    // Everything runs from a scratch SD root, starting with a copy of the sample config
+    char dir[] = "/tmp/fsm_bench_XXXXXX";
+    if (!mkdtemp(dir)) {
+        perror("mkdtemp");
+        return 1;
+    }
+    std::string sample = read_file(std::string(sdRoot) + "/FSM_Config.json");
+    write_file(std::string(dir) + "/FSM_Config.json", sample.data(), sample.size());
+    native_sd_root(dir);
+
+    for (const Scenario& scenario : scenarios) {
+        print_result("FSM_Config.json", -1, scenario, run(scenario, calls));
+    }
+
+    const int sizes[][2] = {
+        {16, 4},
+        {64, 8},
+        {128, 16},
+        {200, 24},
+    };
+    for (const auto& size : sizes) {
+        write_config(dir, size[0], size[1]);
+        char name[32];
+        snprintf(name, sizeof(name), "generated %dx%d", size[0], size[1]);
+        for (const Scenario& scenario : scenarios) {
+            print_result(name, size[1], scenario, run(scenario, calls));
+        }
+    }
+
+    // Boot-time load, JSON vs compiled image
+    printf("\n%-22s %10s %10s %10s %10s %9s\n", "config", "json_B", "json_us", "image_B", "image_us", "speedup");
+    write_file(std::string(dir) + "/FSM_Config.json", sample.data(), sample.size());
+    run_load("FSM_Config.json", dir);
+    for (const auto& size : sizes) {
+        write_config(dir, size[0], size[1]);
+        char name[32];
+        snprintf(name, sizeof(name), "generated %dx%d", size[0], size[1]);
+        run_load(name, dir);
+    }
+
+    // Wake-ups and input-to-transition latency, fixed polling vs the scheduler
+    const unsigned long seconds = 60;
+    printf("\nScheduler, %lu s of virtual time, bouncing sensor presses every ~%llu ms\n\n",
+           seconds, PRESS_PERIOD_US / 1000);
+    printf("%-8s %-10s %8s %8s %10s %12s %12s %8s\n",
+           "debounce", "loop", "presses", "changes", "updates/s", "mean_lat_us", "max_lat_us", "idle");
+    const char* modes[] = {"stable", "leading"};
+    for (const char* mode : modes) {
+        write_chain_config(dir, mode);
+        run_scheduler(mode, false, seconds);
+        run_scheduler(mode, true, seconds);
+    }
+
+    bench_audio(dir);
+    bench_convert(dir);
+    bench_mix(dir);
+    bench_reload(dir);
+    bench_telemetry(dir);
+    bench_program(dir);
+    bench_builtin(dir, sample);
+    bench_timer(dir);
+    bench_led(dir);
+    bench_journal(dir);
+    bench_serial(dir);
+    bench_engine(dir);
+
+    std::string config = std::string(dir) + "/FSM_Config.json";
+    unlink(config.c_str());
+    rmdir(dir);
+
+    printf("\ntrans: transitions per state from the config (-1: as in the file, plus skip/reset)\n");
+    printf("budget: mean update() cost as a share of the %d ms loop period, host time\n", LOOP_DELAY_MS);
+    printf("load times include the SD stand-in\n");
+    printf("lat: virtual time from a sensor's first edge to the transition, update() itself takes no virtual time\n");
+    printf("idle: share of virtual time the scheduler spent asleep\n");
+    if (bench_failures) {
+        printf("\n%lu checks failed\n", bench_failures);
+        return 1;
+    }
+    return 0;
+}
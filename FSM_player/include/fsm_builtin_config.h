@@ -0,0 +1,57 @@
+// Generated from FSM_Config.json by tools/fsm_codegen.cpp, don't edit: change the JSON
+// and run it again. 3 states, 9 transitions, 9 conditions, 3 bytes of code,
+// 480 bytes in flash.
+
+#ifndef FSM_BUILTIN_CONFIG_H
+#define FSM_BUILTIN_CONFIG_H
+
+#include "fsm_builtin.h"
+
+constexpr FsmBuiltinImage<3, 9, 9, 4, 52> fsm_builtin = {
+    {FSM_IMAGE_MAGIC, FSM_IMAGE_VERSION, sizeof(FsmImageHeader), 480, 0x582F98B2UL,
+     3, 9, 9, 8, DEBOUNCE_LEADING,
+     88, 136, 352, 428, 49,
+     {0, 1, 2, 3, 4, 5, 6, 7},
+     20, 2000, 424, 3},
+
+    {
+        {0, false, 1, 3, 0, 1, AUDIO_SELECT_FIRST, 0, 32768, 0, 0}, // "/music/state_0/"
+        {1, false, 2, 3, 3, 17, AUDIO_SELECT_FIRST, 0, 32768, 0, 0}, // "/music/state_1/"
+        {2, false, 3, 3, 6, 33, AUDIO_SELECT_FIRST, 0, 32768, 0, 0}, // "/music/state_2/"
+    },
+
+    {
+        {1, 1, 0, 0x00000001, 0x00000000, 0, 0x00, {}, 0, 0}, // 0 -> 1
+        {1, 1, 1, 0x00000000, 0x00000000, 0, 0x02, {}, 0, 0}, // 0 -> 1 (skip)
+        {0, 1, 2, 0x00000000, 0x00000000, 0, 0x04, {}, 0, 1}, // 0 -> 0 (reset)
+        {2, 1, 3, 0x00000002, 0x00000000, 0, 0x00, {}, 0, 0}, // 1 -> 2
+        {2, 1, 4, 0x00000000, 0x00000000, 0, 0x02, {}, 0, 0}, // 1 -> 2 (skip)
+        {0, 1, 5, 0x00000000, 0x00000000, 0, 0x04, {}, 0, 1}, // 1 -> 0 (reset)
+        {0, 1, 6, 0x00000004, 0x00000000, 0, 0x00, {}, 0, 0}, // 2 -> 0
+        {0, 1, 7, 0x00000000, 0x00000000, 0, 0x02, {}, 0, 0}, // 2 -> 0 (skip)
+        {0, 1, 8, 0x00000000, 0x00000000, 0, 0x04, {}, 0, 1}, // 2 -> 0 (reset)
+    },
+
+    {
+        {SENSOR, {{0, false}}},
+        {SKIP_FLAG, {}},
+        {RESET_FLAG, {}},
+        {SENSOR, {{1, false}}},
+        {SKIP_FLAG, {}},
+        {RESET_FLAG, {}},
+        {SENSOR, {{2, false}}},
+        {SKIP_FLAG, {}},
+        {RESET_FLAG, {}},
+    },
+
+    {0x00, 0x10, 0x00},
+
+    "\000"
+    "/music/state_0/\000"
+    "/music/state_1/\000"
+    "/music/state_2/"
+};
+
+static_assert(fsm_builtin_check(fsm_builtin), "the built-in state table is not usable");
+
+#endif // FSM_BUILTIN_CONFIG_H
@@ -0,0 +1,102 @@
+#ifndef NATIVE_ARDUINO_H
+#define NATIVE_ARDUINO_H
+
+// Stand-in for the Arduino core when the FSM is built for the host (env:native).
+// Only the parts the firmware actually uses are provided. Time comes from a
+// virtual clock and pins from an in-memory table, both controlled through
+// native_hal.h, so the FSM can be driven and measured off-device.
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string>
+
+#define HIGH 0x1
+#define LOW  0x0
+
+#define INPUT        0x0
+#define OUTPUT       0x1
+#define INPUT_PULLUP 0x2
+
+// Pico W SPI0 chip select, only used as a value on the host
+#define SS 17
+
+// Interrupt modes, values as in arduino-pico's PinStatus
+#define CHANGE  2
+#define FALLING 3
+#define RISING  4
+
+void pinMode(uint8_t pin, uint8_t mode);
+void digitalWrite(uint8_t pin, uint8_t val);
+int digitalRead(uint8_t pin);
+
+// Pin interrupts run when native_set_pin() or a scripted pin change moves a pin
+#define digitalPinToInterrupt(p) (p)
+void attachInterrupt(uint8_t interruptNum, void (*callback)(), int mode);
+void detachInterrupt(uint8_t interruptNum);
+
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long ms);
+void delayMicroseconds(unsigned int us);
+
+// Flash strings are plain strings on the host
+class __FlashStringHelper;
+#define F(string_literal) (reinterpret_cast<const __FlashStringHelper *>(string_literal))
+
+// Just enough of Arduino's String for the FSM tables
+class String {
+    public:
+        String(const char* s = "") : str(s ? s : "") {}
+        String(const std::string& s) : str(s) {}
+        const char* c_str() const { return str.c_str(); }
+        unsigned int length() const { return str.length(); }
+        bool operator==(const String& rhs) const { return str == rhs.str; }
+        bool operator!=(const String& rhs) const { return str != rhs.str; }
+        bool operator==(const char* rhs) const { return str == rhs; }
+        bool operator!=(const char* rhs) const { return str != rhs; }
+
+    private:
+        std::string str;
+};
+
+// Print sink, writes to whatever FILE* native_serial_output() selected
+class Print {
+    public:
+        virtual ~Print() {}
+        virtual size_t write(uint8_t c);
+        virtual size_t write(const uint8_t* buffer, size_t size);
+        size_t write(const char* s) { return write((const uint8_t*)s, strlen(s)); }
+
+        size_t print(const __FlashStringHelper* s) { return write((const char*)s); }
+        size_t print(const String& s) { return write(s.c_str()); }
+        size_t print(const char* s) { return write(s); }
+        size_t print(char c) { return write((uint8_t)c); }
+        size_t print(unsigned char n) { return print((unsigned long)n); }
+        size_t print(int n) { return print((long)n); }
+        size_t print(unsigned int n) { return print((unsigned long)n); }
+        size_t print(long n);
+        size_t print(unsigned long n);
+        size_t print(double n, int digits = 2);
+
+        template <typename T>
+        size_t println(const T& v) { size_t n = print(v); return n + println(); }
+        size_t println() { return write("\r\n"); }
+};
+
+class SerialUSB : public Print {
+    public:
+        void begin(unsigned long) {}
+        void flush() {}
+        operator bool() const { return true; }
+        // Bytes given with native_serial_input(), or scripted for a time
+        int available();
+        int read();
+        int availableForWrite();
+};
+
+extern SerialUSB Serial;
+
+#endif // NATIVE_ARDUINO_H
@@ -0,0 +1,65 @@
+#ifndef NATIVE_LITTLEFS_H
+#define NATIVE_LITTLEFS_H
+
+// Stand-in for the Arduino-Pico core's LittleFS (the onboard flash
+// filesystem) when the FSM is built for the host (env:native). The "flash"
+// is a directory on the host file system, selected with native_flash_root()
+// (none by default, begin() then fails). native_hal.h counts what is written
+// and can cut the power part way through a write.
+
+#include <Arduino.h>
+#include <stdio.h>
+#include <string>
+
+namespace fs {
+
+enum SeekMode { SeekSet = SEEK_SET, SeekCur = SEEK_CUR, SeekEnd = SEEK_END };
+
+class File {
+    public:
+        File() : fp(nullptr) {}
+        File(FILE* fp_) : fp(fp_) {}
+        File(const File&) = delete;
+        File& operator=(const File&) = delete;
+        File(File&& other) : fp(other.fp) { other.fp = nullptr; }
+        File& operator=(File&& other);
+        ~File() { close(); }
+
+        operator bool() const { return fp != nullptr; }
+        void close();
+
+        size_t read(uint8_t* buffer, size_t size);
+        // Stops short, as if the power went, once the write budget set with
+        // native_flash_cut_after() is spent
+        size_t write(const uint8_t* buffer, size_t size);
+        void flush();
+        bool seek(uint32_t pos, SeekMode mode = SeekSet);
+        size_t position() const;
+        size_t size() const;
+
+    private:
+        FILE* fp;
+};
+
+class FS {
+    public:
+        bool begin();
+        void end() {}
+        // Modes as fopen(): "r", "w", "a", "r+"
+        File open(const char* path, const char* mode);
+        bool exists(const char* path);
+        bool remove(const char* path);
+        bool rename(const char* from, const char* to);
+};
+
+} // namespace fs
+
+using fs::File;
+using fs::FS;
+using fs::SeekSet;
+using fs::SeekCur;
+using fs::SeekEnd;
+
+extern fs::FS LittleFS;
+
+#endif // NATIVE_LITTLEFS_H
@@ -0,0 +1,113 @@
+#ifndef NATIVE_SDFAT_H
+#define NATIVE_SDFAT_H
+
+// Stand-in for SdFat when the FSM is built for the host (env:native).
+// The "card" is a directory on the host file system, selected with
+// native_sd_root() (defaults to the working directory).
+
+#include <Arduino.h>
+#include <dirent.h>
+
+#define O_RDONLY 0x00
+#define O_WRONLY 0x01
+#define O_RDWR   0x02
+#define O_READ   O_RDONLY
+#define O_WRITE  O_WRONLY
+#define O_CREAT  0x10
+#define O_TRUNC  0x20
+#define O_APPEND 0x40
+#define FILE_READ  O_READ
+#define FILE_WRITE (O_RDWR | O_CREAT)
+
+#define DEDICATED_SPI 1
+#define SHARED_SPI    0
+#define SD_SCK_MHZ(maxMhz) (1000000UL * (maxMhz))
+
+struct SdSpiConfig {
+    SdSpiConfig(uint8_t cs, uint8_t opt, uint32_t maxSck) : csPin(cs), options(opt), maxSck(maxSck) {}
+    uint8_t csPin;
+    uint8_t options;
+    uint32_t maxSck;
+};
+
+// A file or a directory
+class File32 {
+    public:
+        File32() : fp(nullptr), dir(nullptr), entries(0) {}
+        File32(const File32&) = delete;
+        File32& operator=(const File32&) = delete;
+        File32(File32&& other) : fp(other.fp), dir(other.dir), entries(other.entries), path(other.path) { other.fp = nullptr; other.dir = nullptr; }
+        File32& operator=(File32&& other);
+        ~File32() { close(); }
+
+        operator bool() const { return fp != nullptr || dir != nullptr; }
+        bool isOpen() const { return fp != nullptr || dir != nullptr; }
+        bool isDir() const { return dir != nullptr; }
+        bool close();
+
+        // Opens the next entry of the directory dirFile, false at the end
+        bool openNext(File32* dirFile, int oflag = O_RDONLY);
+        // Name without the folder, returns its length (0 if it doesn't fit)
+        size_t getName(char* name, size_t size) const;
+
+        int read();
+        int read(void* buf, size_t count);
+        size_t readBytes(char* buf, size_t count) { int n = read(buf, count); return n < 0 ? 0 : n; }
+        size_t write(const void* buf, size_t count);
+        size_t write(uint8_t b) { return write(&b, 1); }
+        int available();
+        bool sync();
+
+        uint32_t fileSize() const;
+        uint32_t size() const { return fileSize(); }
+        uint32_t curPosition() const;
+        uint32_t position() const { return curPosition(); }
+        bool seekSet(uint32_t pos);
+        bool seek(uint32_t pos) { return seekSet(pos); }
+
+        // First and last sector of the file if it is stored in one piece.
+        // Each file gets its own made-up sectors, see native_sd_fragment().
+        bool contiguousRange(uint32_t* bgnSector, uint32_t* endSector);
+        // Reserves contiguous space for an empty file
+        bool preAllocate(uint64_t length);
+        // Where the file starts on the card. Stands in as the file's identity:
+        // it changes when the file is replaced.
+        uint32_t firstSector() const;
+        // Last modification, FAT encoded: date (year-1980)<<9 | month<<5 | day,
+        // time hours<<11 | minutes<<5 | seconds/2
+        bool getModifyDateTime(uint16_t* pdate, uint16_t* ptime);
+
+    private:
+        friend class SdFat32;
+        bool openPath(const char* hostPath, int oflag, bool charge = true);
+
+        FILE* fp;
+        DIR* dir;
+        uint32_t entries;       // directory entries read so far
+        std::string path;       // host path
+};
+
+// Raw access to the card's sectors
+class SdCard {
+    public:
+        bool readSectors(uint32_t sector, uint8_t* dst, size_t ns);
+        bool readSector(uint32_t sector, uint8_t* dst) { return readSectors(sector, dst, 1); }
+};
+
+class SdFat32 {
+    public:
+        bool begin(SdSpiConfig config);
+        void initErrorHalt(Print* pr);
+        void errorHalt(Print* pr, const __FlashStringHelper* msg);
+
+        File32 open(const char* path, int oflag = O_RDONLY);
+        bool exists(const char* path);
+        bool remove(const char* path);
+        bool rename(const char* oldPath, const char* newPath);
+        SdCard* card() { return &sdCard; }
+
+    private:
+        SdCard sdCard;
+};
+
+#endif // NATIVE_SDFAT_H
@@ -0,0 +1,11 @@
+#ifndef NATIVE_HARDWARE_GPIO_H
+#define NATIVE_HARDWARE_GPIO_H
+
+// Stand-in for the pico-sdk GPIO header (env:native)
+
+#include <stdint.h>
+
+// Levels of all GPIOs in one word, bit n = GPIO n, like a read of SIO gpio_in
+uint32_t gpio_get_all();
+
+#endif // NATIVE_HARDWARE_GPIO_H
@@ -0,0 +1,9 @@
+#ifndef NATIVE_HARDWARE_SYNC_H
+#define NATIVE_HARDWARE_SYNC_H
+
+// Stand-in for the pico-sdk sync header (env:native)
+
+// Signals an event, the next wait for one returns straight away
+void __sev();
+
+#endif // NATIVE_HARDWARE_SYNC_H
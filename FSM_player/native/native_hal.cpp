@@ -0,0 +1,639 @@
+#include <Arduino.h>
+#include <SdFat.h>
+#include <LittleFS.h>
+#include <hardware/gpio.h>
+#include <hardware/sync.h>
+#include <pico/time.h>
+#include <atomic>
+#include <deque>
+#include <map>
+#include <sys/stat.h>
+#include <time.h>
+#include "native_hal.h"
+
+#define NATIVE_NUM_PINS 32
+
+static uint64_t clock_us = 0;
+static uint32_t pin_in = 0xFFFFFFFFUL;     // input levels, bit n = GPIO n
+static uint8_t pin_out[NATIVE_NUM_PINS];
+static uint32_t pin_outputs = 0;          // GPIOs set to OUTPUT, bit n = GPIO n
+static uint32_t pin_out_levels = 0;       // what was last written to them
+static std::string sd_root = ".";
+static std::string sd_path_buf;
+static FILE* serial_out = stdout;
+static bool serial_capturing = false;
+static std::deque<uint8_t> serial_kept;                     // output kept for native_serial_take()
+static std::deque<uint8_t> serial_in;                       // for Serial.read()
+static int serial_tx_space = 4096;
+static uint32_t sd_access_us = 0;
+static uint32_t sd_bytes_per_ms = 0;
+static uint64_t sd_busy_us = 0;
+
+// Made-up sector layout: every file asked for its range gets its own run of
+// sectors, raw reads find the file again from the sector
+struct Extent {
+    std::string path;           // host path
+    uint32_t sectors;
+};
+static std::map<uint32_t, Extent> sd_extents;              // by first sector
+static std::map<std::string, uint32_t> sd_extent_of;       // host path -> first sector
+static uint32_t sd_next_sector = 0x2000;
+static uint32_t sd_stream_sector = 0;                       // sector after the last raw read, 0: not streaming
+static std::map<std::string, uint32_t> sd_fragmented;      // host path -> fragment size
+
+static std::string flash_root;                              // "": no flash filesystem
+static std::string flash_path_buf;
+static uint64_t flash_written = 0;
+static uint64_t flash_cut_at = ~0ULL;                       // flash_written at which the power goes
+static uint32_t flash_stall_us = 0;                         // virtual time a write takes
+
+struct PinChange {
+    uint8_t pin;
+    uint8_t level;
+};
+static std::multimap<uint64_t, PinChange> pin_script;   // scripted pin changes by time
+static std::multimap<uint64_t, std::string> serial_script;  // scripted serial input by time
+static void (*pin_isr[NATIVE_NUM_PINS])();
+static int pin_isr_mode[NATIVE_NUM_PINS];
+static std::atomic<bool> event_flag(false);              // set by __sev() (from any thread), cleared by a wait
+
+struct Alarm {
+    alarm_id_t id;
+    alarm_callback_t callback;
+    void* user;
+};
+static std::multimap<uint64_t, Alarm> alarms;           // alarms set, by time
+static alarm_id_t next_alarm_id = 1;
+static uint32_t alarm_latency_us = 0;                   // from an alarm's time to its callback
+static uint32_t pin_writes[NATIVE_NUM_PINS];
+
+SerialUSB Serial;
+
+//------------------------------------------------------------------------------
+// native_hal.h
+
+// Runs an alarm that was set for at, and sets it again if it asks to: as the
+// SDK does, n > 0 us after the callback returned, -n us after at for n < 0
+static void fire_alarm(uint64_t at, Alarm alarm) {
+    int64_t again = alarm.callback(alarm.id, alarm.user);
+    if (again > 0) {
+        alarms.insert(std::make_pair(clock_us + again, alarm));
+    } else if (again < 0) {
+        alarms.insert(std::make_pair(at - again, alarm));
+    }
+}
+
+// Moves the clock to until, applying the scripted pin changes and serial
+// input and running the alarms on the way, in time order. With stopOnEvent
+// it stops at the first of them that signalled an event, and returns false.
+static bool advance_to(uint64_t until, bool stopOnEvent) {
+    for (;;) {
+        uint64_t pinAt = pin_script.empty() ? ~0ULL : pin_script.begin()->first;
+        uint64_t alarmAt = alarms.empty() ? ~0ULL : alarms.begin()->first + alarm_latency_us;
+        uint64_t serialAt = serial_script.empty() ? ~0ULL : serial_script.begin()->first;
+        uint64_t at = pinAt < alarmAt ? pinAt : alarmAt;
+        if (serialAt < at) at = serialAt;
+        if (at > until) {
+            break;
+        }
+        if (at > clock_us) clock_us = at;
+        if (serialAt == at) {
+            const std::string& bytes = serial_script.begin()->second;
+            serial_in.insert(serial_in.end(), bytes.begin(), bytes.end());
+            serial_script.erase(serial_script.begin());
+            event_flag = true;                              // the USB interrupt wakes a WFE
+        } else if (alarmAt <= pinAt) {
+            Alarm alarm = alarms.begin()->second;
+            alarms.erase(alarms.begin());
+            fire_alarm(alarmAt - alarm_latency_us, alarm);
+        } else {
+            PinChange change = pin_script.begin()->second;
+            pin_script.erase(pin_script.begin());
+            native_set_pin(change.pin, change.level);
+        }
+        if (stopOnEvent && event_flag) {
+            return false;
+        }
+    }
+    if (until > clock_us) clock_us = until;
+    return true;
+}
+
+void native_set_micros(uint64_t us) { clock_us = us; }
+void native_alarm_latency(uint32_t us) { alarm_latency_us = us; }
+void native_advance_micros(uint64_t us) { advance_to(clock_us + us, false); }
+uint64_t native_micros() { return clock_us; }
+
+void native_set_pin(uint8_t pin, uint8_t level) {
+    if (pin >= NATIVE_NUM_PINS) return;
+    uint32_t old = pin_in;
+    if (level) pin_in |= 1UL << pin;
+    else pin_in &= ~(1UL << pin);
+
+    if (old != pin_in && pin_isr[pin]) {
+        int mode = pin_isr_mode[pin];
+        if (mode == CHANGE || (mode == RISING && level) || (mode == FALLING && !level)) {
+            pin_isr[pin]();
+        }
+    }
+}
+
+void native_schedule_pin(uint64_t at_us, uint8_t pin, uint8_t level) {
+    pin_script.insert(std::make_pair(at_us, PinChange{pin, level}));
+}
+
+uint8_t native_get_pin(uint8_t pin) {
+    return pin < NATIVE_NUM_PINS ? pin_out[pin] : LOW;
+}
+
+uint32_t native_pin_writes(uint8_t pin) {
+    return pin < NATIVE_NUM_PINS ? pin_writes[pin] : 0;
+}
+
+void native_sd_root(const char* path) { sd_root = path; }
+
+const char* native_sd_path(const char* path) {
+    sd_path_buf = sd_root;
+    if (path[0] != '/') sd_path_buf += '/';
+    sd_path_buf += path;
+    return sd_path_buf.c_str();
+}
+
+void native_serial_output(FILE* out) { serial_out = out; }
+void native_serial_capture(bool on) { serial_capturing = on; }
+
+size_t native_serial_take(uint8_t* buffer, size_t size) {
+    size_t n = 0;
+    while (n < size && !serial_kept.empty()) {
+        buffer[n++] = serial_kept.front();
+        serial_kept.pop_front();
+    }
+    return n;
+}
+
+void native_serial_input(const uint8_t* data, size_t size) { serial_in.insert(serial_in.end(), data, data + size); }
+
+void native_schedule_serial(uint64_t at_us, const uint8_t* data, size_t size) {
+    serial_script.insert(std::make_pair(at_us, std::string((const char*)data, size)));
+}
+
+void native_serial_tx_space(int bytes) { serial_tx_space = bytes; }
+
+void native_flash_root(const char* path) {
+    flash_root = path ? path : "";
+    if (!flash_root.empty()) mkdir(flash_root.c_str(), 0755);
+}
+
+void native_flash_cut_after(uint64_t bytes) { flash_cut_at = bytes == ~0ULL ? ~0ULL : flash_written + bytes; }
+uint64_t native_flash_written() { return flash_written; }
+void native_flash_stall(uint32_t us) { flash_stall_us = us; }
+
+static const char* flash_path(const char* path) {
+    flash_path_buf = flash_root;
+    if (path[0] != '/') flash_path_buf += '/';
+    flash_path_buf += path;
+    return flash_path_buf.c_str();
+}
+
+void native_sd_timing(uint32_t accessUs, uint32_t bytesPerMs) {
+    sd_access_us = accessUs;
+    sd_bytes_per_ms = bytesPerMs;
+}
+
+uint64_t native_sd_busy_us() { return sd_busy_us; }
+
+void native_sd_fragment(const char* path, uint32_t fragmentBytes) {
+    if (fragmentBytes) sd_fragmented[native_sd_path(path)] = fragmentBytes;
+    else sd_fragmented.erase(native_sd_path(path));
+}
+
+// Charges the virtual clock for accesses card accesses moving bytes bytes
+static void sd_cost(size_t bytes, uint32_t accesses = 1) {
+    uint64_t us = (uint64_t)sd_access_us * accesses;
+    if (sd_bytes_per_ms) us += (uint64_t)bytes * 1000 / sd_bytes_per_ms;
+    sd_busy_us += us;
+    if (us) advance_to(clock_us + us, false);
+}
+
+//------------------------------------------------------------------------------
+// Arduino.h
+
+// Levels of all pins as the SIO input register reads them: an output reads
+// back what the firmware drives it to, the rest what native_set_pin() set
+static uint32_t pin_levels() {
+    return (pin_in & ~pin_outputs) | (pin_out_levels & pin_outputs);
+}
+
+void pinMode(uint8_t pin, uint8_t mode) {
+    if (pin >= NATIVE_NUM_PINS) return;
+    if (mode == OUTPUT) pin_outputs |= 1UL << pin;
+    else pin_outputs &= ~(1UL << pin);
+}
+
+void digitalWrite(uint8_t pin, uint8_t val) {
+    if (pin < NATIVE_NUM_PINS) {
+        pin_out[pin] = val ? HIGH : LOW;
+        if (val) pin_out_levels |= 1UL << pin;
+        else pin_out_levels &= ~(1UL << pin);
+        pin_writes[pin]++;
+    }
+}
+
+int digitalRead(uint8_t pin) {
+    return pin < NATIVE_NUM_PINS ? (pin_levels() >> pin) & 1 : HIGH;
+}
+
+void attachInterrupt(uint8_t interruptNum, void (*callback)(), int mode) {
+    if (interruptNum >= NATIVE_NUM_PINS) return;
+    pin_isr[interruptNum] = callback;
+    pin_isr_mode[interruptNum] = mode;
+}
+
+void detachInterrupt(uint8_t interruptNum) {
+    if (interruptNum < NATIVE_NUM_PINS) pin_isr[interruptNum] = nullptr;
+}
+
+unsigned long millis() { return (unsigned long)(clock_us / 1000); }
+unsigned long micros() { return (unsigned long)clock_us; }
+void delay(unsigned long ms) { advance_to(clock_us + (uint64_t)ms * 1000, false); }
+void delayMicroseconds(unsigned int us) { advance_to(clock_us + us, false); }
+
+size_t Print::write(uint8_t c) { return write(&c, 1); }
+
+size_t Print::write(const uint8_t* buffer, size_t size) {
+    if (serial_capturing) serial_kept.insert(serial_kept.end(), buffer, buffer + size);
+    else if (serial_out) fwrite(buffer, 1, size, serial_out);
+    return size;
+}
+
+size_t Print::print(long n) {
+    char buf[24];
+    snprintf(buf, sizeof(buf), "%ld", n);
+    return write(buf);
+}
+
+size_t Print::print(unsigned long n) {
+    char buf[24];
+    snprintf(buf, sizeof(buf), "%lu", n);
+    return write(buf);
+}
+
+size_t Print::print(double n, int digits) {
+    char buf[48];
+    snprintf(buf, sizeof(buf), "%.*f", digits, n);
+    return write(buf);
+}
+
+int SerialUSB::available() { return (int)serial_in.size(); }
+
+int SerialUSB::read() {
+    if (serial_in.empty()) return -1;
+    uint8_t c = serial_in.front();
+    serial_in.pop_front();
+    return c;
+}
+
+int SerialUSB::availableForWrite() { return serial_tx_space; }
+
+//------------------------------------------------------------------------------
+// hardware/gpio.h
+
+uint32_t gpio_get_all() { return pin_levels(); }
+
+//------------------------------------------------------------------------------
+// hardware/sync.h, pico/time.h
+
+void __sev() { event_flag = true; }
+
+uint64_t time_us_64() { return clock_us; }
+
+bool best_effort_wfe_or_timeout(absolute_time_t timeout_timestamp) {
+    if (!event_flag) {
+        advance_to(timeout_timestamp, true);
+    }
+    event_flag = false;
+    return clock_us >= timeout_timestamp;
+}
+
+alarm_id_t add_alarm_at(absolute_time_t time, alarm_callback_t callback, void* user_data, bool fire_if_past) {
+    // Due already: run now, as the SDK does, until it asks for a time ahead
+    while (time <= clock_us) {
+        if (!fire_if_past) {
+            return 0;
+        }
+        int64_t again = callback(0, user_data);
+        if (again == 0) {
+            return 0;
+        }
+        time = again > 0 ? clock_us + again : time - again;
+    }
+    alarm_id_t id = next_alarm_id++;
+    alarms.insert(std::make_pair(time, Alarm{id, callback, user_data}));
+    return id;
+}
+
+bool cancel_alarm(alarm_id_t alarm_id) {
+    for (std::multimap<uint64_t, Alarm>::iterator it = alarms.begin(); it != alarms.end(); ++it) {
+        if (it->second.id == alarm_id) {
+            alarms.erase(it);
+            return true;
+        }
+    }
+    return false;
+}
+
+//------------------------------------------------------------------------------
+// SdFat.h
+
+File32& File32::operator=(File32&& other) {
+    if (this != &other) {
+        close();
+        fp = other.fp;
+        dir = other.dir;
+        entries = other.entries;
+        path = other.path;
+        other.fp = nullptr;
+        other.dir = nullptr;
+    }
+    return *this;
+}
+
+bool File32::close() {
+    if (dir) {
+        closedir(dir);
+        dir = nullptr;
+        return true;
+    }
+    if (!fp) return false;
+    fclose(fp);
+    fp = nullptr;
+    return true;
+}
+
+bool File32::openPath(const char* hostPath, int oflag, bool charge) {
+    close();
+    sd_stream_sector = 0;
+    if (charge) sd_cost(0);
+    entries = 0;
+    path = hostPath;
+    struct stat st;
+    if (stat(hostPath, &st) == 0 && S_ISDIR(st.st_mode)) {
+        dir = opendir(hostPath);
+        return dir != nullptr;
+    }
+    const char* mode = "rb";
+    if (oflag & O_TRUNC) mode = "w+b";
+    else if (oflag & O_APPEND) mode = "ab";
+    else if (oflag & (O_WRONLY | O_RDWR)) mode = (oflag & O_CREAT) && stat(hostPath, &st) != 0 ? "w+b" : "r+b";
+    fp = fopen(hostPath, mode);
+    return fp != nullptr;
+}
+
+bool File32::openNext(File32* dirFile, int oflag) {
+    if (!dirFile || !dirFile->dir) return false;
+    while (struct dirent* entry = readdir(dirFile->dir)) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) continue;
+        // A directory sector holds 16 entries, 8 files with long names
+        return openPath((dirFile->path + "/" + entry->d_name).c_str(), oflag, dirFile->entries++ % 8 == 0);
+    }
+    if (dirFile->entries % 8 == 0) sd_cost(0);    // reading on to find the end
+    return false;
+}
+
+size_t File32::getName(char* name, size_t size) const {
+    size_t slash = path.find_last_of('/');
+    std::string base = slash == std::string::npos ? path : path.substr(slash + 1);
+    if (base.size() + 1 > size) {
+        if (size) name[0] = '\0';
+        return 0;
+    }
+    strcpy(name, base.c_str());
+    return base.size();
+}
+
+int File32::read() {
+    if (!fp) return -1;
+    int c = fgetc(fp);
+    return c == EOF ? -1 : c;
+}
+
+int File32::read(void* buf, size_t count) {
+    if (!fp) return -1;
+    uint32_t accesses = 1;
+    std::map<std::string, uint32_t>::iterator frag = sd_fragmented.find(path);
+    if (frag != sd_fragmented.end() && count > 0) {
+        uint32_t pos = curPosition();
+        accesses += (pos + count - 1) / frag->second - pos / frag->second;
+    }
+    sd_stream_sector = 0;
+    sd_cost(count, accesses);
+    return (int)fread(buf, 1, count, fp);
+}
+
+size_t File32::write(const void* buf, size_t count) {
+    if (!fp) return 0;
+    return fwrite(buf, 1, count, fp);
+}
+
+int File32::available() {
+    if (!fp) return 0;
+    return (int)(fileSize() - curPosition());
+}
+
+bool File32::sync() { return fp && fflush(fp) == 0; }
+
+uint32_t File32::fileSize() const {
+    if (!fp) return 0;
+    long pos = ftell(fp);
+    fseek(fp, 0, SEEK_END);
+    long end = ftell(fp);
+    fseek(fp, pos, SEEK_SET);
+    return (uint32_t)end;
+}
+
+uint32_t File32::curPosition() const { return fp ? (uint32_t)ftell(fp) : 0; }
+
+bool File32::seekSet(uint32_t pos) { return fp && fseek(fp, pos, SEEK_SET) == 0; }
+
+bool File32::contiguousRange(uint32_t* bgnSector, uint32_t* endSector) {
+    uint32_t size = fileSize();
+    if (!fp || size == 0 || sd_fragmented.count(path)) return false;
+    uint32_t sectors = (size + 511) / 512;
+    std::map<std::string, uint32_t>::iterator known = sd_extent_of.find(path);
+    uint32_t first;
+    if (known != sd_extent_of.end() && sd_extents[known->second].sectors == sectors) {
+        first = known->second;
+    } else {
+        first = sd_next_sector;
+        sd_next_sector += sectors + 64;     // room between files, so no read runs into the next one
+        sd_extents[first] = Extent{path, sectors};
+        sd_extent_of[path] = first;
+    }
+    if (bgnSector) *bgnSector = first;
+    if (endSector) *endSector = first + sectors - 1;
+    return true;
+}
+
+uint32_t File32::firstSector() const {
+    struct stat st;
+    if (!fp || stat(path.c_str(), &st) != 0 || st.st_size == 0) return 0;
+    uint64_t id = (uint64_t)st.st_ino * 0x9E3779B97F4A7C15ULL ^ (uint64_t)st.st_mtim.tv_sec * 1000000007ULL ^ st.st_mtim.tv_nsec;
+    return (uint32_t)(id ^ (id >> 32)) | 1;
+}
+
+bool File32::getModifyDateTime(uint16_t* pdate, uint16_t* ptime) {
+    struct stat st;
+    struct tm t;
+    if (!isOpen() || stat(path.c_str(), &st) != 0 || !localtime_r(&st.st_mtime, &t)) return false;
+    *pdate = (uint16_t)((t.tm_year - 80) << 9 | (t.tm_mon + 1) << 5 | t.tm_mday);
+    *ptime = (uint16_t)(t.tm_hour << 11 | t.tm_min << 5 | t.tm_sec / 2);
+    return true;
+}
+
+bool File32::preAllocate(uint64_t length) {
+    (void)length;       // the host file grows as it is written
+    if (!fp || fileSize() != 0) return false;
+    sd_fragmented.erase(path);
+    return true;
+}
+
+bool SdFat32::begin(SdSpiConfig config) {
+    (void)config;
+    return true;
+}
+
+void SdFat32::initErrorHalt(Print* pr) {
+    pr->println("SD init failed");
+    exit(1);
+}
+
+void SdFat32::errorHalt(Print* pr, const __FlashStringHelper* msg) {
+    pr->println(msg);
+    exit(1);
+}
+
+File32 SdFat32::open(const char* path, int oflag) {
+    File32 file;
+    file.openPath(native_sd_path(path), oflag);
+    return file;
+}
+
+bool SdFat32::exists(const char* path) {
+    FILE* fp = fopen(native_sd_path(path), "rb");
+    if (!fp) return false;
+    fclose(fp);
+    return true;
+}
+
+bool SdFat32::remove(const char* path) {
+    sd_fragmented.erase(native_sd_path(path));
+    return ::remove(native_sd_path(path)) == 0;
+}
+
+bool SdFat32::rename(const char* oldPath, const char* newPath) {
+    std::string from = native_sd_path(oldPath);
+    std::string to = native_sd_path(newPath);
+    std::map<std::string, uint32_t>::iterator frag = sd_fragmented.find(from);
+    sd_fragmented.erase(to);
+    if (frag != sd_fragmented.end()) {
+        sd_fragmented[to] = frag->second;
+        sd_fragmented.erase(frag);
+    }
+    return ::rename(from.c_str(), to.c_str()) == 0;
+}
+
+bool SdCard::readSectors(uint32_t sector, uint8_t* dst, size_t ns) {
+    std::map<uint32_t, Extent>::iterator extent = sd_extents.upper_bound(sector);
+    if (extent == sd_extents.begin()) return false;
+    --extent;
+    uint32_t index = sector - extent->first;
+    if (index + ns > extent->second.sectors) return false;
+
+    FILE* fp = fopen(extent->second.path.c_str(), "rb");
+    if (!fp) return false;
+    memset(dst, 0, ns * 512);
+    fseek(fp, (long)index * 512, SEEK_SET);
+    size_t got = fread(dst, 1, ns * 512, fp);
+    fclose(fp);
+
+    // A read that follows the last one keeps the card's multi-sector read going
+    sd_cost(ns * 512, sector == sd_stream_sector ? 0 : 1);
+    sd_stream_sector = sector + ns;
+    return got > 0;
+}
+
+//------------------------------------------------------------------------------
+// LittleFS.h
+
+fs::FS LittleFS;
+
+fs::File& fs::File::operator=(File&& other) {
+    if (this != &other) {
+        close();
+        fp = other.fp;
+        other.fp = nullptr;
+    }
+    return *this;
+}
+
+void fs::File::close() {
+    if (fp) fclose(fp);
+    fp = nullptr;
+}
+
+size_t fs::File::read(uint8_t* buffer, size_t size) {
+    return fp ? fread(buffer, 1, size, fp) : 0;
+}
+
+size_t fs::File::write(const uint8_t* buffer, size_t size) {
+    if (!fp) return 0;
+    // Past the cut nothing more reaches the flash
+    if (flash_written >= flash_cut_at) return 0;
+    if (size > flash_cut_at - flash_written) size = flash_cut_at - flash_written;
+    size_t wrote = fwrite(buffer, 1, size, fp);
+    flash_written += wrote;
+    if (wrote && flash_stall_us) advance_to(clock_us + flash_stall_us, false);
+    return wrote;
+}
+
+void fs::File::flush() {
+    if (fp) fflush(fp);
+}
+
+bool fs::File::seek(uint32_t pos, SeekMode mode) {
+    return fp && fseek(fp, (long)pos, mode) == 0;
+}
+
+size_t fs::File::position() const {
+    return fp ? (size_t)ftell(fp) : 0;
+}
+
+size_t fs::File::size() const {
+    struct stat st;
+    if (!fp) return 0;
+    fflush(fp);
+    return fstat(fileno(fp), &st) == 0 ? (size_t)st.st_size : 0;
+}
+
+bool fs::FS::begin() { return !flash_root.empty(); }
+
+fs::File fs::FS::open(const char* path, const char* mode) {
+    if (flash_root.empty()) return File();
+    std::string m = std::string(mode) + "b";
+    return File(fopen(flash_path(path), m.c_str()));
+}
+
+bool fs::FS::exists(const char* path) {
+    struct stat st;
+    return !flash_root.empty() && stat(flash_path(path), &st) == 0;
+}
+
+bool fs::FS::remove(const char* path) {
+    return !flash_root.empty() && ::remove(flash_path(path)) == 0;
+}
+
+bool fs::FS::rename(const char* from, const char* to) {
+    if (flash_root.empty()) return false;
+    std::string hostFrom = flash_path(from);
+    return ::rename(hostFrom.c_str(), flash_path(to)) == 0;
+}
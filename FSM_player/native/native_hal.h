@@ -0,0 +1,77 @@
+#ifndef NATIVE_HAL_H
+#define NATIVE_HAL_H
+
+// Controls for the host stand-in hardware layer (env:native).
+// Benchmarks and host tools use these to drive the virtual clock and pins.
+
+#include <stdint.h>
+#include <stdio.h>
+
+// Virtual clock, in microseconds since "power on". millis()/micros() read it,
+// delay()/delayMicroseconds() advance it instead of sleeping.
+void native_set_micros(uint64_t us);
+void native_advance_micros(uint64_t us);
+uint64_t native_micros();
+// Interrupt latency of the alarms (pico/time.h): a callback runs this many
+// us after the time its alarm was set for, 0 (the default) on the dot
+void native_alarm_latency(uint32_t us);
+
+// Input pin levels seen by digitalRead() and gpio_get_all(). All pins idle
+// HIGH (pulled up). A change runs the pin's interrupt handler, if one is
+// attached. Pins set to OUTPUT read back what the firmware writes to them,
+// as on the RP2040.
+void native_set_pin(uint8_t pin, uint8_t level);
+// Scripts a pin change at a virtual time. It is applied when the clock gets
+// there, by delay(), native_advance_micros() or a sleep of the firmware.
+void native_schedule_pin(uint64_t at_us, uint8_t pin, uint8_t level);
+// Last level the firmware wrote with digitalWrite(), and how many times it wrote the pin
+uint8_t native_get_pin(uint8_t pin);
+uint32_t native_pin_writes(uint8_t pin);
+
+// Directory used as the root of the SD card
+void native_sd_root(const char* path);
+const char* native_sd_path(const char* path);
+
+// Card timing: every open, directory entry and read costs accessUs of virtual
+// time, reads another ms per bytesPerMs bytes. Both 0 (the default) make the
+// card free. A raw sector read that carries on where the last one stopped
+// costs no access time, the card is still streaming. A file read pays another
+// access for every fragment boundary it crosses.
+void native_sd_timing(uint32_t accessUs, uint32_t bytesPerMs);
+// Virtual time the card has been busy so far
+uint64_t native_sd_busy_us();
+
+// Files are contiguous on the stand-in card unless marked here as split into
+// fragments of fragmentBytes (0: contiguous again). Copies made with
+// preAllocate() are contiguous.
+void native_sd_fragment(const char* path, uint32_t fragmentBytes);
+
+// Directory used as the onboard flash filesystem (LittleFS); without one
+// (nullptr or "", the default) LittleFS.begin() fails as on an unformatted board
+void native_flash_root(const char* path);
+// Cuts the power after another bytes bytes reach the flash: writes from
+// there on are dropped, part of one included, until it is called with ~0ULL
+void native_flash_cut_after(uint64_t bytes);
+// Bytes written to the flash so far
+uint64_t native_flash_written();
+// Virtual time every write to the flash takes, in which nothing else runs
+// (on the board the audio core is paused for it). 0, the default: none.
+void native_flash_stall(uint32_t us);
+
+// Where Serial output goes, nullptr discards it
+void native_serial_output(FILE* out);
+// Keeps Serial output instead, for native_serial_take() (on), or goes
+// back to native_serial_output()'s FILE* (off)
+void native_serial_capture(bool on);
+// Takes up to size bytes of the output kept, returns how many
+size_t native_serial_take(uint8_t* buffer, size_t size);
+// Bytes for Serial.read(), as if the host had sent them now
+void native_serial_input(const uint8_t* data, size_t size);
+// The same at a virtual time: they arrive when the clock gets there and wake
+// a sleep of the firmware, as the USB interrupt does
+void native_schedule_serial(uint64_t at_us, const uint8_t* data, size_t size);
+// Room Serial.availableForWrite() reports, as if the host stopped reading
+// (default 4096)
+void native_serial_tx_space(int bytes);
+
+#endif // NATIVE_HAL_H
@@ -0,0 +1,78 @@
+#include "pcm_file_sink.h"
+#include "native_hal.h"
+#include "fsm_image.h"
+
+PcmFileSink::PcmFileSink(FILE* out_, uint32_t bufferMs_)
+    : out(out_), bufferMs(bufferMs_), byteRate(0), blockAlign(1), capacity(0), startUs(0), fileBytes(0),
+      running(false), firstSoundUs(0), bytesWritten(0), crc(0), underruns(0), starts(0) {
+}
+
+bool PcmFileSink::begin(const WavFormat& format) {
+    // A running output in the same format plays on, as the I2S output does:
+    // what it holds still plays before the new file
+    firstSoundUs = 0;
+    if (running && format.sampleRate * format.blockAlign == byteRate && format.blockAlign == blockAlign) {
+        return true;
+    }
+    if (!running) {
+        starts++;
+    }
+    byteRate = format.sampleRate * format.blockAlign;
+    blockAlign = format.blockAlign;
+    capacity = (uint32_t)((uint64_t)byteRate * bufferMs / 1000);
+    capacity -= capacity % blockAlign;
+    startUs = native_micros();
+    fileBytes = 0;
+    running = true;
+    return true;
+}
+
+uint32_t PcmFileSink::buffered() {
+    if (!running) {
+        return 0;
+    }
+    uint64_t played = (native_micros() - startUs) * byteRate / 1000000;
+    return played >= fileBytes ? 0 : (uint32_t)(fileBytes - played);
+}
+
+size_t PcmFileSink::availableForWrite() {
+    return running ? capacity - buffered() : 0;
+}
+
+size_t PcmFileSink::write(uint8_t* data, size_t bytes) {
+    if (!running) {
+        return 0;
+    }
+
+    // Playback starts with the first write. If the buffer ran dry since the
+    // last one the output went silent, and what comes next starts from now.
+    uint64_t played = (native_micros() - startUs) * byteRate / 1000000;
+    if (fileBytes == 0 || played > fileBytes) {
+        if (fileBytes > 0) {
+            underruns++;
+        }
+        startUs = native_micros();
+        fileBytes = 0;
+    }
+
+    size_t space = availableForWrite();
+    if (bytes > space) {
+        bytes = space;
+    }
+    bytes -= bytes % blockAlign;
+
+    if (bytes && firstSoundUs == 0) {
+        firstSoundUs = native_micros() + (uint64_t)buffered() * 1000000 / byteRate;
+    }
+    if (out && bytes) {
+        fwrite(data, 1, bytes, out);
+    }
+    crc = fsm_crc32(data, bytes, crc);
+    fileBytes += bytes;
+    bytesWritten += bytes;
+    return bytes;
+}
+
+void PcmFileSink::end() {
+    running = false;
+}
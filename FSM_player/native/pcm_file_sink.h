@@ -0,0 +1,58 @@
+#ifndef NATIVE_PCM_FILE_SINK_H
+#define NATIVE_PCM_FILE_SINK_H
+
+// Host stand-in for the I2S output (env:native). Plays at the file's own rate
+// on the virtual clock: the buffer empties at sampleRate frames per second
+// of virtual time and write() only takes what fits. Whatever it takes is
+// appended to a raw PCM file (if one is given) and to a running CRC, so
+// tests can check that every byte arrived in order, loops included.
+
+#include <stdio.h>
+#include "audio_sink.h"
+
+class PcmFileSink : public AudioSink {
+    public:
+        // out: raw PCM output, nullptr to only count. bufferMs: how much
+        // audio the "DMA" buffer holds.
+        PcmFileSink(FILE* out = nullptr, uint32_t bufferMs = 35);
+
+        bool begin(const WavFormat& format) override;
+        size_t availableForWrite() override;
+        size_t write(uint8_t* data, size_t bytes) override;
+        void end() override;
+        uint32_t getUnderruns() const override { return underruns; }
+
+        // Everything written since the constructor
+        uint64_t getBytesWritten() const { return bytesWritten; }
+        uint32_t getCrc() const { return crc; }
+
+        // Bytes still waiting to be played
+        uint32_t buffered();
+
+        // Virtual time the first sample written since begin() plays, after
+        // whatever the buffer still held of the file before. 0 before that.
+        uint64_t getFirstSoundUs() const { return firstSoundUs; }
+
+        // Times begin() started the output after end() or at first, where the
+        // player sets up the I2S peripheral again; and whether it runs now
+        uint32_t getStarts() const { return starts; }
+        bool isRunning() const { return running; }
+
+    private:
+        FILE* out;
+        uint32_t bufferMs;
+        uint32_t byteRate;          // bytes played per second
+        uint16_t blockAlign;
+        uint32_t capacity;          // buffer size in bytes, whole frames
+        uint64_t startUs;           // virtual time playback of fileBytes started from
+        uint64_t fileBytes;         // bytes written since startUs
+        bool running;
+        uint64_t firstSoundUs;
+
+        uint64_t bytesWritten;
+        uint32_t crc;
+        uint32_t underruns;
+        uint32_t starts;
+};
+
+#endif // NATIVE_PCM_FILE_SINK_H
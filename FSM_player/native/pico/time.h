@@ -0,0 +1,33 @@
+#ifndef NATIVE_PICO_TIME_H
+#define NATIVE_PICO_TIME_H
+
+// Stand-in for the pico-sdk time header (env:native), on the virtual clock
+
+#include <stdint.h>
+
+// Microseconds since boot, like the SDK's non-debug absolute_time_t
+typedef uint64_t absolute_time_t;
+
+uint64_t time_us_64();
+inline uint32_t time_us_32() { return (uint32_t)time_us_64(); }
+inline absolute_time_t get_absolute_time() { return time_us_64(); }
+inline absolute_time_t from_us_since_boot(uint64_t us) { return us; }
+inline uint64_t to_us_since_boot(absolute_time_t t) { return t; }
+
+// Moves the virtual clock on to the timeout, or only as far as the next
+// scripted pin change that runs an interrupt handler which signals an event.
+// Returns true if the timeout was reached.
+bool best_effort_wfe_or_timeout(absolute_time_t timeout_timestamp);
+
+// Alarms of the default alarm pool. The callbacks run as the virtual clock
+// passes their time, in whatever moves it (a sleep, delay(), a card access),
+// like an interrupt would, native_alarm_latency() after their time. A
+// callback returns 0 to end the alarm, n > 0 to run again n us after it
+// returned, n < 0 -n us after the time it was set for, as in the SDK.
+typedef int32_t alarm_id_t;
+typedef int64_t (*alarm_callback_t)(alarm_id_t id, void* user_data);
+
+alarm_id_t add_alarm_at(absolute_time_t time, alarm_callback_t callback, void* user_data, bool fire_if_past);
+bool cancel_alarm(alarm_id_t alarm_id);
+
+#endif // NATIVE_PICO_TIME_H
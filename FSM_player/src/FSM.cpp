@@ -1,4 +1,38 @@
+#include <hardware/gpio.h>
+#include <pico/time.h>
 #include "FSM.h"
+#include "sd_layout.h"
+#include "telemetry.h"
+#include "led_sequencer.h"
+#include "flash_cache.h"
+#ifdef FSM_BUILTIN_CONFIG
+#include "fsm_builtin_config.h"
+#endif
+
+// Size of the JSON document used to parse the config. The native build raises
+// this so generated benchmark configs with hundreds of states fit, anything
+// bigger than the default is taken from the heap instead of the stack.
+// Precompiled images (/FSM_Config.bin) have no such limit.
+#ifndef FSM_JSON_CAPACITY
+#define FSM_JSON_CAPACITY 4096
+#endif
+
+// State LED pattern: blinkCount blinks of BLINK_MS on and BLINK_MS off, then BLINK_WAIT_MS off
+#define BLINK_MS      200
+#define BLINK_WAIT_MS 1500
+
+// Longest wait nextDeadlineUs() gives, time_us_32() stamps compare over half their range
+#define FSM_MAX_WAIT_US 0x7FFFFFFFUL
+
+// The image check keeps the inputs off the pins of gpio_utils.h
+static_assert((~FSM_RESERVED_GPIO & ((1UL << led_status_pin) | (1UL << led_mode_pin) | (1UL << led_state_pin) | (1UL << resetPin))) == 0,
+              "FSM_RESERVED_GPIO is missing an LED or the reset button");
+
+SdFat32 sd;
+
+// The config files, in the order they are tried
+static const char* const config_paths[] = {"/FSM_Config.bin", "/FSM_Config.json"};
+#define CONFIG_FILES 2
 
 const char* conditionToStr(ConditionType conditionType) {
     switch (conditionType) {
@@ -11,15 +45,37 @@ const char* conditionToStr(ConditionType conditionType) {
     }
 }
 
-void print_transition(Transition& transition){
+const char* selectToStr(uint8_t select) {
+    switch (select) {
+        case AUDIO_SELECT_FIRST:      return "first";
+        case AUDIO_SELECT_SEQUENTIAL: return "sequential";
+        case AUDIO_SELECT_SHUFFLE:    return "shuffle";
+        case AUDIO_SELECT_WEIGHTED:   return "weighted";
+        default:                      return "UNKNOWN";
+    }
+}
+
+void print_transition(const Transition& transition, const Condition* conditions, const uint8_t* code){
             Serial.print("\n\tTarget state: ");
             Serial.print(transition.targetState);
             Serial.print("\n\tNumber of conditions: ");
             Serial.print(transition.numConditions);
 
+            // The conditions that aren't plain sensor, time and audio ones are compiled code
+            if (transition.program) {
+                Serial.print("\n\tCondition program: ");
+                Serial.print(fsm_program_size(code + transition.program));
+                Serial.print(" bytes");
+            }
+            if (transition.actions) {
+                Serial.print("\n\tActions: ");
+                Serial.print(fsm_program_size(code + transition.actions));
+                Serial.print(" bytes");
+            }
+
             //go through all conditions and print them
             for (uint8_t k = 0; k < transition.numConditions; k++) {
-                Condition& condition = transition.conditions[k];            // grab a reference to a condition (all conditions in a transition will be looked at in order)
+                const Condition& condition = conditions[transition.firstCondition + k];    // grab a reference to a condition (all conditions in a transition will be looked at in order)
 
                 if (transition.numConditions > 1) {
                     Serial.print("\n\t\tCondition #");
@@ -40,372 +96,1272 @@ void print_transition(Transition& transition){
                         Serial.print("\n\t\tDuration: ");
                         Serial.print(condition.duration);
                         break;
+                    default:
+                        break;
                 }
             }
 }
 
-FSM::FSM(){  
+// Takes a precompiled image that is in memory if it is usable, frees it and
+// returns nullptr (and prints why) if it isn't
+static uint8_t* checkImage(uint8_t* buffer, uint32_t size) {
+    const char* problem = fsm_image_check(buffer, size);
+    if (problem) {
+        Serial.print("FSM_Config.bin: ");
+        Serial.println(problem);
+        free(buffer);
+        return nullptr;
+    }
+    return buffer;
+}
+
+// Reads a precompiled image in one pass into a single buffer.
+// Returns nullptr (and prints why) if the file is not a usable image.
+static uint8_t* readImage(File32& file) {
+    FsmImageHeader header;
+    if (file.read(&header, sizeof(header)) != sizeof(header) || header.magic != FSM_IMAGE_MAGIC ||
+        header.imageSize < sizeof(header) || header.imageSize != file.fileSize()) {
+        Serial.println("FSM_Config.bin is not a valid image");
+        return nullptr;
+    }
+
+    uint8_t* buffer = (uint8_t*)malloc(header.imageSize);
+    if (!buffer) {
+        Serial.println("Not enough memory for FSM_Config.bin");
+        return nullptr;
+    }
+    memcpy(buffer, &header, sizeof(header));
+    uint32_t rest = header.imageSize - sizeof(header);
+    if (file.read(buffer + sizeof(header), rest) != (int)rest) {
+        Serial.println("Failed to read FSM_Config.bin");
+        free(buffer);
+        return nullptr;
+    }
+    return checkImage(buffer, header.imageSize);
+}
+
+// Parses the JSON config and compiles it into an image, from the file at boot
+// or from the file's bytes in memory on a reload.
+// Returns nullptr (and prints why) if the config can't be used.
+template <typename... Input>
+static uint8_t* compileJson(Input... input) {
+    // Parse the JSON document
+#if FSM_JSON_CAPACITY > 4096
+    DynamicJsonDocument doc(FSM_JSON_CAPACITY);
+#else
+    StaticJsonDocument<FSM_JSON_CAPACITY> doc;
+#endif
+    DeserializationError error = deserializeJson(doc, input..., DeserializationOption::NestingLimit(FSM_JSON_NESTING));
+    if (error) {
+        Serial.println("Failed to parse config file");
+        return nullptr;
+    }
+
+    // Measure, then compile into one buffer of exactly the right size
+    const char* problem = nullptr;
+    uint32_t size = fsm_image_compile(doc.as<JsonObject>(), nullptr, 0, &problem);
+    uint8_t* buffer = size ? (uint8_t*)malloc(size) : nullptr;
+    if (buffer && fsm_image_compile(doc.as<JsonObject>(), buffer, size, &problem) == 0) {
+        free(buffer);
+        buffer = nullptr;
+    }
+    if (!buffer) {
+        Serial.print("FSM_Config.json: ");
+        Serial.println(problem ? problem : "not enough memory");
+    }
+    return buffer;
+}
+
+// Reads the config from the card: the precompiled image if there is a usable
+// one, otherwise FSM_Config.json compiled on the spot.
+// Returns nullptr (and prints why) if neither can be used.
+static uint8_t* readConfig() {
+    uint8_t* newImage = nullptr;
+    File32 imageFile = sd.open(config_paths[0], O_READ);
+    if (imageFile) {
+        newImage = readImage(imageFile);
+        imageFile.close();
+    }
+
+    // Otherwise compile the JSON config
+    if (!newImage) {
+        File32 configFile = sd.open(config_paths[1], O_READ);
+        if (!configFile) {
+            Serial.println("Failed to open config file");
+            return nullptr;
+        }
+        newImage = compileJson<File32&>(configFile);
+
+        // Close the file (we are done with it)
+        configFile.close();
+    }
+    return newImage;
+}
+
+// Makes an image of a config file the audio core read into memory, an image
+// or JSON by what it starts with. Takes the bytes, returns nullptr (and
+// prints why) if they can't be used.
+static uint8_t* imageFromBytes(uint8_t* data, uint32_t size) {
+    if (size >= sizeof(uint32_t) && *(const uint32_t*)data == FSM_IMAGE_MAGIC) {
+        return checkImage(data, size);
+    }
+    uint8_t* newImage = compileJson((const char*)data, (size_t)size);
+    free(data);
+    return newImage;
+}
+
+FSM::FSM() : image(nullptr), header(nullptr), evaluate(nullptr), states(nullptr), transitions(nullptr), conditions(nullptr), code(nullptr), strings(nullptr),
+             numStates(0), numInputs(0), currentState(0), gpioMask(0), heldMask(0), heldLevels(0), audio(nullptr), journal(nullptr), journalDue(false), journalWaiting(false), journalAt(0),
+             reloadStep(RELOAD_IDLE), reloadRequested(false), configSignature(0), pendingImage(nullptr), retired(nullptr), syncSeq(0),
+             reloaded(false), reloads(0), reloadFailures(0), serialLength(0), subscribed(false), pushes(0), pushesDropped(0),
+             inputEdgeUs(0) {
     //AudioSourceSDFAT& source_in) : source(source_in) {
     // Constructor
     // Initialize variables here
     // Note: The actual initialization will be done in FSM::begin()
+    memset(vars, 0, sizeof(vars));
+    timers.begin(0);
+}
+
+FSM::~FSM() {
+    free(image);
+    free(pendingImage);
+    free(retired);
 }
 
 void FSM::begin() {
     // Initialize the FSM
     // This is where you'd set the current state to the initial state, etc.
+
     currentState = 0;
+    timers.begin(time_us_32());
     lastStateChange = millis();
+    stateEntryUs = timers.now();
     skipFlag = false;
     resetFlag = false;
+    lastEvents = 0;
+    audioState = 0xFF;              // start the audio of state 0 on the first tick
+    audioSeq = 0;
+    audioDone = false;
+    audioFadeOut = 0;
+    audioUnderruns = 0;
+    ledState = 0xFF;                // start the state LED on the first tick
+    journalDue = true;              // a show started over is journalled as such
+    journalWaiting = false;
+    heldMask = 0;
+    heldLevels = 0;
+    nextPoll = millis() + FSM_RELOAD_POLL_MS;
+    if (numStates == 0) {
+        return;                     // nothing loaded, a config reloaded later begins it
+    }
+
+    beginInputs();
+    evaluateDue = true;             // evaluate on the first tick
+}
+
+bool FSM::resume(const StateJournal& from) {
+    JournalRecord record;
+    if (numStates == 0 || !from.last(record) || record.image != header->crc || record.state >= numStates) {
+        return false;
+    }
+    currentState = record.state;
+    memcpy(vars, record.vars, sizeof(vars));
+    journalDue = false;             // the journal has it already
+    return true;
+}
+
+void FSM::beginInputs() {
+    if (numStates == 0) {
+        return;                     // no config, no inputs
+    }
+
+    //initialize sensor pins to input and pullup
+    for (uint8_t i = 0; i < numInputs; i++) {
+        pinMode(inputPins[i], INPUT_PULLUP);
+    }
+
+    // Debounce from the current levels, so nothing reads as a change at startup
+    sampleInterval = header->debounceMs / 4;
+    lastSample = millis();
+    gpioFell = 0;
+    gpioRose = 0;
+    gpioMask = getInputGpioMask();
+    debouncer.begin(gpio_get_all() & gpioMask, header->debounceMode);
+    resetButton.begin(header->longPressMs);
+
+    inputs = packInputs(debouncer.state());
+    inputsChanged = 0;
+
+    // As far as the condition programs know, the inputs have been where they are since now
+    for (uint8_t i = 0; i < FSM_MAX_INPUTS; i++) {
+        inputSince[i] = millis();
+    }
+    memset(rises, 0, sizeof(rises));
+    memset(falls, 0, sizeof(falls));
+}
+
+void FSM::useImage(uint8_t* newImage) {
+    image = newImage;
+    viewImage(newImage);
+}
+
+void FSM::useBuiltin(const uint8_t* table) {
+    free(image);
+    image = nullptr;
+    viewImage(table);
+}
+
+void FSM::viewImage(const uint8_t* table) {
+    header = fsm_image_header(table);
+    states = fsm_image_states(table);
+    transitions = fsm_image_transitions(table);
+    conditions = fsm_image_conditions(table);
+    code = fsm_image_code(table);
+    strings = fsm_image_strings(table);
+    numStates = header->numStates;
+    evaluate = evaluatorFor(fsm_uses(transitions, header->numTransitions));
+
+    // Work out how to pick the inputs out of a GPIO snapshot. Consecutive
+    // GPIOs (the usual wiring) take a single shift and mask.
+    inputPins = header->inputPins;
+    numInputs = header->numInputs;
+    inputMask = numInputs >= 32 ? 0xFFFFFFFFUL : (1UL << numInputs) - 1;
+    inputShift = inputPins[0];
+    for (uint8_t i = 1; i < numInputs; i++) {
+        if (inputPins[i] != inputPins[0] + i) {
+            inputShift = -1;
+            break;
+        }
+    }
 }
 
 void FSM::loadConfiguration() {
-    // Load the JSON configuration from the SD card
+    // Load the configuration from the SD card
     // Initialize SdFat or print a detailed error message and halt
     // Use SdFat sd;
 
     //light up mode led to indicate loading
-    digitalWrite(led_mode_pin, HIGH);
+    leds.set(LED_MODE, true);
 
 
     const uint8_t SD_CS_PIN = SS;
     #define SPI_CLOCK SD_SCK_MHZ(50)
     #define SD_CONFIG SdSpiConfig(SD_CS_PIN, DEDICATED_SPI, SPI_CLOCK)
 
-    SdFat32 sd;
-    File32 file;
-
-    // Initialize the SD.
+    // Initialize the SD. The error code blinks on through the halt, the LEDs run off their own alarm.
     if (!sd.begin(SD_CONFIG)) {
+        leds.set(LED_MODE, false);
+        leds.blink(LED_STATUS, LED_ERROR_SD, BLINK_MS, BLINK_MS, BLINK_WAIT_MS);
         sd.initErrorHalt(&Serial);
         return;
     }
 
     Serial.println("OK!");
-    // Open the file
-    File32 configFile = sd.open("/FSM_Config.json", O_READ);
-    if (!configFile) {
-        Serial.println("Failed to open config file");
-        return;
-    }
 
-    // Parse the JSON document
-    StaticJsonDocument<4096> doc;
-    DeserializationError error = deserializeJson(doc, configFile);
-    if (error) {
-        Serial.println("Failed to parse config file");
+#ifdef FSM_BUILTIN_CONFIG
+    // The state table is compiled into the firmware, the card is only for the audio
+    useBuiltin(fsm_builtin.bytes());
+#else
+    // Prefer the precompiled image, it loads in one read with no parsing.
+    // The files as they are now, a reload is due when that changes.
+    configSignature = sd_files_signature(sd, config_paths, CONFIG_FILES);
+
+    // The table compiled from these very files at an earlier boot, if the
+    // flash cache has it: no JSON to parse and nothing to read but the signature
+    uint32_t cachedSize = 0;
+    uint8_t* newImage = flashCache.load(FLASH_CACHE_CONFIG, configSignature, cachedSize);
+    if (newImage && fsm_image_check(newImage, cachedSize)) {
+        free(newImage);
+        newImage = nullptr;
+    }
+    if (newImage) {
+        Serial.println("Config from the flash cache");
+    } else {
+        newImage = readConfig();
+        if (newImage) {
+            flashCache.save(FLASH_CACHE_CONFIG, configSignature, newImage, fsm_image_header(newImage)->imageSize);
+        }
+    }
+    if (!newImage) {
+        leds.set(LED_MODE, false);
+        leds.blink(LED_STATUS, LED_ERROR_CONFIG, BLINK_MS, BLINK_MS, BLINK_WAIT_MS);
         return;
     }
+    free(image);
+    useImage(newImage);
+#endif
+    printConfiguration();
 
-    // Close the file (we are done with it)
-    configFile.close();
-
-    // Extract states array
-    JsonArray statesArray = doc["states"];
-    numStates = statesArray.size();
-    states = new State[numStates];
+    //rapidly blink mode led to indicate done loading, it plays on while setup() goes on
+    leds.play(LED_MODE, led_loaded);
+}
 
-    // Loop through each state in the array
+void FSM::printConfiguration() {
     for (uint8_t i = 0; i < numStates; i++) {
-        JsonObject stateObject = statesArray[i];
+        const State &state = states[i];
 
-        State &state = states[i];
-
-        // Extract state properties
-        state.id = stateObject["id"];
-        state.audioFile = stateObject["audioFile"].as<String>();
-        state.repeat = stateObject["repeat"];
-        state.blinkCount = stateObject["blinkCount"];
-        
         //print state info to serial
         Serial.print("\n\nState #");
         Serial.print(state.id);
         Serial.print("\nAudio file: ");
-        Serial.print(state.audioFile);
+        Serial.print(strings + state.audioFile);
         Serial.print("\nRepeat: ");
         Serial.print(state.repeat);
         Serial.print("\nBlink count: ");
         Serial.print(state.blinkCount);
-
-
-        // Extract transitions array
-        JsonArray transitionsArray = stateObject["transitions"];
-        state.numTransitions = transitionsArray.size() +2;               // +2 for skip and reset transitions
-        state.transitions = new Transition[states[i].numTransitions +2];
+        Serial.print("\nSelect: ");
+        Serial.print(selectToStr(state.select));
+        Serial.print("\nGain: ");
+        Serial.print(state.gain / (float)AUDIO_GAIN_UNITY);
+        Serial.print("\nFade in/out: ");
+        Serial.print(state.fadeIn);
+        Serial.print("/");
+        Serial.print(state.fadeOut);
+        Serial.print(" ms");
 
         //print number of transitions
         Serial.print("\nNumber of transitions: ");
         Serial.print(state.numTransitions);
 
+        // skip and reset transitions (the last two) are not printed
+        for (uint8_t j = 0; j + 2 < state.numTransitions; j++) {
+            Serial.print("\n\tTransition #");
+            Serial.print(j);
+            print_transition(transitions[state.firstTransition + j], conditions, code);
+        }
+    }
+}
 
-        // Loop through each transition in the array // -2 for skip and reset transitions, they are added later
-        for (uint8_t j = 0; j < state.numTransitions-2; j++) {
-            JsonObject transitionObject = transitionsArray[j];
-            Transition &transition = state.transitions[j];
-            
-
-            // Extract transition properties
-            transition.targetState = transitionObject["targetState"];
+// Checks one audio file, repacking it if asked to. Returns true if it is (still) fragmented.
+static bool check_audio_file(const char* path, bool repack) {
+    if (sd_file_layout(sd, path) != LAYOUT_FRAGMENTED) {
+        return false;           // contiguous, or missing (play() reports that)
+    }
+    Serial.print("Fragmented: ");
+    Serial.print(path);
+    const char* problem = repack ? sd_repack(sd, path) : "";
+    if (!problem) {
+        Serial.println(" - repacked");
+        return false;
+    }
+    if (repack) {
+        Serial.print(" - can't repack: ");
+        Serial.print(problem);
+    }
+    Serial.println();
+    return true;
+}
 
-            // Extract conditions array
-            JsonArray conditionsArray = transitionObject["conditions"];
-            transition.numConditions = conditionsArray.size();
-            transition.conditions = new Condition[transition.numConditions];           
+void FSM::indexAudio(AudioIndex& index, bool quick) {
+    // Each folder once; the compiler interns equal paths, so equal offsets
+    const char** folders = (const char**)malloc(numStates * sizeof(const char*));
+    uint8_t* modes = (uint8_t*)malloc(numStates);
+    uint16_t count = 0;
+    for (uint8_t i = 0; folders && modes && i < numStates; i++) {
+        const char* path = strings + states[i].audioFile;
+        size_t length = strlen(path);
+        bool seen = false;
+        for (uint16_t j = 0; j < count && !seen; j++) {
+            seen = folders[j] == path;
+        }
+        if (length > 0 && path[length - 1] == '/' && !seen) {
+            folders[count] = path;
+            modes[count++] = states[i].select;
+        }
+    }
 
-            // Loop through each condition in the array
-            for (uint8_t k = 0; k < transition.numConditions; k++) {
-                JsonObject conditionObject = conditionsArray[k];
-                Condition &condition = transition.conditions[k];
+    // The index on the card is trusted only if it is the one the last full
+    // check left there, and that check is noted again after every full one
+    static const char* const index_path[] = {AUDIO_INDEX_PATH};
+    bool trusted = quick && flashCache.has(FLASH_CACHE_INDEX, sd_files_signature(sd, index_path, 1));
 
-                // Extract condition properties
-                String type = conditionObject["type"].as<String>();
-                if (type == "SENSOR") {
-                    condition.type = SENSOR;
-                    condition.sensorPin = conditionObject["data"]["sensorPin"];
-                    condition.state = conditionObject["data"]["state"];
+    unsigned long start = millis();
+    if (folders && modes && index.begin(sd, folders, modes, count, trusted)) {
+        if (!trusted) {
+            flashCache.save(FLASH_CACHE_INDEX, sd_files_signature(sd, index_path, 1), nullptr, 0);
+        }
+        Serial.print("Audio index: ");
+        Serial.print(index.getNumFolders());
+        Serial.print(" folders, ");
+        Serial.print(index.getNumFiles());
+        Serial.print(" files, ");
+        Serial.print(index.getRescanned());
+        Serial.print(trusted ? " folders rescanned, the rest taken without a walk, in " : " folders rescanned in ");
+        Serial.print(millis() - start);
+        Serial.println(" ms");
+    }
+    free(folders);
+    free(modes);
+}
 
+void FSM::checkAudioFiles(AudioIndex& index) {
+    bool repack = sd.exists("/FSM_Repack");
+    uint16_t checked = 0;
+    uint16_t fragmented = 0;
+    uint16_t repacked = 0;
 
-                } else if (type == "TIME_PASSED") {
-                    condition.type = TIME_PASSED;
-                    condition.duration = conditionObject["data"]["duration"];
+    for (uint8_t i = 0; i < numStates; i++) {
+        const char* path = strings + states[i].audioFile;
+        size_t length = strlen(path);
+        if (length == 0) {
+            continue;
+        }
 
+        // States sharing a file or folder check it once
+        bool seen = false;
+        for (uint8_t j = 0; j < i && !seen; j++) {
+            seen = strings + states[j].audioFile == path;
+        }
+        if (seen) {
+            continue;
+        }
 
-                } else if (type == "AUDIO_FINISHED") {
-                    condition.type = AUDIO_FINISHED;
+        int16_t folder = path[length - 1] == '/' ? index.find(path) : -1;
+        if (folder < 0) {
+            if (path[length - 1] != '/') {
+                fragmented += check_audio_file(path, repack);
+                checked++;
+            }
+            continue;
+        }
 
-                }
+        // The index knows which files of a folder are in one piece
+        AudioIndexEntry entry;
+        char file[AUDIO_INDEX_FOLDER + AUDIO_INDEX_NAME];
+        for (uint16_t k = 0; k < index.getNumFiles(folder) && index.getEntry(folder, k, entry); k++) {
+            checked++;
+            if (entry.firstSector) {
+                continue;
             }
+            snprintf(file, sizeof(file), "%s%s", path, entry.name);
+            if (check_audio_file(file, repack)) {
+                fragmented++;
+            } else {
+                repacked++;
+            }
+        }
+    }
 
-            Serial.print("\n\tTransition #");
-            Serial.print(j);
-            print_transition(transition);
+    Serial.print(checked);
+    Serial.print(" audio files, ");
+    Serial.print(fragmented);
+    Serial.println(repack || fragmented == 0 ? " fragmented" : " fragmented (put a /FSM_Repack file on the card to repack them)");
+    if (repack) {
+        sd.remove("/FSM_Repack");
+    }
+
+    // Repacked files moved, the folders they are in get indexed again
+    if (repacked > 0) {
+        indexAudio(index);
+    }
+}
 
+void FSM::checkSwitches() {
+    // Check the state of the sensor switches
+    // All GPIO levels are read at once from the SIO input register, so switches
+    // that change together are never seen half changed. The snapshot goes through
+    // the debouncer (sensors and reset button alike), then the configured inputs
+    // are packed into the inputs word, bit n = input n.
+    inputsChanged = 0;
+    gpioFell = 0;
+    gpioRose = 0;
+
+    // While an input is settling the debouncer must see samples evenly spaced.
+    // Otherwise nothing is counting and the first sample after an edge can be
+    // taken straight away, which is what gets a change through without delay.
+    unsigned long now = millis();
+    bool settling = debouncer.settling();
+    if (!settling || now - lastSample >= sampleInterval) {
+        lastSample = now;
+        debouncer.sample(gpio_get_all() & gpioMask);
+        gpioFell = debouncer.fell();
+        gpioRose = debouncer.rose();
+
+        // A change starts here, the latency of the transition it leads to is counted from this sample
+        if (!settling && (debouncer.settling() || gpioFell || gpioRose)) {
+            inputEdgeUs = Telemetry::now();
         }
-    
-        //add skip transition
-        uint8_t skip_transition_index = state.numTransitions - 2;
-        state.transitions[ skip_transition_index ].targetState = state.id + 1;
-        state.transitions[ skip_transition_index ].numConditions = 1;
-        state.transitions[ skip_transition_index ].conditions = new Condition[1];
-        state.transitions[ skip_transition_index ].conditions[0].type = SKIP_FLAG;
+    }
 
+    // Inputs held from the serial port take the place of their pins, between samples too
+    uint32_t held = heldMask & inputMask;
+    uint32_t levels = (packInputs(debouncer.state()) & ~held) | (heldLevels & held);
+    inputsChanged = levels ^ inputs;
+    inputs = levels;
+
+    // When each input changed and how often, for SENSOR_HELD and COUNT
+    for (uint32_t changed = inputsChanged; changed; changed &= changed - 1) {
+        uint8_t i = __builtin_ctz(changed);
+        inputSince[i] = now;
+        if ((levels >> i) & 1) {
+            rises[i]++;
+        } else {
+            falls[i]++;
+        }
+    }
+}
 
-        //add reset transition
-        uint8_t reset_transition_index = state.numTransitions - 1;
-        state.transitions[ reset_transition_index ].targetState = 0;
-        state.transitions[ reset_transition_index ].numConditions = 1;
-        state.transitions[ reset_transition_index ].conditions = new Condition[1];
-        state.transitions[ reset_transition_index ].conditions[0].type = RESET_FLAG;
-    
+uint32_t FSM::packInputs(uint32_t gpio) const {
+    if (inputShift >= 0) {
+        return (gpio >> inputShift) & inputMask;
     }
 
+    uint32_t levels = 0;
+    for (uint8_t i = 0; i < numInputs; i++) {
+        levels |= ((gpio >> inputPins[i]) & 1UL) << i;
+    }
+    return levels;
+}
 
-    digitalWrite(led_mode_pin, LOW);
-    //rapidly blink mode 10 times led to indicate done loading
-    for (int i = 0; i < 4; i++) {
-        digitalWrite(led_mode_pin, HIGH);
-        delay(100);
-        digitalWrite(led_mode_pin, LOW);
-        delay(100);
+void FSM::checkResetSwitch() {
+    // The reset button is active low: a debounced fall is a press.
+    // Released before longPressMs: skip to the next state.
+    // Held for longPressMs: reset to state 0, the mode LED blinks until it is let go.
+    // Held on for twice that: the config is reloaded from the card as well.
+    // Nothing here waits, the FSM and audio keep running while the button is held.
+    uint32_t bit = 1UL << resetPin;
+    unsigned long now = millis();
+    uint8_t events = resetButton.update(gpioFell & bit, gpioRose & bit, now);
+
+    if (events & BUTTON_PRESS) {
+        leds.set(LED_MODE, true);
+    }
+    if (events & BUTTON_SHORT_PRESS) {
+        skipFlag = true;
+    }
+    if (events & BUTTON_LONG_PRESS) {
+        resetFlag = true;
+        leds.play(LED_MODE, led_reset_held);
+    }
+    if (events & BUTTON_HOLD) {
+        requestReload();
+    }
+    if (events & BUTTON_RELEASE) {
+        leds.set(LED_MODE, false);
     }
 }
 
+void FSM::changeState() {
+    // Handle state transitions based on the compiled conditions of the current state's transitions.
+    // Each transition is a couple of integer compares: the sensors it looks at must have the
+    // required levels, the FSM must have been in the state long enough, and the events it
+    // waits for must have happened. Only then does its condition program run, if it has one
+    // (OR, NOT, edges, holds, counters, variables, show timers). The first transition that passes is taken.
+    // Time in the state is counted in microseconds on the timer wheel, read once per tick at
+    // update(); the state timer is armed for the next threshold, so a TIME_PASSED transition
+    // fires the tick the wheel says it is due rather than on a poll that happens to come after it.
+    unsigned long elapsed = (timers.now() - stateEntryUs) / 1000;
+    uint8_t events = (skipFlag ? EVENT_SKIP : 0) | (resetFlag ? EVENT_RESET : 0) |
+                     (audioDone ? EVENT_AUDIO_FINISHED : 0);
+
+    // Nothing to do if no sensor moved, no event came in and no timer ran out
+    // since the last evaluation, it would give the same answer
+    if (inputsChanged == 0 && events == lastEvents && !evaluateDue) {
+        return;
+    }
+    evaluateDue = false;
 
-void FSM::checkSwitches(uint8_t sensorPins[8], bool sensorStates[8]) {
-    // Check the state of the sensor switches
-    // This function will read the state of each sensor switch
-    // and store the state in the sensorStates array.
-    for (uint8_t i = 0; i < 8; i++) {
-        sensorStates[i] = digitalRead(sensorPins[i]);
+    // skip and reset are one-shot, this evaluation uses them up. Audio finished
+    // lasts until the state changes.
+    skipFlag = false;
+    resetFlag = false;
+    lastEvents = events & EVENT_AUDIO_FINISHED;
+
+    const State& state = states[currentState];
+    const Transition* end = &transitions[state.firstTransition + state.numTransitions];
+    unsigned long timeout = 0xFFFFFFFFUL;
+    const Transition* transition = (this->*evaluate)(elapsed, events, timeout);
+
+    // Thresholds are whole ms in the state, the first one still ahead is due
+    // at that many thousand us after it was entered
+    if (timeout != 0xFFFFFFFFUL) {
+        timers.arm(FSM_STATE_TIMER, stateEntryUs + (uint64_t)timeout * 1000);
+    } else {
+        timers.cancel(FSM_STATE_TIMER);
+    }
+
+    if (transition < end) {  // all conditions of this transition are met, change to the target state
+        // Logged to telemetry rather than printed, so a transition never waits for the serial port.
+        // One a sensor that changed took counts towards the input latency.
+        uint32_t latency = 0;
+        if (inputsChanged & transition->careMask) {
+            latency = Telemetry::now() - inputEdgeUs;
+            telemetry.sample(TELEMETRY_INPUT_US, latency);
+        }
+        telemetry.record(TELEMETRY_FSM_CORE, TELEMETRY_TRANSITION, currentState, transition->targetState, latency);
+        telemetry.count(TELEMETRY_TRANSITIONS);
+
+        if (transition->actions) {
+            fsm_program_act(code + transition->actions, vars, timers);
+        }
+        enterState(transition->targetState);
     }
 }
 
-void FSM::checkResetSwitch() {
-   
-   //check if reset switch is pressed for less than 3 seconds, or held for 3 seconds
-
-    if (buttonPressEvent){
-        //check if held for more than 2 seconds
-        if (millis() - buttonPressStart > 2000) {
-            resetFlag = true;
-            buttonPressEvent = false;
-            
-            long led_tracker = 0;
-            while (digitalRead(resetPin) == LOW) { //wait until button is released
-                delay(5);
-                led_tracker += 1;
-
-                if (led_tracker % 80 < 40) {
-                    digitalWrite(led_mode_pin, HIGH);
-                }
-                else {
-                    digitalWrite(led_mode_pin, LOW);
-                }
-            }
-            digitalWrite(led_mode_pin, LOW);
-            return;
+void FSM::enterState(uint8_t state) {
+    memset(rises, 0, sizeof(rises));                                // COUNT counts from entering the state
+    memset(falls, 0, sizeof(falls));
+
+    currentState = state;
+    journalDue = true;
+    lastStateChange = millis();
+    stateEntryUs = timers.now();
+    timers.cancel(FSM_STATE_TIMER);
+    evaluateDue = true;                                             // evaluate the new state on the next tick
+    lastEvents = 0;
+    audioDone = false;
+    pushes |= 1 << SERIAL_REASON_STATE;
+}
+
+bool FSM::setState(uint8_t state) {
+    if (state >= numStates) {
+        return false;
+    }
+    telemetry.record(TELEMETRY_FSM_CORE, TELEMETRY_TRANSITION, currentState, state, 0);
+    telemetry.count(TELEMETRY_TRANSITIONS);
+    enterState(state);
+    return true;
+}
+
+bool FSM::holdInput(uint8_t input, uint8_t level) {
+    if (input >= numInputs || level > SERIAL_LEVEL_RELEASE) {
+        return false;
+    }
+    uint32_t bit = 1UL << input;
+    if (level == SERIAL_LEVEL_RELEASE) {
+        heldMask &= ~bit;
+    } else {
+        heldMask |= bit;
+        heldLevels = level == SERIAL_LEVEL_HIGH ? heldLevels | bit : heldLevels & ~bit;
+    }
+
+    // checkSwitches() takes it in on this tick when it came over the serial
+    // port, the next one otherwise; the transition's latency counts from here
+    inputEdgeUs = Telemetry::now();
+    return true;
+}
+
+template <uint8_t Uses>
+const Transition* FSM::firstTransition(unsigned long elapsed, uint8_t events, unsigned long& timeout) {
+    // The tests of the kinds of conditions the table doesn't have are left out
+    // at compile time: a show of sensors alone doesn't look at the time or set up
+    // a program context, one without sensors doesn't mask the inputs.
+    const State& state = states[currentState];
+    const Transition* transition = &transitions[state.firstTransition];
+    const Transition* end = transition + state.numTransitions;
+
+    FsmProgramContext context = {};
+    if constexpr ((Uses & FSM_USES_PROGRAMS) != 0) {
+        uint32_t expired = 0;
+        for (uint8_t timer = 0; timer < FSM_MAX_TIMERS; timer++) {
+            expired |= (uint32_t)timers.expired(timer) << timer;
         }
-        
-        else if (digitalRead(resetPin) == HIGH) { //check if released before 3 seconds
-            skipFlag = true;
-            buttonPressEvent = false;
-            digitalWrite(led_mode_pin, LOW);
-            return;
+        context = {inputs, inputsChanged & inputs, inputsChanged & ~inputs, events, millis(), elapsed,
+                   inputSince, rises, falls, vars, expired};
+    }
+
+    for (; transition < end; transition++) {
+        bool pass = (transition->needs & ~events) == 0;
+        if constexpr ((Uses & FSM_USES_SENSORS) != 0) {
+            pass = pass && (inputs & transition->careMask) == transition->valueMask;
+        }
+        if constexpr ((Uses & FSM_USES_TIME) != 0) {
+            pass = pass && elapsed >= transition->minElapsed;
+        }
+        if constexpr ((Uses & FSM_USES_PROGRAMS) != 0) {
+            pass = pass && (!transition->program || fsm_program_test(code + transition->program, context, timeout));
+        }
+        if (pass) {
+            return transition;
+        }
+        if constexpr ((Uses & FSM_USES_TIME) != 0) {
+            if (transition->minElapsed > elapsed && transition->minElapsed < timeout) {
+                timeout = transition->minElapsed;                   // the state's earliest time threshold still ahead
+            }
         }
     }
+    return end;
+}
 
-    //check if buttonpress has begun
-   else if (digitalRead(resetPin) == LOW) {
-        //debounce test
-        bool debounce = false; 
-        for (int i = 0; i < 10; i++) {
-            delay(5);
-            if (digitalRead(resetPin) == HIGH) {
-                debounce = true;
-                break;
+FSM::Evaluator FSM::evaluatorFor(uint8_t uses) {
+#ifdef FSM_BUILTIN_CONFIG
+    // The built-in table is the only one there will be, only its evaluator is compiled in
+    (void)uses;
+    return &FSM::firstTransition<fsm_builtin_uses(fsm_builtin)>;
+#else
+    static const Evaluator evaluators[FSM_USES_ALL + 1] = {
+        &FSM::firstTransition<0>, &FSM::firstTransition<1>, &FSM::firstTransition<2>, &FSM::firstTransition<3>,
+        &FSM::firstTransition<4>, &FSM::firstTransition<5>, &FSM::firstTransition<6>, &FSM::firstTransition<7>
+    };
+    return evaluators[uses & FSM_USES_ALL];
+#endif
+}
+
+void FSM::playAudio() {
+    // Play the audio for the current state
+    // After a state change the new state starts its audioFile (a file, or the first .wav in a folder)
+    // from the beginning, repeating if the state says so. The audio itself runs on the other core,
+    // this only sends it commands and reads back what happened to the current play.
+    // A state without audio, or whose audio can't be played, counts as finished straight
+    // away so AUDIO_FINISHED transitions don't wait forever.
+    // The audio of the state before fades out over that state's fadeOut while the new
+    // one fades in over its own fadeIn, a crossfade when both are set.
+    if (!audio) {
+        return;
+    }
+
+    if (audioState != currentState) {
+        const State& state = states[currentState];
+        const char* audioFile = strings + state.audioFile;
+        bool posted;
+        if (audioFile[0] == '\0') {
+            posted = audio->stop(audioFadeOut);
+            if (!audioDone) {
+                pushes |= 1 << SERIAL_REASON_AUDIO;
             }
+            audioDone = true;
+        } else {
+            posted = audio->play(audioFile, state.repeat, audioSeq + 1, state.gain, state.fadeIn, audioFadeOut);
+        }
+        if (!posted) {
+            return;                                                 // queue full, try again next tick
         }
+        audioSeq++;
+        audioState = currentState;
+        audioStart = millis();
+        audioFadeOut = state.fadeOut;
+        prefetchTargets();
+    }
 
-        if (!debounce) {
-            buttonPressStart = millis();
-            buttonPressEvent = true;
-            digitalWrite(led_mode_pin, HIGH);
-        }
-   
-   }
-
-}
-
-void FSM::changeState(bool sensorStates[8]) {
-    // Handle state transitions based on the conditions in the current state's transitions
-    // This function will check each condition of each transition of the current state,
-    // and if all conditions of a transition are met, change to the target state.
-    for (uint8_t i = 0; i < states[currentState].numTransitions; i++) { // For the number of transition conditions in the current state
-        Transition& transition = states[currentState].transitions[i];   // grab a reference to a transition (all possible transitions will be looked at in order)
-        uint8_t conditionsToMeet = transition.numConditions;                      // Assume the transition conditions are met
-        
-        for (uint8_t j = 0; j < transition.numConditions; j++) {        // For the number of conditions in the transition
-            Condition& condition = transition.conditions[j];            // grab a reference to a condition (all conditions in a transition will be looked at in order)
-            // Serial.println("Checking condition  type:");
-            // Serial.println(condition.type);
-            switch (condition.type) {
-                case SENSOR:                                            //check relevant sensor pin for the desired state
-                    if (sensorStates[condition.sensorPin] == condition.state) {
-                        conditionsToMeet -= 1;
-                    }
-                    break;
-                case TIME_PASSED:                                       //check if the desired condition time has passed
-                    if (millis() - lastStateChange > condition.duration) {
-                        conditionsToMeet -= 1;
-                    }
-                    break;
-
-                case AUDIO_FINISHED:                                    //check if the audio has finished playing
-                    // Here we would check if the audio has finished playing.
-                    // As this requires interaction with the audio library, which is not
-                    // part of this example, we'll just leave a TODO comment here.
-                    // TODO: Check if audio has finished playing.
-                    if (condition.type == AUDIO_FINISHED){
-                        Serial.println("Audio finished transition triggered scuffed shit bruh");
-                    }
-                    break;
-                case SKIP_FLAG:                                         //check if the skip flag is set
-                    if (skipFlag) {
-                        conditionsToMeet -= 1;
-                        skipFlag = false;
-                    }
-                    break;
-                case RESET_FLAG:                                        //check if the reset flag is set
-                    if (resetFlag) {
-                        conditionsToMeet -= 1;
-                        resetFlag = false;
-                    }
-                    break;
+    AudioEvent event;
+    while (audio->poll(event)) {
+        if (event.type == AUDIO_EVENT_UNDERRUN) {
+            audioUnderruns = event.value;
+        } else if (event.type >= AUDIO_EVENT_STAT) {                // replies to the reload's file requests
+            reloadEvent(event);
+        } else if (event.seq == audioSeq && !audioDone) {           // finished or failed, of the current play
+            // The audio core prints nothing, why the file didn't play is printed here
+            if (event.type == AUDIO_EVENT_FAILED && event.data && audioState < numStates) {
+                Serial.print(strings + states[audioState].audioFile);
+                Serial.print(": ");
+                Serial.println((const char*)event.data);
             }
+            audioDone = true;
+            pushes |= 1 << SERIAL_REASON_AUDIO;
         }
+    }
+}
 
-        if (conditionsToMeet == 0) {  // If all conditions are met (none of the condition tests were negative), change to the target state
-            currentState = transition.targetState;
-            lastStateChange = millis();
-            Serial.println("Transition successful: ");
+void FSM::finishAudio() {
+    if (numStates && !audioDone) {
+        audioDone = true;
+        pushes |= 1 << SERIAL_REASON_AUDIO;
+    }
+}
+
+// Sends a message of the binary protocol
+static void send_message(uint8_t type, uint8_t seq, const void* body, size_t size) {
+    SerialWriter writer(Serial);
+    writer.begin(type, seq);
+    writer.write((const uint8_t*)body, size);
+    writer.end();
+}
 
-            print_transition(transition);
+void FSM::checkSerial() {
+    // Commands come in as lines over USB serial: "reload", and "telemetry",
+    // which answers with a binary frame for tools/telemetry_decode.cpp.
+    // Between them a show controller sends binary messages (serial_protocol.h),
+    // decoded a byte at a time as they are read and carried out straight
+    // away, so a command waits for nothing but the tick it arrives in.
+    while (Serial.available() > 0) {
+        int c = Serial.read();
+        SerialByte kind = serialReader.feed((uint8_t)c);
+        if (kind != SERIAL_BYTE_TEXT) {
+            serialLength = 0;                                       // text cut off by a message is dropped
+            if (kind == SERIAL_BYTE_MESSAGE) {
+                handleMessage(serialReader.message(), serialReader.messageLength());
+            }
+        } else if (c == '\n' || c == '\r') {
+            serialLine[serialLength] = '\0';
+            if (strcmp(serialLine, "reload") == 0) {
+                requestReload();
+            } else if (strcmp(serialLine, "telemetry") == 0) {
+                telemetry.dump(Serial);
+            }
+            serialLength = 0;
+        } else if (serialLength < sizeof(serialLine) - 1) {
+            serialLine[serialLength++] = (char)c;
+        }
+    }
+}
 
+void FSM::handleMessage(const uint8_t* message, uint8_t length) {
+    SerialHeader command;
+    memcpy(&command, message, sizeof(command));
+    const uint8_t* body = message + sizeof(command);
+    uint8_t size = length - sizeof(command);
+
+    uint8_t result = SERIAL_OK;
+    switch (command.type) {
+        case SERIAL_PING: {
+            SerialPongBody pong = {time_us_32(), SERIAL_PROTOCOL_VERSION, serialReader.getBadFrames()};
+            send_message(SERIAL_PONG, command.seq, &pong, sizeof(pong));
+            return;
+        }
+        case SERIAL_QUERY:
+            sendStatus(SERIAL_REASON_QUERY, command.seq);
+            return;
+        case SERIAL_TELEMETRY: {
+            SerialWriter writer(Serial);
+            writer.begin(SERIAL_TELEMETRY_DUMP, command.seq);
+            telemetry.dump(writer);
+            writer.end();
+            return;
+        }
+        case SERIAL_INPUT: {
+            SerialInputBody input;
+            if (size != sizeof(input)) {
+                result = SERIAL_BAD_LENGTH;
+            } else if (numStates == 0) {
+                result = SERIAL_NOT_LOADED;
+            } else {
+                memcpy(&input, body, sizeof(input));
+                result = holdInput(input.input, input.level) ? SERIAL_OK : SERIAL_BAD_ARGUMENT;
+            }
+            break;
+        }
+        case SERIAL_SET_STATE: {
+            SerialSetStateBody target;
+            if (size != sizeof(target)) {
+                result = SERIAL_BAD_LENGTH;
+            } else if (numStates == 0) {
+                result = SERIAL_NOT_LOADED;
+            } else {
+                memcpy(&target, body, sizeof(target));
+                result = setState(target.state) ? SERIAL_OK : SERIAL_BAD_ARGUMENT;
+            }
             break;
         }
+        case SERIAL_SUBSCRIBE: {
+            SerialSubscribeBody subscribe;
+            if (size != sizeof(subscribe)) {
+                result = SERIAL_BAD_LENGTH;
+            } else {
+                memcpy(&subscribe, body, sizeof(subscribe));
+                subscribed = subscribe.on != 0;
+                pushes = 0;                                         // from now on
+            }
+            break;
+        }
+        case SERIAL_RELOAD:
+            requestReload();
+            break;
+        default:
+            result = SERIAL_UNKNOWN;
+            break;
     }
+    SerialAckBody ack = {command.type, result};
+    send_message(SERIAL_ACK, command.seq, &ack, sizeof(ack));
 }
 
+void FSM::sendStatus(uint8_t reason, uint8_t seq) {
+    SerialStatusBody status = {};
+    status.reason = reason;
+    status.state = numStates ? currentState : 0xFF;
+    status.numStates = numStates;
+    status.audioDone = audioDone;
+    status.us = time_us_32();
+    status.transitions = telemetry.getCounter(TELEMETRY_TRANSITIONS);
+    status.pushesDropped = pushesDropped;
+    if (numStates) {
+        uint64_t now = timers.extend(status.us);
+        status.inStateMs = (now - stateEntryUs) / 1000;
+        status.audioMs = audioState == currentState ? millis() - audioStart : 0;
+        status.held = heldMask & inputMask;
+        status.inputs = (inputs & ~status.held) | (heldLevels & status.held);    // a hold from this tick included
+        for (uint8_t i = 0; i < FSM_MAX_TIMERS; i++) {
+            uint64_t at = timers.deadline(i);
+            status.timers[i] = timers.armed(i) && at > now ? (uint32_t)(at - now) : 0;
+        }
+        memcpy(status.vars, vars, sizeof(status.vars));
+    }
+    send_message(SERIAL_STATUS, seq, &status, sizeof(status));
+}
 
-// void FSM::playAudio(AudioPlayer& player) {
-//     // Play the audio for the current state
-//     // This function will load the audio file of the current state into the audio player
-//     // and start playing if not already playing.
+bool FSM::takeReloaded() {
+    bool was = reloaded;
+    reloaded = false;
+    return was;
+}
 
-//     // get the current state
-//     State& state = states[currentState];
-    
-//     // check if audio is not playing, or has finished and the state is set to repeat, or the current audio file does not match the state's audio file
-    
-//     bool playing_audio = !player.isActive();
-//     //// bool EOF_and_repeat = (player && state.repeat); //didnt find easy implementation of checking if end of file 💀 can check when i get HW, also dont actually think thisi s needed
-//     bool audio_file_mismatch = (state.audioFile != currentAudioFile);
-    
-//     if (playing_audio || audio_file_mismatch) {
-//         // stop any previously playing audio
-//         player.stop();
-        
-//         // set the audio file of the current state
-//         //source.setPath(state.audioFile.c_str());
+void FSM::checkReload() {
+    // A reload runs over several ticks and nothing in it waits. The audio core
+    // owns the card, so it checks the config files for changes every
+    // FSM_RELOAD_POLL_MS (or straight away when a reload is asked for) and
+    // reads them in between its reads of the audio. The bytes it hands back are
+    // checked or compiled here into an image of their own while the running
+    // one carries on, and the new image is swapped in at the start of the
+    // tick after. The old one is freed once the audio core has answered a
+    // sync, by then nothing it was sent points into it any more.
+#ifdef FSM_BUILTIN_CONFIG
+    // The config is part of the firmware, there is nothing to reload
+    if (reloadRequested) {
+        reloadRequested = false;
+        Serial.println("The config is built in, nothing to reload");
+    }
+    return;
+#endif
+    if (!audio) {
+        // Without the audio core the card is the FSM's own, asked for reloads are read straight away
+        if (reloadRequested) {
+            reloadRequested = false;
+            configSignature = sd_files_signature(sd, config_paths, CONFIG_FILES);
+            uint8_t* newImage = readConfig();
+            if (newImage) {
+                swapImage(newImage);
+                free(retired);
+                retired = nullptr;
+            } else {
+                reloadFailures++;
+                telemetry.record(TELEMETRY_FSM_CORE, TELEMETRY_RELOAD, 0, numStates, currentState);
+            }
+        }
+        return;
+    }
 
-//         // start playing the audio
-//         player.begin();
-//         player.setAutoNext(state.repeat); ///!!!!!!!!!! if enabled can automatically move to next track(s)
-//     }
-// }
+    unsigned long now = millis();
+    switch (reloadStep) {
+        case RELOAD_IDLE:
+            if ((reloadRequested || (long)(now - nextPoll) >= 0) && audio->stat(config_paths, CONFIG_FILES)) {
+                nextPoll = now + FSM_RELOAD_POLL_MS;
+                reloadStep = RELOAD_STAT;
+            }
+            break;
+        case RELOAD_CHANGED:
+            if (audio->load(config_paths, CONFIG_FILES)) {
+                reloadStep = RELOAD_LOADING;
+            }
+            break;
+        case RELOAD_READY:
+            swapImage(pendingImage);
+            pendingImage = nullptr;
+            reloadStep = RELOAD_RETIRE;
+            // fall through
+        case RELOAD_RETIRE:
+            if (audio->sync(syncSeq + 1)) {
+                syncSeq++;
+                reloadStep = RELOAD_RETIRING;
+            }
+            break;
+        default:
+            break;                                                  // waiting for the audio core
+    }
+}
+
+void FSM::reloadEvent(const AudioEvent& event) {
+    switch (event.type) {
+        case AUDIO_EVENT_STAT:
+            if (reloadStep != RELOAD_STAT) {
+                break;
+            }
+            if (reloadRequested || event.value != configSignature) {
+                configSignature = event.value;
+                reloadRequested = false;
+                reloadStep = RELOAD_CHANGED;
+            } else {
+                reloadStep = RELOAD_IDLE;
+            }
+            break;
+        case AUDIO_EVENT_LOADED:
+            if (!event.data) {
+                Serial.println("Failed to read config file");
+            }
+            pendingImage = event.data ? imageFromBytes((uint8_t*)event.data, event.value) : nullptr;
+            if (pendingImage) {
+                reloadStep = RELOAD_READY;
+            } else {
+                reloadFailures++;
+                telemetry.record(TELEMETRY_FSM_CORE, TELEMETRY_RELOAD, 0, numStates, currentState);
+                reloadStep = RELOAD_IDLE;                           // the running config stays
+            }
+            break;
+        case AUDIO_EVENT_SYNC:
+            if (reloadStep == RELOAD_RETIRING && event.value == syncSeq) {
+                free(retired);
+                retired = nullptr;
+                reloadStep = RELOAD_IDLE;
+            }
+            break;
+        default:
+            break;
+    }
+}
 
+void FSM::swapImage(uint8_t* newImage) {
+    if (numStates == 0) {
+        // Booted without a config: this one starts as it would have at boot
+        retired = image;
+        useImage(newImage);
+        begin();
+        flashCache.save(FLASH_CACHE_CONFIG, configSignature, image, header->imageSize);
+        leds.set(LED_STATUS, false);                                // the error code blinks no more
+        reloadDone();
+        return;
+    }
 
+    // How the running config wires its inputs and what it plays, to compare the new one with
+    const FsmImageHeader* oldHeader = header;
+    const FsmImageHeader* newHeader = fsm_image_header(newImage);
+    bool sameInputs = oldHeader->numInputs == newHeader->numInputs &&
+                      memcmp(oldHeader->inputPins, newHeader->inputPins, sizeof(oldHeader->inputPins)) == 0 &&
+                      oldHeader->debounceMs == newHeader->debounceMs && oldHeader->debounceMode == newHeader->debounceMode &&
+                      oldHeader->longPressMs == newHeader->longPressMs;
+    const State& oldState = states[currentState];
+    const char* oldAudio = strings + oldState.audioFile;
+    bool oldRepeat = oldState.repeat;
+
+    retired = image;
+    useImage(newImage);
+
+    // The current state carries over if the new config has it, with the time
+    // spent in it, so TIME_PASSED counts on from when it was entered. If it
+    // doesn't, the FSM enters state 0 as a reset does: its timer and counts
+    // start over and a controller is told about the new state.
+    uint8_t before = currentState;
+    if (currentState >= numStates) {
+        setState(0);
+    }
+    lastEvents = 0;
+    evaluateDue = true;                                             // evaluate with the new transitions on the next tick
+    ledState = 0xFF;                                                // the state's blinkCount may be another
+    journalDue = true;                                              // journalled with the new table's CRC
+
+    // Cached for the next boot, the files it came from are the ones configSignature is of
+    flashCache.save(FLASH_CACHE_CONFIG, configSignature, image, header->imageSize);
+
+    // Audio that is the same file played the same way goes on without a break,
+    // anything else is a state change for the audio: the state's audio starts,
+    // crossfading from the old one if the old state had a fadeOut
+    const State& state = states[currentState];
+    if (currentState == before && audioState == currentState && state.repeat == oldRepeat &&
+        strcmp(strings + state.audioFile, oldAudio) == 0) {
+        audioFadeOut = state.fadeOut;
+        if (audio) {
+            prefetchTargets();                                      // the transitions may lead elsewhere now
+        }
+    } else {
+        audioState = 0xFF;
+        audioDone = false;
+    }
 
-void FSM::blinkLED() {
-    // Calculate the length of one full cycle (blinking phase + waiting phase)
-    // The blinking phase length is blinkCount * 2 * blinkDuration (on and off)
-    // The waiting phase length is waitDuration
+    if (!sameInputs) {
+        beginInputs();
+    }
+    reloadDone();
+}
 
-    uint8_t blinkCount = states[currentState].blinkCount;
-    unsigned long blinkDuration = 200; // 200 ms on time (and )off time)
-    unsigned long waitDuration = 1500; // 2 seconds of waiting after blinking
-    unsigned long cycleLength = blinkCount *  (2 * blinkDuration) + waitDuration;
+void FSM::reloadDone() {
+    reloaded = true;
+    reloads++;
+    telemetry.record(TELEMETRY_FSM_CORE, TELEMETRY_RELOAD, 1, numStates, currentState);
+    telemetry.count(TELEMETRY_RELOADS);
+    pushes |= 1 << SERIAL_REASON_RELOAD;
+
+    Serial.print("Config reloaded: ");
+    Serial.print(numStates);
+    Serial.print(" states, in state ");
+    Serial.println(currentState);
+}
 
-    // Calculate the time passed since the start of the current cycle
-    unsigned long timeInCycle = (millis() - lastStateChange) % cycleLength;
 
-    // Serial.print("\nCycle time: ");
-    // Serial.println(timeInCycle);
-    // Serial.print("Cycle length: ");
-    // Serial.println(cycleLength);
 
-    // Determine whether we are in the blinking phase or the waiting phase
-    if (timeInCycle < blinkCount * (2 * blinkDuration)) { // blinking phase
-        unsigned long timeInBlink = timeInCycle % (2 * blinkDuration); //time since last blink started
-        if (timeInBlink < blinkDuration) {
-            digitalWrite(led_state_pin, HIGH);
-        } else {
-            digitalWrite(led_state_pin, LOW);
+// Adds an audio file to the prefetch list unless it is empty or already there
+static void add_prefetch(const char** paths, uint8_t& count, const char* path) {
+    if (path[0] == '\0' || count == AUDIO_PREFETCH_SLOTS) {
+        return;
+    }
+    for (uint8_t i = 0; i < count; i++) {
+        if (strcmp(paths[i], path) == 0) {
+            return;
         }
-
-    } else { // waiting phase
-        digitalWrite(led_state_pin, LOW);
     }
+    paths[count++] = path;
 }
 
+void FSM::prefetchTargets() {
+    // Every state this one can go to is known from the table, so their audio can be
+    // loaded before a visitor triggers the transition. Most likely first: the skip
+    // target (next state), then the configured transitions in the order changeState
+    // checks them, then reset (state 0).
+    const State& state = states[currentState];
+    const Transition* stateTransitions = &transitions[state.firstTransition];
+    uint8_t configured = state.numTransitions - 2;                  // skip and reset are the last two
+    const char* paths[AUDIO_PREFETCH_SLOTS];
+    uint8_t count = 0;
+
+    add_prefetch(paths, count, getAudioFile(stateTransitions[configured].targetState));
+    for (uint8_t i = 0; i < configured; i++) {
+        add_prefetch(paths, count, getAudioFile(stateTransitions[i].targetState));
+    }
+    add_prefetch(paths, count, getAudioFile(stateTransitions[configured + 1].targetState));
 
-void FSM::update(uint8_t sensorPins[8], bool sensorStates[8]) { //AudioPlayer& player
+    audio->prefetch(paths, count);
+}
+
+void FSM::update() {
     // Update the FSM
     // This function calls all the other functions in the appropriate order.
-    checkSwitches(sensorPins, sensorStates);
+    checkSerial();                                                  // a controller can ask what is wrong with no config
+    checkReload();                                                  // a new config goes in before anything looks at the tables
+    if (numStates == 0) {                                           // nothing loaded, only a reload can change that
+        return;
+    }
+    uint32_t start = Telemetry::now();
+    if (timers.advance(time_us_32())) {                             // a TIME_PASSED threshold or a show timer came
+        evaluateDue = true;
+    }
+    checkSwitches();
     checkResetSwitch();
-    changeState(sensorStates);
-    //playAudio(player);
-    blinkLED();
+    playAudio();                                                    // before changeState, so it sees the audio finish on the same tick
+    changeState();
+
+    // The state LED blinks the state's blinkCount, started over when the state changes
+    if (ledState != currentState) {
+        leds.blink(LED_STATE, states[currentState].blinkCount, BLINK_MS, BLINK_MS, BLINK_WAIT_MS);
+        ledState = currentState;
+    }
+
+    // A state change (or variables a transition set) goes into the journal, one flash
+    // write, on a tick FSM_JOURNAL_DELAY_MS later rather than the one that started the
+    // new state's audio
+    if (journalDue && journal) {
+        journalWaiting = true;
+        journalAt = millis() + FSM_JOURNAL_DELAY_MS;
+    }
+    journalDue = false;
+    if (journalWaiting && (long)(millis() - journalAt) >= 0) {
+        uint32_t journalStart = Telemetry::now();
+        journal->append(header->crc, currentState, vars);
+        telemetry.sample(TELEMETRY_JOURNAL_US, Telemetry::now() - journalStart);
+        journalWaiting = false;
+    }
+
+    // What changed goes to a subscribed controller, if the port has room for it
+    // right now; a host that stopped reading mustn't hold up the show
+    if (pushes && subscribed) {
+        for (uint8_t reason = SERIAL_REASON_STATE; reason <= SERIAL_REASON_RELOAD; reason++) {
+            if (!(pushes & (1 << reason))) {
+                continue;
+            }
+            if ((size_t)Serial.availableForWrite() >= SerialWriter::wireSize(sizeof(SerialHeader) + sizeof(SerialStatusBody))) {
+                sendStatus(reason, 0);
+            } else {
+                pushesDropped++;
+            }
+        }
+    }
+    pushes = 0;
+    telemetry.sample(TELEMETRY_UPDATE_US, Telemetry::now() - start);
+}
+
+// Shortens wait to ms if that is sooner
+static inline void sooner(unsigned long& wait, unsigned long ms) {
+    if (ms < wait) {
+        wait = ms;
+    }
+}
+
+unsigned long FSM::nextDeadline() const {
+    unsigned long now = millis();
+    if (numStates == 0 && !reloadRequested && reloadStep != RELOAD_CHANGED && reloadStep != RELOAD_READY) {
+        // Nothing loaded, only a reload can change that: the next look at the
+        // config files, or the audio core or a serial command waking the scheduler
+        long untilPoll = (long)(nextPoll - now);
+        if (audio && reloadStep == RELOAD_IDLE) {
+            return untilPoll > 0 ? nextPoll : now;
+        }
+        return now + 0x7FFFFFFFUL;
+    }
+    if (numStates == 0 || skipFlag || resetFlag || reloadRequested ||
+        reloadStep == RELOAD_CHANGED || reloadStep == RELOAD_READY || reloadStep == RELOAD_RETIRE) {
+        return now;
+    }
+
+    // Find the shortest wait, everything below is in ms from now.
+    // Nothing scheduled at all is as far ahead as millis() can still compare.
+    unsigned long wait = 0x7FFFFFFFUL;
+
+    // A new state's audio starts straight away
+    if (audio && audioState != currentState) {
+        wait = 0;
+    }
+
+    // Next look at the config files
+    if (audio && reloadStep == RELOAD_IDLE) {
+        long untilPoll = (long)(nextPoll - now);
+        sooner(wait, untilPoll > 0 ? untilPoll : 0);
+    }
+
+    // The state is evaluated again next tick
+    if (evaluateDue) {
+        wait = 0;
+    }
+
+    // Next TIME_PASSED threshold of the current state or show timer, the ms it comes in
+    uint64_t at;
+    if (timers.nextExpiry(at)) {
+        uint64_t nowUs = timers.extend(time_us_32());
+        sooner(wait, at > nowUs ? (unsigned long)((at - nowUs + 999) / 1000) : 0);
+    }
+
+    // Next debounce sample while an input is part way through a change
+    if (debouncer.settling()) {
+        unsigned long since = now - lastSample;
+        sooner(wait, since < sampleInterval ? sampleInterval - since : 0);
+    }
+
+    // The journal append waiting for the new state's audio to be under way
+    if (journalWaiting) {
+        long untilJournal = (long)(journalAt - now);
+        sooner(wait, untilJournal > 0 ? untilJournal : 0);
+    }
+
+    // Reset button: the long press and the hold fire while it is still held
+    unsigned long gestureAt;
+    if (resetButton.nextEventAt(gestureAt)) {
+        long untilGesture = (long)(gestureAt - now);
+        sooner(wait, untilGesture > 0 ? untilGesture : 0);
+    }
+
+    return now + wait;
+}
+
+uint32_t FSM::nextDeadlineUs() const {
+    // The ms deadline at the us millis() reaches it (millis() is time_us_64() / 1000),
+    // far ones cut short so they fit in the 32-bit us counter
+    uint64_t now = time_us_64();
+    long wait = (long)(nextDeadline() - (unsigned long)(now / 1000));
+    if (wait > (long)(FSM_MAX_WAIT_US / 1000)) {
+        wait = FSM_MAX_WAIT_US / 1000;
+    }
+    uint32_t waitUs = wait > 0 ? (uint32_t)(wait * 1000 - now % 1000) : 0;
+
+    // A timer that is due before that, to the us
+    uint64_t at;
+    if (timers.nextExpiry(at)) {
+        uint64_t nowUs = timers.extend((uint32_t)now);
+        uint64_t untilTimer = at > nowUs ? at - nowUs : 0;
+        if (untilTimer < waitUs) {
+            waitUs = (uint32_t)untilTimer;
+        }
+    }
+    return (uint32_t)now + waitUs;
+}
+
+uint32_t FSM::getInputGpioMask() const {
+    uint32_t mask = 1UL << resetPin;
+    for (uint8_t i = 0; i < numInputs; i++) {
+        mask |= 1UL << inputPins[i];
+    }
+    return mask;
 }
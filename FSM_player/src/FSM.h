@@ -4,86 +4,304 @@
 #include <SdFat.h>
 #include <ArduinoJson.h>
 #include "gpio_utils.h"
+#include "fsm_image.h"
+#include "fsm_program.h"
+#include "debounce.h"
+#include "timer_wheel.h"
+#include "audio_engine.h"
+#include "state_journal.h"
+#include "serial_protocol.h"
 
-// Enumeration for condition types
-enum ConditionType {
-    SENSOR,
-    TIME_PASSED,
-    AUDIO_FINISHED,
-    SKIP_FLAG,
-    RESET_FLAG
-};
+// The SD card, shared by the config loader and the audio stream
+extern SdFat32 sd;
 
+// How often the config files are checked for changes, with an audio engine
+#define FSM_RELOAD_POLL_MS 2000
 
-// Structure to hold condition information
-struct Condition {
-    ConditionType type;   // Type of condition
-    union {
-        struct {                // Data for SENSOR type
-            uint8_t sensorPin;  // Sensor pin related to this condition
-            bool state;         // Desired state of the sensor
-        };
-        unsigned long duration; // Data for TIME_PASSED type
-    };
-};
+// How long a state change waits to go into the journal. The flash write
+// pauses the audio core, which by then has the new state's audio streaming
+// rather than still on its way from the card. Changes that come quicker are
+// written together once they stop.
+#define FSM_JOURNAL_DELAY_MS 250
 
-// Structure to hold transition information
-struct Transition {
-    uint8_t targetState;        // Target state ID
-    Condition* conditions;      // Array of conditions
-    uint8_t numConditions;      // Number of conditions
-};
-
-// Structure to hold state information
-struct State {
-    uint8_t id;                 // Unique state ID
-    String audioFile;           // Audio file to be played in this state
-    bool repeat;                // Repeat behavior of the audio file
-    uint8_t blinkCount;         // LED blink count
-    Transition* transitions;    // Array of possible transitions
-    uint8_t numTransitions;     // Number of transitions
-};
+// The wheel's timer for the current state's next time threshold, after the show timers
+#define FSM_STATE_TIMER FSM_MAX_TIMERS
+static_assert(FSM_STATE_TIMER < TIMER_WHEEL_TIMERS, "the state timer needs a timer of its own");
 
 class FSM {
     public:
         FSM(); //AudioSourceSDFAT& source_in);  // Constructor
+        ~FSM();
 
         // Initializes the FSM
         void begin();
 
-        // Loads the JSON configuration from the SD card
+        // Loads the configuration from the SD card, either a precompiled
+        // /FSM_Config.bin image or /FSM_Config.json compiled on the spot. The
+        // compiled table is kept in the flash cache (see FlashCache) and taken
+        // from there while the config files on the card are unchanged.
         void loadConfiguration();
 
-        // Checks the state of the sensor switches
-        void checkSwitches(uint8_t sensorPins[8], bool sensorStates[8]);
+        // Goes on from the journal's last record, after begin(): its state and
+        // variables, with the time in the state counted from now. False (and
+        // state 0 as begin() left it) if there is none or it was written for
+        // another state table.
+        bool resume(const StateJournal& from);
+
+        // Journal every state change is appended to, none by default
+        void setJournal(StateJournal* to) { journal = to; }
 
-        // Checks the state of the reset switch
+        // Uses a state table that is in memory for good, in place: the
+        // fsm_builtin table in FSM_BUILTIN_CONFIG builds (loadConfiguration()
+        // does that), or one a test put together. It must be a checked image.
+        void useBuiltin(const uint8_t* table);
+
+        // Prints the loaded state table to serial
+        void printConfiguration();
+
+        // Indexes the audio folders of the states (see AudioIndex), each with
+        // the select mode of the first state that plays it. Call after
+        // loadConfiguration(), before the audio core takes the card. quick
+        // (resuming after a power cut) takes the index on the card as it is
+        // if it is the one the flash cache says was last checked, without
+        // walking the folders.
+        void indexAudio(AudioIndex& index, bool quick = false);
+
+        // Reports the states' audio files that are fragmented on the card and
+        // so can't be read with raw sector reads, folders from the index. With
+        // a /FSM_Repack file on the card they are rewritten in one piece, the
+        // index updated and /FSM_Repack removed. Call after indexAudio().
+        void checkAudioFiles(AudioIndex& index);
+
+        // Samples and debounces all inputs in one snapshot
+        void checkSwitches();
+
+        // Turns reset button presses into skip (short press), reset (long press)
+        // and reload (held on for twice the long press time)
         void checkResetSwitch();
 
+        // Takes commands typed on the serial monitor ("reload", "telemetry")
+        // and the binary messages of a show controller (serial_protocol.h)
+        void checkSerial();
+
+        // Goes to state straight away, as a transition to it would, without
+        // actions. False if the config has no such state.
+        bool setState(uint8_t state);
+
+        // Holds a sensor input at a level (SerialLevel) in place of its pin, a
+        // virtual sensor event: it counts as a change from the next tick, edges,
+        // holds and counters included. SERIAL_LEVEL_RELEASE hands it back to
+        // the pin. False if the config has no such input.
+        bool holdInput(uint8_t input, uint8_t level);
+
+        // Loads the configuration again without a reboot. It is read and
+        // compiled while the FSM and audio keep running and swapped in between
+        // two ticks: the current state stays if the new config still has it,
+        // with its time in it, otherwise the FSM goes to state 0; its audio
+        // plays on if the state still plays the same file the same way. A bad
+        // config is reported and the running one stays. With an audio engine
+        // the config files are also checked for changes every FSM_RELOAD_POLL_MS
+        // and reloaded when they changed.
+        void requestReload() { reloadRequested = true; }
+
+        // True once after a reload was swapped in. The inputs may be others,
+        // the scheduler has to watch getInputGpioMask() again.
+        bool takeReloaded();
+
+        // Reloads swapped in, and reloads that failed (the config was kept)
+        uint16_t getReloads() const { return reloads; }
+        uint16_t getReloadFailures() const { return reloadFailures; }
+
         // Handles state transitions
-        void changeState(bool sensorStates[8]);
+        void changeState();
 
-        // Plays the audio for the current state
-        //void playAudio(AudioPlayer& player);
+        // Starts the current state's audio after a state change and picks up audio events
+        void playAudio();
 
-        // Blinks the LED for the current state
-        void blinkLED();
+        // Audio engine that plays each state's audioFile, none by default
+        void setAudio(AudioEngine* engine) { audio = engine; }
+
+        // Counts the current state's audio as played through, as the audio
+        // engine's finished event does. For a run without an audio engine,
+        // tools/fsm_replay.cpp plays the audio in virtual time this way.
+        void finishAudio();
+
+        // Output underruns reported by the audio engine
+        uint32_t getAudioUnderruns() const { return audioUnderruns; }
 
         // Update the FSM
-        void update(uint8_t sensorPins[8], bool sensorStates[8]); //AudioPlayer& player, 
+        void update();
+
+        // Earliest millis() at which update() has something to do again: a
+        // TIME_PASSED threshold, the next debounce sample while an input is
+        // settling, the reset button's long press or starting a state's audio
+        // (the LEDs run off their own alarm, see LedSequencer). Input
+        // edges and audio events come on top of this, the scheduler wakes up for those.
+        unsigned long nextDeadline() const;
+
+        // The same as a time_us_32() timestamp, at the microsecond a TIME_PASSED
+        // threshold or a show timer is due rather than the millisecond after
+        uint32_t nextDeadlineUs() const;
+
+        // GPIOs an edge on which must wake the FSM: the inputs and the reset button
+        uint32_t getInputGpioMask() const;
+
+        // The state table in use, a checked image (fsm_image.h), nullptr with no config loaded
+        const uint8_t* getTable() const { return (const uint8_t*)header; }
+
+        // Current state ID and number of loaded states
+        uint8_t getCurrentState() const { return currentState; }
+        uint8_t getNumStates() const { return numStates; }
+
+        // Sensor levels from the last snapshot (bit n = input n) and the bits
+        // that changed since the snapshot before it
+        uint32_t getInputs() const { return inputs; }
+        uint32_t getInputsChanged() const { return inputsChanged; }
+
+        // A variable of the condition programs
+        int32_t getVar(uint8_t var) const { return vars[var]; }
+
+        // The show timers and the state timer
+        const TimerWheel& getTimers() const { return timers; }
+
+        // Audio file of a state, "" if none
+        const char* getAudioFile(uint8_t state) const { return strings + states[state].audioFile; }
 
     private:
-        State* states;                  // Array of states
+        // Steps of a reload with an audio engine
+        enum ReloadStep : uint8_t {
+            RELOAD_IDLE,        // until the next check of the files is due
+            RELOAD_STAT,        // asked the audio core for the files' signature
+            RELOAD_CHANGED,     // they changed (or a reload was asked for), load them next
+            RELOAD_LOADING,     // the audio core is reading them
+            RELOAD_READY,       // pendingImage goes in at the start of the next tick
+            RELOAD_RETIRE,      // swapped, sync with the audio core next
+            RELOAD_RETIRING     // retired is freed when the sync comes back
+        };
+
+        // First transition of the current state whose conditions hold, end of
+        // its transitions if none; lowers timeout to its next time threshold
+        // (ms in the state).
+        // Built for the FSM_USES_* kinds of conditions in Uses, only those are tested.
+        template <uint8_t Uses>
+        const Transition* firstTransition(unsigned long elapsed, uint8_t events, unsigned long& timeout);
+        typedef const Transition* (FSM::*Evaluator)(unsigned long elapsed, uint8_t events, unsigned long& timeout);
+
+        // The evaluator for a table with these FSM_USES_* bits
+        static Evaluator evaluatorFor(uint8_t uses);
+
+        // Points the state table at a checked image, takes ownership
+        void useImage(uint8_t* newImage);
+
+        // Points the state table at a checked image, without taking it
+        void viewImage(const uint8_t* table);
+
+        // Sets up the input pins, the debouncer and the reset button from the image
+        void beginInputs();
+
+        // Moves a reload on by a step, at the start of a tick
+        void checkReload();
+
+        // Replies of the audio core to the reload's requests
+        void reloadEvent(const AudioEvent& event);
+
+        // Puts a new image in place of the running one (kept in retired),
+        // carrying over the state, its time and its audio where they still fit
+        void swapImage(uint8_t* newImage);
+
+        // Counts a reload that was swapped in and reports it
+        void reloadDone();
+
+        // Asks the audio engine to cache the audio of the states this one can go to
+        void prefetchTargets();
+
+        // Picks the configured inputs out of a GPIO snapshot, bit n = input n
+        uint32_t packInputs(uint32_t gpio) const;
+
+        // Enters a state: what every way into one has in common
+        void enterState(uint8_t state);
+
+        // Carries out a binary command and answers it
+        void handleMessage(const uint8_t* message, uint8_t length);
+
+        // Sends a SERIAL_STATUS, seq 0 for a push
+        void sendStatus(uint8_t reason, uint8_t seq);
+
+        uint8_t* image;                 // Compiled state table, one allocation holding everything below, nullptr for a built-in one
+        const FsmImageHeader* header;   // Of the table in use, image or built-in
+        Evaluator evaluate;             // firstTransition for what the table uses
+        const State* states;            // Array of states
+        const Transition* transitions;  // All transitions, states index into this
+        const Condition* conditions;    // All conditions, transitions index into this
+        const uint8_t* code;            // Code pool of the condition programs
+        const char* strings;            // String pool for audio file paths
         uint8_t numStates;              // Number of states
+        const uint8_t* inputPins;       // GPIO of each sensor input
+        uint8_t numInputs;              // Number of sensor inputs
+        int8_t inputShift;              // First GPIO if the inputs are consecutive GPIOs, -1 otherwise
+        uint32_t inputMask;             // One bit per input
         uint8_t currentState;           // Current state ID
         unsigned long lastStateChange;  // Timestamp of the last state change
-        unsigned long buttonPressStart;  // Timestamp of the last button press
-        bool buttonPressEvent;          // Flag for button press event
-        String currentAudioFile;        // Current audio file
+        uint64_t stateEntryUs;          // The same in wheel time, what TIME_PASSED counts from
+
+        Debouncer debouncer;            // Debounces the sensors and the reset button together
+        uint32_t gpioMask;              // Their GPIOs: the LEDs, I2S and SD card pins toggle, they'd never settle
+        ButtonGesture resetButton;      // Short/long press detection for the reset button
+        unsigned long lastSample;       // Timestamp of the last debouncer sample
+        uint16_t sampleInterval;        // ms between debouncer samples
+        uint32_t gpioFell;              // Debounced GPIO edges of the last sample (0 between samples)
+        uint32_t gpioRose;
+
+        uint32_t inputs;                // Sensor levels packed into one word, bit n = input n
+        uint32_t heldMask;              // Inputs held by holdInput(), they don't follow their pins
+        uint32_t heldLevels;            // The levels they are held at
+        uint32_t inputsChanged;         // Bits of inputs that changed at the last snapshot
+        TimerWheel timers;              // Show timers 0 to FSM_MAX_TIMERS - 1, then FSM_STATE_TIMER
+        bool evaluateDue;               // A timer ran out or the state or table changed, evaluate at the next tick
+
+        // What the condition programs look at besides the inputs
+        unsigned long inputSince[FSM_MAX_INPUTS];   // millis() of each input's last change
+        uint16_t rises[FSM_MAX_INPUTS];             // Edges of each input since the state was entered
+        uint16_t falls[FSM_MAX_INPUTS];
+        int32_t vars[FSM_MAX_VARS];                 // Set by transition actions
 
         bool skipFlag;                  // Flag to skip the current state
         bool resetFlag;                 // Flag to reset the FSM
-        //AudioSourceSDFAT& source;       // Audio source
+        uint8_t lastEvents;             // Lasting EVENT_* bits at the last evaluation
+
+        AudioEngine* audio;             // Audio output, nullptr for none
+        uint8_t audioState;             // State whose audio was started last, 0xFF for none
+        uint16_t audioFadeOut;          // That state's fadeOut, what the audio playing fades out over
+        uint16_t audioSeq;              // Number of that play, events about older plays are ignored
+        bool audioDone;                 // The current state's audio has played through once
+        unsigned long audioStart;       // millis() when that play was started
+        uint32_t audioUnderruns;
+
+        uint8_t ledState;               // State whose blinkCount the state LED plays, 0xFF for none
+
+        StateJournal* journal;          // Where state changes are appended, nullptr for none
+        bool journalDue;                // The state or the variables changed this tick
+        bool journalWaiting;            // Changed and not appended yet
+        unsigned long journalAt;        // millis() the append is due, FSM_JOURNAL_DELAY_MS after the last change
+
+        ReloadStep reloadStep;
+        bool reloadRequested;           // Reload even if the files didn't change
+        uint32_t configSignature;       // sd_files_signature() of the config files when they were last read
+        unsigned long nextPoll;         // When the files are next checked
+        uint8_t* pendingImage;          // Compiled, waiting for the next tick
+        uint8_t* retired;               // The image before, until the audio core is done with it
+        uint16_t syncSeq;
+        bool reloaded;                  // See takeReloaded()
+        uint16_t reloads;
+        uint16_t reloadFailures;
+        char serialLine[16];            // Serial command being typed
+        uint8_t serialLength;
+        SerialReader serialReader;      // Binary messages between the text
+        bool subscribed;                // Status pushes asked for
+        uint8_t pushes;                 // Bit per SerialReason to push at the end of the tick
+        uint16_t pushesDropped;         // Pushes the transmit buffer had no room for
+
+        uint32_t inputEdgeUs;           // Telemetry::now() at the first sample of the last input change
 };
 
 #endif  // FINITE_STATE_MACHINE_H
@@ -0,0 +1,132 @@
+#include <string.h>
+#include "adpcm.h"
+
+// Step sizes of the IMA standard
+static const int16_t adpcm_steps[ADPCM_MAX_INDEX + 1] = {
+    7, 8, 9, 10, 11, 12, 13, 14, 16, 17, 19, 21, 23, 25, 28, 31, 34, 37, 41, 45,
+    50, 55, 60, 66, 73, 80, 88, 97, 107, 118, 130, 143, 157, 173, 190, 209, 230,
+    253, 279, 307, 337, 371, 408, 449, 494, 544, 598, 658, 724, 796, 876, 963,
+    1060, 1166, 1282, 1411, 1552, 1707, 1878, 2066, 2272, 2499, 2749, 3024, 3327,
+    3660, 4026, 4428, 4871, 5358, 5894, 6484, 7132, 7845, 8630, 9493, 10442, 11487,
+    12635, 13899, 15289, 16818, 18500, 20350, 22385, 24623, 27086, 29794, 32767
+};
+
+// Step index change per nibble magnitude
+static const int8_t adpcm_index_change[8] = {-1, -1, -1, -1, 2, 4, 6, 8};
+
+// The difference a nibble's magnitude stands for at each step index, the
+// shifts and adds of the standard worked out once at compile time, so
+// decoding a nibble is a table lookup instead of up to three branches
+struct AdpcmTables {
+    uint16_t difference[ADPCM_MAX_INDEX + 1][8];
+    uint8_t nextIndex[ADPCM_MAX_INDEX + 1][8];
+};
+
+static constexpr AdpcmTables make_adpcm_tables() {
+    AdpcmTables tables = {};
+    for (int index = 0; index <= ADPCM_MAX_INDEX; index++) {
+        int32_t step = adpcm_steps[index];
+        for (int magnitude = 0; magnitude < 8; magnitude++) {
+            int32_t difference = step >> 3;
+            if (magnitude & 4) {
+                difference += step;
+            }
+            if (magnitude & 2) {
+                difference += step >> 1;
+            }
+            if (magnitude & 1) {
+                difference += step >> 2;
+            }
+            int next = index + adpcm_index_change[magnitude];
+            tables.difference[index][magnitude] = (uint16_t)difference;
+            tables.nextIndex[index][magnitude] = (uint8_t)(next < 0 ? 0 : next > ADPCM_MAX_INDEX ? ADPCM_MAX_INDEX : next);
+        }
+    }
+    return tables;
+}
+
+static constexpr AdpcmTables adpcm_tables = make_adpcm_tables();
+
+static inline int16_t adpcm_decode_nibble(AdpcmChannel& channel, uint8_t nibble) {
+    int32_t difference = adpcm_tables.difference[channel.index][nibble & 7];
+    int32_t sample = channel.predictor + ((nibble & 8) ? -difference : difference);
+    sample = sample > 32767 ? 32767 : sample < -32768 ? -32768 : sample;
+    channel.predictor = (int16_t)sample;
+    channel.index = adpcm_tables.nextIndex[channel.index][nibble & 7];
+    return channel.predictor;
+}
+
+uint16_t adpcm_block_align(uint32_t sampleRate, uint16_t channels) {
+    uint16_t perChannel = 256;
+    for (uint32_t rate = 11025; rate < sampleRate && perChannel < 1024; rate *= 2) {
+        perChannel *= 2;
+    }
+    return perChannel * channels;
+}
+
+int16_t adpcm_begin_block(AdpcmChannel& channel, const uint8_t* header) {
+    channel.predictor = (int16_t)(header[0] | (header[1] << 8));
+    channel.index = header[2] > ADPCM_MAX_INDEX ? ADPCM_MAX_INDEX : header[2];
+    return channel.predictor;
+}
+
+void adpcm_decode_word(AdpcmChannel& channel, const uint8_t* word, uint8_t first, uint8_t count, int16_t* out, size_t stride) {
+    for (uint8_t i = first; i < first + count; i++) {
+        uint8_t byte = word[i >> 1];
+        *out = adpcm_decode_nibble(channel, (i & 1) ? byte >> 4 : byte & 0x0F);
+        out += stride;
+    }
+}
+
+// The nibble closest to difference at the channel's step, the way the
+// decoder will turn it back into a sample
+static uint8_t adpcm_encode_nibble(AdpcmChannel& channel, int16_t sample) {
+    int32_t step = adpcm_steps[channel.index];
+    int32_t difference = sample - channel.predictor;
+    uint8_t nibble = 0;
+    if (difference < 0) {
+        nibble = 8;
+        difference = -difference;
+    }
+    if (difference >= step) {
+        nibble |= 4;
+        difference -= step;
+    }
+    if (difference >= step >> 1) {
+        nibble |= 2;
+        difference -= step >> 1;
+    }
+    if (difference >= step >> 2) {
+        nibble |= 1;
+    }
+    adpcm_decode_nibble(channel, nibble);
+    return nibble;
+}
+
+size_t adpcm_encode_block(AdpcmChannel* state, uint16_t channels, const int16_t* in, size_t frames, uint8_t* out) {
+    uint8_t* start = out;
+
+    // Header: the first sample as it is, and where the step index got to
+    for (uint16_t c = 0; c < channels; c++) {
+        state[c].predictor = in[c];
+        out[0] = (uint8_t)in[c];
+        out[1] = (uint8_t)((uint16_t)in[c] >> 8);
+        out[2] = state[c].index;
+        out[3] = 0;
+        out += 4;
+    }
+
+    // Then 8 samples per channel and word
+    for (size_t frame = 1; frame < frames; frame += 8) {
+        for (uint16_t c = 0; c < channels; c++) {
+            memset(out, 0, 4);
+            for (uint8_t i = 0; i < 8; i++) {
+                size_t from = frame + i < frames ? frame + i : frames - 1;
+                uint8_t nibble = adpcm_encode_nibble(state[c], in[from * channels + c]);
+                out[i >> 1] |= (i & 1) ? nibble << 4 : nibble;
+            }
+            out += 4;
+        }
+    }
+    return out - start;
+}
@@ -0,0 +1,49 @@
+#ifndef ADPCM_H
+#define ADPCM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// IMA-ADPCM as stored in .wav files (format tag 0x11): 4 bits per sample,
+// a quarter of the card bandwidth and space of 16-bit PCM.
+//
+// The data is a series of blocks of blockAlign bytes. A block starts with a
+// 4-byte header per channel (first sample, step index, a zero byte), then
+// 4-byte words, one per channel in turn, each holding that channel's next 8
+// samples, low nibble first. Everything in a block is in units of
+// 4 * channels bytes, the first unit of a block being the headers, so a
+// decoder can work through the data a unit at a time without holding a
+// whole block. A block has (blockAlign / (4 * channels) - 1) * 8 + 1 samples
+// per channel; the last block of a file may be shorter.
+#define ADPCM_MAX_INDEX 88
+
+// Decoder (and encoder) state of one channel
+struct AdpcmChannel {
+    int16_t predictor;          // Last sample
+    uint8_t index;              // Into the step table
+};
+
+// Samples per channel in a block of blockAlign bytes
+inline uint16_t adpcm_samples_per_block(uint16_t blockAlign, uint16_t channels) {
+    return (blockAlign / (4 * channels) - 1) * 8 + 1;
+}
+
+// Block size the encoder uses for a sample rate, as the usual encoders do:
+// 256 bytes per channel up to 11 kHz, doubling with the rate
+uint16_t adpcm_block_align(uint32_t sampleRate, uint16_t channels);
+
+// Starts a block: reads a channel's 4-byte header, returns its first sample
+int16_t adpcm_begin_block(AdpcmChannel& channel, const uint8_t* header);
+
+// Decodes samples first..first+count-1 (of 8) of a channel's 4-byte word
+// into out, stride samples apart. Table-driven: each nibble is one lookup of
+// the step difference and one of the next step index.
+void adpcm_decode_word(AdpcmChannel& channel, const uint8_t* word, uint8_t first, uint8_t count, int16_t* out, size_t stride);
+
+// Encodes one block of interleaved 16-bit samples, frames of them
+// (1 to adpcm_samples_per_block()), into out. The last word is padded with
+// the last sample. Each channel's step index carries over from block to
+// block through state. Returns the bytes written, header included.
+size_t adpcm_encode_block(AdpcmChannel* state, uint16_t channels, const int16_t* in, size_t frames, uint8_t* out);
+
+#endif // ADPCM_H
@@ -0,0 +1,375 @@
+#include <string.h>
+#include <math.h>
+#include "audio_convert.h"
+
+// Two 16-bit samples in one 32-bit word, little-endian: the first sample in
+// the low half. may_alias lets the kernels read int16_t buffers through it.
+typedef uint32_t __attribute__((may_alias)) pcm_word;
+
+static inline int16_t clamp16(int32_t x) {
+    return x > 32767 ? 32767 : x < -32768 ? -32768 : (int16_t)x;
+}
+
+static inline uint32_t xorshift32(uint32_t& x) {
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return x;
+}
+
+// A 32-bit sample to 16 bits with TPDF dither and rounding:
+// floor((x + r1 + r2 - 65536 + 32768) / 65536), worked out on the halves of x
+// so nothing overflows
+static inline int16_t dither16(int32_t x, uint32_t& dither) {
+    uint32_t r = xorshift32(dither);
+    uint32_t t = ((uint32_t)x & 0xFFFF) + (r & 0xFFFF) + (r >> 16) + 0x8000;
+    return clamp16((x >> 16) + (int32_t)(t >> 16) - 1);
+}
+
+void pcm_downmix16(const int16_t* in, int16_t* out, size_t frames) {
+    // Two frames in, two mono samples out, per pair of word loads and one
+    // word store. Writing out never overtakes reading in, so in place works.
+    if ((((uintptr_t)in | (uintptr_t)out) & 3) == 0) {
+        const pcm_word* src = (const pcm_word*)in;
+        pcm_word* dst = (pcm_word*)out;
+        for (size_t i = 0; i + 2 <= frames; i += 2) {
+            uint32_t a = src[0];
+            uint32_t b = src[1];
+            int32_t m0 = ((int32_t)(a << 16) >> 16) + ((int32_t)a >> 16);
+            int32_t m1 = ((int32_t)(b << 16) >> 16) + ((int32_t)b >> 16);
+            *dst++ = ((uint32_t)(m0 >> 1) & 0xFFFF) | ((uint32_t)(m1 >> 1) << 16);
+            src += 2;
+        }
+        size_t done = frames & ~(size_t)1;
+        in += done * 2;
+        out += done;
+        frames -= done;
+    }
+    for (size_t i = 0; i < frames; i++) {
+        out[i] = (int16_t)(((int32_t)in[2 * i] + in[2 * i + 1]) >> 1);
+    }
+}
+
+void pcm_8_to_16(const uint8_t* in, int16_t* out, size_t samples) {
+    for (size_t i = 0; i < samples; i++) {
+        out[i] = (int16_t)(((int32_t)in[i] - 128) << 8);
+    }
+}
+
+void pcm_24_to_16(const uint8_t* in, int16_t* out, size_t samples, uint32_t& dither) {
+    // Byte loads, a 24-bit sample is rarely word aligned. It goes into the
+    // top of a 32-bit word and on through the same rounding as 32-bit.
+    for (size_t i = 0; i < samples; i++, in += 3) {
+        int32_t x = (int32_t)(((uint32_t)in[0] << 8) | ((uint32_t)in[1] << 16) | ((uint32_t)in[2] << 24));
+        out[i] = dither16(x, dither);
+    }
+}
+
+void pcm_32_to_16(const uint8_t* in, int16_t* out, size_t samples, uint32_t& dither) {
+    for (size_t i = 0; i < samples; i++, in += 4) {
+        int32_t x = (int32_t)((uint32_t)in[0] | ((uint32_t)in[1] << 8) | ((uint32_t)in[2] << 16) | ((uint32_t)in[3] << 24));
+        out[i] = dither16(x, dither);
+    }
+}
+
+Resampler::Resampler() : step(0), fraction(0), pending(1), channels(1), position(0), designedStep(0) {
+}
+
+void Resampler::begin(uint32_t inRate, uint32_t outRate, uint16_t channels_) {
+    channels = channels_;
+    step = ((uint64_t)inRate << 32) / outRate;
+
+    // The table only changes with the rates, files usually share them
+    if (step != designedStep) {
+        design(inRate > outRate ? 0.9f * outRate / inRate : 0.9f);
+        designedStep = step;
+    }
+    reset();
+}
+
+void Resampler::reset() {
+    fraction = 0;
+    pending = 1;
+    position = 0;
+    memset(history, 0, sizeof(history));
+}
+
+void Resampler::design(float cutoff) {
+    const float pi = 3.14159265f;
+    const float half = AUDIO_RESAMPLE_TAPS / 2;
+
+    for (uint16_t phase = 0; phase < AUDIO_RESAMPLE_PHASES; phase++) {
+        // Tap k is the input frame (AUDIO_RESAMPLE_TAPS - 1 - k) before the
+        // newest one, the output sits half the filter back from the newest
+        // one plus the phase's fraction
+        float h[AUDIO_RESAMPLE_TAPS];
+        float sum = 0;
+        for (uint8_t k = 0; k < AUDIO_RESAMPLE_TAPS; k++) {
+            float x = (float)phase / AUDIO_RESAMPLE_PHASES + (half - 1) - k;
+            float sinc = x == 0 ? 1.0f : sinf(pi * cutoff * x) / (pi * cutoff * x);
+            float window = 0.42f + 0.5f * cosf(pi * x / half) + 0.08f * cosf(2 * pi * x / half);
+            h[k] = x <= -half || x >= half ? 0 : sinc * window;
+            sum += h[k];
+        }
+
+        // Rows add up to exactly 1.0 in Q15 so a constant level stays the
+        // same whatever the phase; the rounding goes to the largest tap
+        int32_t total = 0;
+        uint8_t largest = 0;
+        for (uint8_t k = 0; k < AUDIO_RESAMPLE_TAPS; k++) {
+            coefficients[phase][k] = (int16_t)lroundf(h[k] / sum * 32768);
+            total += coefficients[phase][k];
+            if (coefficients[phase][k] > coefficients[phase][largest]) {
+                largest = k;
+            }
+        }
+        coefficients[phase][largest] += 32768 - total;
+    }
+}
+
+uint32_t Resampler::groupSize(uint32_t from) const {
+    uint32_t size = 1;
+    for (uint64_t next = (uint64_t)from + step; next < (1ULL << 32); next += step) {
+        size++;
+    }
+    return size;
+}
+
+uint32_t Resampler::inputFor(size_t outFrames) const {
+    // The same walk as process(), a group of outputs at a time
+    uint32_t at = fraction;
+    uint32_t take = pending;
+    uint32_t frames = 0;
+    size_t produced = 0;
+    while (true) {
+        uint32_t size = take > 0 ? groupSize(at) : 1;
+        if (produced + size > outFrames) {
+            return frames;
+        }
+        frames += take;
+        produced += size;
+        uint64_t next = (uint64_t)at + size * step;
+        at = (uint32_t)next;
+        take = (uint32_t)(next >> 32);
+    }
+}
+
+size_t Resampler::process(const int16_t* in, size_t inFrames, int16_t* out, size_t outFrames, size_t& inUsed) {
+    size_t produced = 0;
+    size_t used = 0;
+
+    while (produced < outFrames) {
+        // Take the input frames up to this output's position, if all the
+        // outputs that end on the newest of them fit
+        if (pending > 0 && produced + groupSize(fraction) > outFrames) {
+            break;
+        }
+        while (pending > 0) {
+            if (used == inFrames) {
+                inUsed = used;
+                return produced;
+            }
+            for (uint16_t c = 0; c < channels; c++) {
+                int16_t sample = in[used * channels + c];
+                history[c][position] = sample;
+                history[c][position + AUDIO_RESAMPLE_TAPS] = sample;
+            }
+            position = (position + 1) % AUDIO_RESAMPLE_TAPS;
+            used++;
+            pending--;
+        }
+
+        // One row of the table over the last AUDIO_RESAMPLE_TAPS frames, oldest first
+        const int16_t* row = coefficients[fraction >> (32 - AUDIO_RESAMPLE_PHASE_BITS)];
+        for (uint16_t c = 0; c < channels; c++) {
+            const int16_t* window = history[c] + position;
+            int32_t acc = 1 << 14;
+            for (uint8_t k = 0; k < AUDIO_RESAMPLE_TAPS; k++) {
+                acc += (int32_t)row[k] * window[k];
+            }
+            out[produced * channels + c] = clamp16(acc >> 15);
+        }
+        produced++;
+
+        uint64_t next = (uint64_t)fraction + step;
+        fraction = (uint32_t)next;
+        pending = (uint32_t)(next >> 32);
+    }
+    inUsed = used;
+    return produced;
+}
+
+AudioConverter::AudioConverter()
+    : unit(2), outChannels(1), passThrough(true), resample(false), dither(AUDIO_DITHER_SEED), adpcmOffset(0),
+      blockOffset(0), nibble(0) {
+    memset(&format, 0, sizeof(format));
+}
+
+bool AudioConverter::begin(const WavFormat& in, uint32_t outRate, bool mono, WavFormat& out) {
+    bool adpcmFile = in.formatTag == WAV_FORMAT_IMA_ADPCM;
+    uint16_t bits = in.bitsPerSample;
+    if (in.channels < 1 || in.channels > 2 ||
+        (!adpcmFile && bits != 8 && bits != 16 && bits != 24 && bits != 32)) {
+        return false;
+    }
+    format = in;
+    unit = adpcmFile ? 4 * in.channels : in.blockAlign;
+    outChannels = mono ? 1 : in.channels;
+    uint32_t rate = outRate ? outRate : in.sampleRate;
+    resample = rate != in.sampleRate;
+    passThrough = !adpcmFile && bits == 16 && outChannels == in.channels && !resample;
+    dither = AUDIO_DITHER_SEED;
+    adpcmOffset = 0;
+    blockOffset = 0;
+    nibble = 0;
+    if (resample) {
+        resampler.begin(in.sampleRate, rate, outChannels);
+    }
+
+    // Frames in the file: whole blocks and the rest of a short last one for IMA-ADPCM
+    uint32_t frames = in.dataSize / in.blockAlign;
+    if (adpcmFile) {
+        uint32_t rest = in.dataSize % in.blockAlign;
+        frames = frames * adpcm_samples_per_block(in.blockAlign, in.channels) + (rest ? (rest / unit - 1) * 8 + 1 : 0);
+    }
+    out.formatTag = WAV_FORMAT_PCM;
+    out.channels = outChannels;
+    out.bitsPerSample = 16;
+    out.blockAlign = outChannels * 2;
+    out.sampleRate = rate;
+    out.dataOffset = 0;
+    out.dataSize = (uint32_t)((uint64_t)frames * rate / in.sampleRate) * out.blockAlign;
+    return true;
+}
+
+void AudioConverter::decode(const uint8_t* in, int16_t* out, size_t frames) {
+    size_t samples = frames * format.channels;
+    switch (format.bitsPerSample) {
+        case 8:
+            pcm_8_to_16(in, out, samples);
+            break;
+        case 16:
+            // Only reached to mix down, which reads the file's samples directly
+            pcm_downmix16((const int16_t*)in, out, frames);
+            return;
+        case 24:
+            pcm_24_to_16(in, out, samples, dither);
+            break;
+        default:
+            pcm_32_to_16(in, out, samples, dither);
+            break;
+    }
+    if (outChannels < format.channels) {
+        pcm_downmix16(out, out, frames);
+    }
+}
+
+size_t AudioConverter::decodeAdpcm(const uint8_t* in, size_t units, int16_t* out, size_t maxFrames, size_t& unitsUsed) {
+    uint16_t channels = format.channels;
+    size_t frames = 0;
+    size_t used = 0;
+    while (used < units && frames < maxFrames) {
+        const uint8_t* p = in + used * unit;
+        if (blockOffset == 0) {
+            // The headers, with the block's first sample of each channel
+            for (uint16_t c = 0; c < channels; c++) {
+                out[frames * channels + c] = adpcm_begin_block(adpcm[c], p + 4 * c);
+            }
+            frames++;
+        } else {
+            // The next samples of each channel's word, as many as fit
+            uint8_t count = 8 - nibble;
+            if (count > maxFrames - frames) {
+                count = maxFrames - frames;
+            }
+            for (uint16_t c = 0; c < channels; c++) {
+                adpcm_decode_word(adpcm[c], p + 4 * c, nibble, count, out + frames * channels + c, channels);
+            }
+            frames += count;
+            nibble += count;
+            if (nibble < 8) {
+                break;
+            }
+            nibble = 0;
+        }
+        used++;
+
+        // The end of a block, or of the data when the file loops, starts a new block
+        blockOffset += unit;
+        adpcmOffset += unit;
+        if (adpcmOffset >= format.dataSize) {
+            adpcmOffset = 0;
+            blockOffset = 0;
+        } else if (blockOffset >= format.blockAlign) {
+            blockOffset = 0;
+        }
+    }
+    unitsUsed = used;
+    return frames;
+}
+
+size_t AudioConverter::convert(const uint8_t* in, size_t inBytes, int16_t* out, size_t outFrames, size_t& inUsed) {
+    size_t inUnits = inBytes / unit;
+    bool adpcmFile = format.formatTag == WAV_FORMAT_IMA_ADPCM;
+
+    // Same rate: straight from the file's samples into out
+    if (!resample) {
+        size_t frames;
+        size_t units;
+        if (adpcmFile) {
+            frames = decodeAdpcm(in, inUnits, out, outFrames, units);
+            if (outChannels < format.channels) {
+                pcm_downmix16(out, out, frames);
+            }
+        } else {
+            frames = inUnits < outFrames ? inUnits : outFrames;
+            units = frames;
+            decode(in, out, frames);
+        }
+        inUsed = units * unit;
+        return frames;
+    }
+
+    // 16-bit frames of the right channel count go into the resampler as
+    // they are, anything else is decoded into work a piece at a time. Only
+    // the input the outputs need is decoded, so none is left over.
+    bool direct = !adpcmFile && format.bitsPerSample == 16 && outChannels == format.channels;
+    size_t produced = 0;
+    size_t taken = 0;
+    while (produced < outFrames && taken < inUnits) {
+        size_t want = resampler.inputFor(outFrames - produced);
+        const uint8_t* from = in + taken * unit;
+        const int16_t* source = work;
+        size_t frames;
+        size_t units;
+        if (direct) {
+            frames = want < inUnits - taken ? want : inUnits - taken;
+            units = frames;
+            source = (const int16_t*)from;
+        } else {
+            if (want > AUDIO_CONVERT_FRAMES) {
+                want = AUDIO_CONVERT_FRAMES;
+            }
+            if (adpcmFile) {
+                frames = decodeAdpcm(from, inUnits - taken, work, want, units);
+                if (outChannels < format.channels) {
+                    pcm_downmix16(work, work, frames);
+                }
+            } else {
+                frames = want < inUnits - taken ? want : inUnits - taken;
+                units = frames;
+                decode(from, work, frames);
+            }
+        }
+        size_t used;
+        size_t made = resampler.process(source, frames, out + produced * outChannels, outFrames - produced, used);
+        produced += made;
+        taken += units;
+        if (made == 0 && frames == 0) {
+            // Not enough room left for the outputs of the next input frame
+            break;
+        }
+    }
+    inUsed = taken * unit;
+    return produced;
+}
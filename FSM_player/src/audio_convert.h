@@ -0,0 +1,143 @@
+#ifndef AUDIO_CONVERT_H
+#define AUDIO_CONVERT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "wav.h"
+#include "adpcm.h"
+
+// Format conversion between the samples of a .wav file and what the output
+// plays: 8, 24 and 32-bit PCM and IMA-ADPCM to 16-bit, stereo to mono, and
+// any sample rate to the output rate. The kernels work on the bytes in AudioStream's ring as
+// they are, so a file needs no conversion before it goes on the card.
+//
+// The Cortex-M0+ has no SIMD instructions, the kernels get their speed from
+// handling two 16-bit samples per 32-bit load or store where the data is
+// word aligned, and from keeping everything in integers.
+
+// Filter length and number of phases of the resampler. 8 taps per output
+// sample and channel keep 44.1 kHz stereo at a few percent of core1.
+#define AUDIO_RESAMPLE_TAPS        8
+#define AUDIO_RESAMPLE_PHASE_BITS  6
+#define AUDIO_RESAMPLE_PHASES      (1 << AUDIO_RESAMPLE_PHASE_BITS)
+
+// Frames a converter works on at a time
+#define AUDIO_CONVERT_FRAMES 128
+
+// Dither seed of every file, so a file always converts to the same samples
+#define AUDIO_DITHER_SEED 0x2545F491UL
+
+// Averages the channels of 16-bit stereo frames into mono, (L + R) >> 1.
+// out may be the same buffer as in.
+void pcm_downmix16(const int16_t* in, int16_t* out, size_t frames);
+
+// Unsigned 8-bit samples to 16-bit
+void pcm_8_to_16(const uint8_t* in, int16_t* out, size_t samples);
+
+// Packed little-endian 24-bit and 32-bit samples to 16-bit, with TPDF
+// dither: each sample gets the sum of two random numbers of one output LSB
+// each, minus one LSB, and is then rounded. One draw of the xorshift32 in
+// dither per sample, the low bits for the first number and the next ones
+// for the second, so the result only depends on the samples and the seed.
+void pcm_24_to_16(const uint8_t* in, int16_t* out, size_t samples, uint32_t& dither);
+void pcm_32_to_16(const uint8_t* in, int16_t* out, size_t samples, uint32_t& dither);
+
+// Polyphase FIR resampler for 16-bit mono or stereo. Output frame n is
+// filtered at input position n * inRate / outRate (32.32 fixed point), with
+// the phase table row of the fraction's top AUDIO_RESAMPLE_PHASE_BITS bits,
+// over the AUDIO_RESAMPLE_TAPS input frames up to the one at that position;
+// input before the first frame is silence. The filter is a Blackman-windowed
+// sinc cut off below the lower of the two rates' Nyquist frequency, each row
+// scaled to a gain of exactly 1.
+class Resampler {
+    public:
+        Resampler();
+
+        // Sets up for a rate pair and channel count (1 or 2) and starts from silence
+        void begin(uint32_t inRate, uint32_t outRate, uint16_t channels);
+
+        // Starts from silence again, same rates
+        void reset();
+
+        // Turns up to inFrames frames of in into at most outFrames frames of
+        // out. Input is only taken as output needs it, and an input frame
+        // only when there is room for every output frame that ends on it,
+        // so the last frame of a file comes out in full. inUsed says how
+        // many frames were taken. Returns the number of output frames.
+        size_t process(const int16_t* in, size_t inFrames, int16_t* out, size_t outFrames, size_t& inUsed);
+
+        // Input frames process() takes when given outFrames of room
+        uint32_t inputFor(size_t outFrames) const;
+
+        // Coefficient row of a phase, Q15
+        const int16_t* getPhase(uint16_t phase) const { return coefficients[phase]; }
+        uint64_t getStep() const { return step; }
+
+    private:
+        // Builds the phase table for a cutoff, as a fraction of the input's Nyquist frequency
+        void design(float cutoff);
+        // Output frames from position 0.from on that share their newest input frame
+        uint32_t groupSize(uint32_t from) const;
+
+        uint64_t step;                  // Input frames per output frame, 32.32
+        uint32_t fraction;              // Position between input frames, 0.32
+        uint32_t pending;               // Input frames to take before the next output
+        uint16_t channels;
+        uint8_t position;               // Oldest frame in history
+        uint64_t designedStep;          // step the phase table was built for, 0 for none
+        // Last AUDIO_RESAMPLE_TAPS frames per channel, twice over so a window is never split
+        int16_t history[2][2 * AUDIO_RESAMPLE_TAPS];
+        int16_t coefficients[AUDIO_RESAMPLE_PHASES][AUDIO_RESAMPLE_TAPS];
+};
+
+// The whole conversion of one file: decoding, bit depth, downmix and rate,
+// as needed. Frames that need none of it pass through untouched.
+class AudioConverter {
+    public:
+        AudioConverter();
+
+        // Sets up for a file's format. outRate 0 keeps the file's rate, mono
+        // mixes stereo down. Fills in the format the output gets (16-bit,
+        // no header). False if the file has more than two channels or isn't
+        // 8, 16, 24 or 32-bit PCM or IMA-ADPCM.
+        bool begin(const WavFormat& in, uint32_t outRate, bool mono, WavFormat& out);
+
+        // Nothing to do: the file's bytes are what the output plays
+        bool isPassThrough() const { return passThrough; }
+
+        // Converts whole input units from in (inBytes of the file's samples)
+        // into at most outFrames output frames. inUsed says how many bytes
+        // were taken, always whole units. Returns the number of output frames.
+        // A unit of IMA-ADPCM can be partly decoded when outFrames runs out;
+        // it isn't counted as taken, and has to be passed in again.
+        size_t convert(const uint8_t* in, size_t inBytes, int16_t* out, size_t outFrames, size_t& inUsed);
+
+        // Bytes of the file that go in together: a frame of PCM, one 4-byte
+        // word per channel of IMA-ADPCM
+        uint16_t getInputUnit() const { return unit; }
+
+        // Output bytes per frame
+        uint16_t getOutputFrame() const { return outChannels * 2; }
+
+    private:
+        // Turns frames of the file into 16-bit frames of the output's channel count
+        void decode(const uint8_t* in, int16_t* out, size_t frames);
+        // Decodes up to maxFrames frames of IMA-ADPCM from units whole units,
+        // in the file's channel count. unitsUsed: the units fully decoded.
+        size_t decodeAdpcm(const uint8_t* in, size_t units, int16_t* out, size_t maxFrames, size_t& unitsUsed);
+
+        WavFormat format;
+        uint16_t unit;                  // getInputUnit()
+        uint16_t outChannels;
+        bool passThrough;
+        bool resample;
+        uint32_t dither;                // xorshift32 state of the dither
+        AdpcmChannel adpcm[2];          // IMA-ADPCM decoder state per channel
+        uint32_t adpcmOffset;           // Data offset of the next unit, wraps at the end of the data
+        uint16_t blockOffset;           // Offset of the next unit in its block, 0: a header unit
+        uint8_t nibble;                 // Samples of the next unit already decoded
+        Resampler resampler;
+        int16_t work[AUDIO_CONVERT_FRAMES * 2] __attribute__((aligned(4)));
+};
+
+#endif // AUDIO_CONVERT_H
@@ -0,0 +1,282 @@
+#include <hardware/sync.h>
+#include <pico/time.h>
+#include "audio_engine.h"
+#include "sd_layout.h"
+#include "telemetry.h"
+
+AudioEngine::AudioEngine() : streams(), mixer(nullptr), current(0), notify(nullptr), seq(0), underruns(0), pendingEvents(0), pending(),
+                             reply(), replyPending(false), loadData(nullptr), loadSize(0), loadDone(0) {
+}
+
+void AudioEngine::begin(AudioStream& stream, void (*notify_)()) {
+    streams[0] = &stream;
+    streams[1] = nullptr;
+    mixer = nullptr;
+    current = 0;
+    notify = notify_;
+}
+
+void AudioEngine::begin(AudioMixer& mixer_, AudioStream& first, AudioStream& second, void (*notify_)()) {
+    streams[0] = &first;
+    streams[1] = &second;
+    mixer = &mixer_;
+    current = 0;
+    notify = notify_;
+}
+
+bool AudioEngine::post(const AudioCommand& command) {
+    if (!commands.push(command)) {
+        return false;
+    }
+    __sev();                        // wakes the audio core if it is idle
+    return true;
+}
+
+bool AudioEngine::play(const char* path, bool repeat, uint16_t seq_, uint16_t gain, uint16_t fadeIn, uint16_t fadeOut) {
+    AudioCommand command = {};
+    command.type = AUDIO_PLAY;
+    command.repeat = repeat;
+    command.count = 1;
+    command.seq = seq_;
+    command.gain = gain;
+    command.fadeIn = fadeIn;
+    command.fadeOut = fadeOut;
+    command.paths[0] = path;
+    return post(command);
+}
+
+bool AudioEngine::stop(uint16_t fadeOut) {
+    AudioCommand command = {};
+    command.type = AUDIO_STOP;
+    command.fadeOut = fadeOut;
+    return post(command);
+}
+
+// A file request with paths, AUDIO_PREFETCH, AUDIO_STAT or AUDIO_LOAD
+static AudioCommand file_request(AudioCommandType type, const char* const* paths, uint8_t count) {
+    AudioCommand command = {};
+    command.type = type;
+    command.count = count < AUDIO_PREFETCH_SLOTS ? count : AUDIO_PREFETCH_SLOTS;
+    for (uint8_t i = 0; i < command.count; i++) {
+        command.paths[i] = paths[i];
+    }
+    return command;
+}
+
+bool AudioEngine::prefetch(const char* const* paths, uint8_t count) {
+    return post(file_request(AUDIO_PREFETCH, paths, count));
+}
+
+bool AudioEngine::poll(AudioEvent& event) {
+    return events.pop(event);
+}
+
+bool AudioEngine::stat(const char* const* paths, uint8_t count) {
+    return post(file_request(AUDIO_STAT, paths, count));
+}
+
+bool AudioEngine::load(const char* const* paths, uint8_t count) {
+    return post(file_request(AUDIO_LOAD, paths, count));
+}
+
+bool AudioEngine::sync(uint16_t seq_) {
+    AudioCommand command = {};
+    command.type = AUDIO_SYNC;
+    command.seq = seq_;
+    return post(command);
+}
+
+void AudioEngine::send(AudioEventType type, uint32_t value, void* data) {
+    AudioEvent event = {type, seq, value, data};
+    queue(event);
+}
+
+void AudioEngine::queue(const AudioEvent& event) {
+    // A newer event of a type supersedes one still waiting
+    if (events.push(event)) {
+        pendingEvents &= ~(1 << event.type);
+    } else {
+        pendingEvents |= 1 << event.type;
+        pending[event.type] = event;
+    }
+}
+
+void AudioEngine::run() {
+    bool sent = pendingEvents != 0;
+
+    // Events that didn't fit last time go first, so none is lost, each with
+    // the play and the value it had: a play started since doesn't take them over
+    for (uint8_t type = 0; type <= AUDIO_EVENT_UNDERRUN; type++) {
+        if (pendingEvents & (1 << type)) {
+            queue(pending[type]);
+        }
+    }
+    if (replyPending) {
+        answer(reply.type, reply.value, reply.data);
+        sent = true;
+    }
+
+    AudioCommand command;
+    while (commands.pop(command)) {
+        switch (command.type) {
+            case AUDIO_PLAY:
+                seq = command.seq;
+                // Without a fade play() cuts whatever the stream was playing
+                if (command.fadeOut) {
+                    fadeOut(command.fadeOut);
+                }
+                if (!streams[current]->play(command.paths[0], command.repeat)) {
+                    send(AUDIO_EVENT_FAILED, 0, (void*)streams[current]->getProblem());
+                    telemetry.record(TELEMETRY_AUDIO_CORE, TELEMETRY_AUDIO_FAILED, 0, seq);
+                    sent = true;
+                } else if (mixer) {
+                    // Nothing has gone to the mixer yet, the gain is there for the first frame
+                    AudioMixer::Input& input = mixer->getInput(current);
+                    input.setGain(command.fadeIn ? 0 : command.gain);
+                    input.fade(command.gain, command.fadeIn);
+                }
+                break;
+            case AUDIO_STOP:
+                if (!command.fadeOut || !fadeOut(command.fadeOut)) {
+                    streams[current]->stop();
+                }
+                break;
+            case AUDIO_PREFETCH:
+                streams[current]->prefetchNext(command.paths, command.count);
+                break;
+            case AUDIO_STAT:
+                answer(AUDIO_EVENT_STAT, sd_files_signature(*streams[0]->getCard(), command.paths, command.count));
+                sent = true;
+                break;
+            case AUDIO_LOAD:
+                startLoad(command);
+                break;
+            case AUDIO_SYNC:
+                // Commands are done with in order, the ones before this are
+                answer(AUDIO_EVENT_SYNC, command.seq);
+                sent = true;
+                break;
+        }
+    }
+
+    // The stream fading out is only serviced while it plays, so the prefetch
+    // cache loads between the reads of the current one as before
+    streams[current]->service();
+    AudioStream* fading = streams[1 - current];
+    if (fading && fading->isPlaying()) {
+        fading->service();
+    }
+    checkInputs();
+    if (loadData) {
+        continueLoad();
+        sent |= loadData == nullptr;
+    }
+
+    if (streams[current]->takeFinished()) {
+        send(AUDIO_EVENT_FINISHED, 0);
+        sent = true;
+    }
+    uint32_t total = streams[current]->getUnderruns();
+    if (total != underruns) {
+        underruns = total;
+        send(AUDIO_EVENT_UNDERRUN, underruns);
+        telemetry.set(TELEMETRY_UNDERRUNS, underruns);
+        telemetry.record(TELEMETRY_AUDIO_CORE, TELEMETRY_UNDERRUN, 0, 0, underruns);
+        sent = true;
+    }
+
+    if (sent && notify) {
+        notify();
+    }
+}
+
+void AudioEngine::answer(AudioEventType type, uint32_t value, void* data) {
+    AudioEvent event = {type, seq, value, data};
+    replyPending = !events.push(event);
+    if (replyPending) {
+        reply = event;
+    }
+}
+
+void AudioEngine::startLoad(const AudioCommand& command) {
+    SdFat32& card = *streams[0]->getCard();
+    for (uint8_t i = 0; i < command.count && !loadFile; i++) {
+        loadFile = card.open(command.paths[i], O_RDONLY);
+        if (loadFile && loadFile.isDir()) {
+            loadFile.close();
+        }
+    }
+    loadSize = loadFile ? loadFile.fileSize() : 0;
+    loadData = loadSize > 0 && loadSize <= AUDIO_LOAD_MAX ? (uint8_t*)malloc(loadSize) : nullptr;
+    loadDone = 0;
+    if (!loadData) {
+        loadFile.close();
+        answer(AUDIO_EVENT_LOADED, 0, nullptr);
+    }
+}
+
+void AudioEngine::continueLoad() {
+    uint32_t chunk = loadSize - loadDone < AUDIO_LOAD_CHUNK ? loadSize - loadDone : AUDIO_LOAD_CHUNK;
+    if (loadFile.read(loadData + loadDone, chunk) != (int)chunk) {
+        free(loadData);
+        loadData = nullptr;
+        loadFile.close();
+        answer(AUDIO_EVENT_LOADED, 0, nullptr);
+        return;
+    }
+    loadDone += chunk;
+    if (loadDone == loadSize) {
+        loadFile.close();
+        answer(AUDIO_EVENT_LOADED, loadSize, loadData);
+        loadData = nullptr;
+    }
+}
+
+bool AudioEngine::fadeOut(uint16_t ms) {
+    if (!mixer || !streams[current]->isPlaying()) {
+        return false;
+    }
+    // A file still fading out from before makes room
+    uint8_t other = 1 - current;
+    streams[other]->stop();
+    mixer->getInput(current).fade(0, ms);
+    current = other;
+    return true;
+}
+
+void AudioEngine::checkInputs() {
+    if (!mixer) {
+        return;
+    }
+    uint8_t other = 1 - current;
+    if (streams[other]->isPlaying() && mixer->getInput(other).isSilent()) {
+        streams[other]->stop();
+    }
+    streams[other]->takeFinished();         // no events about it, the FSM has moved on
+
+    // A file that ended by itself leaves the mix, the output keeps running
+    for (uint8_t i = 0; i < AUDIO_MIX_INPUTS; i++) {
+        if (!streams[i]->isPlaying() && mixer->getInput(i).isActive()) {
+            mixer->getInput(i).finish();
+        }
+    }
+}
+
+unsigned long AudioEngine::nextDeadline() const {
+    unsigned long deadline = streams[current]->nextDeadline();
+    AudioStream* fading = streams[1 - current];
+    if (fading && fading->isPlaying() && (long)(fading->nextDeadline() - deadline) < 0) {
+        deadline = fading->nextDeadline();
+    }
+    return deadline;
+}
+
+void AudioEngine::idle() {
+    unsigned long wait = nextDeadline() - millis();
+    if (wait > 1000) {
+        wait = 1000;
+    }
+    absolute_time_t until = from_us_since_boot(time_us_64() + (uint64_t)wait * 1000);
+    while (commands.empty() && !best_effort_wfe_or_timeout(until)) {
+    }
+}
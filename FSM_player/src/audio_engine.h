@@ -0,0 +1,143 @@
+#ifndef AUDIO_ENGINE_H
+#define AUDIO_ENGINE_H
+
+#include "audio_stream.h"
+#include "audio_mixer.h"
+#include "spsc_queue.h"
+
+#define AUDIO_COMMAND_QUEUE 8
+#define AUDIO_EVENT_QUEUE   16
+
+// Files read with AUDIO_LOAD: bytes per run(), so the streams are serviced in
+// between, and the largest file taken
+#define AUDIO_LOAD_CHUNK 2048
+#define AUDIO_LOAD_MAX   65536
+
+// Commands from the FSM to the audio core
+enum AudioCommandType : uint8_t {
+    AUDIO_PLAY,         // play paths[0] from the start, repeat says whether it loops
+    AUDIO_STOP,         // stop playing
+    AUDIO_PREFETCH,     // cache the start of paths[0..count-1], most important first
+    AUDIO_STAT,         // signature of paths[0..count-1] (sd_files_signature)
+    AUDIO_LOAD,         // read the first of paths[0..count-1] that exists into memory
+    AUDIO_SYNC          // reply once every command before it is done with, seq comes back
+};
+
+struct AudioCommand {
+    AudioCommandType type;
+    bool repeat;
+    uint8_t count;
+    uint16_t seq;       // play number, comes back in the events about it
+    uint16_t gain;      // of the new file, Q15
+    uint16_t fadeIn;    // ms the new file ramps up over
+    uint16_t fadeOut;   // ms the file playing until now ramps down over, 0 cuts it
+    const char* paths[AUDIO_PREFETCH_SLOTS];    // point into the FSM's string pool, valid until AUDIO_SYNC
+};
+
+// Events from the audio core to the FSM
+enum AudioEventType : uint8_t {
+    AUDIO_EVENT_FINISHED,   // the file went out in full (every pass, for a repeating one)
+    AUDIO_EVENT_FAILED,     // the file couldn't be played, data: why (a string constant)
+    AUDIO_EVENT_UNDERRUN,   // the output ran dry, value: underruns so far
+    AUDIO_EVENT_STAT,       // reply to AUDIO_STAT, value: the signature
+    AUDIO_EVENT_LOADED,     // reply to AUDIO_LOAD, value: size, data: the file (malloc'd,
+                            // the FSM frees it), nullptr if none could be read
+    AUDIO_EVENT_SYNC        // reply to AUDIO_SYNC, value: its seq
+};
+
+struct AudioEvent {
+    AudioEventType type;
+    uint16_t seq;       // play the event is about
+    uint32_t value;
+    void* data;
+};
+
+// Runs an AudioStream on its own core (core1 on the RP2040, a std::thread in
+// host tests). The FSM side only posts commands and polls events; the audio
+// side does all SD card and output work in run(). Each side owns one end of
+// each queue, so nothing is shared but the queues.
+//
+// With a mixer and a second stream, a file that is replaced or stopped with a
+// fadeOut keeps playing on its stream while it fades out, and the new file
+// starts on the other stream, mixed over it. A file still fading out when the
+// next change comes is cut. Events are only ever about the newest play.
+//
+// The card belongs to the audio core once it runs, so the FSM's own file
+// accesses (watching and reloading its config) are requests to it as well,
+// answered with events. A load is read a chunk per run(), between the
+// services of the streams, so it doesn't hold up the audio.
+class AudioEngine {
+    public:
+        AudioEngine();
+
+        // notify is called on the audio core after events were queued, to
+        // wake the FSM core (nullptr: the FSM finds them when it next polls).
+        // One stream: files are cut, gains and fades are ignored.
+        void begin(AudioStream& stream, void (*notify)() = nullptr);
+
+        // Two streams, writing to inputs 0 and 1 of mixer, for fades and crossfades
+        void begin(AudioMixer& mixer, AudioStream& first, AudioStream& second, void (*notify)() = nullptr);
+
+        // FSM side. False if the command queue is full, try again next tick.
+        // gain and fadeIn are the new file's, fadeOut the ms the file playing
+        // until now fades out over.
+        bool play(const char* path, bool repeat, uint16_t seq, uint16_t gain = AUDIO_GAIN_UNITY, uint16_t fadeIn = 0,
+                  uint16_t fadeOut = 0);
+        bool stop(uint16_t fadeOut = 0);
+        bool prefetch(const char* const* paths, uint8_t count);
+        bool poll(AudioEvent& event);
+
+        // FSM side, file requests for the card the audio core owns. One at a
+        // time: post the next one once the reply to the last came in.
+        bool stat(const char* const* paths, uint8_t count);
+        bool load(const char* const* paths, uint8_t count);
+        bool sync(uint16_t seq);
+
+        // Audio side: carries out queued commands, services the stream and
+        // queues the events that came of it
+        void run();
+
+        // Audio side: sleeps until the stream needs servicing or a command comes in
+        void idle();
+
+        // Latest millis() by which run() must be called again
+        unsigned long nextDeadline() const;
+
+    private:
+        bool post(const AudioCommand& command);
+        // Queues an event about the current play, or keeps it in pending if the queue is full
+        void send(AudioEventType type, uint32_t value, void* data = nullptr);
+        void queue(const AudioEvent& event);
+        // Leaves the current file to fade out over ms on its stream, the
+        // other stream becomes the current one. False without a mixer.
+        bool fadeOut(uint16_t ms);
+        // Stops the file fading out once it is silent, lets the mixer know
+        // about files that ended by themselves
+        void checkInputs();
+        // Queues the reply to a file request, or keeps it in reply until it fits
+        void answer(AudioEventType type, uint32_t value, void* data = nullptr);
+        // Starts an AUDIO_LOAD, then reads a chunk of it per call
+        void startLoad(const AudioCommand& command);
+        void continueLoad();
+
+        AudioStream* streams[AUDIO_MIX_INPUTS];     // The second one nullptr without a mixer
+        AudioMixer* mixer;
+        uint8_t current;                // Stream of the newest play, the other one fades out
+        void (*notify)();
+        SpscQueue<AudioCommand, AUDIO_COMMAND_QUEUE> commands;
+        SpscQueue<AudioEvent, AUDIO_EVENT_QUEUE> events;
+
+        // Audio side state
+        uint16_t seq;                   // play the stream is on
+        uint32_t underruns;             // sink underruns already reported
+        uint8_t pendingEvents;          // bit per AudioEventType that didn't fit in the queue
+        AudioEvent pending[AUDIO_EVENT_UNDERRUN + 1];   // those events, with the play they were about
+        AudioEvent reply;               // Reply to a file request that didn't fit in the queue
+        bool replyPending;
+        File32 loadFile;                // AUDIO_LOAD in progress
+        uint8_t* loadData;              // nullptr when none is
+        uint32_t loadSize;
+        uint32_t loadDone;
+};
+
+#endif // AUDIO_ENGINE_H
@@ -0,0 +1,460 @@
+#include <stddef.h>
+#include "audio_index.h"
+
+// The index file layout must not depend on the compiler or target
+static_assert(sizeof(WavFormat) == 20, "WavFormat layout changed, bump AUDIO_INDEX_VERSION");
+static_assert(sizeof(AudioIndexHeader) == 24, "AudioIndexHeader layout changed, bump AUDIO_INDEX_VERSION");
+static_assert(sizeof(AudioIndexFolder) == 128, "AudioIndexFolder layout changed, bump AUDIO_INDEX_VERSION");
+static_assert(sizeof(AudioIndexEntry) == 128, "AudioIndexEntry layout changed, bump AUDIO_INDEX_VERSION");
+
+#define AUDIO_INDEX_TEMP "/FSM_Index.tmp"
+
+// Names listed per pass over a directory while scanning a folder
+#define SCAN_BATCH 16
+
+// Weight from a name like rain@3.wav, 1 without one
+static uint16_t weight_of(const char* name) {
+    const char* at = strrchr(name, '@');
+    if (!at || at[1] < '0' || at[1] > '9') {
+        return 1;
+    }
+    uint32_t weight = 0;
+    const char* p = at + 1;
+    for (; *p >= '0' && *p <= '9'; p++) {
+        weight = weight * 10 + (*p - '0');
+        if (weight > 0xFFFF) {
+            weight = 0xFFFF;
+        }
+    }
+    return strcasecmp(p, ".wav") == 0 ? weight : 1;
+}
+
+// Fingerprint of the .wav files in a folder from their names, sizes and first
+// sectors, whatever order the directory lists them in. Only reads the directory.
+static uint32_t fingerprint_folder(SdFat32& sd, const char* path) {
+    File32 dir = sd.open(path, O_RDONLY);
+    if (!dir || !dir.isDir()) {
+        return 0;
+    }
+    uint32_t sum = 0;
+    char name[WAV_NAME_MAX];
+    File32 entry;
+    while (entry.openNext(&dir, O_RDONLY)) {
+        size_t length = entry.getName(name, sizeof(name));
+        if (!entry.isDir() && wav_is_audio_name(name, length)) {
+            uint32_t facts[2] = {entry.fileSize(), entry.firstSector()};
+            sum += fsm_crc32(name, length, fsm_crc32(facts, sizeof(facts)));
+        }
+        entry.close();
+    }
+    return sum;
+}
+
+// Stores the alias table fields of record k of the records starting at start
+static bool write_alias(File32& out, uint32_t start, uint16_t k, uint32_t threshold, uint16_t alias) {
+    return out.seekSet(start + k * sizeof(AudioIndexEntry) + offsetof(AudioIndexEntry, aliasThreshold)) &&
+           out.write(&threshold, sizeof(threshold)) == sizeof(threshold) &&
+           out.write(&alias, sizeof(alias)) == sizeof(alias);
+}
+
+// Builds the alias table (Vose's method) of n records that already hold their
+// weights: record k is kept with probability threshold / 2^32, otherwise its
+// alias is taken. Together with a uniform choice of k that picks every file
+// in proportion to its weight, in constant time.
+static bool build_aliases(File32& out, uint32_t start, uint16_t n) {
+    if (n == 0) {
+        return true;
+    }
+    uint64_t* scaled = (uint64_t*)malloc(n * sizeof(uint64_t));     // weight * n, against the total
+    uint16_t* small = (uint16_t*)malloc(n * sizeof(uint16_t));      // scaled below the total
+    uint16_t* large = (uint16_t*)malloc(n * sizeof(uint16_t));
+    bool ok = scaled && small && large;
+
+    uint64_t total = 0;
+    for (uint16_t k = 0; k < n && ok; k++) {
+        uint16_t weight = 0;
+        ok = out.seekSet(start + k * sizeof(AudioIndexEntry) + offsetof(AudioIndexEntry, weight)) &&
+             out.read(&weight, sizeof(weight)) == sizeof(weight);
+        scaled[k] = weight;
+        total += weight;
+    }
+    // All weights 0: every file equally
+    for (uint16_t k = 0; k < n && ok; k++) {
+        scaled[k] = (total ? scaled[k] : 1) * n;
+    }
+    if (total == 0) {
+        total = n;
+    }
+
+    uint16_t numSmall = 0;
+    uint16_t numLarge = 0;
+    for (uint16_t k = 0; k < n && ok; k++) {
+        if (scaled[k] < total) {
+            small[numSmall++] = k;
+        } else {
+            large[numLarge++] = k;
+        }
+    }
+    // Each small record is topped up to the total by a large one
+    while (ok && numSmall > 0 && numLarge > 0) {
+        uint16_t s = small[--numSmall];
+        uint16_t l = large[numLarge - 1];
+        ok = write_alias(out, start, s, (uint32_t)((scaled[s] << 32) / total), l);
+        scaled[l] -= total - scaled[s];
+        if (scaled[l] < total) {
+            numLarge--;
+            small[numSmall++] = l;
+        }
+    }
+    // What is left is full, up to rounding
+    while (ok && numLarge > 0) {
+        uint16_t l = large[--numLarge];
+        ok = write_alias(out, start, l, 0xFFFFFFFFUL, l);
+    }
+    while (ok && numSmall > 0) {
+        uint16_t s = small[--numSmall];
+        ok = write_alias(out, start, s, 0xFFFFFFFFUL, s);
+    }
+
+    free(scaled);
+    free(small);
+    free(large);
+    return ok;
+}
+
+AudioIndex::AudioIndex() : sd(nullptr), folders(nullptr), numFolders(0), rescanned(0), entriesOffset(0), random(0x9E3779B9UL) {
+}
+
+AudioIndex::~AudioIndex() {
+    clear();
+}
+
+void AudioIndex::clear() {
+    file.close();
+    for (uint16_t f = 0; f < numFolders; f++) {
+        free(folders[f].order);
+    }
+    free(folders);
+    folders = nullptr;
+    numFolders = 0;
+}
+
+void AudioIndex::seed(uint32_t seed) {
+    random = seed ? seed : 0x9E3779B9UL;
+}
+
+uint32_t AudioIndex::nextRandom() {
+    // xorshift32
+    random ^= random << 13;
+    random ^= random >> 17;
+    random ^= random << 5;
+    return random;
+}
+
+uint32_t AudioIndex::uniform(uint32_t n) {
+    // Scaled down without a division
+    return (uint32_t)(((uint64_t)nextRandom() * n) >> 32);
+}
+
+bool AudioIndex::begin(SdFat32& sd_, const char* const* paths, const uint8_t* modes, uint16_t count, bool trusted) {
+    clear();
+    sd = &sd_;
+    rescanned = 0;
+    folders = (Folder*)calloc(count ? count : 1, sizeof(Folder));
+    Check* checks = (Check*)calloc(count ? count : 1, sizeof(Check));
+    if (!folders || !checks) {
+        free(checks);
+        return false;
+    }
+    numFolders = count;
+    for (uint16_t f = 0; f < count; f++) {
+        strncpy(folders[f].path, paths[f], sizeof(folders[f].path) - 1);
+        folders[f].mode = modes[f];
+        checks[f].fingerprint = trusted ? 0 : fingerprint_folder(sd_, paths[f]);
+    }
+
+    // Find each folder in the index on the card, with the same fingerprint
+    File32 old = sd->open(AUDIO_INDEX_PATH, O_RDONLY);
+    AudioIndexHeader header;
+    bool usable = old && old.read(&header, sizeof(header)) == sizeof(header) &&
+                  header.magic == AUDIO_INDEX_MAGIC && header.version == AUDIO_INDEX_VERSION &&
+                  header.headerSize == sizeof(header) &&
+                  header.entriesOffset >= sizeof(header) + (uint64_t)header.numFolders * sizeof(AudioIndexFolder) &&
+                  header.entriesOffset + (uint64_t)header.numEntries * sizeof(AudioIndexEntry) <= old.fileSize();
+    uint32_t crc = 0;
+    for (uint32_t r = 0; usable && r < header.numFolders; r++) {
+        AudioIndexFolder record;
+        if (old.read(&record, sizeof(record)) != sizeof(record)) {
+            usable = false;
+            break;
+        }
+        crc = fsm_crc32(&record, sizeof(record), crc);
+        record.path[AUDIO_INDEX_FOLDER - 1] = '\0';
+        for (uint16_t f = 0; f < count; f++) {
+            Check& check = checks[f];
+            if (!check.unchanged && (trusted || record.fingerprint == check.fingerprint) && strcmp(record.path, paths[f]) == 0 &&
+                record.numEntries <= 0xFFFF && record.firstEntry + (uint64_t)record.numEntries <= header.numEntries) {
+                check.unchanged = true;
+                check.fingerprint = record.fingerprint;
+                check.oldFirst = record.firstEntry;
+                check.oldCount = record.numEntries;
+            }
+        }
+    }
+    usable = usable && crc == header.crc;
+
+    // Trusted, only the folders the index doesn't have are walked, to be scanned
+    for (uint16_t f = 0; trusted && f < count; f++) {
+        if (!usable || !checks[f].unchanged) {
+            checks[f].fingerprint = fingerprint_folder(sd_, paths[f]);
+        }
+    }
+
+    // Rewrite it unless it has every folder, unchanged, and no others
+    bool current = usable && header.numFolders == count;
+    for (uint16_t f = 0; f < count; f++) {
+        if (!usable) {
+            checks[f].unchanged = false;
+        }
+        current = current && checks[f].unchanged;
+    }
+    bool ok;
+    if (current) {
+        entriesOffset = header.entriesOffset;
+        for (uint16_t f = 0; f < count; f++) {
+            folders[f].firstEntry = checks[f].oldFirst;
+            folders[f].numEntries = checks[f].oldCount;
+        }
+        old.close();
+        ok = true;
+    } else {
+        ok = rebuild(old, checks, usable ? header.entriesOffset : 0);
+    }
+    free(checks);
+
+    file = sd->open(AUDIO_INDEX_PATH, O_RDONLY);
+    if (!ok || !file) {
+        Serial.println("Can't write " AUDIO_INDEX_PATH);
+        clear();
+        return false;
+    }
+
+    // Every folder starts at its first file, in a fresh order when shuffled
+    for (uint16_t f = 0; f < count; f++) {
+        Folder& folder = folders[f];
+        if (folder.mode == AUDIO_SELECT_SHUFFLE && folder.numEntries > 0) {
+            folder.order = (uint16_t*)malloc(folder.numEntries * sizeof(uint16_t));
+            if (!folder.order) {
+                folder.mode = AUDIO_SELECT_SEQUENTIAL;
+            } else {
+                for (uint16_t k = 0; k < folder.numEntries; k++) {
+                    folder.order[k] = k;
+                }
+            }
+        }
+        draw(folder);
+    }
+    return true;
+}
+
+bool AudioIndex::rebuild(File32& old, const Check* checks, uint32_t oldEntriesOffset) {
+    File32 out = sd->open(AUDIO_INDEX_TEMP, O_RDWR | O_CREAT | O_TRUNC);
+    if (!out) {
+        return false;
+    }
+
+    // Room for the header and folder records, filled in at the end
+    entriesOffset = sizeof(AudioIndexHeader) + numFolders * sizeof(AudioIndexFolder);
+    entriesOffset = (entriesOffset + AUDIO_SECTOR_SIZE - 1) / AUDIO_SECTOR_SIZE * AUDIO_SECTOR_SIZE;
+    AudioIndexEntry entry;
+    memset(&entry, 0, sizeof(entry));
+    bool ok = true;
+    for (uint32_t done = 0; done < entriesOffset && ok; done += sizeof(entry)) {
+        ok = out.write(&entry, sizeof(entry)) == sizeof(entry);
+    }
+
+    uint32_t numEntries = 0;
+    for (uint16_t f = 0; f < numFolders && ok; f++) {
+        Folder& folder = folders[f];
+        folder.firstEntry = numEntries;
+        if (checks[f].unchanged) {
+            ok = old.seekSet(oldEntriesOffset + checks[f].oldFirst * sizeof(entry));
+            for (uint32_t k = 0; k < checks[f].oldCount && ok; k++) {
+                ok = old.read(&entry, sizeof(entry)) == sizeof(entry) && out.write(&entry, sizeof(entry)) == sizeof(entry);
+            }
+            folder.numEntries = checks[f].oldCount;
+        } else {
+            folder.numEntries = scanFolder(out, folder.path);
+            rescanned++;
+        }
+        numEntries += folder.numEntries;
+    }
+    old.close();
+
+    AudioIndexHeader header = {};
+    ok = ok && out.seekSet(sizeof(header));
+    for (uint16_t f = 0; f < numFolders && ok; f++) {
+        AudioIndexFolder record = {};
+        memcpy(record.path, folders[f].path, sizeof(record.path));
+        record.fingerprint = checks[f].fingerprint;
+        record.firstEntry = folders[f].firstEntry;
+        record.numEntries = folders[f].numEntries;
+        ok = out.write(&record, sizeof(record)) == sizeof(record);
+        header.crc = fsm_crc32(&record, sizeof(record), header.crc);
+    }
+    header.magic = AUDIO_INDEX_MAGIC;
+    header.version = AUDIO_INDEX_VERSION;
+    header.headerSize = sizeof(header);
+    header.numFolders = numFolders;
+    header.numEntries = numEntries;
+    header.entriesOffset = entriesOffset;
+    ok = ok && out.seekSet(0) && out.write(&header, sizeof(header)) == sizeof(header) && out.sync();
+    out.close();
+
+    // Swap it in, a cut-off swap only costs a rescan at the next boot
+    if (!ok) {
+        sd->remove(AUDIO_INDEX_TEMP);
+        return false;
+    }
+    sd->remove(AUDIO_INDEX_PATH);
+    return sd->rename(AUDIO_INDEX_TEMP, AUDIO_INDEX_PATH);
+}
+
+uint16_t AudioIndex::scanFolder(File32& out, const char* path) {
+    if (strlen(path) >= AUDIO_INDEX_FOLDER) {
+        return 0;
+    }
+    uint32_t start = out.curPosition();
+    uint16_t n = 0;
+
+    // The folder's .wav files in name order, a batch of names per directory pass
+    char names[SCAN_BATCH][WAV_NAME_MAX];
+    char last[WAV_NAME_MAX] = "";
+    char filePath[AUDIO_INDEX_FOLDER + WAV_NAME_MAX];
+    uint16_t listed;
+    while ((listed = wav_list_next(*sd, path, last, names, SCAN_BATCH)) > 0) {
+        for (uint16_t b = 0; b < listed && n < 0xFFFF; b++) {
+            snprintf(filePath, sizeof(filePath), "%s%s", path, names[b]);
+            AudioIndexEntry entry;
+            memset(&entry, 0, sizeof(entry));
+            File32 wav = sd->open(filePath, O_RDONLY);
+            const char* problem = wav ? wav_parse(wav, entry.format) : "can't open";
+            if (problem) {
+                Serial.print(filePath);
+                Serial.print(": ");
+                Serial.println(problem);
+                continue;
+            }
+            strcpy(entry.name, names[b]);
+            entry.fileSize = wav.fileSize();
+            uint32_t endSector;
+            if (!wav.contiguousRange(&entry.firstSector, &endSector)) {
+                entry.firstSector = 0;
+            }
+            entry.weight = weight_of(names[b]);
+            if (out.write(&entry, sizeof(entry)) != sizeof(entry)) {
+                return 0;
+            }
+            n++;
+        }
+        strcpy(last, names[listed - 1]);
+    }
+
+    if (!build_aliases(out, start, n) || !out.seekSet(start + n * sizeof(AudioIndexEntry))) {
+        return 0;
+    }
+    return n;
+}
+
+int16_t AudioIndex::find(const char* folder) const {
+    // A handful of folders, compared by name
+    for (uint16_t f = 0; f < numFolders; f++) {
+        if (strcmp(folders[f].path, folder) == 0) {
+            return f;
+        }
+    }
+    return -1;
+}
+
+uint32_t AudioIndex::getNumFiles() const {
+    uint32_t total = 0;
+    for (uint16_t f = 0; f < numFolders; f++) {
+        total += folders[f].numEntries;
+    }
+    return total;
+}
+
+bool AudioIndex::readEntry(const Folder& folder, uint16_t i, AudioIndexEntry& entry) {
+    return i < folder.numEntries &&
+           file.seekSet(entriesOffset + (folder.firstEntry + i) * sizeof(AudioIndexEntry)) &&
+           file.read(&entry, sizeof(entry)) == sizeof(entry);
+}
+
+bool AudioIndex::getEntry(uint16_t folder, uint16_t i, AudioIndexEntry& entry) {
+    return folder < numFolders && readEntry(folders[folder], i, entry);
+}
+
+void AudioIndex::draw(Folder& folder) {
+    uint16_t n = folder.numEntries;
+    if (n == 0) {
+        return;
+    }
+
+    switch (folder.mode) {
+        case AUDIO_SELECT_SEQUENTIAL:
+            folder.next = folder.position;
+            folder.position = (folder.position + 1) % n;
+            break;
+
+        case AUDIO_SELECT_SHUFFLE: {
+            // One step of a Fisher-Yates shuffle per pick. A new round doesn't
+            // start with the file that ended the last one.
+            uint16_t j;
+            if (folder.position == n) {
+                folder.position = 0;
+                j = n > 1 ? uniform(n - 1) : 0;
+            } else {
+                j = folder.position + uniform(n - folder.position);
+            }
+            uint16_t swap = folder.order[folder.position];
+            folder.order[folder.position] = folder.order[j];
+            folder.order[j] = swap;
+            folder.next = folder.order[folder.position++];
+            break;
+        }
+
+        case AUDIO_SELECT_WEIGHTED: {
+            uint16_t k = uniform(n);
+            AudioIndexEntry entry;
+            folder.next = k;
+            if (readEntry(folder, k, entry) && nextRandom() >= entry.aliasThreshold && entry.alias < n) {
+                folder.next = entry.alias;
+            }
+            break;
+        }
+
+        default:
+            folder.next = 0;
+            break;
+    }
+}
+
+bool AudioIndex::peek(const char* path, Pick& pick) {
+    int16_t f = find(path);
+    AudioIndexEntry entry;
+    if (f < 0 || !readEntry(folders[f], folders[f].next, entry)) {
+        return false;
+    }
+    entry.name[WAV_NAME_MAX - 1] = '\0';
+    snprintf(pick.path, sizeof(pick.path), "%s%s", folders[f].path, entry.name);
+    pick.format = entry.format;
+    pick.firstSector = entry.firstSector;
+    return true;
+}
+
+void AudioIndex::advance(const char* path) {
+    int16_t f = find(path);
+    if (f >= 0) {
+        draw(folders[f]);
+    }
+}
@@ -0,0 +1,143 @@
+#ifndef AUDIO_INDEX_H
+#define AUDIO_INDEX_H
+
+#include <SdFat.h>
+#include "wav.h"
+#include "fsm_image.h"
+
+// Index of the audio folders the states play from, kept on the card in
+// /FSM_Index.bin next to the config.
+//
+// The file holds a header, one record per folder and then one fixed-size
+// record per .wav file, each folder's files together and in name order. A
+// file record has everything needed to start playing it: name, size, WAV
+// format and, for a contiguous file, its first sector, so a track starts
+// without a directory scan, a header read or a walk of the FAT.
+//
+// At boot each folder's directory is walked once, without opening any file,
+// to fingerprint its .wav names, sizes and first sectors. Folders whose
+// fingerprint matches the index are used as they are, the others are
+// scanned again and the file is rewritten. After that, picking a folder's
+// next file takes one or two record reads, whatever the number of files.
+#define AUDIO_INDEX_PATH    "/FSM_Index.bin"
+#define AUDIO_INDEX_MAGIC   0x58534D46UL    // "FSMX"
+#define AUDIO_INDEX_VERSION 2
+#define AUDIO_INDEX_NAME    WAV_NAME_MAX    // longest file name + 1
+#define AUDIO_INDEX_FOLDER  96              // longest folder path + 1
+
+struct AudioIndexHeader {
+    uint32_t magic;             // AUDIO_INDEX_MAGIC
+    uint16_t version;           // AUDIO_INDEX_VERSION
+    uint16_t headerSize;        // sizeof(AudioIndexHeader)
+    uint32_t numFolders;
+    uint32_t numEntries;
+    uint32_t entriesOffset;     // First file record, on a sector boundary
+    uint32_t crc;               // CRC-32 of the folder records
+};
+
+struct AudioIndexFolder {
+    char path[AUDIO_INDEX_FOLDER];      // audioFile as configured, ends in '/'
+    uint32_t fingerprint;       // Of the .wav names, sizes and first sectors in the folder
+    uint32_t firstEntry;        // Index of its first file record
+    uint32_t numEntries;
+    uint8_t reserved[20];
+};
+
+// Four to a sector
+struct AudioIndexEntry {
+    char name[AUDIO_INDEX_NAME];        // File name without the folder
+    WavFormat format;
+    uint32_t fileSize;
+    uint32_t firstSector;       // Card sector of the file's first byte if it is contiguous, 0 if not
+    uint32_t aliasThreshold;    // Weighted pick: keep this file if a random 32-bit number is below this...
+    uint16_t alias;             // ...otherwise take this one (index in the folder)
+    uint16_t weight;            // From the name: rain@3.wav has weight 3, others 1
+    uint8_t reserved[28];
+};
+
+class AudioIndex {
+    public:
+        // The file a folder plays next, as AudioStream needs it
+        struct Pick {
+            char path[AUDIO_INDEX_FOLDER + AUDIO_INDEX_NAME];
+            WavFormat format;
+            uint32_t firstSector;       // 0 if the file isn't contiguous
+        };
+
+        AudioIndex();
+        ~AudioIndex();
+
+        // Indexes the folders (paths ending in '/') with their AUDIO_SELECT_*
+        // modes, rescanning only those that changed since the index file was
+        // written. The paths are copied, so the index outlives the config they
+        // came from (a reloaded one). Runs at boot, before the audio core takes
+        // the card. False if the index file can't be written or read.
+        // trusted: the card is known not to have changed since the index was
+        // last checked (a restart after a power cut), the folders the index
+        // has are taken as they are without walking their directories.
+        bool begin(SdFat32& sd, const char* const* folders, const uint8_t* modes, uint16_t count, bool trusted = false);
+
+        // Seeds the random picks of shuffle and weighted folders
+        void seed(uint32_t seed);
+
+        // Folder number of an indexed folder, -1 if it isn't one
+        int16_t find(const char* folder) const;
+
+        uint16_t getNumFolders() const { return numFolders; }
+        uint16_t getNumFiles(uint16_t folder) const { return folders[folder].numEntries; }
+        uint32_t getNumFiles() const;
+
+        // Folders scanned again by the last begin()
+        uint16_t getRescanned() const { return rescanned; }
+
+        // File record i of a folder
+        bool getEntry(uint16_t folder, uint16_t i, AudioIndexEntry& entry);
+
+        // The file a folder plays next, without moving on. False if the folder
+        // isn't indexed or has no playable file.
+        bool peek(const char* folder, Pick& pick);
+
+        // Moves a folder on to the file after the one peek() returns
+        void advance(const char* folder);
+
+    private:
+        struct Folder {
+            char path[AUDIO_INDEX_FOLDER];      // Longer paths can't be found, they aren't indexed
+            uint32_t firstEntry;
+            uint16_t numEntries;
+            uint8_t mode;               // AUDIO_SELECT_*
+            uint16_t position;          // Sequential: next file; shuffle: place in this round
+            uint16_t next;              // File peek() returns
+            uint16_t* order;            // Shuffle: this round's order, nullptr otherwise
+        };
+
+        // What begin() found out about a folder
+        struct Check {
+            uint32_t fingerprint;       // Of the folder as it is now
+            bool unchanged;             // The old index has it with this fingerprint...
+            uint32_t oldFirst;          // ...at these records
+            uint32_t oldCount;
+        };
+
+        // Picks the folder's next file
+        void draw(Folder& folder);
+        uint32_t nextRandom();
+        // Random number below n
+        uint32_t uniform(uint32_t n);
+        bool readEntry(const Folder& folder, uint16_t i, AudioIndexEntry& entry);
+        // Writes a new index file, copying the records of unchanged folders from old
+        bool rebuild(File32& old, const Check* checks, uint32_t oldEntriesOffset);
+        // Scans a folder into the new index file at its end, returns its number of files
+        uint16_t scanFolder(File32& out, const char* path);
+        void clear();
+
+        SdFat32* sd;
+        File32 file;                    // The index, open for reading
+        Folder* folders;
+        uint16_t numFolders;
+        uint16_t rescanned;
+        uint32_t entriesOffset;
+        uint32_t random;                // xorshift32 state
+};
+
+#endif // AUDIO_INDEX_H
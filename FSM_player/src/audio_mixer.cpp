@@ -0,0 +1,242 @@
+#include <string.h>
+#include "audio_mixer.h"
+
+static inline int16_t clamp16(int32_t x) {
+    return x > 32767 ? 32767 : x < -32768 ? -32768 : (int16_t)x;
+}
+
+AudioMixer::Input::Input() : mixer(nullptr), active(false), level((int32_t)AUDIO_GAIN_UNITY << 15), step(0), rampLeft(0),
+                             target(AUDIO_GAIN_UNITY), filled(0) {
+}
+
+bool AudioMixer::Input::begin(const WavFormat& format) {
+    if (active) {
+        active = false;
+        mixer->drop(*this);
+    }
+
+    // Alone, this input sets up the output; next to one playing another
+    // format it can't be mixed, so that one is cut off
+    bool others = mixer->activeInputs() > 0;
+    const WavFormat& playing = mixer->format;
+    if (others && (format.channels != playing.channels || format.sampleRate != playing.sampleRate ||
+                   format.bitsPerSample != playing.bitsPerSample)) {
+        for (Input& other : mixer->inputs) {
+            other.active = false;
+            other.filled = 0;
+        }
+        mixer->mixLength = 0;
+        others = false;
+    }
+    if (!others) {
+        if (!mixer->output->begin(format)) {
+            return false;
+        }
+        mixer->format = format;
+        mixer->channels = format.channels;
+    }
+
+    active = true;
+    filled = 0;
+    setGain(AUDIO_GAIN_UNITY);
+    return true;
+}
+
+size_t AudioMixer::Input::availableForWrite() {
+    if (!active) {
+        return 0;
+    }
+    if (mixer->mixLength == 0 && mixer->activeInputs() == 1) {
+        return mixer->output->availableForWrite();
+    }
+    return mixer->room(*this) * mixer->channels * 2;
+}
+
+size_t AudioMixer::Input::write(uint8_t* data, size_t bytes) {
+    if (!active) {
+        return 0;
+    }
+    if (mixer->mixLength == 0 && mixer->activeInputs() == 1) {
+        return mixer->writeDirect(*this, data, bytes);
+    }
+    return mixer->writeMixed(*this, data, bytes);
+}
+
+void AudioMixer::Input::end() {
+    finish();
+    if (mixer->activeInputs() == 0) {
+        mixer->output->end();
+    }
+}
+
+uint32_t AudioMixer::Input::getUnderruns() const {
+    return mixer->output->getUnderruns();
+}
+
+void AudioMixer::Input::finish() {
+    if (active) {
+        active = false;
+        mixer->drop(*this);
+    }
+}
+
+void AudioMixer::Input::setGain(uint16_t gain) {
+    target = gain < AUDIO_GAIN_UNITY ? gain : AUDIO_GAIN_UNITY;
+    level = (int32_t)target << 15;
+    step = 0;
+    rampLeft = 0;
+}
+
+void AudioMixer::Input::fade(uint16_t gain, uint32_t ms) {
+    uint32_t frames = (uint32_t)((uint64_t)ms * mixer->format.sampleRate / 1000);
+    if (frames == 0) {
+        setGain(gain);
+        return;
+    }
+    target = gain < AUDIO_GAIN_UNITY ? gain : AUDIO_GAIN_UNITY;
+    step = (((int32_t)target << 15) - level) / (int32_t)frames;
+    rampLeft = frames;
+}
+
+inline int32_t AudioMixer::Input::nextGain() {
+    int32_t gain = level >> 15;
+    if (rampLeft > 0) {
+        rampLeft--;
+        level = rampLeft > 0 ? level + step : (int32_t)target << 15;
+    }
+    return gain;
+}
+
+AudioMixer::AudioMixer() : output(nullptr), format(), channels(1), mixLength(0), mixedFrames(0) {
+    for (Input& input : inputs) {
+        input.mixer = this;
+    }
+}
+
+void AudioMixer::begin(AudioSink& output_) {
+    output = &output_;
+    mixLength = 0;
+    mixedFrames = 0;
+}
+
+uint8_t AudioMixer::activeInputs() const {
+    uint8_t count = 0;
+    for (const Input& input : inputs) {
+        count += input.active;
+    }
+    return count;
+}
+
+size_t AudioMixer::room(const Input& input) {
+    // Everything in the mix buffer has to fit in the output when it goes, so
+    // an input gets no further ahead than the output has room for
+    size_t limit = output->availableForWrite() / (channels * 2);
+    if (limit > AUDIO_MIX_FRAMES) {
+        limit = AUDIO_MIX_FRAMES;
+    }
+    return limit > input.filled ? limit - input.filled : 0;
+}
+
+size_t AudioMixer::writeDirect(Input& input, uint8_t* data, size_t bytes) {
+    if (input.level == (int32_t)AUDIO_GAIN_UNITY << 15 && input.rampLeft == 0) {
+        return output->write(data, bytes);
+    }
+
+    // Only what the output takes now is scaled, so nothing comes back to be scaled twice
+    size_t frameBytes = channels * 2;
+    size_t space = output->availableForWrite();
+    size_t frames = (bytes < space ? bytes : space) / frameBytes;
+    int16_t* samples = (int16_t*)data;
+    if (input.rampLeft == 0) {
+        int32_t gain = input.level >> 15;
+        for (size_t i = 0; i < frames * channels; i++) {
+            samples[i] = (int16_t)((samples[i] * gain + 16384) >> 15);
+        }
+    } else {
+        for (size_t f = 0; f < frames; f++) {
+            int32_t gain = input.nextGain();
+            for (uint16_t c = 0; c < channels; c++) {
+                samples[c] = (int16_t)((samples[c] * gain + 16384) >> 15);
+            }
+            samples += channels;
+        }
+    }
+    return output->write(data, frames * frameBytes);
+}
+
+size_t AudioMixer::writeMixed(Input& input, const uint8_t* data, size_t bytes) {
+    size_t frames = bytes / (channels * 2);
+    size_t space = room(input);
+    if (frames > space) {
+        frames = space;
+    }
+
+    // Frames another input is already in add to it, the ones past those start the sum
+    const int16_t* samples = (const int16_t*)data;
+    int32_t* to = mix + input.filled * channels;
+    size_t shared = mixLength > input.filled ? mixLength - input.filled : 0;
+    if (shared > frames) {
+        shared = frames;
+    }
+    for (size_t f = 0; f < frames; f++) {
+        int32_t gain = input.nextGain();
+        if (f < shared) {
+            for (uint16_t c = 0; c < channels; c++) {
+                to[c] += samples[c] * gain;
+            }
+        } else {
+            for (uint16_t c = 0; c < channels; c++) {
+                to[c] = samples[c] * gain;
+            }
+        }
+        samples += channels;
+        to += channels;
+    }
+    input.filled += frames;
+    if (input.filled > mixLength) {
+        mixLength = input.filled;
+    }
+
+    // Out goes what every active input has added to
+    uint16_t ready = mixLength;
+    for (const Input& other : inputs) {
+        if (other.active && other.filled < ready) {
+            ready = other.filled;
+        }
+    }
+    if (ready > 0) {
+        flush(ready);
+    }
+    return frames * channels * 2;
+}
+
+void AudioMixer::flush(uint16_t frames) {
+    // Back to 16 bits in place, each sample over the first half of its own sum
+    size_t samples = (size_t)frames * channels;
+    int16_t* out = (int16_t*)mix;
+    for (size_t i = 0; i < samples; i++) {
+        out[i] = clamp16((mix[i] + 16384) >> 15);
+    }
+    output->write((uint8_t*)out, samples * 2);
+
+    memmove(mix, mix + samples, (size_t)(mixLength - frames) * channels * sizeof(int32_t));
+    mixLength -= frames;
+    for (Input& input : inputs) {
+        input.filled = input.filled > frames ? input.filled - frames : 0;
+    }
+    mixedFrames += frames;
+}
+
+void AudioMixer::drop(Input& input) {
+    // Its frames stay in the sum, the others now only wait for each other
+    input.filled = 0;
+    uint16_t ready = mixLength;
+    for (const Input& other : inputs) {
+        if (other.active && other.filled < ready) {
+            ready = other.filled;
+        }
+    }
+    if (ready > 0) {
+        flush(ready);
+    }
+}
@@ -0,0 +1,105 @@
+#ifndef AUDIO_MIXER_H
+#define AUDIO_MIXER_H
+
+#include "audio_sink.h"
+#include "fsm_image.h"
+
+// Frames of two inputs the mixer can hold while it waits for both, about
+// 6 ms at 44.1 kHz
+#define AUDIO_MIX_FRAMES 256
+
+#define AUDIO_MIX_INPUTS 2
+
+// Mixes the output of two AudioStreams into one AudioSink, each scaled by its
+// own gain, so the audio of a state can fade in over the audio of the state
+// before it while that fades out.
+//
+// Each stream writes to one of the mixer's inputs as if it were the output.
+// Gains are Q15 (AUDIO_GAIN_UNITY is 1.0) and ramp linearly, frame by frame,
+// over a given time. A sample x at gain g becomes (x * g + 16384) >> 15, the
+// samples of both inputs summed before the shift and then clamped to 16 bits.
+//
+// With one input playing, its samples go to the output straight from the
+// stream's buffers: untouched at unity gain, scaled in place otherwise. Only
+// while both play are frames added up in the mixer's own buffer, so an input
+// that gets ahead of the other waits there. Both inputs must play the same
+// format; an input that starts in another format cuts the other one off.
+class AudioMixer {
+    public:
+        class Input : public AudioSink {
+            public:
+                Input();
+
+                bool begin(const WavFormat& format) override;
+                size_t availableForWrite() override;
+                size_t write(uint8_t* data, size_t bytes) override;
+                void end() override;
+                uint32_t getUnderruns() const override;
+
+                // The stream's file ended or gave way to the next: it takes no
+                // part in the mix any more, but the output keeps running
+                void finish() override;
+
+                // Sets the gain from the next frame on, stopping any ramp
+                void setGain(uint16_t gain);
+
+                // Ramps the gain from where it is to gain over ms of output,
+                // starting with the next frame written
+                void fade(uint16_t gain, uint32_t ms);
+
+                // True while the input's frames go into the mix
+                bool isActive() const { return active; }
+
+                // Faded out (or cut off): active, gain 0 and no ramp left, or not active
+                bool isSilent() const { return !active || (level == 0 && rampLeft == 0); }
+
+                uint16_t getGain() const { return (uint16_t)(level >> 15); }
+
+            private:
+                friend class AudioMixer;
+
+                // Gain of the next frame, then moves the ramp on a frame
+                int32_t nextGain();
+
+                AudioMixer* mixer;
+                bool active;
+                int32_t level;          // Gain << 15, the fraction keeps ramps exact
+                int32_t step;           // Added to level per frame while rampLeft > 0
+                uint32_t rampLeft;      // Frames until the ramp reaches target
+                uint16_t target;
+                uint16_t filled;        // Frames of this input in the mix buffer
+        };
+
+        AudioMixer();
+
+        void begin(AudioSink& output);
+
+        // Input i, the sink of one stream
+        Input& getInput(uint8_t i) { return inputs[i]; }
+
+        // Frames that went out while both inputs were active, since begin()
+        uint64_t getMixedFrames() const { return mixedFrames; }
+
+    private:
+        // Frames an input may add to the mix buffer: what fits there and in the output
+        size_t room(const Input& input);
+        // One input alone, straight to the output
+        size_t writeDirect(Input& input, uint8_t* data, size_t bytes);
+        // Into the mix buffer, then out as far as every active input has got
+        size_t writeMixed(Input& input, const uint8_t* data, size_t bytes);
+        // Sends frames of the mix buffer to the output
+        void flush(uint16_t frames);
+        // An input stopped taking part: what only it was waiting for goes out
+        void drop(Input& input);
+        uint8_t activeInputs() const;
+
+        AudioSink* output;
+        Input inputs[AUDIO_MIX_INPUTS];
+        WavFormat format;               // Of the active inputs and the output
+        uint16_t channels;
+        uint16_t mixLength;             // Frames in mix, the most any input has filled
+        uint64_t mixedFrames;
+        int32_t mix[AUDIO_MIX_FRAMES * 2];      // Samples times gains, summed
+};
+
+#endif // AUDIO_MIXER_H
@@ -0,0 +1,195 @@
+#include "audio_prefetch.h"
+#include "telemetry.h"
+
+AudioPrefetch::AudioPrefetch() : sd(nullptr), index(nullptr), wanted(0), loading(-1), hits(0), misses(0), loads(0) {
+    for (uint8_t s = 0; s < AUDIO_PREFETCH_SLOTS; s++) {
+        entries[s].key[0] = '\0';
+        entries[s].ready = false;
+    }
+}
+
+void AudioPrefetch::begin(SdFat32& sd_, AudioIndex* index_) {
+    sd = &sd_;
+    index = index_;
+    hits = 0;
+    misses = 0;
+    loads = 0;
+}
+
+void AudioPrefetch::want(const char* const* keys, uint8_t count) {
+    if (count > AUDIO_PREFETCH_SLOTS) {
+        count = AUDIO_PREFETCH_SLOTS;
+    }
+    bool taken[AUDIO_PREFETCH_SLOTS] = {};
+    int8_t slotOf[AUDIO_PREFETCH_SLOTS];
+
+    // Files that are already cached, or on their way, keep their slot
+    for (uint8_t i = 0; i < count; i++) {
+        slotOf[i] = -1;
+        for (uint8_t s = 0; s < AUDIO_PREFETCH_SLOTS; s++) {
+            if (!taken[s] && strcmp(entries[s].key, keys[i]) == 0 && current(entries[s], s)) {
+                taken[s] = true;
+                slotOf[i] = s;
+                break;
+            }
+        }
+    }
+
+    // The others take over slots no wanted file is using. Slots that are
+    // left over keep what they have, it may still be played.
+    for (uint8_t i = 0; i < count; i++) {
+        if (slotOf[i] >= 0 || strlen(keys[i]) >= AUDIO_PREFETCH_PATH) {
+            continue;
+        }
+        for (uint8_t s = 0; s < AUDIO_PREFETCH_SLOTS; s++) {
+            if (!taken[s]) {
+                if (loading == s) {
+                    file.close();
+                    loading = -1;
+                }
+                taken[s] = true;
+                slotOf[i] = s;
+                strcpy(entries[s].key, keys[i]);
+                entries[s].ready = false;
+                entries[s].length = 0;
+                break;
+            }
+        }
+    }
+
+    wanted = 0;
+    for (uint8_t i = 0; i < count; i++) {
+        if (slotOf[i] >= 0) {
+            order[wanted++] = slotOf[i];
+        }
+    }
+}
+
+bool AudioPrefetch::current(const Entry& entry, int8_t slot) {
+    AudioIndex::Pick pick;
+    if (!index || !(entry.ready || loading == slot) || !index->peek(entry.key, pick)) {
+        return true;                // not a folder the index picks from, or not resolved yet
+    }
+    return strcmp(entry.path, pick.path) == 0;
+}
+
+const AudioPrefetch::Entry* AudioPrefetch::find(const char* key, const char* path) {
+    for (uint8_t s = 0; s < AUDIO_PREFETCH_SLOTS; s++) {
+        if (entries[s].ready && strcmp(entries[s].key, key) == 0 && (!path || strcmp(entries[s].path, path) == 0)) {
+            hits++;
+            return &entries[s];
+        }
+    }
+    misses++;
+    return nullptr;
+}
+
+bool AudioPrefetch::pending() const {
+    for (uint8_t i = 0; i < wanted; i++) {
+        const Entry& entry = entries[order[i]];
+        if (!entry.ready && entry.key[0] != '\0') {
+            return true;
+        }
+    }
+    return false;
+}
+
+void AudioPrefetch::fail(Entry& entry) {
+    telemetry.record(TELEMETRY_AUDIO_CORE, TELEMETRY_PREFETCH_FAILED);
+    entry.key[0] = '\0';
+    entry.ready = false;
+    file.close();
+    loading = -1;
+}
+
+bool AudioPrefetch::service() {
+    if (!sd) {
+        return false;
+    }
+
+    // Start on the most important file that isn't loaded: find it, open it
+    // and read its header
+    if (loading < 0) {
+        for (uint8_t i = 0; i < wanted && loading < 0; i++) {
+            const Entry& entry = entries[order[i]];
+            if (!entry.ready && entry.key[0] != '\0') {
+                loading = order[i];
+            }
+        }
+        if (loading < 0) {
+            return false;
+        }
+
+        // An indexed folder's next file is known without touching the card,
+        // and a contiguous one is read without opening it
+        Entry& entry = entries[loading];
+        size_t length = strlen(entry.key);
+        AudioIndex::Pick pick;
+        entry.firstSector = 0;
+        if (index && index->peek(entry.key, pick)) {
+            if (strlen(pick.path) >= sizeof(entry.path)) {
+                fail(entry);
+                return true;
+            }
+            strcpy(entry.path, pick.path);
+            entry.format = pick.format;
+            entry.firstSector = pick.firstSector;
+        } else {
+            if (entry.key[length - 1] == '/') {
+                if (!wav_find_first(*sd, entry.key, entry.path, sizeof(entry.path))) {
+                    fail(entry);
+                    return true;
+                }
+            } else {
+                strcpy(entry.path, entry.key);
+            }
+            file = sd->open(entry.path, O_RDONLY);
+            if (!file || wav_parse(file, entry.format) != nullptr) {
+                fail(entry);
+                return true;
+            }
+        }
+        loadStart = entry.format.dataOffset - entry.format.dataOffset % AUDIO_SECTOR_SIZE;
+        entry.length = 0;
+        if (!entry.firstSector) {
+            if (!file) {
+                file = sd->open(entry.path, O_RDONLY);
+            }
+            if (!file || !file.seekSet(loadStart)) {
+                fail(entry);
+            }
+        }
+        return true;
+    }
+
+    // Then one read per step until the slot is full or the file ends
+    Entry& entry = entries[loading];
+    uint32_t total = entry.format.dataOffset + entry.format.dataSize - loadStart;
+    if (total > AUDIO_PREFETCH_BYTES) {
+        total = AUDIO_PREFETCH_BYTES;
+    }
+    uint32_t chunk = total - entry.length;
+    if (chunk > AUDIO_PREFETCH_READ) {
+        chunk = AUDIO_PREFETCH_READ;
+    }
+    bool ok;
+    if (entry.firstSector) {
+        uint32_t sectors = (chunk + AUDIO_SECTOR_SIZE - 1) / AUDIO_SECTOR_SIZE;
+        ok = sd->card()->readSectors(entry.firstSector + (loadStart + entry.length) / AUDIO_SECTOR_SIZE,
+                                     entry.data + entry.length, sectors);
+    } else {
+        ok = file.read(entry.data + entry.length, chunk) == (int)chunk;
+    }
+    if (!ok) {
+        fail(entry);
+        return true;
+    }
+    entry.length += chunk;
+    if (entry.length == total) {
+        entry.ready = true;
+        file.close();
+        loading = -1;
+        loads++;
+    }
+    return true;
+}
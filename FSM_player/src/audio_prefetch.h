@@ -0,0 +1,94 @@
+#ifndef AUDIO_PREFETCH_H
+#define AUDIO_PREFETCH_H
+
+#include <SdFat.h>
+#include "wav.h"
+#include "audio_index.h"
+
+// Fixed RAM budget of the cache: AUDIO_PREFETCH_SLOTS files, the first
+// AUDIO_PREFETCH_BYTES of each (from the sector holding the first sample).
+// A slot holds AUDIO_PREFETCH_LEAD_MS of a file of AUDIO_PREFETCH_RATE bytes
+// per second, the time the card has to catch up once a cached file plays.
+// The default, 250 ms of 16-bit mono 44.1 kHz, takes 4 x 22 KB; smaller
+// files last longer (ADPCM four times), 16-bit stereo 44.1 kHz half as long.
+// Both can be set with -D, 250 ms of 44.1 kHz stereo takes 4 x 43 KB.
+#ifndef AUDIO_PREFETCH_LEAD_MS
+#define AUDIO_PREFETCH_LEAD_MS 250
+#endif
+#ifndef AUDIO_PREFETCH_RATE
+#define AUDIO_PREFETCH_RATE 88200
+#endif
+#define AUDIO_PREFETCH_SLOTS 4
+#define AUDIO_PREFETCH_BYTES (((uint32_t)AUDIO_PREFETCH_RATE * AUDIO_PREFETCH_LEAD_MS / 1000 + AUDIO_SECTOR_SIZE - 1) / AUDIO_SECTOR_SIZE * AUDIO_SECTOR_SIZE)
+#define AUDIO_PREFETCH_PATH  96
+#define AUDIO_PREFETCH_READ  8192   // largest read of one service() step
+
+// Keeps the start of the audio of the states the FSM can go to next in RAM.
+// When a cached file is played, AudioStream reads from this copy instead of
+// the card, so the first sound needs no folder scan, header parse or card
+// read; the file is only opened once the stream has to read past the cached part.
+//
+// The FSM says which files it wants, most important first, each time it
+// enters a state. service() loads them one step (an open or one read) at a
+// time between feeding the audio, so nothing stalls playback. For an indexed
+// folder the cache holds the file the folder plays next, and loads it again
+// when the folder has moved on.
+class AudioPrefetch {
+    public:
+        struct Entry {
+            char key[AUDIO_PREFETCH_PATH];      // audioFile as configured, "" if the slot is free
+            char path[AUDIO_PREFETCH_PATH];     // the .wav it resolved to
+            WavFormat format;
+            uint32_t firstSector;               // of a contiguous file, from the index; 0 if not known
+            uint32_t length;                    // bytes cached, from the sector holding the first sample
+            bool ready;                         // fully loaded
+            uint8_t data[AUDIO_PREFETCH_BYTES] __attribute__((aligned(4)));
+        };
+
+        AudioPrefetch();
+
+        // With an index, folders are resolved through it
+        void begin(SdFat32& sd, AudioIndex* index = nullptr);
+
+        // Replaces the wanted files (audioFile paths, most important first,
+        // up to AUDIO_PREFETCH_SLOTS). Wanted files already cached stay,
+        // the others make room.
+        void want(const char* const* keys, uint8_t count);
+
+        // The cached start of a file, nullptr if it isn't loaded (yet). With
+        // path, only if the key was resolved to that file.
+        const Entry* find(const char* key, const char* path = nullptr);
+
+        // Does one step of loading, false if there was nothing left to do
+        bool service();
+
+        // True while some wanted file isn't loaded yet
+        bool pending() const;
+
+        // Counters since begin()
+        uint32_t getHits() const { return hits; }
+        uint32_t getMisses() const { return misses; }
+        uint32_t getLoads() const { return loads; }
+
+    private:
+        // Drops a file that can't be loaded, so it isn't tried again and again
+        void fail(Entry& entry);
+        // False if the entry holds (or is loading) another file than its
+        // folder would play now
+        bool current(const Entry& entry, int8_t slot);
+
+        SdFat32* sd;
+        AudioIndex* index;
+        Entry entries[AUDIO_PREFETCH_SLOTS];
+        uint8_t order[AUDIO_PREFETCH_SLOTS];    // slots of the wanted files, most important first
+        uint8_t wanted;
+        int8_t loading;             // slot being loaded, -1 for none
+        File32 file;                // open while a slot is being loaded
+        uint32_t loadStart;         // file offset of data[0]
+
+        uint32_t hits;
+        uint32_t misses;
+        uint32_t loads;
+};
+
+#endif // AUDIO_PREFETCH_H
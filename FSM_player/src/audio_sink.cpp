@@ -0,0 +1,63 @@
+#ifndef FSM_NATIVE
+#include "audio_sink.h"
+
+bool I2SSink::begin(const WavFormat& format) {
+    if (format.bitsPerSample != 16 || format.channels > 2) {
+        return false;
+    }
+    mono = format.channels == 1;
+
+    if (running && i2s.getUnderflow()) {
+        underruns++;
+    }
+    if (running) {
+        // Same DMA setup, only the rate can differ between files
+        i2s.setFrequency(format.sampleRate);
+        return true;
+    }
+
+    i2s.setBCLK(i2s_bclk_pin);
+    i2s.setDATA(i2s_data_pin);
+    i2s.setBitsPerSample(16);
+    i2s.setBuffers(I2S_BUFFERS, I2S_BUFFER_WORDS);
+    running = i2s.begin(format.sampleRate);
+    return running;
+}
+
+size_t I2SSink::availableForWrite() {
+    if (!running) {
+        return 0;
+    }
+    if (i2s.getUnderflow()) {
+        underruns++;
+    }
+    // Every frame on the wire is 4 bytes, a mono frame in the file is 2
+    size_t space = i2s.availableForWrite() & ~3;
+    return mono ? space / 2 : space;
+}
+
+size_t I2SSink::write(uint8_t* data, size_t bytes) {
+    if (!running) {
+        return 0;
+    }
+    if (!mono) {
+        return i2s.write(data, bytes & ~3);
+    }
+
+    // Mono, each sample goes out twice
+    const int16_t* samples = (const int16_t*)data;
+    size_t count = bytes / 2;
+    size_t written = 0;
+    while (written < count && i2s.write16(samples[written], samples[written])) {
+        written++;
+    }
+    return written * 2;
+}
+
+void I2SSink::end() {
+    if (running) {
+        i2s.end();
+        running = false;
+    }
+}
+#endif
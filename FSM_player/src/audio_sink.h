@@ -0,0 +1,74 @@
+#ifndef AUDIO_SINK_H
+#define AUDIO_SINK_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "wav.h"
+
+// Where AudioStream sends the samples it reads. The stream hands over runs of
+// bytes straight out of its ring buffer; the sink copies what it takes into
+// its own output buffers (DMA on the Pico, a file on the host). The bytes are
+// the sink's to change on the way, the mixer scales them in place.
+class AudioSink {
+    public:
+        virtual ~AudioSink() {}
+
+        // Prepares for a file in this format, false if the sink can't play it
+        virtual bool begin(const WavFormat& format) = 0;
+
+        // Bytes write() would take right now
+        virtual size_t availableForWrite() = 0;
+
+        // Takes up to bytes bytes, always whole frames, returns how many it took
+        virtual size_t write(uint8_t* data, size_t bytes) = 0;
+
+        // Stops output
+        virtual void end() = 0;
+
+        // The file ended or gives way to another: what was written still
+        // plays and the output keeps running for the next begin(). Nothing
+        // to do for an output that runs until end().
+        virtual void finish() {}
+
+        // Times the output ran dry while a file was playing
+        virtual uint32_t getUnderruns() const = 0;
+};
+
+#ifndef FSM_NATIVE
+#include <I2S.h>
+
+// I2S DAC pins, LRCLK is the pin after BCLK
+#define i2s_bclk_pin 26
+#define i2s_data_pin 28
+
+// What the I2S output plays: every file is converted to 16-bit at this rate,
+// so changing files never retunes the I2S clock. With I2S_OUTPUT_MONO stereo
+// files are mixed down and both DAC channels carry the same signal.
+#define I2S_OUTPUT_RATE 44100
+#define I2S_OUTPUT_MONO true
+
+// DMA buffers of the I2S output, 6 x 256 words is about 35 ms of 44.1 kHz stereo
+#define I2S_BUFFERS      6
+#define I2S_BUFFER_WORDS 256
+
+// 16-bit PCM to an I2S DAC through arduino-pico's DMA-driven I2S output.
+// Stereo is written as it is, mono goes to both channels.
+class I2SSink : public AudioSink {
+    public:
+        I2SSink() : i2s(OUTPUT), running(false), mono(false), underruns(0) {}
+
+        bool begin(const WavFormat& format) override;
+        size_t availableForWrite() override;
+        size_t write(uint8_t* data, size_t bytes) override;
+        void end() override;
+        uint32_t getUnderruns() const override { return underruns; }
+
+    private:
+        I2S i2s;
+        bool running;
+        bool mono;
+        uint32_t underruns;
+};
+#endif
+
+#endif // AUDIO_SINK_H
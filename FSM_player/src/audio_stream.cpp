@@ -0,0 +1,344 @@
+#include "audio_stream.h"
+#include "telemetry.h"
+
+AudioStream::AudioStream() : sd(nullptr), sink(nullptr), prefetch(nullptr), index(nullptr), cached(nullptr), firstSector(0), outputRate(0), outputMono(false), repeat(false), playing(false),
+                             finished(false), fileDone(false), problem(nullptr), head(0), tail(0), count(0), carryLength(0),
+                             reads(0), rawReads(0), bytesRead(0), loops(0) {
+}
+
+void AudioStream::begin(SdFat32& sd_, AudioSink& sink_) {
+    sd = &sd_;
+    sink = &sink_;
+    reads = 0;
+    rawReads = 0;
+    bytesRead = 0;
+    loops = 0;
+    if (prefetch) {
+        prefetch->begin(sd_, index);
+    }
+}
+
+void AudioStream::prefetchNext(const char* const* paths, uint8_t count) {
+    if (prefetch) {
+        prefetch->want(paths, count);
+    }
+}
+
+bool AudioStream::play(const char* path, bool repeat_) {
+    // The file playing gives way to this one: the output isn't stopped and
+    // started again in between, it only stops if this one can't play
+    bool wasPlaying = playing;
+    if (playing) {
+        sink->finish();
+        playing = false;
+    }
+    stop();
+
+    // An indexed folder knows the file it plays next, its format and where
+    // it is on the card, and moves on to the one after
+    AudioIndex::Pick pick;
+    bool indexed = index && index->peek(path, pick);
+    if (indexed) {
+        index->advance(path);
+    }
+
+    // From the cache the format is known and the start of the file is in RAM,
+    // the file itself is opened when the stream reads past that
+    cached = prefetch ? prefetch->find(path, indexed ? pick.path : nullptr) : nullptr;
+    problem = nullptr;
+    firstSector = 0;
+    if (cached) {
+        format = cached->format;
+        strcpy(filePath, cached->path);
+        firstSector = cached->firstSector;
+    } else if (indexed) {
+        format = pick.format;
+        strcpy(filePath, pick.path);
+        firstSector = pick.firstSector;
+    } else {
+        // A folder plays its first .wav
+        size_t length = strlen(path);
+        if (length > 0 && path[length - 1] == '/') {
+            if (!wav_find_first(*sd, path, filePath, sizeof(filePath))) {
+                problem = "no .wav file in the folder";
+            }
+        } else if (length < sizeof(filePath)) {
+            strcpy(filePath, path);
+        } else {
+            problem = "path too long";
+        }
+
+        if (!problem) {
+            file = sd->open(filePath, O_RDONLY);
+            problem = file ? wav_parse(file, format) : "can't open";
+        }
+    }
+    WavFormat output;
+    if (!problem && !converter.begin(format, outputRate, outputMono, output)) {
+        problem = "format can't be converted";
+    }
+    if (!problem && converter.getInputUnit() > sizeof(carry)) {
+        problem = "too many channels";
+    }
+    if (!problem && !sink->begin(output)) {
+        problem = "format not supported by the audio output";
+    }
+    if (problem) {
+        file.close();
+        if (wasPlaying) {
+            sink->end();
+        }
+        return false;
+    }
+
+    // Reads start at the sector holding the first sample, the header bytes
+    // in front of it are skipped in the ring
+    repeat = repeat_;
+    alignedStart = format.dataOffset - format.dataOffset % AUDIO_SECTOR_SIZE;
+    dataEnd = format.dataOffset + format.dataSize;
+    readPos = alignedStart;
+    if (file) {
+        openFile();
+    }
+
+    head = 0;
+    tail = 0;
+    count = 0;
+    carryLength = 0;
+    fileDone = false;
+    finished = false;
+    playing = true;
+    fill();
+    return true;
+}
+
+void AudioStream::stop() {
+    if (playing) {
+        sink->end();
+    }
+    playing = false;
+    finished = false;
+    file.close();
+}
+
+bool AudioStream::takeFinished() {
+    bool wasFinished = finished;
+    finished = false;
+    return wasFinished;
+}
+
+unsigned long AudioStream::nextDeadline() const {
+    return millis() + (needsService() ? AUDIO_SERVICE_MS : 0x7FFFFFFFUL);
+}
+
+void AudioStream::service() {
+    if (playing) {
+        telemetry.sample(TELEMETRY_AUDIO_FILL, count * 100 / AUDIO_RING_BLOCKS);
+        drain();
+        fill();
+        drain();
+    }
+
+    // The cache only gets the card when the ring has no read due
+    if (prefetch && (!playing || fileDone || AUDIO_RING_BLOCKS - count < AUDIO_REFILL_BLOCKS)) {
+        prefetch->service();
+    }
+}
+
+bool AudioStream::openFile() {
+    if (!file) {
+        file = sd->open(filePath, O_RDONLY);
+    }
+    if (!file || !file.seekSet(readPos)) {
+        return false;
+    }
+
+    // One piece on the card: read its sectors directly from now on
+    uint32_t endSector;
+    if (!firstSector && !file.contiguousRange(&firstSector, &endSector)) {
+        firstSector = 0;
+    }
+    return true;
+}
+
+void AudioStream::fill() {
+    if (AUDIO_RING_BLOCKS - count < AUDIO_REFILL_BLOCKS) {
+        return;
+    }
+
+    while (playing && !fileDone && count < AUDIO_RING_BLOCKS) {
+        // All free blocks that follow each other in the ring, in one read
+        uint8_t run = AUDIO_RING_BLOCKS - count;
+        if (run > AUDIO_RING_BLOCKS - head) {
+            run = AUDIO_RING_BLOCKS - head;
+        }
+        uint32_t want = (uint32_t)run * AUDIO_BLOCK_SIZE;
+        uint32_t left = dataEnd - readPos;
+        if (want > left) {
+            want = left;
+        }
+
+        // What the cache holds comes from RAM, for as long as the slot the
+        // file started from still has it (the cache may have moved on)
+        uint32_t offset = readPos - alignedStart;
+        if (cached && cached->ready && offset < cached->length && strcmp(cached->path, filePath) == 0) {
+            if (want > cached->length - offset) {
+                want = cached->length - offset;
+            }
+            memcpy(ring[head], cached->data + offset, want);
+            addBlocks(want);
+            continue;
+        }
+
+        // A file started from the cache or the index is opened at its first
+        // read, unless it is contiguous and where it is already known
+        if (!firstSector && !file && !openFile()) {
+            problem = "can't open";
+            telemetry.record(TELEMETRY_AUDIO_CORE, TELEMETRY_READ_FAILED);
+            stop();
+            return;
+        }
+
+        bool ok;
+        uint32_t start = Telemetry::now();
+        if (firstSector) {
+            // Whole sectors, the end of the last one past the samples is never played
+            uint32_t sectors = (want + AUDIO_SECTOR_SIZE - 1) / AUDIO_SECTOR_SIZE;
+            ok = sd->card()->readSectors(firstSector + readPos / AUDIO_SECTOR_SIZE, ring[head], sectors);
+            rawReads++;
+        } else {
+            ok = file.read(ring[head], want) == (int)want;
+        }
+        telemetry.sample(TELEMETRY_SD_READ_US, Telemetry::now() - start);
+        if (!ok) {
+            problem = "read from the card failed";
+            telemetry.record(TELEMETRY_AUDIO_CORE, TELEMETRY_READ_FAILED);
+            stop();
+            return;
+        }
+        reads++;
+        bytesRead += want;
+        addBlocks(want);
+    }
+}
+
+void AudioStream::addBlocks(uint32_t length) {
+    // Split into blocks, marking the samples in each
+    for (uint32_t offset = 0; offset < length; offset += AUDIO_BLOCK_SIZE) {
+        uint32_t pos = readPos + offset;
+        uint32_t end = pos + AUDIO_BLOCK_SIZE < dataEnd ? pos + AUDIO_BLOCK_SIZE : dataEnd;
+        if (end > readPos + length) {
+            end = readPos + length;
+        }
+        Block& block = blocks[head];
+        block.start = pos < format.dataOffset ? format.dataOffset - pos : 0;
+        block.end = end - pos;
+        block.last = end == dataEnd;
+        head = (head + 1) % AUDIO_RING_BLOCKS;
+        count++;
+    }
+    readPos += length;
+
+    // End of the samples: a repeating file goes round again
+    if (readPos == dataEnd) {
+        if (repeat) {
+            readPos = alignedStart;
+            if (file && !firstSector) {
+                file.seekSet(readPos);
+            }
+        } else {
+            fileDone = true;
+        }
+    }
+}
+
+void AudioStream::releaseBlock() {
+    if (blocks[tail].last) {
+        // The whole file has gone to the sink
+        finished = true;
+        if (repeat) {
+            loops++;
+        } else {
+            playing = false;
+            file.close();
+        }
+    }
+    tail = (tail + 1) % AUDIO_RING_BLOCKS;
+    count--;
+}
+
+void AudioStream::drain() {
+    uint16_t frame = converter.getInputUnit();
+
+    while (playing) {
+        // Finish a frame that was split across two blocks first
+        if (carryLength > 0) {
+            while (carryLength < frame && count > 0) {
+                Block& block = blocks[tail];
+                uint16_t take = frame - carryLength;
+                if (take > block.end - block.start) {
+                    take = block.end - block.start;
+                }
+                memcpy(carry + carryLength, ring[tail] + block.start, take);
+                carryLength += take;
+                block.start += take;
+                if (block.start == block.end) {
+                    releaseBlock();
+                }
+            }
+            if (carryLength < frame || output(carry, frame) == 0) {
+                return;
+            }
+            carryLength = 0;
+        }
+
+        if (count == 0) {
+            return;
+        }
+
+        // Whole frames go to the sink straight from the ring
+        Block& block = blocks[tail];
+        uint16_t length = block.end - block.start;
+        uint16_t whole = length - length % frame;
+        if (whole > 0) {
+            size_t written = output(ring[tail] + block.start, whole);
+            block.start += written;
+            if (written < whole) {
+                return;
+            }
+        }
+
+        // A frame cut off by the end of the block waits in carry for the rest
+        carryLength = block.end - block.start;
+        memcpy(carry, ring[tail] + block.start, carryLength);
+        releaseBlock();
+    }
+}
+
+size_t AudioStream::output(uint8_t* data, size_t bytes) {
+    if (converter.isPassThrough()) {
+        return sink->write(data, bytes);
+    }
+
+    // Only as many frames as the sink has room for are converted, so all
+    // of them are taken and the converter never has to hold any back
+    uint16_t frame = converter.getOutputFrame();
+    size_t taken = 0;
+    while (taken < bytes) {
+        size_t room = sink->availableForWrite() / frame;
+        if (room > AUDIO_CONVERT_FRAMES) {
+            room = AUDIO_CONVERT_FRAMES;
+        }
+        if (room == 0) {
+            break;
+        }
+        size_t used;
+        size_t frames = converter.convert(data + taken, bytes - taken, converted, room, used);
+        sink->write((uint8_t*)converted, frames * frame);
+        taken += used;
+        if (frames == 0 && used == 0) {
+            break;
+        }
+    }
+    return taken;
+}
@@ -0,0 +1,157 @@
+#ifndef AUDIO_STREAM_H
+#define AUDIO_STREAM_H
+
+#include <SdFat.h>
+#include "wav.h"
+#include "audio_sink.h"
+#include "audio_prefetch.h"
+#include "audio_index.h"
+#include "audio_convert.h"
+
+// Ring buffer: AUDIO_RING_BLOCKS blocks of AUDIO_BLOCK_SIZE bytes. Blocks are
+// whole SD sectors and are read at sector-aligned file offsets, several at a
+// time when they follow each other in the ring.
+#define AUDIO_BLOCK_SIZE   2048
+#define AUDIO_RING_BLOCKS  8
+
+// Reads wait until this many blocks are free, so each one is at least this big
+#define AUDIO_REFILL_BLOCKS 4
+
+// How often service() has to run while playing, well inside the sink's buffer
+#define AUDIO_SERVICE_MS   5
+
+// Streams a .wav file from the SD card to an AudioSink.
+// The header is parsed once when the file starts, after that service() keeps
+// the ring topped up with large reads and hands the sink runs of bytes
+// straight from the ring. A file stored in one piece on the card is read with
+// raw multi-sector reads at its known sectors, without the FAT; fragmented
+// files go through the file system. A repeating file wraps around to its first sample
+// in the ring itself, so loops are gapless. Nothing blocks, service() is
+// called from AudioEngine::run() on core1. Nothing is printed from there
+// either: why a file didn't play is kept for the engine to pass on.
+class AudioStream {
+    public:
+        AudioStream();
+
+        void begin(SdFat32& sd, AudioSink& sink);
+
+        // The card begin() was given
+        SdFat32* getCard() const { return sd; }
+
+        // Cache of the starts of files that may be played next, none by default
+        void setPrefetch(AudioPrefetch* cache) { prefetch = cache; }
+
+        // Index of the audio folders, which picks the file a folder plays.
+        // Without one (or for a folder it doesn't have) a folder plays its
+        // first .wav, found by a directory scan. Set before begin().
+        void setIndex(AudioIndex* folderIndex) { index = folderIndex; }
+
+        // Output format: every file is converted to 16-bit at rate (0 plays
+        // each file at its own rate) and with mono, stereo files are mixed
+        // down to one channel. 16-bit files at the output's rate and channel
+        // count go to the sink as they are. Set before play().
+        void setOutput(uint32_t rate, bool mono) { outputRate = rate; outputMono = mono; }
+
+        // Files (audioFile paths) to cache, most important first
+        void prefetchNext(const char* const* paths, uint8_t count);
+
+        // Starts a file, or when path ends in '/' the folder's next file as
+        // the index picks it (the first .wav by name without an index).
+        // Whatever was playing stops. False if there is nothing playable
+        // there, getProblem() says why.
+        bool play(const char* path, bool repeat);
+
+        // Stops playback, nothing is reported as finished
+        void stop();
+
+        // Reads ahead and feeds the sink, then loads the prefetch cache a step
+        void service();
+
+        bool isPlaying() const { return playing; }
+
+        // True while service() has work: playing, or files left to prefetch
+        bool needsService() const { return playing || (prefetch && prefetch->pending()); }
+
+        // True once when a file has been handed to the sink in full: at the end
+        // of a non-repeating file, and at every wrap of a repeating one
+        bool takeFinished();
+
+        // Latest millis() by which service() must run again
+        unsigned long nextDeadline() const;
+
+        const WavFormat& getFormat() const { return format; }
+
+        // Why the last play() failed or the file stopped early, nullptr if
+        // it didn't. A string constant, it stays valid on the other core.
+        const char* getProblem() const { return problem; }
+
+        // Times the output ran dry
+        uint32_t getUnderruns() const { return sink ? sink->getUnderruns() : 0; }
+
+        // Counters since begin()
+        uint32_t getReads() const { return reads; }
+        uint32_t getRawReads() const { return rawReads; }
+        uint64_t getBytesRead() const { return bytesRead; }
+        uint32_t getLoops() const { return loops; }
+
+    private:
+        // Opens filePath if it isn't open yet, moves to readPos and finds out
+        // whether the file is contiguous. False if that fails.
+        bool openFile();
+        // Fills free ring blocks from the file
+        void fill();
+        // Marks length bytes just put at the ring's head as blocks, moves readPos on
+        void addBlocks(uint32_t length);
+        // Hands ring data to the sink
+        void drain();
+        // Hands whole frames of the file to the sink through the converter,
+        // returns how many bytes of them it took
+        size_t output(uint8_t* data, size_t bytes);
+        // Frees the oldest block once the sink has all of it
+        void releaseBlock();
+
+        struct Block {
+            uint16_t start;     // First valid byte
+            uint16_t end;       // One past the last valid byte
+            bool last;          // Holds the last sample of the file
+        };
+
+        SdFat32* sd;
+        AudioSink* sink;
+        AudioPrefetch* prefetch;
+        AudioIndex* index;
+        const AudioPrefetch::Entry* cached;     // the file's start in the cache, nullptr if it wasn't there
+        File32 file;                    // opened when the first read is due
+        uint32_t firstSector;           // Card sector of a contiguous file's first byte, 0: read through the FAT
+        char filePath[AUDIO_INDEX_FOLDER + AUDIO_INDEX_NAME];
+        WavFormat format;
+        uint32_t outputRate;            // 0: each file at its own rate
+        bool outputMono;
+        AudioConverter converter;
+        int16_t converted[AUDIO_CONVERT_FRAMES * 2] __attribute__((aligned(4)));   // On their way to the sink
+        bool repeat;
+        bool playing;
+        bool finished;
+        bool fileDone;                  // Every sample of a non-repeating file is in the ring
+        const char* problem;
+
+        uint32_t alignedStart;          // Sector holding the first sample
+        uint32_t dataEnd;               // One past the last sample in the file
+        uint32_t readPos;               // Next file offset to read, sector aligned
+
+        uint8_t ring[AUDIO_RING_BLOCKS][AUDIO_BLOCK_SIZE] __attribute__((aligned(4)));
+        Block blocks[AUDIO_RING_BLOCKS];
+        uint8_t head;                   // Next block to fill
+        uint8_t tail;                   // Next block to play
+        uint8_t count;                  // Filled blocks
+
+        uint8_t carry[8] __attribute__((aligned(4)));   // A frame split across two blocks
+        uint8_t carryLength;
+
+        uint32_t reads;
+        uint32_t rawReads;
+        uint64_t bytesRead;
+        uint32_t loops;
+};
+
+#endif // AUDIO_STREAM_H
@@ -0,0 +1,81 @@
+#include "debounce.h"
+
+void Debouncer::begin(uint32_t levels, uint8_t mode_) {
+    mode = mode_;
+    debounced = levels;
+    count0 = 0xFFFFFFFFUL;      // every counter idle at 3
+    count1 = 0xFFFFFFFFUL;
+    pendingMask = 0;
+    fellMask = 0;
+    roseMask = 0;
+}
+
+uint32_t Debouncer::sample(uint32_t raw) {
+    uint32_t delta = raw ^ debounced;           // inputs reading differently from their debounced level
+    uint32_t toggle;
+
+    if (mode == DEBOUNCE_LEADING) {
+        // Count every input that is locked out up towards 3 (quiet)...
+        uint32_t counting = ~(count0 & count1);
+        count1 ^= count0 & counting;
+        count0 ^= counting;
+
+        // ...take changes of quiet inputs at once and lock them out from 0
+        toggle = delta & ~counting;
+        count0 &= ~toggle;
+        count1 &= ~toggle;
+    } else {
+        // Count those inputs down 3, 2, 1, 0, reset the others back to 3
+        count0 = ~(count0 & delta);
+        count1 = count0 ^ (count1 & delta);
+
+        // Inputs whose counter wrapped around have been stable for 4 samples
+        toggle = delta & count0 & count1;
+    }
+    debounced ^= toggle;
+    pendingMask = delta & ~toggle;
+
+    fellMask = toggle & ~debounced;
+    roseMask = toggle & debounced;
+    return debounced;
+}
+
+void ButtonGesture::begin(uint16_t longPressMs_) {
+    longPressMs = longPressMs_;
+    pressStart = 0;
+    isHeld = false;
+    isLongHeld = false;
+    isHoldSent = false;
+}
+
+uint8_t ButtonGesture::update(bool down, bool up, unsigned long now) {
+    uint8_t events = 0;
+
+    if (down) {
+        events |= BUTTON_PRESS;
+        pressStart = now;
+        isHeld = true;
+        isLongHeld = false;
+        isHoldSent = false;
+    }
+
+    if (isHeld && !isLongHeld && now - pressStart >= longPressMs) {
+        events |= BUTTON_LONG_PRESS;
+        isLongHeld = true;
+    }
+    if (isLongHeld && !isHoldSent && now - pressStart >= 2UL * longPressMs) {
+        events |= BUTTON_HOLD;
+        isHoldSent = true;
+    }
+
+    if (up && isHeld) {
+        events |= BUTTON_RELEASE;
+        if (!isLongHeld) {
+            events |= BUTTON_SHORT_PRESS;
+        }
+        isHeld = false;
+        isLongHeld = false;
+    }
+
+    return events;
+}
@@ -0,0 +1,87 @@
+#ifndef DEBOUNCE_H
+#define DEBOUNCE_H
+
+#include <stdint.h>
+
+// Debounces up to 32 inputs at once with a 2-bit vertical counter: bit n of
+// count0/count1 together form the counter of input n, so every input is
+// handled by the same handful of word operations per sample. Nothing blocks,
+// call sample() at a fixed interval (debounce time / 4) while settling().
+//
+// DEBOUNCE_STABLE: an input takes its new level after reading it on 4
+// consecutive samples, any sample back at the old level restarts its count.
+// DEBOUNCE_LEADING: an input that has been quiet takes its new level on the
+// first sample, then ignores its bounce for the next 3 samples. Changes get
+// through with no delay, at the cost of letting single glitches through.
+// Leading is the default, the player is there to react to its visitors.
+#define DEBOUNCE_STABLE  0
+#define DEBOUNCE_LEADING 1
+
+class Debouncer {
+    public:
+        // Starts with the given levels as the debounced state, no events
+        void begin(uint32_t levels, uint8_t mode = DEBOUNCE_LEADING);
+
+        // Feeds one raw sample of all inputs, returns the debounced levels
+        uint32_t sample(uint32_t raw);
+
+        // Debounced levels after the last sample
+        uint32_t state() const { return debounced; }
+
+        // Inputs that went 1->0 / 0->1 at the last sample
+        uint32_t fell() const { return fellMask; }
+        uint32_t rose() const { return roseMask; }
+
+        // True while some input is part way through a change, or still reads
+        // differently from its debounced level
+        bool settling() const { return (count0 & count1) != 0xFFFFFFFFUL || pendingMask != 0; }
+
+    private:
+        uint8_t mode;
+        uint32_t debounced;
+        uint32_t count0;        // counter bit 0 of every input
+        uint32_t count1;        // counter bit 1 of every input
+        uint32_t pendingMask;   // inputs that read differently and were not taken yet
+        uint32_t fellMask;
+        uint32_t roseMask;
+};
+
+// Button gesture events, as bits
+#define BUTTON_PRESS       0x01   // went down
+#define BUTTON_RELEASE     0x02   // came up
+#define BUTTON_SHORT_PRESS 0x04   // came up before the long press time
+#define BUTTON_LONG_PRESS  0x08   // held for the long press time, sent once while still held
+#define BUTTON_HOLD        0x10   // held on for twice the long press time, sent once while still held
+
+// Turns the debounced edges of one button into press/release and short/long
+// press events, without waiting for the release.
+class ButtonGesture {
+    public:
+        void begin(uint16_t longPressMs);
+
+        // down/up: the button's debounced edges from this sample. Returns BUTTON_* bits.
+        uint8_t update(bool down, bool up, unsigned long now);
+
+        bool held() const { return isHeld; }
+        bool longHeld() const { return isLongHeld; }
+        unsigned long heldSince() const { return pressStart; }
+
+        // When the long press fires if the button stays down
+        unsigned long longPressAt() const { return pressStart + longPressMs; }
+
+        // When the next event fires if the button stays down, the long press
+        // or the hold; false if it isn't held or both were sent
+        bool nextEventAt(unsigned long& at) const {
+            at = pressStart + (isLongHeld ? 2UL * longPressMs : longPressMs);
+            return isHeld && !isHoldSent;
+        }
+
+    private:
+        uint16_t longPressMs;
+        unsigned long pressStart;
+        bool isHeld;
+        bool isLongHeld;
+        bool isHoldSent;
+};
+
+#endif // DEBOUNCE_H
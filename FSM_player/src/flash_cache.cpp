@@ -0,0 +1,72 @@
+#include <LittleFS.h>
+#include <stdlib.h>
+#include <string.h>
+#include "flash_cache.h"
+#include "fsm_image.h"
+
+FlashCache flashCache;
+
+#define FLASH_CACHE_TEMP "/cache.tmp"
+
+bool FlashCache::begin() {
+    mounted = LittleFS.begin();
+    return mounted;
+}
+
+// Opens an entry and reads its header, checked against the key
+static bool open_entry(const char* name, uint32_t key, File& file, FlashCacheHeader& header) {
+    file = LittleFS.open(name, "r");
+    return file && file.read((uint8_t*)&header, sizeof(header)) == sizeof(header) &&
+           header.magic == FLASH_CACHE_MAGIC && header.key == key &&
+           header.size == file.size() - sizeof(header);
+}
+
+uint8_t* FlashCache::load(const char* name, uint32_t key, uint32_t& size) {
+    File file;
+    FlashCacheHeader header;
+    uint8_t* data = nullptr;
+    if (mounted && open_entry(name, key, file, header) && header.size > 0) {
+        data = (uint8_t*)malloc(header.size);
+        if (data && (file.read(data, header.size) != header.size || fsm_crc32(data, header.size) != header.crc)) {
+            free(data);
+            data = nullptr;
+        }
+    }
+    if (data) {
+        size = header.size;
+        hits++;
+    } else {
+        misses++;
+    }
+    return data;
+}
+
+bool FlashCache::has(const char* name, uint32_t key) {
+    File file;
+    FlashCacheHeader header;
+    bool found = mounted && open_entry(name, key, file, header);
+    if (found) {
+        hits++;
+    } else {
+        misses++;
+    }
+    return found;
+}
+
+bool FlashCache::save(const char* name, uint32_t key, const void* data, uint32_t size) {
+    if (!mounted) {
+        return false;
+    }
+    FlashCacheHeader header = {FLASH_CACHE_MAGIC, key, size, fsm_crc32(data, size)};
+    File file = LittleFS.open(FLASH_CACHE_TEMP, "w");
+    bool ok = file && file.write((const uint8_t*)&header, sizeof(header)) == sizeof(header) &&
+              file.write((const uint8_t*)data, size) == size;
+    file.close();
+
+    // LittleFS renames atomically, the old entry stays until the new one is complete
+    ok = ok && LittleFS.rename(FLASH_CACHE_TEMP, name);
+    if (!ok) {
+        LittleFS.remove(FLASH_CACHE_TEMP);
+    }
+    return ok;
+}
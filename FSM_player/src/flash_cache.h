@@ -0,0 +1,64 @@
+#ifndef FLASH_CACHE_H
+#define FLASH_CACHE_H
+
+#include <stdint.h>
+
+// Things worked out from the card at boot, kept in the Pico's onboard flash
+// (LittleFS, in the board_build.filesystem_size part of platformio.ini) so
+// the next boot can skip the work.
+//
+// Each entry is one file: a header with the key it was made for, its size
+// and a CRC, then the data. The key is a signature of the card files it was
+// made from (sd_files_signature()); an entry is only used while they are
+// unchanged, otherwise it is made again and replaces the old one. An entry
+// is written to a temporary file and renamed over the old one, so a power
+// cut while saving leaves the old entry or the new one, never half of it.
+//
+// Only this file and state_journal.cpp include LittleFS.h, its File clashes
+// with SdFat's.
+#define FLASH_CACHE_CONFIG "/config.img"    // The compiled state table, for the config files' signature
+#define FLASH_CACHE_INDEX  "/index.key"     // Signature of the card's audio index when it was last checked
+
+#define FLASH_CACHE_MAGIC 0x43534D46UL      // "FSMC"
+
+struct FlashCacheHeader {
+    uint32_t magic;             // FLASH_CACHE_MAGIC
+    uint32_t key;
+    uint32_t size;              // Of the data after the header
+    uint32_t crc;               // CRC-32 of the data
+};
+
+class FlashCache {
+    public:
+        FlashCache() : mounted(false), hits(0), misses(0) {}
+
+        // Mounts the flash filesystem (formatting it the first time). Without
+        // it every load misses and every save does nothing.
+        bool begin();
+        void end() { mounted = false; }
+        bool isMounted() const { return mounted; }
+
+        // The data saved under name for key, in a buffer the caller frees and
+        // its size; nullptr if there is none for that key or it is damaged
+        uint8_t* load(const char* name, uint32_t key, uint32_t& size);
+
+        // Whether name was saved for key, without reading its data
+        bool has(const char* name, uint32_t key);
+
+        // Saves data under name for key in place of what was there
+        bool save(const char* name, uint32_t key, const void* data, uint32_t size);
+
+        // Loads that found their entry, and ones that didn't
+        uint16_t getHits() const { return hits; }
+        uint16_t getMisses() const { return misses; }
+
+    private:
+        bool mounted;
+        uint16_t hits;
+        uint16_t misses;
+};
+
+// The firmware's cache
+extern FlashCache flashCache;
+
+#endif // FLASH_CACHE_H
@@ -0,0 +1,137 @@
+#ifndef FSM_BUILTIN_H
+#define FSM_BUILTIN_H
+
+#include <stddef.h>
+#include "fsm_image.h"
+#include "debounce.h"
+
+// State table built into the firmware.
+//
+// For a show that never changes, tools/fsm_codegen.cpp (env:fsm_codegen)
+// writes FSM_Config.json out as include/fsm_builtin_config.h: the image
+// fsm_image_compile makes, as constexpr tables of States, Transitions and
+// Conditions in an FsmBuiltinImage. The env:rpipicow_builtin firmware
+// (FSM_BUILTIN_CONFIG) uses it in place. Being const it stays in flash, so
+// nothing is read from the card or parsed at boot and the state table takes
+// no RAM; the card is only needed for the audio.
+//
+// The layout is that of a compiled image, byte for byte, so FSM uses it like
+// any other. fsm_builtin_check() runs while the firmware compiles: a table
+// that refers to a state, transition, condition, sensor, string or program
+// that isn't there, or whose masks don't match its conditions, is a compile
+// error naming what is wrong instead of misbehaving on the player.
+
+template <uint16_t States, uint16_t Transitions, uint16_t Conditions, uint32_t Code, uint32_t Strings>
+struct FsmBuiltinImage {
+    FsmImageHeader header;
+    State states[States];
+    Transition transitions[Transitions];
+    Condition conditions[Conditions];
+    uint8_t code[Code];         // codeSize bytes, padded to 4
+    char strings[Strings];      // stringsSize bytes, padded to 4
+
+    const uint8_t* bytes() const { return (const uint8_t*)this; }
+};
+
+// Not constexpr: a check that fails calls it, and the compiler stops there
+// with the reason in the error
+inline bool fsm_builtin_failed(const char* reason) {
+    return reason == nullptr;
+}
+
+// Checks a built-in table the way fsm_image_check checks an image, minus the
+// CRC and the condition programs' code, which fsm_codegen checked. True if it
+// is usable, otherwise it doesn't compile.
+template <uint16_t S, uint16_t T, uint16_t C, uint32_t K, uint32_t N>
+constexpr bool fsm_builtin_check(const FsmBuiltinImage<S, T, C, K, N>& image) {
+    typedef FsmBuiltinImage<S, T, C, K, N> Image;
+    const FsmImageHeader& header = image.header;
+
+    if (header.magic != FSM_IMAGE_MAGIC || header.version != FSM_IMAGE_VERSION || header.headerSize != sizeof(FsmImageHeader)) {
+        return fsm_builtin_failed("not a current FSM image, run fsm_codegen again");
+    }
+    if (header.numStates != S || header.numTransitions != T || header.numConditions != C ||
+        header.statesOffset != offsetof(Image, states) || header.transitionsOffset != offsetof(Image, transitions) ||
+        header.conditionsOffset != offsetof(Image, conditions) || header.codeOffset != offsetof(Image, code) ||
+        header.codeSize > K || header.stringsOffset != offsetof(Image, strings) || header.stringsSize > N ||
+        header.imageSize != offsetof(Image, strings) + N) {
+        return fsm_builtin_failed("header does not match the tables");
+    }
+    if (S == 0 || S > FSM_MAX_STATES) {
+        return fsm_builtin_failed("need 1 to 255 states");
+    }
+    if (header.debounceMs < 4 || header.longPressMs < header.debounceMs || header.debounceMode > DEBOUNCE_LEADING) {
+        return fsm_builtin_failed("bad input timings");
+    }
+    if (header.numInputs == 0 || header.numInputs > FSM_MAX_INPUTS) {
+        return fsm_builtin_failed("need 1 to 32 inputs");
+    }
+    uint32_t usedPins = 0;
+    for (uint8_t i = 0; i < header.numInputs; i++) {
+        if (header.inputPins[i] >= FSM_NUM_GPIO || (usedPins & (1UL << header.inputPins[i]))) {
+            return fsm_builtin_failed("input on a GPIO that doesn't exist or is listed twice");
+        }
+        if (FSM_RESERVED_GPIO & (1UL << header.inputPins[i])) {
+            return fsm_builtin_failed("input on a GPIO the player uses itself");
+        }
+        usedPins |= 1UL << header.inputPins[i];
+    }
+    if (header.stringsSize == 0 || image.strings[header.stringsSize - 1] != '\0') {
+        return fsm_builtin_failed("string pool not terminated");
+    }
+
+    for (uint16_t i = 0; i < S; i++) {
+        const State& state = image.states[i];
+        if (state.id != i) {
+            return fsm_builtin_failed("state ids must be sequential from 0");
+        }
+        if (state.numTransitions < 2 || state.firstTransition + state.numTransitions > T) {
+            return fsm_builtin_failed("state transitions out of range");
+        }
+        if (state.audioFile >= header.stringsSize) {
+            return fsm_builtin_failed("state audio file out of range");
+        }
+        if (state.select > AUDIO_SELECT_WEIGHTED || state.gain > AUDIO_GAIN_UNITY ||
+            state.fadeIn > AUDIO_FADE_MAX_MS || state.fadeOut > AUDIO_FADE_MAX_MS) {
+            return fsm_builtin_failed("state has a bad select mode, gain or fade");
+        }
+    }
+
+    for (uint16_t j = 0; j < T; j++) {
+        const Transition& transition = image.transitions[j];
+        if (transition.targetState >= S) {
+            return fsm_builtin_failed("transition targets a missing state");
+        }
+        if (transition.firstCondition + transition.numConditions > C) {
+            return fsm_builtin_failed("transition conditions out of range");
+        }
+        for (uint8_t k = 0; k < transition.numConditions; k++) {
+            const Condition& condition = image.conditions[transition.firstCondition + k];
+            if (condition.type > RESET_FLAG) {
+                return fsm_builtin_failed("bad condition type");
+            }
+            if (condition.type == SENSOR && condition.sensorPin >= header.numInputs) {
+                return fsm_builtin_failed("condition uses a sensor pin that isn't in the inputs");
+            }
+        }
+        if (transition.program >= header.codeSize || transition.actions >= header.codeSize) {
+            return fsm_builtin_failed("transition program out of range");
+        }
+
+        Transition compiled = transition;
+        fsm_compile_transition(compiled, image.conditions);
+        if (compiled.careMask != transition.careMask || compiled.valueMask != transition.valueMask ||
+            compiled.minElapsed != transition.minElapsed || compiled.needs != transition.needs) {
+            return fsm_builtin_failed("transition masks do not match its conditions");
+        }
+    }
+    return true;
+}
+
+// The FSM_USES_* bits of a built-in table, known at compile time
+template <uint16_t S, uint16_t T, uint16_t C, uint32_t K, uint32_t N>
+constexpr uint8_t fsm_builtin_uses(const FsmBuiltinImage<S, T, C, K, N>& image) {
+    return fsm_uses(image.transitions, T);
+}
+
+#endif // FSM_BUILTIN_H
@@ -0,0 +1,510 @@
+#include <string.h>
+#include <stdio.h>
+#include "fsm_image.h"
+#include "fsm_program.h"
+#include "debounce.h"
+
+// The image layout is shared between the host compiler and the firmware, so the
+// record sizes must not depend on the compiler or target.
+static_assert(sizeof(Condition) == 8, "Condition layout changed, bump FSM_IMAGE_VERSION");
+static_assert(sizeof(Transition) == 24, "Transition layout changed, bump FSM_IMAGE_VERSION");
+static_assert(sizeof(State) == 16, "State layout changed, bump FSM_IMAGE_VERSION");
+static_assert(sizeof(FsmImageHeader) == 88, "FsmImageHeader layout changed, bump FSM_IMAGE_VERSION");
+
+static char message[80];    // Detail for the last compile/check error
+
+// Start of every code pool: offset 0 stands for "no program", the reset
+// transitions share the action at 1 that clears the variables
+static const uint8_t code_start[] = {OP_END, OP_CLEAR, OP_END};
+#define CODE_CLEAR_VARS 1
+
+static uint32_t align4(uint32_t n) {
+    return (n + 3) & ~3UL;
+}
+
+uint32_t fsm_crc32(const void* data, size_t length, uint32_t crc) {
+    // Bitwise CRC-32 (IEEE), only used at load time so no table
+    const uint8_t* p = (const uint8_t*)data;
+    crc = ~crc;
+    while (length--) {
+        crc ^= *p++;
+        for (uint8_t k = 0; k < 8; k++) {
+            crc = (crc >> 1) ^ (0xEDB88320UL & (0 - (crc & 1)));
+        }
+    }
+    return ~crc;
+}
+
+// A whole number of the config up to max. ArduinoJson turns a number that
+// doesn't fit the field, a missing one or text into 0, a state or an input
+// that exists, so these are checked on the JSON before that happens.
+static bool json_whole(JsonVariantConst value, uint32_t max) {
+    return value.is<uint32_t>() && value.as<uint32_t>() <= max;
+}
+
+// Returns the index of an earlier state with the same audio file, or -1
+static int find_audio_file(JsonArray statesArray, uint16_t i, const char* audioFile) {
+    int j = 0;
+    for (JsonObject other : statesArray) {
+        if (j == i) {
+            break;
+        }
+        if (strcmp(other["audioFile"] | "", audioFile) == 0) {
+            return j;
+        }
+        j++;
+    }
+    return -1;
+}
+
+uint32_t fsm_image_compile(JsonObject config, uint8_t* image, uint32_t capacity, const char** err) {
+    JsonArray statesArray = config["states"];
+    uint32_t numStates = statesArray.size();
+
+    if (numStates == 0 || numStates > FSM_MAX_STATES) {
+        snprintf(message, sizeof(message), "need 1 to %d states, found %lu", FSM_MAX_STATES, (unsigned long)numStates);
+        *err = message;
+        return 0;
+    }
+
+    // Sensor inputs, by default the eight original switch inputs on GPIO0-7
+    uint8_t inputPins[FSM_MAX_INPUTS];
+    uint8_t numInputs = 0;
+    if (config.containsKey("inputs")) {
+        JsonArray inputsArray = config["inputs"];
+        if (inputsArray.size() == 0 || inputsArray.size() > FSM_MAX_INPUTS) {
+            snprintf(message, sizeof(message), "need 1 to %d inputs", FSM_MAX_INPUTS);
+            *err = message;
+            return 0;
+        }
+        for (JsonVariant pin : inputsArray) {
+            if (!json_whole(pin, 255)) {
+                snprintf(message, sizeof(message), "input %u: GPIO must be a number 0-%d", numInputs, FSM_NUM_GPIO - 1);
+                *err = message;
+                return 0;
+            }
+            inputPins[numInputs++] = pin.as<uint8_t>();
+        }
+    } else {
+        for (numInputs = 0; numInputs < 8; numInputs++) {
+            inputPins[numInputs] = numInputs;
+        }
+    }
+
+    // Input timings, whole ms where given
+    if ((config.containsKey("debounceMs") && !json_whole(config["debounceMs"], 1000)) ||
+        (config.containsKey("longPressMs") && !json_whole(config["longPressMs"], 60000))) {
+        *err = "debounceMs must be 4-1000 and longPressMs debounceMs-60000";
+        return 0;
+    }
+    uint32_t debounceMs = config["debounceMs"] | 20;
+    uint32_t longPressMs = config["longPressMs"] | 2000;
+    if (debounceMs < 4 || debounceMs > 1000 || longPressMs < debounceMs || longPressMs > 60000) {
+        *err = "debounceMs must be 4-1000 and longPressMs debounceMs-60000";
+        return 0;
+    }
+    const char* mode = config["debounceMode"] | "leading";
+    uint8_t debounceMode;
+    if (strcmp(mode, "stable") == 0) {
+        debounceMode = DEBOUNCE_STABLE;
+    } else if (strcmp(mode, "leading") == 0) {
+        debounceMode = DEBOUNCE_LEADING;
+    } else {
+        *err = "debounceMode must be \"stable\" or \"leading\"";
+        return 0;
+    }
+
+    // First pass: count records and string pool bytes
+    uint32_t numTransitions = 0;
+    uint32_t numConditions = 0;
+    uint32_t codeSize = sizeof(code_start);
+    uint32_t stringsSize = 1;   // offset 0 is the empty string
+    uint16_t i = 0;
+    for (JsonObject stateObject : statesArray) {
+        JsonArray transitionsArray = stateObject["transitions"];
+
+        if (transitionsArray.size() + 2 > 255) {
+            snprintf(message, sizeof(message), "state %u: too many transitions", i);
+            *err = message;
+            return 0;
+        }
+        numTransitions += transitionsArray.size() + 2;    // +2 for skip and reset transitions
+        numConditions += 2;
+
+        for (JsonObject transitionObject : transitionsArray) {
+            JsonArray conditionsArray = transitionObject["conditions"];
+            if (conditionsArray.size() > 255) {
+                snprintf(message, sizeof(message), "state %u: too many conditions", i);
+                *err = message;
+                return 0;
+            }
+            if (!json_whole(transitionObject["targetState"], numStates - 1)) {
+                snprintf(message, sizeof(message), "state %u: targetState must be a state, 0-%lu", i,
+                         (unsigned long)numStates - 1);
+                *err = message;
+                return 0;
+            }
+            for (JsonObject conditionObject : conditionsArray) {
+                if (!fsm_condition_is_plain(conditionObject)) {
+                    continue;
+                }
+                const char* type = conditionObject["type"] | "";
+                if (strcmp(type, "SENSOR") == 0 && !json_whole(conditionObject["data"]["sensorPin"], numInputs - 1)) {
+                    snprintf(message, sizeof(message), "state %u: sensorPin must be an input, 0-%u", i, numInputs - 1);
+                    *err = message;
+                    return 0;
+                }
+                if (strcmp(type, "TIME_PASSED") == 0 && !json_whole(conditionObject["data"]["duration"], 0xFFFFFFFFUL)) {
+                    snprintf(message, sizeof(message), "state %u: TIME_PASSED duration must be a number of ms", i);
+                    *err = message;
+                    return 0;
+                }
+                numConditions++;
+            }
+
+            // The rest of the conditions and the actions are code, measured here
+            const char* problem = nullptr;
+            codeSize = fsm_program_compile(conditionsArray, nullptr, codeSize, &problem);
+            if (codeSize) {
+                codeSize = fsm_program_compile_actions(transitionObject["actions"], nullptr, codeSize, &problem);
+            }
+            if (!codeSize) {
+                snprintf(message, sizeof(message), "state %u: %s", i, problem);
+                *err = message;
+                return 0;
+            }
+        }
+
+        const char* audioFile = stateObject["audioFile"] | "";
+        if (audioFile[0] != '\0' && find_audio_file(statesArray, i, audioFile) < 0) {
+            stringsSize += strlen(audioFile) + 1;
+        }
+        i++;
+    }
+
+    if (numTransitions > 0xFFFF || numConditions > 0xFFFF || codeSize > 0xFFFF || stringsSize > 0xFFFF) {
+        *err = "config too large for the image format";
+        return 0;
+    }
+
+    uint32_t statesOffset = align4(sizeof(FsmImageHeader));
+    uint32_t transitionsOffset = statesOffset + numStates * sizeof(State);
+    uint32_t conditionsOffset = transitionsOffset + numTransitions * sizeof(Transition);
+    uint32_t codeOffset = conditionsOffset + numConditions * sizeof(Condition);
+    uint32_t stringsOffset = codeOffset + align4(codeSize);
+    uint32_t imageSize = align4(stringsOffset + stringsSize);
+
+    if (image == nullptr) {
+        return imageSize;
+    }
+    if (imageSize > capacity) {
+        *err = "image buffer too small";
+        return 0;
+    }
+
+    // Second pass: fill in the tables
+    memset(image, 0, imageSize);
+    FsmImageHeader* header = (FsmImageHeader*)image;
+    header->magic = FSM_IMAGE_MAGIC;
+    header->version = FSM_IMAGE_VERSION;
+    header->headerSize = sizeof(FsmImageHeader);
+    header->imageSize = imageSize;
+    header->numStates = numStates;
+    header->numTransitions = numTransitions;
+    header->numConditions = numConditions;
+    header->statesOffset = statesOffset;
+    header->transitionsOffset = transitionsOffset;
+    header->conditionsOffset = conditionsOffset;
+    header->stringsOffset = stringsOffset;
+    header->stringsSize = stringsSize;
+    header->codeOffset = codeOffset;
+    header->codeSize = codeSize;
+    header->numInputs = numInputs;
+    memcpy(header->inputPins, inputPins, numInputs);
+    header->debounceMode = debounceMode;
+    header->debounceMs = debounceMs;
+    header->longPressMs = longPressMs;
+
+    State* states = (State*)(image + statesOffset);
+    Transition* transitions = (Transition*)(image + transitionsOffset);
+    Condition* conditions = (Condition*)(image + conditionsOffset);
+    uint8_t* code = image + codeOffset;
+    char* strings = (char*)(image + stringsOffset);
+
+    uint16_t nextTransition = 0;
+    uint16_t nextCondition = 0;
+    uint32_t nextCode = sizeof(code_start);
+    uint16_t nextString = 1;
+    memcpy(code, code_start, sizeof(code_start));
+
+    i = 0;
+    for (JsonObject stateObject : statesArray) {
+        State& state = states[i];
+
+        // Extract state properties
+        state.id = stateObject["id"];
+        state.repeat = stateObject["repeat"];
+        state.blinkCount = stateObject["blinkCount"];
+
+        const char* select = stateObject["select"] | "first";
+        if (strcmp(select, "first") == 0) {
+            state.select = AUDIO_SELECT_FIRST;
+        } else if (strcmp(select, "sequential") == 0) {
+            state.select = AUDIO_SELECT_SEQUENTIAL;
+        } else if (strcmp(select, "shuffle") == 0) {
+            state.select = AUDIO_SELECT_SHUFFLE;
+        } else if (strcmp(select, "weighted") == 0) {
+            state.select = AUDIO_SELECT_WEIGHTED;
+        } else {
+            snprintf(message, sizeof(message), "state %u: select must be first, sequential, shuffle or weighted", i);
+            *err = message;
+            return 0;
+        }
+
+        // Level and fades of the audio
+        float gain = stateObject["gain"] | 1.0f;
+        uint32_t fadeIn = stateObject["fadeIn"] | 0;
+        uint32_t fadeOut = stateObject["fadeOut"] | 0;
+        if (!(gain >= 0.0f && gain <= 1.0f) || fadeIn > AUDIO_FADE_MAX_MS || fadeOut > AUDIO_FADE_MAX_MS) {
+            snprintf(message, sizeof(message), "state %u: gain must be 0-1, fadeIn and fadeOut 0-%d ms", i, AUDIO_FADE_MAX_MS);
+            *err = message;
+            return 0;
+        }
+        state.gain = (uint16_t)(gain * AUDIO_GAIN_UNITY + 0.5f);
+        state.fadeIn = fadeIn;
+        state.fadeOut = fadeOut;
+
+        // Intern the audio file path
+        const char* audioFile = stateObject["audioFile"] | "";
+        if (audioFile[0] != '\0') {
+            int same = find_audio_file(statesArray, i, audioFile);
+            if (same >= 0) {
+                state.audioFile = states[same].audioFile;
+            } else {
+                state.audioFile = nextString;
+                strcpy(strings + nextString, audioFile);
+                nextString += strlen(audioFile) + 1;
+            }
+        }
+
+        JsonArray transitionsArray = stateObject["transitions"];
+        state.numTransitions = transitionsArray.size() + 2;
+        state.firstTransition = nextTransition;
+
+        for (JsonObject transitionObject : transitionsArray) {
+            Transition& transition = transitions[nextTransition++];
+            JsonArray conditionsArray = transitionObject["conditions"];
+
+            transition.targetState = transitionObject["targetState"];
+            transition.firstCondition = nextCondition;
+
+            // Plain conditions, the first pass made sure the others compile
+            for (JsonObject conditionObject : conditionsArray) {
+                if (!fsm_condition_is_plain(conditionObject)) {
+                    continue;
+                }
+                Condition& condition = conditions[nextCondition++];
+                transition.numConditions++;
+
+                const char* type = conditionObject["type"] | "";
+                if (strcmp(type, "SENSOR") == 0) {
+                    condition.type = SENSOR;
+                    condition.sensorPin = conditionObject["data"]["sensorPin"];
+                    condition.state = conditionObject["data"]["state"];
+
+                } else if (strcmp(type, "TIME_PASSED") == 0) {
+                    condition.type = TIME_PASSED;
+                    condition.duration = conditionObject["data"]["duration"];
+
+                } else {
+                    condition.type = AUDIO_FINISHED;
+                }
+            }
+            fsm_compile_transition(transition, conditions);
+
+            // Everything else, and what it does when it fires
+            const char* problem = nullptr;
+            uint32_t end = fsm_program_compile(conditionsArray, code, nextCode, &problem);
+            transition.program = end != nextCode ? nextCode : 0;
+            nextCode = end;
+            end = fsm_program_compile_actions(transitionObject["actions"], code, nextCode, &problem);
+            transition.actions = end != nextCode ? nextCode : 0;
+            nextCode = end;
+        }
+
+        // add skip transition, the last state skips back to the first
+        Transition& skip = transitions[nextTransition++];
+        skip.targetState = (i + 1) % numStates;
+        skip.numConditions = 1;
+        skip.firstCondition = nextCondition;
+        conditions[nextCondition++].type = SKIP_FLAG;
+        fsm_compile_transition(skip, conditions);
+
+        // add reset transition
+        Transition& reset = transitions[nextTransition++];
+        reset.targetState = 0;
+        reset.numConditions = 1;
+        reset.firstCondition = nextCondition;
+        conditions[nextCondition++].type = RESET_FLAG;
+        fsm_compile_transition(reset, conditions);
+        reset.actions = CODE_CLEAR_VARS;                            // a reset starts the show over
+        i++;
+    }
+
+    header->crc = fsm_crc32(image + header->headerSize, imageSize - header->headerSize);
+
+    const char* problem = fsm_image_check(image, imageSize);
+    if (problem) {
+        *err = problem;
+        return 0;
+    }
+    return imageSize;
+}
+
+const char* fsm_image_check(const uint8_t* image, uint32_t size) {
+    if (size < sizeof(FsmImageHeader)) {
+        return "image truncated";
+    }
+
+    const FsmImageHeader* header = fsm_image_header(image);
+    if (header->magic != FSM_IMAGE_MAGIC) {
+        return "not an FSM image";
+    }
+    if (header->version != FSM_IMAGE_VERSION || header->headerSize != sizeof(FsmImageHeader)) {
+        return "unsupported image version, recompile FSM_Config.json";
+    }
+    if (header->imageSize != size) {
+        return "image size does not match header";
+    }
+
+    // Every table has to be aligned and inside the image
+    uint32_t tables[][2] = {
+        {header->statesOffset, header->numStates * (uint32_t)sizeof(State)},
+        {header->transitionsOffset, header->numTransitions * (uint32_t)sizeof(Transition)},
+        {header->conditionsOffset, header->numConditions * (uint32_t)sizeof(Condition)},
+        {header->codeOffset, header->codeSize},
+        {header->stringsOffset, header->stringsSize},
+    };
+    for (uint8_t t = 0; t < 5; t++) {
+        if (tables[t][0] % 4 != 0 || tables[t][0] < header->headerSize || tables[t][0] > size || tables[t][1] > size - tables[t][0]) {
+            return "image table out of bounds";
+        }
+    }
+
+    if (fsm_crc32(image + header->headerSize, size - header->headerSize) != header->crc) {
+        return "image CRC mismatch";
+    }
+
+    if (header->numStates == 0 || header->numStates > FSM_MAX_STATES) {
+        return "image has no states";
+    }
+
+    if (header->debounceMs < 4 || header->longPressMs < header->debounceMs || header->debounceMode > DEBOUNCE_LEADING) {
+        return "image has bad input timings";
+    }
+
+    if (header->numInputs == 0 || header->numInputs > FSM_MAX_INPUTS) {
+        return "image has no inputs";
+    }
+    uint32_t usedPins = 0;
+    for (uint8_t i = 0; i < header->numInputs; i++) {
+        uint8_t pin = header->inputPins[i];
+        if (pin >= FSM_NUM_GPIO) {
+            snprintf(message, sizeof(message), "input %u: GPIO %u does not exist, use 0-%d", i, pin, FSM_NUM_GPIO - 1);
+            return message;
+        }
+        if (FSM_RESERVED_GPIO & (1UL << pin)) {
+            snprintf(message, sizeof(message), "input %u: GPIO %u is used by the player (LEDs, SD card, reset button or I2S)", i, pin);
+            return message;
+        }
+        if (usedPins & (1UL << pin)) {
+            snprintf(message, sizeof(message), "input %u: GPIO %u is listed twice", i, pin);
+            return message;
+        }
+        usedPins |= 1UL << pin;
+    }
+
+    const char* strings = fsm_image_strings(image);
+    if (header->stringsSize == 0 || strings[header->stringsSize - 1] != '\0') {
+        return "image string pool not terminated";
+    }
+
+    const State* states = fsm_image_states(image);
+    for (uint16_t i = 0; i < header->numStates; i++) {
+        const State& state = states[i];
+        if (state.id != i) {
+            snprintf(message, sizeof(message), "state %u: id is %u, ids must be sequential from 0", i, state.id);
+            return message;
+        }
+        if (state.numTransitions < 2) {
+            snprintf(message, sizeof(message), "state %u: no skip and reset transitions", i);    // the last two, always
+            return message;
+        }
+        if (state.firstTransition + state.numTransitions > header->numTransitions) {
+            snprintf(message, sizeof(message), "state %u: transitions out of range", i);
+            return message;
+        }
+        if (state.audioFile >= header->stringsSize) {
+            snprintf(message, sizeof(message), "state %u: audio file out of range", i);
+            return message;
+        }
+        if (state.select > AUDIO_SELECT_WEIGHTED) {
+            snprintf(message, sizeof(message), "state %u: bad select mode", i);
+            return message;
+        }
+        if (state.gain > AUDIO_GAIN_UNITY || state.fadeIn > AUDIO_FADE_MAX_MS || state.fadeOut > AUDIO_FADE_MAX_MS) {
+            snprintf(message, sizeof(message), "state %u: bad gain or fade", i);
+            return message;
+        }
+
+        const Transition* transitions = fsm_image_transitions(image) + state.firstTransition;
+        for (uint8_t j = 0; j < state.numTransitions; j++) {
+            const Transition& transition = transitions[j];
+            if (transition.targetState >= header->numStates) {
+                snprintf(message, sizeof(message), "state %u: transition %u targets missing state %u", i, j, transition.targetState);
+                return message;
+            }
+            if (transition.firstCondition + transition.numConditions > header->numConditions) {
+                snprintf(message, sizeof(message), "state %u: transition %u conditions out of range", i, j);
+                return message;
+            }
+
+            const Condition* conditions = fsm_image_conditions(image) + transition.firstCondition;
+            for (uint8_t k = 0; k < transition.numConditions; k++) {
+                if (conditions[k].type > RESET_FLAG) {
+                    snprintf(message, sizeof(message), "state %u: transition %u has a bad condition type", i, j);
+                    return message;
+                }
+                if (conditions[k].type == SENSOR && conditions[k].sensorPin >= header->numInputs) {
+                    snprintf(message, sizeof(message), "state %u: transition %u uses sensor pin %u, only 0-%d exist",
+                             i, j, conditions[k].sensorPin, header->numInputs - 1);
+                    return message;
+                }
+            }
+
+            const char* problem = nullptr;
+            if (transition.program) {
+                problem = fsm_program_check(fsm_image_code(image), header->codeSize, transition.program, false,
+                                            header->numInputs);
+            }
+            if (!problem && transition.actions) {
+                problem = fsm_program_check(fsm_image_code(image), header->codeSize, transition.actions, true,
+                                            header->numInputs);
+            }
+            if (problem) {
+                snprintf(message, sizeof(message), "state %u: transition %u: %s", i, j, problem);
+                return message;
+            }
+
+            Transition compiled = transition;
+            fsm_compile_transition(compiled, fsm_image_conditions(image));
+            if (compiled.careMask != transition.careMask || compiled.valueMask != transition.valueMask ||
+                compiled.minElapsed != transition.minElapsed || compiled.needs != transition.needs) {
+                snprintf(message, sizeof(message), "state %u: transition %u masks do not match its conditions", i, j);
+                return message;
+            }
+        }
+    }
+
+    return nullptr;
+}
@@ -0,0 +1,221 @@
+#ifndef FSM_IMAGE_H
+#define FSM_IMAGE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <ArduinoJson.h>
+
+// Compiled state table ("FSM image").
+//
+// The image is one flat block: a header followed by the state, transition and
+// condition tables, the code pool of the condition programs (fsm_program.h)
+// and a pool of NUL-terminated strings. Records refer to each
+// other by index and strings by offset into the pool, so the block can be
+// read from the SD card in one go and used in place, with no fix-ups and no
+// allocation per state. All fields are little-endian, like the RP2040.
+//
+// FSM_Config.bin images are made from FSM_Config.json by the fsm_compile tool
+// (env:fsm_compile); the firmware compiles the JSON into the same form at boot
+// when no image is present.
+
+#define FSM_IMAGE_MAGIC   0x494D5346UL    // "FSMI"
+#define FSM_IMAGE_VERSION 10    // 10: "debounceMode" defaults to "leading"
+
+#define FSM_MAX_STATES  255     // state IDs are uint8_t
+#define FSM_MAX_INPUTS  32      // sensor inputs, one bit each in the input word
+#define FSM_NUM_GPIO    30      // GPIO0-29 on the RP2040
+
+// GPIOs the player drives itself, which an input would take over with its
+// pull-up: the LEDs (8-10, gpio_utils.h), the SD card on SPI0 (16-19), the
+// reset button (22, read apart from the inputs) and the I2S DAC (26-28,
+// audio_sink.h). Images with an input on one of them are refused.
+#define FSM_RESERVED_GPIO 0x1C4F0700UL
+
+// Nesting the JSON parser accepts in a config. ArduinoJson's default of 10
+// stops at conditions in two levels of ALL/ANY/NOT groups, this allows six.
+#define FSM_JSON_NESTING 20
+
+// Enumeration for condition types
+enum ConditionType : uint8_t {
+    SENSOR,
+    TIME_PASSED,
+    AUDIO_FINISHED,
+    SKIP_FLAG,
+    RESET_FLAG
+};
+
+// Structure to hold condition information
+struct Condition {
+    ConditionType type;   // Type of condition
+    union {
+        struct {                // Data for SENSOR type
+            uint8_t sensorPin;  // Sensor input related to this condition (index into the inputs list)
+            bool state;         // Desired state of the sensor
+        };
+        uint32_t duration;      // Data for TIME_PASSED type
+    };
+};
+
+// Events a transition can wait for, one bit each
+#define EVENT_AUDIO_FINISHED 0x01
+#define EVENT_SKIP           0x02
+#define EVENT_RESET          0x04
+#define EVENT_NEVER          0x80   // conditions contradict each other, never fires
+
+// Structure to hold transition information
+struct Transition {
+    uint8_t targetState;        // Target state ID
+    uint8_t numConditions;      // Number of conditions
+    uint16_t firstCondition;    // Index of the first condition in the condition table
+
+    // The plain conditions compiled into masks, this is what changeState evaluates.
+    // A transition fires when (inputs & careMask) == valueMask, the FSM has been
+    // in the state for at least minElapsed ms, every event in needs happened
+    // and its program, if it has one, is true.
+    uint32_t careMask;          // Sensors the transition looks at, bit n = input n
+    uint32_t valueMask;         // Required levels of those sensors
+    uint32_t minElapsed;        // Longest TIME_PASSED duration + 1, 0 if there is none
+    uint8_t needs;              // EVENT_* bits
+    uint8_t reserved[3];
+    uint16_t program;           // Condition program, offset into the code pool, 0 for none
+    uint16_t actions;           // Action program run when it fires, 0 for none
+};
+
+// How a state picks the file to play when its audioFile is a folder
+#define AUDIO_SELECT_FIRST      0   // the file with the lowest name, every time
+#define AUDIO_SELECT_SEQUENTIAL 1   // each file in turn, in name order
+#define AUDIO_SELECT_SHUFFLE    2   // every file once in random order, then again in another
+#define AUDIO_SELECT_WEIGHTED   3   // at random, more often the higher the weight in its name (rain@3.wav)
+
+// Gain of a state's audio, Q15: the file as it is
+#define AUDIO_GAIN_UNITY 32768
+
+// Longest fadeIn and fadeOut
+#define AUDIO_FADE_MAX_MS 10000
+
+// Structure to hold state information
+struct State {
+    uint8_t id;                 // Unique state ID
+    bool repeat;                // Repeat behavior of the audio file
+    uint8_t blinkCount;         // LED blink count
+    uint8_t numTransitions;     // Number of transitions
+    uint16_t firstTransition;   // Index of the first transition in the transition table
+    uint16_t audioFile;         // Audio file to be played in this state (offset into the string pool)
+    uint8_t select;             // AUDIO_SELECT_*, how a folder's file is picked
+    uint8_t reserved;
+    uint16_t gain;              // Of the audio, Q15, up to AUDIO_GAIN_UNITY
+    uint16_t fadeIn;            // ms the audio ramps up over when the state starts it
+    uint16_t fadeOut;           // ms it ramps down over when the state is left while it plays
+};
+
+struct FsmImageHeader {
+    uint32_t magic;             // FSM_IMAGE_MAGIC
+    uint16_t version;           // FSM_IMAGE_VERSION
+    uint16_t headerSize;        // sizeof(FsmImageHeader)
+    uint32_t imageSize;         // Total size including this header
+    uint32_t crc;               // CRC-32 of everything after the header
+    uint16_t numStates;
+    uint16_t numTransitions;
+    uint16_t numConditions;
+    uint8_t numInputs;          // Number of sensor inputs
+    uint8_t debounceMode;       // DEBOUNCE_STABLE or DEBOUNCE_LEADING
+    uint32_t statesOffset;      // Offsets from the start of the image
+    uint32_t transitionsOffset;
+    uint32_t conditionsOffset;
+    uint32_t stringsOffset;
+    uint32_t stringsSize;
+    uint8_t inputPins[FSM_MAX_INPUTS];  // GPIO of each sensor input
+    uint16_t debounceMs;        // Time an input must be stable before it counts
+    uint16_t longPressMs;       // Reset button hold time for a reset (shorter presses skip)
+    uint32_t codeOffset;        // Code pool of the condition programs
+    uint32_t codeSize;
+};
+
+// Compiles a parsed FSM_Config.json into an image, adding the internal skip
+// and reset transitions to every state. A transition's plain conditions go
+// into its masks, the rest into its program. Configs without an "inputs" list get
+// the original eight inputs on GPIO0-7, "debounceMs", "longPressMs" and
+// "debounceMode" default to 20, 2000 and "leading", a state's "select" to "first",
+// its "gain" to 1.0 and "fadeIn" and "fadeOut" to 0. With image == nullptr it
+// only measures. Returns the image size, or 0 and sets *err if the config is bad
+// or the image does not fit in capacity.
+uint32_t fsm_image_compile(JsonObject config, uint8_t* image, uint32_t capacity, const char** err);
+
+// Fills in the compiled masks of a transition from its (plain) conditions.
+// constexpr so the tables built into the firmware (fsm_builtin.h) can be
+// checked against their conditions while it compiles.
+constexpr void fsm_compile_transition(Transition& transition, const Condition* conditions) {
+    transition.careMask = 0;
+    transition.valueMask = 0;
+    transition.minElapsed = 0;
+    transition.needs = 0;
+
+    for (uint8_t k = 0; k < transition.numConditions; k++) {
+        const Condition& condition = conditions[transition.firstCondition + k];
+        uint32_t bit = 0;
+
+        switch (condition.type) {
+            case SENSOR:
+                bit = 1UL << condition.sensorPin;
+                if ((transition.careMask & bit) && ((transition.valueMask & bit) != 0) != condition.state) {
+                    transition.needs |= EVENT_NEVER;    // same sensor required both open and closed
+                }
+                transition.careMask |= bit;
+                if (condition.state) {
+                    transition.valueMask |= bit;
+                }
+                break;
+            case TIME_PASSED:
+                // all conditions must hold, so only the longest duration matters.
+                // "more than duration ms" is "at least duration + 1 ms"
+                if (condition.duration == 0xFFFFFFFFUL) {
+                    transition.needs |= EVENT_NEVER;
+                } else if (condition.duration + 1 > transition.minElapsed) {
+                    transition.minElapsed = condition.duration + 1;
+                }
+                break;
+            case AUDIO_FINISHED:
+                transition.needs |= EVENT_AUDIO_FINISHED;
+                break;
+            case SKIP_FLAG:
+                transition.needs |= EVENT_SKIP;
+                break;
+            case RESET_FLAG:
+                transition.needs |= EVENT_RESET;
+                break;
+        }
+    }
+}
+
+// What the transitions of a table test besides events, one bit each. changeState
+// has an evaluator for every combination that leaves the rest out.
+#define FSM_USES_SENSORS  0x01  // a careMask
+#define FSM_USES_TIME     0x02  // a minElapsed
+#define FSM_USES_PROGRAMS 0x04  // a condition program
+#define FSM_USES_ALL      0x07
+
+constexpr uint8_t fsm_uses(const Transition* transitions, uint16_t numTransitions) {
+    uint8_t uses = 0;
+    for (uint16_t i = 0; i < numTransitions; i++) {
+        uses |= (transitions[i].careMask ? FSM_USES_SENSORS : 0) | (transitions[i].minElapsed ? FSM_USES_TIME : 0) |
+                (transitions[i].program ? FSM_USES_PROGRAMS : 0);
+    }
+    return uses;
+}
+
+// Checks that an image is complete and self-consistent (sizes, offsets,
+// ranges, state references, compiled masks, programs, CRC). Returns nullptr if it is
+// usable, otherwise a description of the first problem found.
+const char* fsm_image_check(const uint8_t* image, uint32_t size);
+
+// Views into a checked image
+inline const FsmImageHeader* fsm_image_header(const uint8_t* image) { return (const FsmImageHeader*)image; }
+inline const State* fsm_image_states(const uint8_t* image) { return (const State*)(image + fsm_image_header(image)->statesOffset); }
+inline const Transition* fsm_image_transitions(const uint8_t* image) { return (const Transition*)(image + fsm_image_header(image)->transitionsOffset); }
+inline const Condition* fsm_image_conditions(const uint8_t* image) { return (const Condition*)(image + fsm_image_header(image)->conditionsOffset); }
+inline const uint8_t* fsm_image_code(const uint8_t* image) { return image + fsm_image_header(image)->codeOffset; }
+inline const char* fsm_image_strings(const uint8_t* image) { return (const char*)(image + fsm_image_header(image)->stringsOffset); }
+
+uint32_t fsm_crc32(const void* data, size_t length, uint32_t crc = 0);
+
+#endif // FSM_IMAGE_H
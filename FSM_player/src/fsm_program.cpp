@@ -0,0 +1,479 @@
+#include <string.h>
+#include <stdio.h>
+#include "fsm_program.h"
+#include "fsm_image.h"
+
+static char message[80];    // Detail for the last compile error
+
+// Bytes of each instruction, opcode included
+static const uint8_t op_sizes[FSM_OPCODES] = {
+    1,  // OP_END
+    2,  // OP_CONST
+    2,  // OP_SENSOR
+    2,  // OP_ROSE
+    2,  // OP_FELL
+    6,  // OP_HELD
+    5,  // OP_ELAPSED
+    2,  // OP_EVENT
+    4,  // OP_COUNT
+    6,  // OP_VAR
+    2,  // OP_TIMER
+    1,  // OP_AND
+    1,  // OP_OR
+    1,  // OP_NOT
+    6,  // OP_SET
+    6,  // OP_ADD
+    1,  // OP_CLEAR
+    6,  // OP_START
+    6,  // OP_RESTART
+    2   // OP_STOP
+};
+
+static const char* const compare_names[FSM_COMPARES] = {"==", "!=", "<", "<=", ">", ">="};
+
+// Writers that only count when there is no code to write to
+static void put8(uint8_t* code, uint32_t& at, uint8_t value) {
+    if (code) {
+        code[at] = value;
+    }
+    at++;
+}
+
+static void put16(uint8_t* code, uint32_t& at, uint16_t value) {
+    put8(code, at, value);
+    put8(code, at, value >> 8);
+}
+
+static void put32(uint8_t* code, uint32_t& at, uint32_t value) {
+    put16(code, at, value);
+    put16(code, at, value >> 16);
+}
+
+// Operands are unaligned, the M0+ can't load them as words
+static inline uint16_t read16(const uint8_t* p) {
+    return p[0] | (uint16_t)p[1] << 8;
+}
+
+static inline uint32_t read32(const uint8_t* p) {
+    return p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static inline void sooner(unsigned long& timeout, unsigned long ms) {
+    if (ms < timeout) {
+        timeout = ms;
+    }
+}
+
+bool fsm_condition_is_plain(JsonObject condition) {
+    const char* type = condition["type"] | "";
+    return strcmp(type, "SENSOR") == 0 || strcmp(type, "TIME_PASSED") == 0 || strcmp(type, "AUDIO_FINISHED") == 0;
+}
+
+// The sensor input of a condition's data with a flag in the top bit, false if it can't be one
+static bool input_operand(JsonObject data, bool flag, uint8_t& operand) {
+    // | 0 would take a missing or negative sensorPin for input 0
+    if (!data["sensorPin"].is<uint32_t>() || data["sensorPin"].as<uint32_t>() >= FSM_MAX_INPUTS) {
+        snprintf(message, sizeof(message), "sensorPin must be an input, 0-%d", FSM_MAX_INPUTS - 1);
+        return false;
+    }
+    uint32_t input = data["sensorPin"];
+    operand = input | (flag ? 0x80 : 0);
+    return true;
+}
+
+// The duration of a condition's data in ms, false if it can't be one
+static bool duration_operand(JsonObject data, uint32_t& ms) {
+    // | 0 would take a missing or negative duration for no wait at all
+    if (!data["duration"].is<uint32_t>()) {
+        snprintf(message, sizeof(message), "duration must be a number of ms");
+        return false;
+    }
+    ms = data["duration"];
+    return true;
+}
+
+static bool emit(JsonObject condition, uint8_t* code, uint32_t& at);
+
+// The conditions of a list joined by op, OP_AND or OP_OR. An empty list is
+// what joining nothing gives: true for AND, false for OR.
+static bool emit_list(JsonArray conditions, uint8_t op, uint8_t* code, uint32_t& at) {
+    uint16_t count = 0;
+    for (JsonObject condition : conditions) {
+        if (!emit(condition, code, at)) {
+            return false;
+        }
+        if (count++ > 0) {
+            put8(code, at, op);
+        }
+    }
+    if (count == 0) {
+        put8(code, at, OP_CONST);
+        put8(code, at, op == OP_AND);
+    }
+    return true;
+}
+
+// Compiles one condition, false with message set if it is bad
+static bool emit(JsonObject condition, uint8_t* code, uint32_t& at) {
+    const char* type = condition["type"] | "";
+    JsonObject data = condition["data"];
+    uint8_t operand;
+    uint32_t ms;
+
+    if (strcmp(type, "ALL") == 0) {
+        return emit_list(condition["conditions"], OP_AND, code, at);
+
+    } else if (strcmp(type, "ANY") == 0) {
+        return emit_list(condition["conditions"], OP_OR, code, at);
+
+    } else if (strcmp(type, "NOT") == 0) {
+        if (!emit_list(condition["conditions"], OP_AND, code, at)) {
+            return false;
+        }
+        put8(code, at, OP_NOT);
+
+    } else if (strcmp(type, "SENSOR") == 0) {
+        if (!input_operand(data, data["state"], operand)) {
+            return false;
+        }
+        put8(code, at, OP_SENSOR);
+        put8(code, at, operand);
+
+    } else if (strcmp(type, "SENSOR_ROSE") == 0 || strcmp(type, "SENSOR_FELL") == 0) {
+        if (!input_operand(data, false, operand)) {
+            return false;
+        }
+        put8(code, at, type[7] == 'R' ? OP_ROSE : OP_FELL);
+        put8(code, at, operand);
+
+    } else if (strcmp(type, "SENSOR_HELD") == 0) {
+        if (!input_operand(data, data["state"], operand) || !duration_operand(data, ms)) {
+            return false;
+        }
+        put8(code, at, OP_HELD);
+        put8(code, at, operand);
+        put32(code, at, ms);
+
+    } else if (strcmp(type, "TIME_PASSED") == 0) {
+        if (!duration_operand(data, ms)) {
+            return false;
+        }
+        put8(code, at, OP_ELAPSED);
+        put32(code, at, ms);
+
+    } else if (strcmp(type, "AUDIO_FINISHED") == 0) {
+        put8(code, at, OP_EVENT);
+        put8(code, at, EVENT_AUDIO_FINISHED);
+
+    } else if (strcmp(type, "COUNT") == 0) {
+        const char* edge = data["edge"] | "rising";
+        uint32_t count = data["count"] | 1;
+        bool falling = strcmp(edge, "falling") == 0;
+        if ((!falling && strcmp(edge, "rising") != 0) || count == 0 || count > 0xFFFF) {
+            snprintf(message, sizeof(message), "COUNT needs edge rising or falling and count 1-65535");
+            return false;
+        }
+        if (!input_operand(data, falling, operand)) {
+            return false;
+        }
+        put8(code, at, OP_COUNT);
+        put8(code, at, operand);
+        put16(code, at, count);
+
+    } else if (strcmp(type, "VAR") == 0) {
+        uint32_t var = data["var"] | 0;
+        const char* compare = data["op"] | "==";
+        uint8_t c = 0;
+        while (c < FSM_COMPARES && strcmp(compare, compare_names[c]) != 0) {
+            c++;
+        }
+        if (var >= FSM_MAX_VARS || c == FSM_COMPARES) {
+            snprintf(message, sizeof(message), "VAR needs var 0-%d and op ==, !=, <, <=, > or >=", FSM_MAX_VARS - 1);
+            return false;
+        }
+        put8(code, at, OP_VAR);
+        put8(code, at, var | c << 4);
+        put32(code, at, (uint32_t)(int32_t)(data["value"] | 0L));
+
+    } else if (strcmp(type, "TIMER") == 0) {
+        uint32_t timer = data["timer"] | FSM_MAX_TIMERS;
+        if (timer >= FSM_MAX_TIMERS) {
+            snprintf(message, sizeof(message), "TIMER needs timer 0-%d", FSM_MAX_TIMERS - 1);
+            return false;
+        }
+        put8(code, at, OP_TIMER);
+        put8(code, at, timer);
+
+    } else {
+        snprintf(message, sizeof(message), "unknown condition type \"%s\"", type);
+        return false;
+    }
+    return true;
+}
+
+uint32_t fsm_program_compile(JsonArray conditions, uint8_t* code, uint32_t at, const char** err) {
+    uint32_t start = at;
+    uint16_t count = 0;
+    for (JsonObject condition : conditions) {
+        if (fsm_condition_is_plain(condition)) {
+            continue;                                   // in the masks
+        }
+        if (!emit(condition, code, at)) {
+            *err = message;
+            return 0;
+        }
+        if (count++ > 0) {
+            put8(code, at, OP_AND);
+        }
+    }
+    if (count == 0) {
+        return start;
+    }
+    put8(code, at, OP_END);
+    return at;
+}
+
+uint32_t fsm_program_compile_actions(JsonArray actions, uint8_t* code, uint32_t at, const char** err) {
+    uint32_t start = at;
+    for (JsonObject action : actions) {
+        if (action.containsKey("timer")) {
+            // A show timer: started (if it isn't running), started over or stopped
+            uint32_t timer = action["timer"] | FSM_MAX_TIMERS;
+            bool begin = action.containsKey("start");
+            bool restart = action.containsKey("restart");
+            bool stop = action["stop"] | false;
+            if (timer >= FSM_MAX_TIMERS || begin + restart + stop != 1) {
+                snprintf(message, sizeof(message), "a timer action needs timer 0-%d and one of start, restart or stop",
+                         FSM_MAX_TIMERS - 1);
+                *err = message;
+                return 0;
+            }
+            if (stop) {
+                put8(code, at, OP_STOP);
+                put8(code, at, timer);
+            } else {
+                put8(code, at, begin ? OP_START : OP_RESTART);
+                put8(code, at, timer);
+                put32(code, at, action[begin ? "start" : "restart"] | 0UL);
+            }
+            continue;
+        }
+
+        uint32_t var = action["var"] | FSM_MAX_VARS;
+        bool set = action.containsKey("set");
+        if (var >= FSM_MAX_VARS || set == action.containsKey("add")) {
+            snprintf(message, sizeof(message), "an action needs var 0-%d and either set or add", FSM_MAX_VARS - 1);
+            *err = message;
+            return 0;
+        }
+        put8(code, at, set ? OP_SET : OP_ADD);
+        put8(code, at, var);
+        put32(code, at, (uint32_t)(int32_t)(action[set ? "set" : "add"] | 0L));
+    }
+    if (at == start) {
+        return start;
+    }
+    put8(code, at, OP_END);
+    return at;
+}
+
+const char* fsm_program_check(const uint8_t* code, uint32_t size, uint32_t at, bool actions, uint8_t numInputs) {
+    uint8_t depth = 0;
+    while (at < size) {
+        uint8_t op = code[at];
+        if (op >= FSM_OPCODES) {
+            return "bad opcode";
+        }
+        if (op_sizes[op] > size - at) {
+            break;
+        }
+        if (op != OP_END && (op >= OP_SET) != actions) {
+            return actions ? "condition among the actions" : "action among the conditions";
+        }
+
+        uint8_t b = op_sizes[op] > 1 ? code[at + 1] : 0;
+        bool bad = false;
+        switch (op) {
+            case OP_END:
+                return depth == (actions ? 0 : 1) ? nullptr : "program leaves the stack unbalanced";
+            case OP_CONST:
+                bad = b > 1;
+                break;
+            case OP_SENSOR:
+            case OP_HELD:
+            case OP_COUNT:
+                bad = (b & 0x7F) >= numInputs;
+                break;
+            case OP_ROSE:
+            case OP_FELL:
+                bad = b >= numInputs;
+                break;
+            case OP_EVENT:
+                bad = b == 0 || (b & ~(EVENT_AUDIO_FINISHED | EVENT_SKIP | EVENT_RESET)) != 0;
+                break;
+            case OP_VAR:
+                bad = (b >> 4) >= FSM_COMPARES;
+                break;
+            case OP_SET:
+            case OP_ADD:
+                bad = b >= FSM_MAX_VARS;
+                break;
+            case OP_TIMER:
+            case OP_START:
+            case OP_RESTART:
+            case OP_STOP:
+                bad = b >= FSM_MAX_TIMERS;
+                break;
+            default:
+                break;
+        }
+        if (bad) {
+            return "operand out of range";
+        }
+
+        // Stack effect: logic takes two values (NOT one) and leaves one, conditions push one
+        if (op == OP_AND || op == OP_OR) {
+            if (depth < 2) {
+                return "program underflows the stack";
+            }
+            depth--;
+        } else if (op == OP_NOT) {
+            if (depth < 1) {
+                return "program underflows the stack";
+            }
+        } else if (op < OP_AND) {
+            if (depth == FSM_PROGRAM_STACK) {
+                return "conditions nested too deep";
+            }
+            depth++;
+        }
+        at += op_sizes[op];
+    }
+    return "program runs past the code pool";
+}
+
+uint32_t fsm_program_size(const uint8_t* program) {
+    const uint8_t* pc = program;
+    while (*pc != OP_END) {
+        pc += op_sizes[*pc];
+    }
+    return pc + 1 - program;
+}
+
+bool fsm_program_test(const uint8_t* pc, const FsmProgramContext& context, unsigned long& timeout) {
+    // The stack is one word, bit 0 is the top
+    uint32_t stack = 0;
+    for (;;) {
+        uint8_t op = pc[0];
+        bool value;
+        switch (op) {
+            case OP_END:
+                return stack & 1;
+            case OP_CONST:
+                value = pc[1];
+                break;
+            case OP_SENSOR:
+                value = ((context.inputs >> (pc[1] & 0x7F)) & 1) == (pc[1] >> 7);
+                break;
+            case OP_ROSE:
+                value = (context.rose >> pc[1]) & 1;
+                break;
+            case OP_FELL:
+                value = (context.fell >> pc[1]) & 1;
+                break;
+            case OP_HELD: {
+                // Becomes true ms + 1 after the input's last change, if it stays
+                uint8_t input = pc[1] & 0x7F;
+                unsigned long ms = read32(pc + 2);
+                value = false;
+                if (((context.inputs >> input) & 1) == (pc[1] >> 7)) {
+                    unsigned long held = context.now - context.inputSince[input];
+                    value = held > ms;
+                    if (!value) {
+                        sooner(timeout, context.elapsed + (ms + 1 - held));
+                    }
+                }
+                break;
+            }
+            case OP_ELAPSED: {
+                unsigned long ms = read32(pc + 1);
+                value = context.elapsed > ms;
+                if (!value && ms != 0xFFFFFFFFUL) {
+                    sooner(timeout, ms + 1);
+                }
+                break;
+            }
+            case OP_EVENT:
+                value = (context.events & pc[1]) == pc[1];
+                break;
+            case OP_COUNT:
+                value = ((pc[1] & 0x80) ? context.falls : context.rises)[pc[1] & 0x7F] >= read16(pc + 2);
+                break;
+            case OP_VAR: {
+                int32_t var = context.vars[pc[1] & 0x0F];
+                int32_t operand = (int32_t)read32(pc + 2);
+                switch (pc[1] >> 4) {
+                    case COMPARE_EQ: value = var == operand; break;
+                    case COMPARE_NE: value = var != operand; break;
+                    case COMPARE_LT: value = var < operand; break;
+                    case COMPARE_LE: value = var <= operand; break;
+                    case COMPARE_GT: value = var > operand; break;
+                    default:         value = var >= operand; break;
+                }
+                break;
+            }
+            case OP_TIMER:
+                value = (context.timers >> pc[1]) & 1;      // the wheel wakes the FSM when it runs out
+                break;
+            case OP_AND:
+                stack = (stack >> 1) & (stack | ~1UL);
+                pc++;
+                continue;
+            case OP_OR:
+                stack = (stack >> 1) | (stack & 1);
+                pc++;
+                continue;
+            case OP_NOT:
+                stack ^= 1;
+                pc++;
+                continue;
+            default:
+                return false;       // actions, fsm_program_check keeps them out
+        }
+        stack = (stack << 1) | value;
+        pc += op_sizes[op];
+    }
+}
+
+void fsm_program_act(const uint8_t* pc, int32_t* vars, TimerWheel& timers) {
+    for (;;) {
+        switch (pc[0]) {
+            case OP_SET:
+                vars[pc[1]] = (int32_t)read32(pc + 2);
+                break;
+            case OP_ADD:
+                vars[pc[1]] = (int32_t)((uint32_t)vars[pc[1]] + read32(pc + 2));     // wraps, no overflow trap
+                break;
+            case OP_CLEAR:
+                memset(vars, 0, FSM_MAX_VARS * sizeof(int32_t));
+                for (uint8_t timer = 0; timer < FSM_MAX_TIMERS; timer++) {
+                    timers.cancel(timer);
+                }
+                break;
+            case OP_START:
+                if (!timers.armed(pc[1])) {
+                    timers.armIn(pc[1], (uint64_t)read32(pc + 2) * 1000);
+                }
+                break;
+            case OP_RESTART:
+                timers.armIn(pc[1], (uint64_t)read32(pc + 2) * 1000);
+                break;
+            case OP_STOP:
+                timers.cancel(pc[1]);
+                break;
+            default:
+                return;
+        }
+        pc += op_sizes[pc[0]];
+    }
+}
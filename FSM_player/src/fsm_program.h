@@ -0,0 +1,118 @@
+#ifndef FSM_PROGRAM_H
+#define FSM_PROGRAM_H
+
+#include <stdint.h>
+#include <ArduinoJson.h>
+#include "timer_wheel.h"
+
+// Condition programs.
+//
+// A transition's plain conditions (SENSOR, TIME_PASSED and AUDIO_FINISHED at
+// the top of its list) compile into the masks changeState tests in a few
+// integer compares. Everything the masks can't say, OR and NOT groups, edges,
+// how long a sensor has held, edge counters, variables and show timers, compiles at load
+// time into a short program for a stack machine of booleans. It runs only when
+// the transition's masks already pass, and its result is ANDed with them.
+//
+// Programs live in the image's code pool, a transition points to its program
+// and to the actions it runs when it fires by offset. Offset 0 is "none".
+// Operands follow their opcode byte, multi-byte ones little-endian and
+// unaligned, so a program is as long as it has to be and no longer.
+
+// Variables, set and tested by transitions. 0 at boot and after a reset,
+// reloads keep them.
+#define FSM_MAX_VARS 16
+
+// Show timers, started and stopped by transitions. Unlike TIME_PASSED they
+// run on across state changes, until they run out, are stopped or a reset.
+// Reloads keep them.
+#define FSM_MAX_TIMERS 8
+
+// Depth of the stack a program evaluates on, one bit per value
+#define FSM_PROGRAM_STACK 32
+
+enum FsmOpcode : uint8_t {
+    // Conditions, each pushes one value
+    OP_END,         // the result is the value on top, the only one left
+    OP_CONST,       // b: 0 or 1
+    OP_SENSOR,      // b: input | state << 7. Input at that level
+    OP_ROSE,        // b: input. Went high at this snapshot
+    OP_FELL,        // b: input. Went low at this snapshot
+    OP_HELD,        // b: input | state << 7, u32 ms. At that level for longer than ms
+    OP_ELAPSED,     // u32 ms. In the state for longer than ms
+    OP_EVENT,       // b: EVENT_* bits, all of them happened
+    OP_COUNT,       // b: input | falling << 7, u16 n. At least n such edges since the state was entered
+    OP_VAR,         // b: var | compare << 4, i32 value. Variable compared with value
+    OP_TIMER,       // b: timer. The show timer ran out
+
+    // Logic, on the values on top
+    OP_AND,
+    OP_OR,
+    OP_NOT,
+
+    // Actions, run when the transition fires
+    OP_SET,         // b: var, i32 value
+    OP_ADD,         // b: var, i32 value
+    OP_CLEAR,       // every variable to 0, every show timer stopped
+    OP_START,       // b: timer, u32 ms. Starts the timer unless it is running
+    OP_RESTART,     // b: timer, u32 ms. Starts the timer over
+    OP_STOP,        // b: timer
+
+    FSM_OPCODES
+};
+
+// Compares of OP_VAR
+enum FsmCompare : uint8_t {
+    COMPARE_EQ,
+    COMPARE_NE,
+    COMPARE_LT,
+    COMPARE_LE,
+    COMPARE_GT,
+    COMPARE_GE,
+    FSM_COMPARES
+};
+
+// What a program looks at, filled in by changeState for each evaluation
+struct FsmProgramContext {
+    uint32_t inputs;                // Sensor levels, bit n = input n
+    uint32_t rose;                  // Inputs that went high at this snapshot
+    uint32_t fell;                  // and low
+    uint8_t events;                 // EVENT_* bits that happened
+    unsigned long now;              // millis()
+    unsigned long elapsed;          // ms in the state
+    const unsigned long* inputSince;    // millis() of each input's last change
+    const uint16_t* rises;          // Edges of each input since the state was entered
+    const uint16_t* falls;
+    const int32_t* vars;
+    uint32_t timers;                // Show timers that ran out, bit n = timer n
+};
+
+// True if a condition goes into the transition's masks rather than its program
+bool fsm_condition_is_plain(JsonObject condition);
+
+// Compiles the conditions of a transition that aren't plain, ANDed, to code +
+// at; with code == nullptr it only measures. Returns the end of the program,
+// at itself if there is nothing to compile, or 0 and sets *err if a
+// condition is bad. at must not be 0, that offset means "no program".
+uint32_t fsm_program_compile(JsonArray conditions, uint8_t* code, uint32_t at, const char** err);
+
+// Compiles a transition's "actions" in the same way
+uint32_t fsm_program_compile_actions(JsonArray actions, uint8_t* code, uint32_t at, const char** err);
+
+// Checks the program at offset at of a code pool of size bytes: every opcode
+// and operand inside the pool and in range, the stack never over- or
+// underflowing and ending with the one result. actions: an action program.
+// Returns nullptr if it is usable, otherwise what is wrong with it.
+const char* fsm_program_check(const uint8_t* code, uint32_t size, uint32_t at, bool actions, uint8_t numInputs);
+
+// Bytes of a checked program, OP_END included
+uint32_t fsm_program_size(const uint8_t* program);
+
+// Runs a checked condition program. Lowers timeout (ms in the state) to when
+// a time it waits for comes, if that is sooner: it may give another answer then.
+bool fsm_program_test(const uint8_t* program, const FsmProgramContext& context, unsigned long& timeout);
+
+// Runs a checked action program. Show timer n is timer n of the wheel.
+void fsm_program_act(const uint8_t* program, int32_t* vars, TimerWheel& timers);
+
+#endif // FSM_PROGRAM_H
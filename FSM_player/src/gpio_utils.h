@@ -12,6 +12,4 @@
 // Store error strings in flash to save RAM.
 #define error(s) sd.errorHalt(&Serial, F(s)) // idk what this, some sd card error thing 🤷‍♂️
 
-void flasher (unsigned int timer);
-
 #endif // GPIO_UTILS_H
\ No newline at end of file
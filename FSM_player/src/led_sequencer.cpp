@@ -0,0 +1,169 @@
+#include "led_sequencer.h"
+#include "gpio_utils.h"
+
+LedSequencer leds;
+
+static const uint8_t led_pins[LED_CHANNELS] = {led_status_pin, led_mode_pin, led_state_pin};
+
+// Each LED on for a part of a 300 ms cycle, one after the other
+static const LedStep waiting_status[] = {{125, 175, 1}};
+static const LedStep waiting_mode[] = {{0, 100, 1}, {125, 75, 1}};
+static const LedStep waiting_state[] = {{0, 200, 1}, {100, 0, 1}};
+const LedPattern led_waiting[LED_CHANNELS] = {
+    {waiting_status, 1, true},
+    {waiting_mode, 2, true},
+    {waiting_state, 2, true}
+};
+
+static const LedStep loaded[] = {{100, 100, 4}};
+const LedPattern led_loaded = {loaded, 1, false};
+
+static const LedStep reset_held[] = {{200, 200, 1}};
+const LedPattern led_reset_held = {reset_held, 1, true};
+
+void LedSequencer::begin() {
+    alarm = 0;
+    writes = 0;
+    for (uint8_t i = 0; i < LED_CHANNELS; i++) {
+        Channel& channel = channels[i];
+        channel.pin = led_pins[i];
+        channel.phase = PHASE_IDLE;
+        channel.on = false;
+        pinMode(channel.pin, OUTPUT);
+        digitalWrite(channel.pin, LOW);
+    }
+}
+
+void LedSequencer::write(Channel& channel, bool on) {
+    if (channel.on != on) {
+        digitalWrite(channel.pin, on ? HIGH : LOW);
+        channel.on = on;
+        writes++;
+    }
+}
+
+void LedSequencer::advance(Channel& channel) {
+    // Phases of 0 ms are passed over, play() made sure the pattern has one that isn't
+    for (;;) {
+        const LedStep& current = channel.steps[channel.step];
+        uint16_t ms;
+        bool on;
+        if (channel.phase == PHASE_ON) {
+            channel.phase = PHASE_OFF;
+            ms = current.offMs;
+            on = false;
+        } else {
+            // The off part ended: the step again, the next step, or the end
+            if (channel.phase == PHASE_OFF && ++channel.times >= (current.times ? current.times : 1)) {
+                channel.times = 0;
+                if (++channel.step == channel.count) {
+                    if (!channel.loop) {
+                        channel.phase = PHASE_IDLE;
+                        write(channel, false);
+                        return;
+                    }
+                    channel.step = 0;
+                }
+            }
+            channel.phase = PHASE_ON;
+            ms = channel.steps[channel.step].onMs;
+            on = true;
+        }
+        if (ms) {
+            write(channel, on);
+            channel.nextUs += ms * 1000ULL;
+            return;
+        }
+    }
+}
+
+void LedSequencer::schedule() {
+    uint64_t earliest = ~0ULL;
+    for (uint8_t i = 0; i < LED_CHANNELS; i++) {
+        if (channels[i].phase != PHASE_IDLE && channels[i].nextUs < earliest) {
+            earliest = channels[i].nextUs;
+        }
+    }
+    if (earliest != ~0ULL) {
+        alarmUs = earliest;
+        alarm = add_alarm_at(from_us_since_boot(earliest), onAlarm, this, true);
+        if (alarm < 0) {
+            alarm = 0;                                  // no alarm free, the LEDs stay as they are
+        }
+    }
+}
+
+int64_t LedSequencer::onAlarm(alarm_id_t id, void* user) {
+    (void)id;
+    // Edges are timed from when they were due, not from when the interrupt
+    // ran, so a late interrupt doesn't push the rest of the pattern back
+    LedSequencer* self = (LedSequencer*)user;
+    uint64_t earliest = ~0ULL;
+    for (uint8_t i = 0; i < LED_CHANNELS; i++) {
+        Channel& channel = self->channels[i];
+        while (channel.phase != PHASE_IDLE && channel.nextUs <= self->alarmUs) {
+            self->advance(channel);
+        }
+        if (channel.phase != PHASE_IDLE && channel.nextUs < earliest) {
+            earliest = channel.nextUs;
+        }
+    }
+    if (earliest == ~0ULL) {
+        self->alarm = 0;                                // the pool frees it
+        return 0;
+    }
+    int64_t after = earliest - self->alarmUs;
+    self->alarmUs = earliest;
+    return -after;                                      // negative: from the time it was set for, not from now
+}
+
+void LedSequencer::cancel() {
+    if (alarm) {
+        cancel_alarm(alarm);
+        alarm = 0;
+    }
+}
+
+void LedSequencer::play(uint8_t channel, const LedPattern& pattern) {
+    cancel();
+
+    Channel& c = channels[channel];
+    bool timed = false;
+    for (uint8_t i = 0; i < pattern.count; i++) {
+        timed = timed || pattern.steps[i].onMs || pattern.steps[i].offMs;
+    }
+    if (timed) {
+        c.steps = pattern.steps;
+        c.count = pattern.count;
+        c.loop = pattern.loop;
+        c.step = 0;
+        c.times = 0;
+        c.phase = PHASE_START;
+        c.nextUs = time_us_64();
+        advance(c);
+    } else {
+        c.phase = PHASE_IDLE;                           // nothing to play
+        write(c, false);
+    }
+    schedule();
+}
+
+void LedSequencer::blink(uint8_t channel, uint8_t count, uint16_t onMs, uint16_t offMs, uint16_t gapMs) {
+    if (count == 0) {
+        set(channel, false);
+        return;
+    }
+    cancel();                                           // the interrupt may be reading own
+    Channel& c = channels[channel];
+    c.own[0] = {onMs, offMs, count};
+    c.own[1] = {0, gapMs, 1};
+    LedPattern pattern = {c.own, 2, true};
+    play(channel, pattern);
+}
+
+void LedSequencer::set(uint8_t channel, bool on) {
+    cancel();
+    channels[channel].phase = PHASE_IDLE;
+    write(channels[channel], on);
+    schedule();
+}
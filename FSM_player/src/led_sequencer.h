@@ -0,0 +1,117 @@
+#ifndef LED_SEQUENCER_H
+#define LED_SEQUENCER_H
+
+#include <Arduino.h>
+#include <pico/time.h>
+
+// Plays blink patterns on the three LEDs off a hardware alarm.
+//
+// A pattern is a short list of steps, each "on for onMs, then off for offMs,
+// times times over". The sequencer works out when the LED next changes and
+// sets the SDK's default alarm pool (a hardware alarm of the timer) to that
+// moment; the alarm's interrupt writes the pin and sets the next one. Pins are
+// only written at an edge, and nothing in loop() looks at the LEDs: the FSM
+// starts a pattern when something happens (a state change, the reset button,
+// an error) and the pattern runs by itself, also while the firmware waits or
+// is halted.
+//
+// Call play(), blink() and set() from core0 only, the core the alarm pool
+// interrupts.
+
+#define LED_CHANNELS 3
+
+// The LEDs, in the order of the pins in gpio_utils.h
+enum LedChannel : uint8_t {
+    LED_STATUS,     // led_status_pin: startup, error codes
+    LED_MODE,       // led_mode_pin: loading, the reset button
+    LED_STATE       // led_state_pin: the current state's blinkCount
+};
+
+// Error codes, blinked on the status LED until the next reboot
+#define LED_ERROR_SD     2      // the card didn't start
+#define LED_ERROR_CONFIG 3      // no config on the card could be used
+
+// On for onMs, then off for offMs, times times in a row. onMs 0 is a pause.
+struct LedStep {
+    uint16_t onMs;
+    uint16_t offMs;
+    uint8_t times;
+};
+
+// Steps played in order, then from the first again if loop. A pattern that
+// doesn't loop leaves the LED off at the end.
+struct LedPattern {
+    const LedStep* steps;
+    uint8_t count;
+    bool loop;
+};
+
+// The player's patterns
+extern const LedPattern led_waiting[LED_CHANNELS];  // the three LEDs in turn, waiting for the serial monitor
+extern const LedPattern led_loaded;                 // four quick blinks, the config is loaded
+extern const LedPattern led_reset_held;             // the reset button is held past the long press
+
+class LedSequencer {
+    public:
+        // Sets the LED pins as outputs, all off
+        void begin();
+
+        // Plays a pattern from its start, in place of whatever the LED did.
+        // The pattern must stay where it is while it plays.
+        void play(uint8_t channel, const LedPattern& pattern);
+
+        // count blinks of onMs on and offMs off, then gapMs off, over and over;
+        // off for good if count is 0. State blinks and error codes.
+        void blink(uint8_t channel, uint8_t count, uint16_t onMs, uint16_t offMs, uint16_t gapMs);
+
+        // Holds the LED on or off, the pattern stops
+        void set(uint8_t channel, bool on);
+
+        // Level the LED has now
+        bool isOn(uint8_t channel) const { return channels[channel].on; }
+
+        // Pin writes since begin(), one per edge
+        uint32_t getWrites() const { return writes; }
+
+    private:
+        enum : uint8_t { PHASE_IDLE, PHASE_START, PHASE_ON, PHASE_OFF };     // idle first, as before begin()
+
+        struct Channel {
+            uint8_t pin;
+            const LedStep* steps;
+            uint8_t count;
+            bool loop;
+            uint8_t step;       // step playing
+            uint8_t times;      // repetitions of it done
+            uint8_t phase;
+            bool on;            // level written last
+            uint64_t nextUs;    // time_us_64() of its next edge
+            LedStep own[2];     // the steps of blink()
+        };
+
+        // The alarm's interrupt, returns the us to the next edge after the one it was set for
+        static int64_t onAlarm(alarm_id_t id, void* user);
+
+        // Writes the level if it changed
+        void write(Channel& channel, bool on);
+
+        // Plays a channel on to the end of its current phase: the next edge
+        // and when it comes, or idle at the end of a pattern
+        void advance(Channel& channel);
+
+        // Takes the alarm back, so the interrupt leaves the channels alone
+        void cancel();
+
+        // Sets the alarm to the earliest edge of the channels, with the alarm cancelled
+        void schedule();
+
+        Channel channels[LED_CHANNELS];
+        alarm_id_t alarm;       // 0 when none is set
+        uint64_t alarmUs;       // time the alarm is set for
+        uint32_t writes;
+};
+
+// The firmware's LEDs
+extern LedSequencer leds;
+
+#endif // LED_SEQUENCER_H
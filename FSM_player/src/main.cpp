@@ -1,53 +1,125 @@
 #include "SdFat.h"
 #include "FSM.h"
 #include "gpio_utils.h"
-
-
-uint8_t sensorPins[8] = {0, 1, 2, 3, 4, 5, 6, 7 }; 
-bool sensorStates[8];
+#include "scheduler.h"
+#include "audio_engine.h"
+#include "led_sequencer.h"
+#include "flash_cache.h"
+#include "state_journal.h"
 
 FSM fsm;
+Scheduler scheduler;
+I2SSink audioOut;
+AudioMixer audioMixer;
+AudioStream audioStream;
+AudioStream audioFader;         // plays the audio of the state before while it fades out
+AudioPrefetch audioCache;
+AudioIndex audioIndex;
+AudioEngine audio;
+StateJournal journal;           // where the show is, in the onboard flash
+volatile bool audioReady = false;   // set by setup() once core1 may start on the audio
 
 //------------------------------------------------------------------------------
 void setup() {
 
 
-  //initialize led pins
-  pinMode(led_status_pin, OUTPUT);
-  pinMode(led_mode_pin, OUTPUT);
-  pinMode(led_state_pin, OUTPUT);
+  //initialize led pins, the sequencer blinks them off a hardware alarm from here on
+  leds.begin();
 
 
-  //initialize sensor pins to input and pullup
-  for (uint8_t i = 0; i < 8; i++) {
-    pinMode(sensorPins[i], INPUT_PULLUP);
-  }
+  //sensor pins are set up by fsm.begin(), they are listed in the config
   pinMode(resetPin, INPUT_PULLUP);
 
   Serial.begin(115200);
 
-// wait for serial to be connected or for three seconds to pass. while waiting, flash all three leds in sequence
-unsigned int startup_timer = millis();
-while (!Serial && startup_timer+5000 > millis()) {
-  flasher(millis()-startup_timer);
-  delay(5);
+  //a show cut off by a power cut goes on where it was, straight away. hold the
+  //reset button while powering up to start over at state 0 with the card checked
+  flashCache.begin();
+  JournalRecord last;
+  bool resuming = journal.begin() && journal.last(last) && digitalRead(resetPin) == HIGH;
 
+// wait for serial to be connected or for five seconds to pass. while waiting, flash all three leds in sequence
+if (!resuming) {
+  for (uint8_t i = 0; i < LED_CHANNELS; i++) {
+    leds.play(i, led_waiting[i]);
+  }
+  unsigned int startup_timer = millis();
+  while (!Serial && startup_timer+5000 > millis()) {
+    delay(5);
+  }
+  for (uint8_t i = 0; i < LED_CHANNELS; i++) {
+    leds.set(i, false);
+  }
 }
   
 
 
   fsm.loadConfiguration();
 
+  //index the audio folders, then report audio files the raw sector reads can't be used for
+  //(and repack them if asked to)
+  //(resuming, the index is taken as it is and the report left for the next full boot)
+  audioIndex.seed(rp2040.hwrand32());
+  fsm.indexAudio(audioIndex, resuming);
+  if (!resuming) {
+    fsm.checkAudioFiles(audioIndex);
+  }
+
+  //stream each state's audio from the card loadConfiguration() opened, on core1,
+  //two streams through the mixer so one state's audio can fade into the next
+  audioMixer.begin(audioOut);
+  audioStream.setOutput(I2S_OUTPUT_RATE, I2S_OUTPUT_MONO);
+  audioStream.setPrefetch(&audioCache);
+  audioStream.setIndex(&audioIndex);
+  audioStream.begin(sd, audioMixer.getInput(0));
+  audioFader.setOutput(I2S_OUTPUT_RATE, I2S_OUTPUT_MONO);
+  audioFader.setPrefetch(&audioCache);
+  audioFader.setIndex(&audioIndex);
+  audioFader.begin(sd, audioMixer.getInput(1));
+  audio.begin(audioMixer, audioStream, audioFader, Scheduler::notify);
+  fsm.setAudio(&audio);
+
+  fsm.setJournal(&journal);
   fsm.begin();
+  if (resuming && fsm.resume(journal)) {
+    Serial.print(F("Resumed in state "));
+    Serial.println(fsm.getCurrentState());
+  }
+
+  //wake up on any sensor or reset button edge
+  scheduler.begin(fsm.getInputGpioMask());
 
 
   Serial.println(F("\nSetup complete"));
+  audioReady = true;
   delay(500);
 }
 
+//------------------------------------------------------------------------------
+// Core1: audio only. From here on only core1 touches the SD card and the I2S
+// output, core0 runs the FSM and talks to it through the engine's queues.
+void setup1() {
+  while (!audioReady) {
+    delay(1);
+  }
+}
+
+void loop1() {
+  audio.run();
+
+  //sleep until the stream needs feeding or the FSM sends a command
+  audio.idle();
+}
+
 void loop() {
 
-  fsm.update(sensorPins, sensorStates);
+  fsm.update();
+
+  //a reloaded config may use other inputs
+  if (fsm.takeReloaded()) {
+    scheduler.watch(fsm.getInputGpioMask());
+  }
 
-  delay(5);
+  //sleep until the FSM has something to do or an input changes
+  scheduler.sleepUntilUs(fsm.nextDeadlineUs());
 }
@@ -0,0 +1,88 @@
+#include <hardware/sync.h>
+#include <pico/time.h>
+#include "scheduler.h"
+#include "telemetry.h"
+
+volatile bool Scheduler::edgePending = false;
+volatile bool Scheduler::notified = false;
+
+void Scheduler::onEdge() {
+    // Runs in interrupt context, only notes the edge and wakes the core
+    edgePending = true;
+    __sev();
+}
+
+void Scheduler::notify() {
+    notified = true;
+    __sev();
+}
+
+void Scheduler::begin(uint32_t gpioMask) {
+    wakeups = 0;
+    edgeWakeups = 0;
+    sleptUs = 0;
+    edgePending = false;
+    watched = 0;
+    watch(gpioMask);
+}
+
+void Scheduler::watch(uint32_t gpioMask) {
+    for (uint8_t pin = 0; pin < 32; pin++) {
+        uint32_t bit = 1UL << pin;
+        if ((gpioMask & bit) && !(watched & bit)) {
+            attachInterrupt(digitalPinToInterrupt(pin), onEdge, CHANGE);
+        } else if (!(gpioMask & bit) && (watched & bit)) {
+            detachInterrupt(digitalPinToInterrupt(pin));
+        }
+    }
+    watched = gpioMask;
+}
+
+bool Scheduler::sleepUntil(unsigned long deadline) {
+    // Work in microseconds since boot, millis() is the same clock divided by 1000,
+    // so waking at deadline * 1000 us is exactly when millis() reaches deadline
+    uint64_t now = time_us_64();
+    long wait = (long)(deadline - (unsigned long)(now / 1000));
+    if (wait > SCHEDULER_MAX_SLEEP_MS) {
+        wait = SCHEDULER_MAX_SLEEP_MS;
+    }
+    return sleepFor(now, wait > 0 ? (uint32_t)wait * 1000 - now % 1000 : 0);
+}
+
+bool Scheduler::sleepUntilUs(uint32_t deadlineUs) {
+    uint64_t now = time_us_64();
+    int32_t wait = (int32_t)(deadlineUs - (uint32_t)now);
+    if (wait > SCHEDULER_MAX_SLEEP_MS * 1000L) {
+        wait = SCHEDULER_MAX_SLEEP_MS * 1000L;
+    }
+    return sleepFor(now, wait > 0 ? wait : 0);
+}
+
+bool Scheduler::sleepFor(uint64_t now, uint32_t waitUs) {
+    if (waitUs > 0 && !edgePending && !notified && !Serial.available()) {
+        absolute_time_t until = from_us_since_boot(now + waitUs);
+
+        // WFE also returns for other interrupts (USB, timers), go back to
+        // sleep until it was our edge, the deadline or bytes from the serial
+        // port (the USB interrupt that brought them woke us, a show
+        // controller's command is carried out without waiting for a deadline)
+        while (!edgePending && !notified && !Serial.available() && !best_effort_wfe_or_timeout(until)) {
+        }
+        uint64_t woke = time_us_64();
+        sleptUs += woke - now;
+
+        // Woken by the deadline: how late
+        if (!edgePending && !notified && woke >= until) {
+            telemetry.sample(TELEMETRY_JITTER_US, (uint32_t)(woke - until));
+        }
+    }
+
+    wakeups++;
+    bool edge = edgePending;
+    edgePending = false;
+    notified = false;
+    if (edge) {
+        edgeWakeups++;
+    }
+    return edge;
+}
@@ -0,0 +1,55 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <Arduino.h>
+
+// Longest single sleep, so loop() still comes round now and then when the FSM
+// has nothing scheduled at all
+#define SCHEDULER_MAX_SLEEP_MS 1000
+
+// Puts the core to sleep between FSM updates instead of polling.
+// loop() runs fsm.update(), then sleeps until fsm.nextDeadlineUs() (the next
+// timer, LED edge or debounce sample) or until one of the watched GPIOs
+// changes, whichever comes first. The pin interrupt only wakes the core up,
+// the pins are still read by the FSM's own snapshot.
+class Scheduler {
+    public:
+        // Watches the GPIOs set in gpioMask for edges
+        void begin(uint32_t gpioMask);
+
+        // Changes the GPIOs watched, after a config reload
+        void watch(uint32_t gpioMask);
+
+        // Sleeps until millis() reaches deadline, a watched GPIO changes,
+        // notify() is called or the serial port has bytes to read. Returns
+        // true if it was woken by an edge.
+        bool sleepUntil(unsigned long deadline);
+
+        // The same to the microsecond, deadlineUs a time_us_32() timestamp
+        bool sleepUntilUs(uint32_t deadlineUs);
+
+        // Wakes sleepUntil() early, callable from the other core (the audio
+        // engine calls it when it has events for the FSM)
+        static void notify();
+
+        // Counters since begin()
+        unsigned long getWakeups() const { return wakeups; }
+        unsigned long getEdgeWakeups() const { return edgeWakeups; }
+        uint64_t getSleptUs() const { return sleptUs; }
+
+    private:
+        static void onEdge();
+
+        // Sleeps from now (time_us_64()) for waitUs, both sleepUntil()s end here
+        bool sleepFor(uint64_t now, uint32_t waitUs);
+
+        static volatile bool edgePending;   // set by onEdge(), cleared when sleepUntil() returns
+        static volatile bool notified;      // set by notify(), cleared when sleepUntil() returns
+
+        uint32_t watched;
+        unsigned long wakeups;
+        unsigned long edgeWakeups;
+        uint64_t sleptUs;
+};
+
+#endif // SCHEDULER_H
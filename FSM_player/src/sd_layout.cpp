@@ -0,0 +1,88 @@
+#include "sd_layout.h"
+#include "fsm_image.h"
+
+// Copy buffer, whole sectors
+#define REPACK_CHUNK 2048
+
+FileLayout sd_file_layout(SdFat32& sd, const char* path) {
+    File32 file = sd.open(path, O_RDONLY);
+    if (!file || file.isDir()) {
+        return LAYOUT_MISSING;
+    }
+    uint32_t bgnSector, endSector;
+    return file.contiguousRange(&bgnSector, &endSector) ? LAYOUT_CONTIGUOUS : LAYOUT_FRAGMENTED;
+}
+
+const char* sd_repack(SdFat32& sd, const char* path) {
+    char copyPath[130];
+    if (snprintf(copyPath, sizeof(copyPath), "%s~", path) >= (int)sizeof(copyPath)) {
+        return "path too long";
+    }
+
+    if (!sd.exists(path) && sd.exists(copyPath)) {
+        if (!sd.rename(copyPath, path)) {
+            return "can't restore the copy";
+        }
+    }
+    FileLayout layout = sd_file_layout(sd, path);
+    if (layout == LAYOUT_MISSING) {
+        return "not found";
+    }
+    if (layout == LAYOUT_CONTIGUOUS) {
+        return nullptr;
+    }
+
+    File32 source = sd.open(path, O_RDONLY);
+    File32 copy = sd.open(copyPath, O_RDWR | O_CREAT | O_TRUNC);
+    if (!source || !copy) {
+        return "can't open";
+    }
+    uint32_t size = source.fileSize();
+    if (!copy.preAllocate(size)) {
+        copy.close();
+        sd.remove(copyPath);
+        return "no contiguous free space";
+    }
+
+    static uint8_t buffer[REPACK_CHUNK] __attribute__((aligned(4)));
+    for (uint32_t done = 0; done < size; ) {
+        uint32_t chunk = size - done < REPACK_CHUNK ? size - done : REPACK_CHUNK;
+        if (source.read(buffer, chunk) != (int)chunk || copy.write(buffer, chunk) != chunk) {
+            copy.close();
+            sd.remove(copyPath);
+            return "copy failed";
+        }
+        done += chunk;
+    }
+    source.close();
+    if (!copy.sync()) {
+        copy.close();
+        sd.remove(copyPath);
+        return "copy failed";
+    }
+    copy.close();
+
+    // From here the copy is complete, a cut-off repack is finished on the next one
+    if (!sd.remove(path) || !sd.rename(copyPath, path)) {
+        return "can't replace the original";
+    }
+    return nullptr;
+}
+
+uint32_t sd_files_signature(SdFat32& sd, const char* const* paths, uint8_t count) {
+    uint32_t crc = 0;
+    for (uint8_t i = 0; i < count; i++) {
+        uint32_t facts[3] = {0, 0, 0};
+        File32 file = sd.open(paths[i], O_RDONLY);
+        if (file && !file.isDir()) {
+            uint16_t date = 0;
+            uint16_t time = 0;
+            file.getModifyDateTime(&date, &time);
+            facts[0] = file.fileSize();
+            facts[1] = file.firstSector();
+            facts[2] = (uint32_t)date << 16 | time;
+        }
+        crc = fsm_crc32(facts, sizeof(facts), crc);
+    }
+    return crc;
+}
@@ -0,0 +1,29 @@
+#ifndef SD_LAYOUT_H
+#define SD_LAYOUT_H
+
+#include <SdFat.h>
+
+// How a file is laid out on the card. AudioStream reads contiguous files
+// with raw sector reads, fragmented ones through the FAT, which costs a card
+// access at every fragment and leaves less bandwidth for the audio.
+enum FileLayout : uint8_t {
+    LAYOUT_MISSING,
+    LAYOUT_CONTIGUOUS,      // one run of sectors
+    LAYOUT_FRAGMENTED       // scattered over the card
+};
+
+FileLayout sd_file_layout(SdFat32& sd, const char* path);
+
+// Rewrites a file into one run of free clusters: copies it to path + "~",
+// removes the original and renames the copy. A copy left over by a repack
+// that was cut off after the original was removed is put back first.
+// Returns nullptr when the file is contiguous, otherwise what went wrong;
+// the original is left as it was.
+const char* sd_repack(SdFat32& sd, const char* path);
+
+// Identity of files as the directory has them: sizes, first sectors and
+// modification times, combined into one number. Changes when any of them is
+// written, replaced, created or removed; a missing file counts as all zeros.
+uint32_t sd_files_signature(SdFat32& sd, const char* const* paths, uint8_t count);
+
+#endif // SD_LAYOUT_H
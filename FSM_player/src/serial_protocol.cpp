@@ -0,0 +1,114 @@
+#include <string.h>
+#include "serial_protocol.h"
+#include "fsm_image.h"
+
+static_assert(sizeof(SerialPongBody) == 8, "SerialPongBody layout changed");
+static_assert(sizeof(SerialStatusBody) == 32 + 4 * FSM_MAX_TIMERS + 4 * FSM_MAX_VARS, "SerialStatusBody layout changed");
+
+SerialByte SerialReader::feed(uint8_t byte) {
+    if (byte == 0) {
+        if (!inFrame) {                                 // opens a message
+            inFrame = true;
+            length = 0;
+            remaining = 0;
+            lastCode = 0xFF;
+            overflow = false;
+            return SERIAL_BYTE_FRAME;
+        }
+        if (length == 0 && remaining == 0 && lastCode == 0xFF) {
+            return SERIAL_BYTE_FRAME;                   // nothing in it yet, the host syncing
+        }
+
+        // Closes it: whole COBS blocks, room for the header and the CRC, and the CRC right
+        inFrame = false;
+        uint32_t crc;
+        if (overflow || remaining != 0 || length < sizeof(SerialHeader) + sizeof(crc)) {
+            badFrames++;
+            return SERIAL_BYTE_FRAME;
+        }
+        length -= sizeof(crc);
+        memcpy(&crc, buffer + length, sizeof(crc));
+        if (fsm_crc32(buffer, length) != crc) {
+            badFrames++;
+            return SERIAL_BYTE_FRAME;
+        }
+        return SERIAL_BYTE_MESSAGE;
+    }
+
+    if (!inFrame) {
+        return SERIAL_BYTE_TEXT;
+    }
+
+    if (remaining == 0) {
+        // A code byte: the block before it ended in a zero unless it was a full
+        // one (or there was none, lastCode starts at 0xFF)
+        if (lastCode != 0xFF) {
+            if (length < sizeof(buffer)) {
+                buffer[length++] = 0;
+            } else {
+                overflow = true;
+            }
+        }
+        lastCode = byte;
+        remaining = byte - 1;
+        return SERIAL_BYTE_FRAME;
+    }
+
+    if (length < sizeof(buffer)) {
+        buffer[length++] = byte;
+    } else {
+        overflow = true;
+    }
+    remaining--;
+    return SERIAL_BYTE_FRAME;
+}
+
+void SerialWriter::begin(uint8_t type, uint8_t seq) {
+    count = 0;
+    crc = 0;
+    out.write((uint8_t)0);
+    out.write((uint8_t)0);                              // ends what a receiver out of step took for a message
+    SerialHeader header = {type, seq};
+    write((const uint8_t*)&header, sizeof(header));
+}
+
+void SerialWriter::flushBlock(uint8_t code) {
+    out.write(code);
+    out.write(block, count);
+    count = 0;
+}
+
+size_t SerialWriter::write(uint8_t byte) {
+    crc = fsm_crc32(&byte, 1, crc);
+    if (byte == 0) {
+        flushBlock(count + 1);
+    } else {
+        block[count++] = byte;
+        if (count == sizeof(block)) {
+            flushBlock(0xFF);                           // a full block, no zero after it
+        }
+    }
+    return 1;
+}
+
+size_t SerialWriter::write(const uint8_t* data, size_t size) {
+    crc = fsm_crc32(data, size, crc);
+    for (size_t i = 0; i < size; i++) {
+        if (data[i] == 0) {
+            flushBlock(count + 1);
+        } else {
+            block[count++] = data[i];
+            if (count == sizeof(block)) {
+                flushBlock(0xFF);
+            }
+        }
+    }
+    return size;
+}
+
+void SerialWriter::end() {
+    uint32_t sum = crc;
+    write((const uint8_t*)&sum, sizeof(sum));
+    flushBlock(count + 1);                              // the last block, its zero is the one left off
+    out.write((uint8_t)0);
+}
@@ -0,0 +1,185 @@
+#ifndef SERIAL_PROTOCOL_H
+#define SERIAL_PROTOCOL_H
+
+#include <Arduino.h>
+#include "fsm_program.h"
+
+// Binary protocol for a show controller on the USB serial port, alongside
+// the text commands typed on the serial monitor ("reload", "telemetry").
+//
+// A message is a type, a sequence number and a body, followed by the
+// CRC-32 (fsm_crc32) of all three. On the wire it is COBS-encoded, so it
+// has no zero bytes in it, and sent between zero bytes: 0x00 0x00, the
+// encoded message, 0x00. Text lines never contain a zero byte, so a zero
+// starts a message and the next one ends it. A zero straight after the
+// opening one changes nothing, so the second one only matters to a
+// receiver that lost track, when a zero was lost or a flipped bit made
+// one: it ends whatever that receiver took for a message, and the message
+// after it comes through. A message that fails its CRC is dropped and
+// counted, without an answer; the host sends it again after a timeout.
+// The text "telemetry" command's dump isn't framed and has zeros in it, a
+// host that speaks this protocol asks with SERIAL_TELEMETRY instead.
+//
+// Every command is answered with the same sequence number, either by a
+// message of its own (SERIAL_PONG, SERIAL_STATUS, SERIAL_TELEMETRY_DUMP) or
+// by SERIAL_ACK. Once a host has subscribed, the player also pushes a
+// SERIAL_STATUS with sequence number 0 for every state change, finished
+// audio and reload. A push is only sent if it fits in the port's transmit
+// buffer, otherwise it is dropped and counted, so a host that stops reading
+// never holds up the show. tools/serial_client.h is the host side.
+//
+// Little-endian, like the RP2040. The bodies below start after type and seq.
+
+#define SERIAL_PROTOCOL_VERSION 1
+
+// Longest message a command can be, CRC included. Longer ones are dropped.
+#define SERIAL_COMMAND_MAX 32
+
+enum SerialMessageType : uint8_t {
+    // Host to player
+    SERIAL_PING = 0x01,             // -> SERIAL_PONG
+    SERIAL_INPUT,                   // SerialInputBody: a virtual sensor event -> SERIAL_ACK
+    SERIAL_SET_STATE,               // SerialSetStateBody: go to a state now -> SERIAL_ACK
+    SERIAL_QUERY,                   // -> SERIAL_STATUS
+    SERIAL_SUBSCRIBE,               // SerialSubscribeBody: status pushes on or off -> SERIAL_ACK
+    SERIAL_TELEMETRY,               // -> SERIAL_TELEMETRY_DUMP
+    SERIAL_RELOAD,                  // reload the config (FSM::requestReload()) -> SERIAL_ACK
+
+    // Player to host
+    SERIAL_ACK = 0x80,              // SerialAckBody
+    SERIAL_PONG,                    // SerialPongBody
+    SERIAL_STATUS,                  // SerialStatusBody, a reply or a push
+    SERIAL_TELEMETRY_DUMP           // a telemetry dump frame as Telemetry::dump() writes it (telemetry.h)
+};
+
+enum SerialResult : uint8_t {
+    SERIAL_OK,
+    SERIAL_UNKNOWN,                 // not a command this firmware has
+    SERIAL_BAD_LENGTH,              // the body is too short or too long for the command
+    SERIAL_BAD_ARGUMENT,            // an input or state the config doesn't have
+    SERIAL_NOT_LOADED               // no config loaded
+};
+
+// SERIAL_INPUT levels
+enum SerialLevel : uint8_t {
+    SERIAL_LEVEL_LOW,               // held low, pressed for a switch to ground
+    SERIAL_LEVEL_HIGH,              // held high
+    SERIAL_LEVEL_RELEASE            // back to what its pin says
+};
+
+// Why a SERIAL_STATUS was sent
+enum SerialReason : uint8_t {
+    SERIAL_REASON_QUERY,            // the reply to SERIAL_QUERY
+    SERIAL_REASON_STATE,            // pushed, a state was entered (a transition, SERIAL_SET_STATE)
+    SERIAL_REASON_AUDIO,            // pushed, the state's audio finished
+    SERIAL_REASON_RELOAD            // pushed, a config reload went in
+};
+
+struct SerialHeader {
+    uint8_t type;                   // SerialMessageType
+    uint8_t seq;                    // Chosen by the host, 0 on pushes
+};
+
+struct SerialInputBody {
+    uint8_t input;                  // Sensor input of the config, not the GPIO
+    uint8_t level;                  // SerialLevel
+};
+
+struct SerialSetStateBody {
+    uint8_t state;
+};
+
+struct SerialSubscribeBody {
+    uint8_t on;
+};
+
+struct SerialAckBody {
+    uint8_t command;                // Type of the command answered
+    uint8_t result;                 // SerialResult
+};
+
+struct SerialPongBody {
+    uint32_t us;                    // time_us_32() when the ping was answered
+    uint16_t version;               // SERIAL_PROTOCOL_VERSION
+    uint16_t badFrames;             // Messages dropped so far: CRC, COBS or too long
+};
+
+struct SerialStatusBody {
+    uint8_t reason;                 // SerialReason
+    uint8_t state;                  // Current state, 0xFF with no config loaded
+    uint8_t numStates;
+    uint8_t audioDone;              // The state's audio played through
+    uint32_t us;                    // time_us_32() when it was sent
+    uint32_t inStateMs;             // Time in the state
+    uint32_t audioMs;               // Time since the state's audio was started, 0 while it hasn't been
+    uint32_t inputs;                // Sensor levels, bit n = input n, held inputs included
+    uint32_t held;                  // Inputs held by SERIAL_INPUT
+    uint32_t transitions;           // Transitions so far (telemetry counter)
+    uint16_t pushesDropped;         // Pushes that didn't fit in the transmit buffer
+    uint16_t reserved;
+    uint32_t timers[FSM_MAX_TIMERS];    // us until each show timer runs out, 0: not armed or run out
+    int32_t vars[FSM_MAX_VARS];
+};
+
+// What a byte fed to SerialReader was
+enum SerialByte : uint8_t {
+    SERIAL_BYTE_TEXT,               // outside a message, for the text commands
+    SERIAL_BYTE_FRAME,              // part of a message, or a delimiter
+    SERIAL_BYTE_MESSAGE             // ended a message that checks out, see message()
+};
+
+// Takes the bytes from the port one at a time as they are read and undoes
+// the COBS encoding straight into the message buffer: no buffer of the
+// encoded frame, no second pass, the CRC is checked when the closing zero
+// comes.
+class SerialReader {
+    public:
+        SerialReader() : inFrame(false), length(0), remaining(0), lastCode(0xFF), overflow(false), badFrames(0) {}
+
+        SerialByte feed(uint8_t byte);
+
+        // The last message, CRC taken off; valid until the next feed()
+        const uint8_t* message() const { return buffer; }
+        uint8_t messageLength() const { return length; }
+
+        // Frames dropped: failed CRC, broken COBS, too long or too short
+        uint16_t getBadFrames() const { return badFrames; }
+
+    private:
+        bool inFrame;
+        uint8_t buffer[SERIAL_COMMAND_MAX];
+        uint8_t length;
+        uint8_t remaining;              // Bytes left in the current COBS block, 0: a code byte comes next
+        uint8_t lastCode;               // Code of that block, below 0xFF it ends in a zero
+        bool overflow;
+        uint16_t badFrames;
+};
+
+// Writes one message: the two opening zeros at begin(), the COBS encoding as the
+// bytes come, the CRC and the closing zero at end(). A Print, so
+// Telemetry::dump() can write into a message like into the port. Encodes in
+// blocks of at most 254 bytes, the only buffer it needs.
+class SerialWriter : public Print {
+    public:
+        explicit SerialWriter(Print& out) : out(out), count(0), crc(0) {}
+
+        using Print::write;
+        void begin(uint8_t type, uint8_t seq);
+        size_t write(uint8_t byte) override;
+        size_t write(const uint8_t* data, size_t size) override;
+        void end();
+
+        // Bytes a message of size bytes (type, seq and body) takes on the wire, at most
+        static size_t wireSize(size_t size) { return size + 4 + (size + 4) / 254 + 4; }
+
+    private:
+        // Sends the block with its code byte
+        void flushBlock(uint8_t code);
+
+        Print& out;
+        uint8_t block[254];
+        uint8_t count;
+        uint32_t crc;
+};
+
+#endif // SERIAL_PROTOCOL_H
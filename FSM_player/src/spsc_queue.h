@@ -0,0 +1,57 @@
+#ifndef SPSC_QUEUE_H
+#define SPSC_QUEUE_H
+
+#include <stdint.h>
+#include <atomic>
+
+// Fixed-size queue between exactly one producer and one consumer, e.g. the
+// two RP2040 cores, without locks. The producer only writes head and the
+// consumer only writes tail, so plain atomic loads and stores with
+// acquire/release ordering are enough; the Cortex-M0+ has no atomic
+// read-modify-write, and none is needed. Size must be a power of two,
+// one slot is never used so full and empty can be told apart.
+template <typename T, uint16_t Size>
+class SpscQueue {
+    static_assert(Size >= 2 && (Size & (Size - 1)) == 0, "SpscQueue size must be a power of two");
+
+    public:
+        SpscQueue() : head(0), tail(0) {}
+
+        // Producer side. False if the queue is full.
+        bool push(const T& item) {
+            uint16_t h = head.load(std::memory_order_relaxed);
+            uint16_t next = (h + 1) & (Size - 1);
+            if (next == tail.load(std::memory_order_acquire)) {
+                return false;
+            }
+            items[h] = item;
+            head.store(next, std::memory_order_release);     // publishes the item
+            return true;
+        }
+
+        // Consumer side. False if the queue is empty.
+        bool pop(T& item) {
+            uint16_t t = tail.load(std::memory_order_relaxed);
+            if (t == head.load(std::memory_order_acquire)) {
+                return false;
+            }
+            item = items[t];
+            tail.store((t + 1) & (Size - 1), std::memory_order_release);    // hands the slot back
+            return true;
+        }
+
+        // Consumer side: items there are to pop, at least (more may come in meanwhile)
+        uint16_t size() const {
+            return (head.load(std::memory_order_acquire) - tail.load(std::memory_order_relaxed)) & (Size - 1);
+        }
+
+        // Either side, may be out of date by the time it returns
+        bool empty() const { return head.load(std::memory_order_acquire) == tail.load(std::memory_order_acquire); }
+
+    private:
+        T items[Size];
+        std::atomic<uint16_t> head;     // next slot to write, producer only
+        std::atomic<uint16_t> tail;     // next slot to read, consumer only
+};
+
+#endif // SPSC_QUEUE_H
@@ -0,0 +1,110 @@
+#include <LittleFS.h>
+#include <stddef.h>
+#include <string.h>
+#include "state_journal.h"
+#include "fsm_image.h"
+
+static_assert(sizeof(JournalRecord) == 12 + 4 * FSM_MAX_VARS + 4, "JournalRecord layout changed");
+
+static const char* const journal_paths[2] = JOURNAL_PATHS;
+
+static uint32_t record_crc(const JournalRecord& record) {
+    return fsm_crc32(&record, offsetof(JournalRecord, crc));
+}
+
+StateJournal::StateJournal() : mounted(false), found(false), current(1), count(0), restart(true), appends(0), damaged(0) {
+}
+
+bool StateJournal::begin() {
+    mounted = LittleFS.begin();
+    found = false;
+    current = 1;                    // with nothing found the first append starts file 0
+    count = 0;
+    restart = true;
+    appends = 0;
+    damaged = 0;
+    if (mounted) {
+        scan(0);
+        scan(1);
+    }
+    return mounted;
+}
+
+void StateJournal::scan(uint8_t which) {
+    File file = LittleFS.open(journal_paths[which], "r");
+    if (!file) {
+        return;
+    }
+    size_t size = file.size();
+    uint16_t good = 0;
+    JournalRecord record;
+    JournalRecord newest;
+    bool any = false;
+    while (file.read((uint8_t*)&record, sizeof(record)) == sizeof(record)) {
+        if (record.crc != record_crc(record)) {
+            break;
+        }
+        newest = record;
+        any = true;
+        good++;
+    }
+    if (size != good * sizeof(JournalRecord)) {
+        damaged++;                  // a record cut off part way, or garbage after the good ones
+    }
+
+    // The newer of the two files is the one appended to
+    if (any && (!found || (int32_t)(newest.seq - latest.seq) > 0)) {
+        latest = newest;
+        found = true;
+        current = which;
+        count = good;
+        restart = size != good * sizeof(JournalRecord) || good >= JOURNAL_RECORDS;
+    }
+}
+
+bool StateJournal::last(JournalRecord& record) const {
+    if (found) {
+        record = latest;
+    }
+    return found;
+}
+
+bool StateJournal::append(uint32_t image, uint8_t state, const int32_t* vars) {
+    if (!mounted) {
+        return false;
+    }
+    JournalRecord record;
+    memset(&record, 0, sizeof(record));
+    record.seq = found ? latest.seq + 1 : 1;
+    record.image = image;
+    record.state = state;
+    memcpy(record.vars, vars, sizeof(record.vars));
+    record.crc = record_crc(record);
+
+    // A full file, or one with a damaged tail, is left as it is and the other
+    // one started over: until this record is in, the newest good one stays where it is
+    if (restart) {
+        current ^= 1;
+        count = 0;
+    }
+    File file = LittleFS.open(journal_paths[current], restart ? "w" : "a");
+    bool ok = file && file.write((const uint8_t*)&record, sizeof(record)) == sizeof(record);
+    file.close();
+
+    if (!ok) {
+        // Whatever got in is a damaged tail now. If it was the first record of
+        // a file started over, the newest good one is in the other file: keep
+        // that one and start this one over again next time.
+        if (count == 0) {
+            current ^= 1;
+        }
+        restart = true;
+        return false;
+    }
+    latest = record;
+    found = true;
+    count++;
+    restart = count >= JOURNAL_RECORDS;
+    appends++;
+    return true;
+}
@@ -0,0 +1,70 @@
+#ifndef STATE_JOURNAL_H
+#define STATE_JOURNAL_H
+
+#include <stdint.h>
+#include "fsm_program.h"
+
+// Where the show is, kept in the onboard flash so that after a power cut
+// the player picks up in the state it was in rather than at state 0.
+//
+// Every state change appends a record: the state, the variables of the
+// condition programs and the CRC of the state table it belongs to, with a
+// sequence number and a CRC of its own. Records go into one of two files in
+// turn; when one holds JOURNAL_RECORDS the other is started over, so the
+// journal never takes more than two files and LittleFS spreads the writes
+// over the free blocks of the flash (its wear levelling). At boot the
+// record with the highest sequence number whose CRC checks out is the one
+// the show goes on from: a record the power cut off part way is passed
+// over, the one before it is used.
+//
+// An append is a flash write, which pauses the other core while it runs
+// (the Arduino-Pico core idles it and the XIP cache for it). The FSM
+// appends once per state change, FSM_JOURNAL_DELAY_MS after it once the new
+// state's audio is under way, never on a plain tick.
+#define JOURNAL_RECORDS 64                  // Per file, then the other file is started over
+#define JOURNAL_PATHS   {"/journal.0", "/journal.1"}
+
+struct JournalRecord {
+    uint32_t seq;               // Goes up by one with every record, across both files
+    uint32_t image;             // CRC of the state table (FsmImageHeader::crc)
+    uint8_t state;
+    uint8_t reserved[3];
+    int32_t vars[FSM_MAX_VARS];
+    uint32_t crc;               // CRC-32 of the record before this field
+};
+
+class StateJournal {
+    public:
+        StateJournal();
+
+        // Mounts the flash filesystem and finds the last good record. False
+        // without a filesystem, the journal then does nothing.
+        bool begin();
+        void end() { mounted = false; }
+
+        // The record the show goes on from, false if there is none
+        bool last(JournalRecord& record) const;
+
+        // Appends a record of the state and variables, false if it couldn't be written
+        bool append(uint32_t image, uint8_t state, const int32_t* vars);
+
+        // Records appended since begin(), and the ones before the last good
+        // one at begin() that were damaged (cut off by a power loss)
+        uint32_t getAppends() const { return appends; }
+        uint16_t getDamaged() const { return damaged; }
+
+    private:
+        // Reads one file, keeping its last good record if it is the newest so far
+        void scan(uint8_t file);
+
+        bool mounted;
+        bool found;                 // latest holds a record
+        JournalRecord latest;
+        uint8_t current;            // File appended to
+        uint16_t count;             // Records in it
+        bool restart;               // Start a file over at the next append: the current one is full or has a damaged tail
+        uint32_t appends;
+        uint16_t damaged;
+};
+
+#endif // STATE_JOURNAL_H
@@ -0,0 +1,60 @@
+#include <string.h>
+#include "telemetry.h"
+#include "fsm_image.h"
+
+Telemetry telemetry;
+
+Telemetry::Telemetry() : histograms(), counters() {
+}
+
+void Telemetry::record(TelemetryCore core, TelemetryEvent event, uint8_t a, uint16_t b, uint32_t value) {
+    TelemetryRecord record = {now(), event, a, b, value};
+    if (!rings[core].push(record)) {
+        counters[core == TELEMETRY_FSM_CORE ? TELEMETRY_DROPPED_FSM : TELEMETRY_DROPPED_AUDIO]++;
+    }
+}
+
+// Writes bytes of the frame and adds them to its CRC
+static void put(Print& out, const void* data, size_t length, uint32_t& crc) {
+    out.write((const uint8_t*)data, length);
+    crc = fsm_crc32(data, length, crc);
+}
+
+size_t Telemetry::dump(Print& out) {
+    // The events there are now; ones that come in while the frame goes out wait for the next
+    uint16_t records[TELEMETRY_CORES];
+    uint16_t numRecords = 0;
+    for (uint8_t core = 0; core < TELEMETRY_CORES; core++) {
+        records[core] = rings[core].size();
+        numRecords += records[core];
+    }
+
+    TelemetryDumpHeader header = {};
+    header.magic = TELEMETRY_MAGIC;
+    header.version = TELEMETRY_VERSION;
+    header.headerSize = sizeof(header);
+    header.size = sizeof(header) + sizeof(histograms) + numRecords * sizeof(TelemetryRecord) + sizeof(uint32_t);
+    header.us = now();
+    header.numMetrics = TELEMETRY_METRICS;
+    header.numBuckets = TELEMETRY_BUCKETS;
+    header.numRecords = numRecords;
+    for (uint8_t i = 0; i < TELEMETRY_COUNTERS; i++) {
+        header.counters[i] = counters[i];
+    }
+
+    uint32_t crc = 0;
+    put(out, &header, sizeof(header), crc);
+    for (uint8_t i = 0; i < TELEMETRY_METRICS; i++) {
+        TelemetryHistogram copy;
+        memcpy(&copy, &histograms[i], sizeof(copy));    // the CRC has to match what went out
+        put(out, &copy, sizeof(copy), crc);
+    }
+    for (uint8_t core = 0; core < TELEMETRY_CORES; core++) {
+        TelemetryRecord record;
+        for (uint16_t i = 0; i < records[core] && rings[core].pop(record); i++) {
+            put(out, &record, sizeof(record), crc);
+        }
+    }
+    out.write((const uint8_t*)&crc, sizeof(crc));
+    return header.size;
+}
@@ -0,0 +1,134 @@
+#ifndef TELEMETRY_H
+#define TELEMETRY_H
+
+#include <Arduino.h>
+#include <pico/time.h>
+#include "spsc_queue.h"
+
+// Hot-path telemetry: histograms of how long things take, a few counters and
+// a ring of timestamped events per core, collected without printing and
+// dumped on demand ("telemetry" on the serial monitor) as one binary frame
+// that tools/telemetry_decode.cpp (env:telemetry_decode) turns into text.
+//
+// Each histogram, counter and ring is written by one core only, so nothing
+// needs a lock: a sample is a few adds, an event a push into that core's
+// SpscQueue, whose other end the dump on core0 drains. An event that finds
+// its ring full is dropped and counted. Histograms are copied while the
+// other core may be adding to them, a dump can be a sample or two behind.
+
+#define TELEMETRY_MAGIC   0x544D5346UL      // "FSMT"
+#define TELEMETRY_VERSION 2
+
+// Histogram buckets: 0 holds 0, bucket b holds [2^(b-1), 2^b), the last one everything above
+#define TELEMETRY_BUCKETS 24
+
+// Events each core's ring holds until the next dump
+#define TELEMETRY_RING 128
+
+enum TelemetryMetric : uint8_t {
+    TELEMETRY_UPDATE_US,        // core0: one FSM::update()
+    TELEMETRY_JITTER_US,        // core0: how late the scheduler woke for a deadline
+    TELEMETRY_INPUT_US,         // core0: first sample of an input change to the transition it caused
+    TELEMETRY_SD_READ_US,       // core1: one read of audio from the card
+    TELEMETRY_AUDIO_FILL,       // core1: % of a playing stream's ring filled, before it is topped up
+    TELEMETRY_JOURNAL_US,       // core0: one append to the state journal, a flash write
+    TELEMETRY_METRICS
+};
+
+enum TelemetryCounter : uint8_t {
+    TELEMETRY_TRANSITIONS,      // core0
+    TELEMETRY_RELOADS,          // core0, config reloads swapped in
+    TELEMETRY_DROPPED_FSM,      // core0, events its ring had no room for
+    TELEMETRY_UNDERRUNS,        // core1, of the audio output
+    TELEMETRY_DROPPED_AUDIO,    // core1
+    TELEMETRY_COUNTERS
+};
+
+// Which ring an event goes to, by the core that records it
+enum TelemetryCore : uint8_t {
+    TELEMETRY_FSM_CORE,
+    TELEMETRY_AUDIO_CORE,
+    TELEMETRY_CORES
+};
+
+enum TelemetryEvent : uint8_t {
+    TELEMETRY_TRANSITION,       // a: from, b: to, value: input latency us (0: no input caused it)
+    TELEMETRY_RELOAD,           // a: 1 swapped in, 0 kept out; b: states; value: state after
+    TELEMETRY_AUDIO_FAILED,     // b: play number
+    TELEMETRY_UNDERRUN,         // value: underruns so far
+    TELEMETRY_READ_FAILED,      // opening or reading a playing file on the card failed, the stream stopped
+    TELEMETRY_PREFETCH_FAILED   // a file's start couldn't be loaded into the prefetch cache
+};
+
+struct TelemetryRecord {
+    uint32_t us;                // time_us_32() when it happened
+    TelemetryEvent event;
+    uint8_t a;
+    uint16_t b;
+    uint32_t value;
+};
+
+struct TelemetryHistogram {
+    uint32_t count;
+    uint32_t max;
+    uint64_t sum;
+    uint32_t buckets[TELEMETRY_BUCKETS];
+};
+
+// A dump: this header, TELEMETRY_METRICS histograms, numRecords records (both
+// rings, each in order), then the CRC-32 (fsm_crc32) of everything before it.
+// Little-endian, like the RP2040.
+struct TelemetryDumpHeader {
+    uint32_t magic;             // TELEMETRY_MAGIC
+    uint16_t version;           // TELEMETRY_VERSION
+    uint16_t headerSize;        // sizeof(TelemetryDumpHeader)
+    uint32_t size;              // Whole frame, CRC included
+    uint32_t us;                // time_us_32() at the dump
+    uint8_t numMetrics;         // TELEMETRY_METRICS
+    uint8_t numBuckets;         // TELEMETRY_BUCKETS
+    uint16_t numRecords;
+    uint32_t counters[TELEMETRY_COUNTERS];
+};
+
+class Telemetry {
+    public:
+        Telemetry();
+
+        // Microsecond timestamp, one register read on the RP2040 (the M0+ has no cycle counter)
+        static uint32_t now() { return time_us_32(); }
+
+        // Adds a value to a histogram, from the metric's core
+        void sample(TelemetryMetric metric, uint32_t value) {
+            TelemetryHistogram& histogram = histograms[metric];
+            uint8_t bucket = value ? 32 - __builtin_clz(value) : 0;
+            histogram.buckets[bucket < TELEMETRY_BUCKETS ? bucket : TELEMETRY_BUCKETS - 1]++;
+            histogram.count++;
+            histogram.sum += value;
+            if (value > histogram.max) {
+                histogram.max = value;
+            }
+        }
+
+        void count(TelemetryCounter counter, uint32_t n = 1) { counters[counter] += n; }
+        void set(TelemetryCounter counter, uint32_t value) { counters[counter] = value; }
+
+        // Queues an event in the ring of the core it is recorded on
+        void record(TelemetryCore core, TelemetryEvent event, uint8_t a = 0, uint16_t b = 0, uint32_t value = 0);
+
+        // Core0: writes a dump frame, taking the events out of the rings.
+        // Returns the bytes written.
+        size_t dump(Print& out);
+
+        const TelemetryHistogram& getHistogram(TelemetryMetric metric) const { return histograms[metric]; }
+        uint32_t getCounter(TelemetryCounter counter) const { return counters[counter]; }
+
+    private:
+        TelemetryHistogram histograms[TELEMETRY_METRICS];
+        volatile uint32_t counters[TELEMETRY_COUNTERS];
+        SpscQueue<TelemetryRecord, TELEMETRY_RING> rings[TELEMETRY_CORES];
+};
+
+// The firmware's telemetry
+extern Telemetry telemetry;
+
+#endif // TELEMETRY_H
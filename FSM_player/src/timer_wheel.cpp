@@ -0,0 +1,201 @@
+#include <string.h>
+#include "timer_wheel.h"
+
+#define LEVEL_BITS 6                                    // log2(TIMER_WHEEL_SLOTS)
+#define WHEEL_BITS (TIMER_WHEEL_LEVELS * LEVEL_BITS)    // what the levels cover, 36 bits
+#define OVERFLOW   (TIMER_WHEEL_LEVELS * TIMER_WHEEL_SLOTS)
+#define DUE        0xFFFF                               // where[] of a timer armed in the past
+
+static_assert(TIMER_WHEEL_SLOTS == 1 << LEVEL_BITS, "a slot mask is one 64-bit word");
+static_assert(TIMER_WHEEL_TIMERS <= 32, "advance() returns the timers as bits of a word");
+
+// Index of the highest set bit of a non-zero value
+static inline uint8_t top_bit(uint64_t value) {
+    return 63 - __builtin_clzll(value);
+}
+
+void TimerWheel::begin(uint32_t nowUs) {
+    current = nowUs;
+    memset(state, TIMER_IDLE, sizeof(state));
+    memset(heads, TIMER_WHEEL_NONE, sizeof(heads));
+    memset(occupied, 0, sizeof(occupied));
+    due = 0;
+}
+
+bool TimerWheel::insert(uint8_t id) {
+    uint64_t at = deadlines[id];
+    if (at <= current) {
+        return false;
+    }
+
+    // The level of the highest digit the deadline differs in from now. The
+    // deadline's digit there is above now's, so the slot is always ahead.
+    uint8_t level = top_bit(at ^ current) / LEVEL_BITS;
+    uint16_t list;
+    if (level >= TIMER_WHEEL_LEVELS) {
+        list = OVERFLOW;
+    } else {
+        uint8_t slot = (at >> (level * LEVEL_BITS)) & (TIMER_WHEEL_SLOTS - 1);
+        list = level * TIMER_WHEEL_SLOTS + slot;
+        occupied[level] |= 1ULL << slot;
+    }
+
+    where[id] = list;
+    prev[id] = TIMER_WHEEL_NONE;
+    next[id] = heads[list];
+    if (next[id] != TIMER_WHEEL_NONE) {
+        prev[next[id]] = id;
+    }
+    heads[list] = id;
+    return true;
+}
+
+void TimerWheel::unlink(uint8_t id) {
+    uint16_t list = where[id];
+    if (list == DUE) {
+        due &= ~(1UL << id);
+        return;
+    }
+    if (prev[id] != TIMER_WHEEL_NONE) {
+        next[prev[id]] = next[id];
+    } else {
+        heads[list] = next[id];
+    }
+    if (next[id] != TIMER_WHEEL_NONE) {
+        prev[next[id]] = prev[id];
+    }
+    if (heads[list] == TIMER_WHEEL_NONE && list != OVERFLOW) {
+        occupied[list / TIMER_WHEEL_SLOTS] &= ~(1ULL << (list % TIMER_WHEEL_SLOTS));
+    }
+}
+
+void TimerWheel::arm(uint8_t id, uint64_t at) {
+    if (state[id] == TIMER_ARMED) {
+        unlink(id);
+    }
+    deadlines[id] = at;
+    state[id] = TIMER_ARMED;
+
+    // Due already: no slot would ever be reached, the next advance() fires
+    // it whatever time it moves to
+    if (!insert(id)) {
+        where[id] = DUE;
+        due |= 1UL << id;
+    }
+}
+
+void TimerWheel::cancel(uint8_t id) {
+    if (state[id] == TIMER_ARMED) {
+        unlink(id);
+    }
+    state[id] = TIMER_IDLE;
+}
+
+bool TimerWheel::nextEvent(uint64_t& at) const {
+    // The next slot of each level after now's; level l's slot s starts when
+    // now's digit l becomes s, the digits above stay as they are
+    bool any = false;
+    for (uint8_t level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+        uint8_t shift = level * LEVEL_BITS;
+        uint8_t digit = (current >> shift) & (TIMER_WHEEL_SLOTS - 1);
+        uint64_t ahead = digit == TIMER_WHEEL_SLOTS - 1 ? 0 : occupied[level] & (~0ULL << (digit + 1));
+        if (ahead) {
+            uint64_t start = ((current >> (shift + LEVEL_BITS)) << (shift + LEVEL_BITS)) |
+                             ((uint64_t)__builtin_ctzll(ahead) << shift);
+            if (!any || start < at) {
+                at = start;
+                any = true;
+            }
+        }
+    }
+
+    // The overflow list is sorted in when the top digit changes
+    if (heads[OVERFLOW] != TIMER_WHEEL_NONE) {
+        uint64_t start = ((current >> WHEEL_BITS) + 1) << WHEEL_BITS;
+        if (!any || start < at) {
+            at = start;
+            any = true;
+        }
+    }
+    return any;
+}
+
+uint32_t TimerWheel::sortOut(uint16_t list) {
+    uint32_t fired = 0;
+    uint8_t id = heads[list];
+    heads[list] = TIMER_WHEEL_NONE;
+    while (id != TIMER_WHEEL_NONE) {
+        uint8_t following = next[id];
+        if (!insert(id)) {
+            state[id] = TIMER_EXPIRED;
+            fired |= 1UL << id;
+        }
+        id = following;
+    }
+    return fired;
+}
+
+uint32_t TimerWheel::advance(uint32_t nowUs) {
+    uint64_t target = extend(nowUs);
+    uint32_t fired = due;
+    for (uint8_t id = 0; due; id++) {
+        if (due & (1UL << id)) {
+            state[id] = TIMER_EXPIRED;
+            due &= ~(1UL << id);
+        }
+    }
+
+    // Stop at every slot on the way that has timers and move them down a
+    // level, or out of the wheel at level 0. Nothing else needs looking at.
+    uint64_t at;
+    while (nextEvent(at) && at <= target) {
+        current = at;
+        for (uint8_t level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+            uint8_t digit = (current >> (level * LEVEL_BITS)) & (TIMER_WHEEL_SLOTS - 1);
+            if (occupied[level] & (1ULL << digit)) {
+                occupied[level] &= ~(1ULL << digit);
+                fired |= sortOut(level * TIMER_WHEEL_SLOTS + digit);
+            }
+        }
+        if ((current & ((1ULL << WHEEL_BITS) - 1)) == 0) {
+            fired |= sortOut(OVERFLOW);
+        }
+    }
+    current = target;
+    return fired;
+}
+
+bool TimerWheel::nextExpiry(uint64_t& at) const {
+    if (due) {
+        at = ~0ULL;
+        for (uint8_t id = 0; id < TIMER_WHEEL_TIMERS; id++) {
+            if ((due & (1UL << id)) && deadlines[id] < at) {
+                at = deadlines[id];
+            }
+        }
+        return true;
+    }
+
+    // Timers on a lower level all run out before any on a higher one, and a
+    // level's slots are all ahead of now, so the earliest is in the first
+    // slot of the lowest level that has any
+    for (uint8_t level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+        if (occupied[level]) {
+            uint8_t slot = __builtin_ctzll(occupied[level]);
+            at = ~0ULL;
+            for (uint8_t id = heads[level * TIMER_WHEEL_SLOTS + slot]; id != TIMER_WHEEL_NONE; id = next[id]) {
+                if (deadlines[id] < at) {
+                    at = deadlines[id];
+                }
+            }
+            return true;
+        }
+    }
+    at = ~0ULL;
+    for (uint8_t id = heads[OVERFLOW]; id != TIMER_WHEEL_NONE; id = next[id]) {
+        if (deadlines[id] < at) {
+            at = deadlines[id];
+        }
+    }
+    return at != ~0ULL;
+}
@@ -0,0 +1,92 @@
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+#include <stdint.h>
+
+// Hierarchical timing wheel on microsecond timestamps.
+//
+// Timers are kept by when they run out rather than looked at one by one:
+// level l has TIMER_WHEEL_SLOTS slots, each covering 64^l us, and a timer
+// sits in the slot of the highest 6-bit digit in which its deadline differs
+// from now. When now reaches a slot, its timers drop to a lower level, and
+// at level 0 they have run out. Arming, cancelling and advancing cost the
+// same however many timers are armed, and advancing over a stretch with
+// nothing due is a few bit tests per level, however long it is. Deadlines
+// more than 2^36 us (19 hours) away wait in an overflow list that is
+// sorted into the wheel every 19 hours.
+//
+// Time is the 32-bit microsecond counter (micros(), time_us_32()), which
+// wraps every 71 minutes. The wheel counts the wraps into a 64-bit now, so
+// timers of any length work across them as long as advance() is called at
+// least once every 71 minutes.
+
+#define TIMER_WHEEL_LEVELS 6
+#define TIMER_WHEEL_SLOTS  64
+#define TIMER_WHEEL_TIMERS 16       // timer ids 0-15
+#define TIMER_WHEEL_NONE   0xFF
+
+class TimerWheel {
+    public:
+        // Cancels every timer, now is nowUs
+        void begin(uint32_t nowUs);
+
+        // Moves now on to nowUs, returns the timers that ran out on the way
+        // (bit n = timer n), now or earlier, each once
+        uint32_t advance(uint32_t nowUs);
+
+        // Now as of the last begin() or advance(), in wheel time
+        uint64_t now() const { return current; }
+
+        // A 32-bit timestamp no earlier than now in wheel time
+        uint64_t extend(uint32_t us) const { return current + (uint32_t)(us - (uint32_t)current); }
+
+        // (Re)arms timer id to run out at wheel time at; a time that has
+        // passed runs out at the next advance()
+        void arm(uint8_t id, uint64_t at);
+
+        // Arms timer id to run out us after now
+        void armIn(uint8_t id, uint64_t us) { arm(id, current + us); }
+
+        // Stops timer id and forgets that it ran out
+        void cancel(uint8_t id);
+
+        // Armed and not run out yet
+        bool armed(uint8_t id) const { return state[id] == TIMER_ARMED; }
+
+        // Ran out, until armed again or cancelled
+        bool expired(uint8_t id) const { return state[id] == TIMER_EXPIRED; }
+
+        // When an armed timer runs out, in wheel time
+        uint64_t deadline(uint8_t id) const { return deadlines[id]; }
+
+        // Earliest deadline of the armed timers, false if none is armed
+        bool nextExpiry(uint64_t& at) const;
+
+    private:
+        enum : uint8_t { TIMER_IDLE, TIMER_ARMED, TIMER_EXPIRED };
+
+        // Files an armed timer under its deadline; returns false (and files
+        // nothing) if it is due already
+        bool insert(uint8_t id);
+
+        // Takes an armed timer out of its slot's list
+        void unlink(uint8_t id);
+
+        // Files the timers of a slot again as of now, returns those that ran out
+        uint32_t sortOut(uint16_t list);
+
+        // Earliest time at which a slot has to be emptied, false if none
+        bool nextEvent(uint64_t& at) const;
+
+        uint64_t current;
+        uint64_t deadlines[TIMER_WHEEL_TIMERS];
+        uint8_t state[TIMER_WHEEL_TIMERS];
+        uint16_t where[TIMER_WHEEL_TIMERS];     // level * TIMER_WHEEL_SLOTS + slot, the overflow list or due
+        uint8_t next[TIMER_WHEEL_TIMERS];       // doubly linked lists per slot
+        uint8_t prev[TIMER_WHEEL_TIMERS];
+        uint8_t heads[TIMER_WHEEL_LEVELS * TIMER_WHEEL_SLOTS + 1];  // last one: overflow
+        uint64_t occupied[TIMER_WHEEL_LEVELS];  // slots with timers, bit n = slot n
+        uint32_t due;                           // armed in the past, fired by the next advance()
+};
+
+#endif // TIMER_WHEEL_H
@@ -0,0 +1,130 @@
+#include "wav.h"
+#include "adpcm.h"
+
+static uint16_t get16(const uint8_t* p) { return p[0] | (p[1] << 8); }
+static uint32_t get32(const uint8_t* p) { return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24); }
+
+const char* wav_parse(File32& file, WavFormat& format) {
+    uint8_t buf[40];
+    uint32_t fileSize = file.fileSize();
+
+    if (!file.seekSet(0) || file.read(buf, 12) != 12 ||
+        memcmp(buf, "RIFF", 4) != 0 || memcmp(buf + 8, "WAVE", 4) != 0) {
+        return "not a RIFF/WAVE file";
+    }
+
+    // Walk the chunks until "data", "fmt " has to come before it
+    bool haveFormat = false;
+    uint32_t pos = 12;
+    while (pos + 8 <= fileSize) {
+        if (!file.seekSet(pos) || file.read(buf, 8) != 8) {
+            return "truncated chunk header";
+        }
+        uint32_t chunkSize = get32(buf + 4);
+
+        if (memcmp(buf, "fmt ", 4) == 0) {
+            uint32_t n = chunkSize < sizeof(buf) ? chunkSize : sizeof(buf);
+            if (n < 16 || file.read(buf, n) != (int)n) {
+                return "bad fmt chunk";
+            }
+            uint16_t formatTag = get16(buf);
+            if (formatTag == WAV_FORMAT_EXTENSIBLE && n >= 26) {
+                formatTag = get16(buf + 24);            // first two bytes of the sub-format GUID
+            }
+            if (formatTag != WAV_FORMAT_PCM && formatTag != WAV_FORMAT_IMA_ADPCM) {
+                return "not integer PCM or IMA-ADPCM";
+            }
+            format.formatTag = formatTag;
+            format.channels = get16(buf + 2);
+            format.sampleRate = get32(buf + 4);
+            format.blockAlign = get16(buf + 12);
+            format.bitsPerSample = get16(buf + 14);
+            if (format.channels == 0 || format.sampleRate == 0) {
+                return "unsupported sample format";
+            }
+            if (formatTag == WAV_FORMAT_IMA_ADPCM) {
+                // Blocks of whole 4-byte words per channel, the samples per
+                // block (if given) have to match
+                uint16_t unit = 4 * format.channels;
+                if (format.channels > 2 || format.bitsPerSample != 4 ||
+                    format.blockAlign <= unit || format.blockAlign % unit != 0 ||
+                    (n >= 20 && get16(buf + 16) >= 2 &&
+                     get16(buf + 18) != adpcm_samples_per_block(format.blockAlign, format.channels))) {
+                    return "unsupported IMA-ADPCM format";
+                }
+            } else if ((format.bitsPerSample != 8 && format.bitsPerSample != 16 &&
+                        format.bitsPerSample != 24 && format.bitsPerSample != 32) ||
+                       format.blockAlign != format.channels * (format.bitsPerSample / 8)) {
+                return "unsupported sample format";
+            }
+            haveFormat = true;
+        } else if (memcmp(buf, "data", 4) == 0) {
+            if (!haveFormat) {
+                return "data chunk before fmt chunk";
+            }
+            // Recorders that never went back to fill in the size leave it too
+            // big, play up to the end of the file
+            format.dataOffset = pos + 8;
+            uint32_t available = fileSize - format.dataOffset;
+            format.dataSize = chunkSize < available ? chunkSize : available;
+            format.dataSize -= format.dataSize % (format.formatTag == WAV_FORMAT_IMA_ADPCM ? 4 * format.channels
+                                                                                           : format.blockAlign);
+            if (format.dataSize == 0) {
+                return "no samples";
+            }
+            return nullptr;
+        }
+        if (chunkSize > fileSize - pos - 8) {
+            break;
+        }
+        pos += 8 + chunkSize + (chunkSize & 1);         // chunks are padded to an even size
+    }
+    return "no data chunk";
+}
+
+bool wav_is_audio_name(const char* name, size_t length) {
+    return length > 4 && name[0] != '.' && strcasecmp(name + length - 4, ".wav") == 0;
+}
+
+uint16_t wav_list_next(SdFat32& sd, const char* folder, const char* after, char (*names)[WAV_NAME_MAX], uint16_t max) {
+    File32 dir = sd.open(folder, O_RDONLY);
+    if (!dir || !dir.isDir() || max == 0) {
+        return 0;
+    }
+
+    // Keeps the lowest max names after after, sorted, by insertion
+    char name[WAV_NAME_MAX];
+    uint16_t count = 0;
+    File32 entry;
+    while (entry.openNext(&dir, O_RDONLY)) {
+        size_t length = entry.getName(name, sizeof(name));
+        bool wav = !entry.isDir() && wav_is_audio_name(name, length);
+        entry.close();
+        if (!wav || strcmp(name, after) <= 0 || (count == max && strcmp(name, names[count - 1]) >= 0)) {
+            continue;
+        }
+        uint16_t at = count < max ? count++ : max - 1;
+        while (at > 0 && strcmp(name, names[at - 1]) < 0) {
+            strcpy(names[at], names[at - 1]);
+            at--;
+        }
+        strcpy(names[at], name);
+    }
+    return count;
+}
+
+bool wav_find_next(SdFat32& sd, const char* folder, const char* after, char* name, size_t size) {
+    char first[1][WAV_NAME_MAX];
+    if (wav_list_next(sd, folder, after, first, 1) == 0) {
+        return false;
+    }
+    return snprintf(name, size, "%s", first[0]) < (int)size;
+}
+
+bool wav_find_first(SdFat32& sd, const char* folder, char* path, size_t size) {
+    char name[WAV_NAME_MAX];
+    if (!wav_find_next(sd, folder, "", name, sizeof(name))) {
+        return false;
+    }
+    return snprintf(path, size, "%s%s", folder, name) < (int)size;
+}
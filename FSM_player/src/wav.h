@@ -0,0 +1,53 @@
+#ifndef WAV_H
+#define WAV_H
+
+#include <stdint.h>
+#include <SdFat.h>
+
+#define WAV_FORMAT_PCM        0x0001
+#define WAV_FORMAT_IMA_ADPCM  0x0011
+#define WAV_FORMAT_EXTENSIBLE 0xFFFE
+
+// SD card sector, audio reads start on a sector boundary
+#define AUDIO_SECTOR_SIZE 512
+
+// Longest .wav file name in a folder + 1, longer names are skipped
+#define WAV_NAME_MAX 64
+
+// What the header of a .wav file says about its audio
+struct WavFormat {
+    uint16_t channels;
+    uint16_t bitsPerSample;     // 8, 16, 24 or 32; 4 for IMA-ADPCM
+    uint16_t blockAlign;        // Bytes per frame (one sample of every channel), per block for IMA-ADPCM
+    uint16_t formatTag;         // WAV_FORMAT_PCM or WAV_FORMAT_IMA_ADPCM
+    uint32_t sampleRate;        // Frames per second
+    uint32_t dataOffset;        // Where the samples start in the file
+    uint32_t dataSize;          // Bytes of samples, a whole number of frames (of 4-byte words per channel for IMA-ADPCM)
+};
+
+// Reads the RIFF header of a .wav file and finds its "fmt " and "data"
+// chunks. Plain and WAVE_FORMAT_EXTENSIBLE integer PCM and mono or stereo
+// IMA-ADPCM are accepted. Returns
+// nullptr if the file can be played, otherwise what is wrong with it.
+const char* wav_parse(File32& file, WavFormat& format);
+
+// True for file names the player plays from folders: ending in .wav and
+// not hidden (skips the "._" files macOS leaves on cards)
+bool wav_is_audio_name(const char* name, size_t length);
+
+// Lists the .wav files of a folder (path ending in '/') whose names come
+// after the name in after ("" for the first ones), up to max of them in name
+// order, without the folder. Returns how many. Walking a folder this way takes
+// one pass over the directory per max files, and doesn't depend on the order
+// of the directory, so files can be replaced on the way.
+uint16_t wav_list_next(SdFat32& sd, const char* folder, const char* after, char (*names)[WAV_NAME_MAX], uint16_t max);
+
+// The first file wav_list_next() would list, false if there is none
+bool wav_find_next(SdFat32& sd, const char* folder, const char* after, char* name, size_t size);
+
+// Finds the .wav file with the lowest name in a folder (path ending in '/'),
+// so the choice doesn't depend on the order files were copied to the card.
+// Writes its full path into path, false if there is none.
+bool wav_find_first(SdFat32& sd, const char* folder, char* path, size_t size);
+
+#endif // WAV_H
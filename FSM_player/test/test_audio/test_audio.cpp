@@ -0,0 +1,223 @@
+// Unit tests of the audio stream, its prefetch cache and the audio engine's
+// events and output, on the stand-in SD card (env:native_test).
+//
+//   pio test -e native_test -f test_audio
+
+#include <Arduino.h>
+#include <unity.h>
+#include <string>
+#include <vector>
+#include <stdlib.h>
+#include <unistd.h>
+#include "native_hal.h"
+#include "audio_engine.h"
+#include "audio_mixer.h"
+#include "pcm_file_sink.h"
+#include "FSM.h"
+
+// Takes everything it is given and keeps it
+class KeepSink : public AudioSink {
+    public:
+        bool begin(const WavFormat& format) override { (void)format; return true; }
+        size_t availableForWrite() override { return 4096; }
+        size_t write(uint8_t* data, size_t bytes) override {
+            kept.insert(kept.end(), data, data + bytes);
+            return bytes;
+        }
+        void end() override {}
+        uint32_t getUnderruns() const override { return 0; }
+
+        std::vector<uint8_t> kept;
+};
+
+static char card[] = "/tmp/fsm_test_XXXXXX";
+
+static void put32(std::vector<uint8_t>& out, uint32_t v) {
+    for (int i = 0; i < 4; i++) {
+        out.push_back(v >> (8 * i));
+    }
+}
+
+// Writes a 16-bit mono 44.1 kHz .wav of seconds of pseudo-random samples to
+// the card, returns the samples
+static std::vector<uint8_t> write_wav(const char* name, double seconds) {
+    std::vector<uint8_t> data((size_t)(seconds * 44100) * 2);
+    uint32_t x = 1;
+    for (uint8_t& b : data) {
+        x = x * 1103515245 + 12345;
+        b = x >> 24;
+    }
+    std::vector<uint8_t> file = {'R', 'I', 'F', 'F'};
+    put32(file, 36 + data.size());
+    file.insert(file.end(), {'W', 'A', 'V', 'E', 'f', 'm', 't', ' ', 16, 0, 0, 0, 1, 0, 1, 0});
+    put32(file, 44100);
+    put32(file, 88200);
+    file.insert(file.end(), {2, 0, 16, 0, 'd', 'a', 't', 'a'});
+    put32(file, data.size());
+    file.insert(file.end(), data.begin(), data.end());
+    FILE* f = fopen((std::string(card) + name).c_str(), "wb");
+    fwrite(file.data(), 1, file.size(), f);
+    fclose(f);
+    return data;
+}
+
+void setUp() {
+}
+
+void tearDown() {
+}
+
+void test_cache_holds_the_lead_time() {
+    TEST_ASSERT_GREATER_OR_EQUAL((uint32_t)AUDIO_PREFETCH_RATE * AUDIO_PREFETCH_LEAD_MS / 1000, AUDIO_PREFETCH_BYTES);
+    TEST_ASSERT_EQUAL_UINT32(0, AUDIO_PREFETCH_BYTES % AUDIO_SECTOR_SIZE);
+}
+
+void test_cached_file_plays_byte_for_byte() {
+    // The cache holds more than the ring: the stream carries on from it, then from the card
+    std::vector<uint8_t> data = write_wav("/cached.wav", 1.0);
+    KeepSink sink;
+    AudioStream stream;
+    AudioPrefetch cache;
+    stream.setPrefetch(&cache);
+    stream.begin(sd, sink);
+    const char* paths[] = {"/cached.wav"};
+    stream.prefetchNext(paths, 1);
+    while (cache.service()) {
+    }
+    const AudioPrefetch::Entry* entry = cache.find("/cached.wav");
+    TEST_ASSERT_NOT_NULL(entry);
+    TEST_ASSERT_GREATER_THAN(AUDIO_RING_BLOCKS * AUDIO_BLOCK_SIZE, entry->length);
+
+    TEST_ASSERT_TRUE(stream.play("/cached.wav", false));
+    TEST_ASSERT_EQUAL_UINT32(0, stream.getReads());
+    for (int i = 0; i < 1000 && stream.isPlaying(); i++) {
+        stream.service();
+    }
+    TEST_ASSERT_EQUAL_UINT32(data.size(), sink.kept.size());
+    TEST_ASSERT_EQUAL_MEMORY(data.data(), sink.kept.data(), data.size());
+
+    // Only what the cache didn't have came from the card
+    TEST_ASSERT_LESS_OR_EQUAL(data.size() + 44 - entry->length + AUDIO_SECTOR_SIZE, stream.getBytesRead());
+    unlink((std::string(card) + "/cached.wav").c_str());
+}
+
+void test_event_queued_out_keeps_its_play() {
+    // Plays that fail while the event queue is full: the event that didn't
+    // fit is sent later about the play it was for, not about the one after
+    write_wav("/good.wav", 1.0);
+    KeepSink sink;
+    AudioStream stream;
+    stream.begin(sd, sink);
+    AudioEngine engine;
+    engine.begin(stream);
+    uint16_t seq = 1;
+    for (int i = 0; i < AUDIO_EVENT_QUEUE + 1; i++) {
+        engine.play("/missing.wav", false, seq++);
+        engine.run();
+    }
+    uint16_t lastFailed = seq - 1;
+    engine.play("/good.wav", false, seq);
+    engine.run();
+
+    AudioEvent event;
+    while (engine.poll(event)) {
+    }
+    engine.run();
+    bool resent = false;
+    while (engine.poll(event)) {
+        if (event.type == AUDIO_EVENT_FAILED) {
+            TEST_ASSERT_EQUAL_UINT16(lastFailed, event.seq);
+            resent = true;
+        }
+    }
+    TEST_ASSERT_TRUE(resent);
+    unlink((std::string(card) + "/good.wav").c_str());
+}
+
+void test_failed_play_is_reported_not_printed() {
+    // The audio core doesn't print: why a play failed comes back with the event
+    KeepSink sink;
+    AudioStream stream;
+    stream.begin(sd, sink);
+    AudioEngine engine;
+    engine.begin(stream);
+    native_serial_capture(true);
+    engine.play("/missing.wav", false, 1);
+    engine.play("/no_such_folder/", false, 2);
+    engine.run();
+    uint8_t printed[64];
+    TEST_ASSERT_EQUAL(0, native_serial_take(printed, sizeof(printed)));
+    native_serial_capture(false);
+
+    AudioEvent event;
+    TEST_ASSERT_TRUE(engine.poll(event));
+    TEST_ASSERT_EQUAL(AUDIO_EVENT_FAILED, event.type);
+    TEST_ASSERT_EQUAL_STRING("can't open", (const char*)event.data);
+    TEST_ASSERT_TRUE(engine.poll(event));
+    TEST_ASSERT_EQUAL_UINT16(2, event.seq);
+    TEST_ASSERT_EQUAL_STRING("no .wav file in the folder", (const char*)event.data);
+}
+
+// Runs the engine every AUDIO_SERVICE_MS of virtual time for ms, as core1 does
+static void run_engine(AudioEngine& engine, uint32_t ms) {
+    for (uint32_t t = 0; t < ms; t += AUDIO_SERVICE_MS) {
+        engine.run();
+        delay(AUDIO_SERVICE_MS);
+    }
+}
+
+void test_hard_cut_keeps_the_output_running() {
+    // A state change without a fade starts the next file on the running
+    // output; only a stop, or a file that can't play, stops it
+    write_wav("/first.wav", 1.0);
+    write_wav("/second.wav", 1.0);
+    PcmFileSink sink;
+    AudioMixer mixer;
+    AudioStream first, second;
+    mixer.begin(sink);
+    first.begin(sd, mixer.getInput(0));
+    second.begin(sd, mixer.getInput(1));
+    AudioEngine engine;
+    engine.begin(mixer, first, second);
+
+    engine.play("/first.wav", true, 1);
+    run_engine(engine, 200);
+    engine.play("/second.wav", false, 2);
+    run_engine(engine, 200);
+    engine.play("/first.wav", false, 3);
+    run_engine(engine, 200);
+    TEST_ASSERT_TRUE(sink.isRunning());
+    TEST_ASSERT_EQUAL_UINT32(1, sink.getStarts());
+    TEST_ASSERT_EQUAL_UINT32(0, sink.getUnderruns());
+
+    engine.stop();
+    run_engine(engine, 10);
+    TEST_ASSERT_FALSE(sink.isRunning());
+    engine.play("/second.wav", false, 4);
+    run_engine(engine, 200);
+    TEST_ASSERT_EQUAL_UINT32(2, sink.getStarts());
+    engine.play("/missing.wav", false, 5);
+    run_engine(engine, 10);
+    TEST_ASSERT_FALSE(sink.isRunning());
+    unlink((std::string(card) + "/first.wav").c_str());
+    unlink((std::string(card) + "/second.wav").c_str());
+}
+
+int main() {
+    if (!mkdtemp(card)) {
+        return 1;
+    }
+    native_sd_root(card);
+    native_serial_output(nullptr);
+    sd.begin(SdSpiConfig(SS, DEDICATED_SPI, SD_SCK_MHZ(50)));
+
+    UNITY_BEGIN();
+    RUN_TEST(test_cache_holds_the_lead_time);
+    RUN_TEST(test_cached_file_plays_byte_for_byte);
+    RUN_TEST(test_event_queued_out_keeps_its_play);
+    RUN_TEST(test_failed_play_is_reported_not_printed);
+    RUN_TEST(test_hard_cut_keeps_the_output_running);
+    int failures = UNITY_END();
+    rmdir(card);
+    return failures;
+}
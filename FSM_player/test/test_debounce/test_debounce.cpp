@@ -0,0 +1,107 @@
+// Unit tests of the input debouncer and the reset button's gestures (env:native_test).
+//
+//   pio test -e native_test -f test_debounce
+
+#include <unity.h>
+#include "debounce.h"
+
+#define ALL_HIGH 0xFFFFFFFFUL
+
+void setUp() {
+}
+
+void tearDown() {
+}
+
+void test_leading_is_the_default() {
+    // A press counts at the first sample that sees it
+    Debouncer debouncer;
+    debouncer.begin(ALL_HIGH);
+    debouncer.sample(ALL_HIGH & ~0x01UL);
+    TEST_ASSERT_EQUAL_HEX32(ALL_HIGH & ~0x01UL, debouncer.state());
+    TEST_ASSERT_EQUAL_HEX32(0x01, debouncer.fell());
+    TEST_ASSERT_EQUAL_HEX32(0, debouncer.rose());
+}
+
+void test_leading_ignores_bounce_for_three_samples() {
+    Debouncer debouncer;
+    debouncer.begin(ALL_HIGH, DEBOUNCE_LEADING);
+    debouncer.sample(ALL_HIGH & ~0x04UL);
+    const uint32_t bounce[] = {ALL_HIGH, ALL_HIGH & ~0x04UL, ALL_HIGH};
+    for (uint32_t raw : bounce) {
+        debouncer.sample(raw);
+        TEST_ASSERT_EQUAL_HEX32(ALL_HIGH & ~0x04UL, debouncer.state());
+        TEST_ASSERT_EQUAL_HEX32(0, debouncer.rose());
+        TEST_ASSERT_TRUE(debouncer.settling());
+    }
+
+    // Still released once the lockout is over: that counts at once
+    debouncer.sample(ALL_HIGH);
+    TEST_ASSERT_EQUAL_HEX32(ALL_HIGH, debouncer.state());
+    TEST_ASSERT_EQUAL_HEX32(0x04, debouncer.rose());
+}
+
+void test_stable_waits_for_four_samples() {
+    Debouncer debouncer;
+    debouncer.begin(ALL_HIGH, DEBOUNCE_STABLE);
+    for (int i = 0; i < 3; i++) {
+        debouncer.sample(ALL_HIGH & ~0x02UL);
+        TEST_ASSERT_EQUAL_HEX32(ALL_HIGH, debouncer.state());
+        TEST_ASSERT_TRUE(debouncer.settling());
+    }
+    debouncer.sample(ALL_HIGH & ~0x02UL);
+    TEST_ASSERT_EQUAL_HEX32(ALL_HIGH & ~0x02UL, debouncer.state());
+    TEST_ASSERT_EQUAL_HEX32(0x02, debouncer.fell());
+    TEST_ASSERT_FALSE(debouncer.settling());
+}
+
+void test_glitch_only_gets_through_leading() {
+    // The price of reacting at once: one stray sample is a change
+    Debouncer stable, leading;
+    stable.begin(ALL_HIGH, DEBOUNCE_STABLE);
+    leading.begin(ALL_HIGH, DEBOUNCE_LEADING);
+    stable.sample(ALL_HIGH & ~0x08UL);
+    leading.sample(ALL_HIGH & ~0x08UL);
+    TEST_ASSERT_EQUAL_HEX32(0, stable.fell());
+    TEST_ASSERT_EQUAL_HEX32(0x08, leading.fell());
+    for (int i = 0; i < 4; i++) {
+        stable.sample(ALL_HIGH);
+    }
+    TEST_ASSERT_EQUAL_HEX32(ALL_HIGH, stable.state());
+    TEST_ASSERT_FALSE(stable.settling());
+}
+
+void test_inputs_are_debounced_independently() {
+    Debouncer debouncer;
+    debouncer.begin(ALL_HIGH, DEBOUNCE_STABLE);
+    for (int i = 0; i < 4; i++) {
+        // Input 0 held down, input 1 bouncing every other sample
+        debouncer.sample(ALL_HIGH & ~0x01UL & (i % 2 ? ALL_HIGH : ~0x02UL));
+    }
+    TEST_ASSERT_EQUAL_HEX32(ALL_HIGH & ~0x01UL, debouncer.state());
+}
+
+void test_button_short_and_long_press() {
+    ButtonGesture button;
+    button.begin(2000);
+    TEST_ASSERT_EQUAL_UINT8(BUTTON_PRESS, button.update(true, false, 1000));
+    TEST_ASSERT_EQUAL_UINT8(BUTTON_RELEASE | BUTTON_SHORT_PRESS, button.update(false, true, 1500));
+
+    // Held: the long press comes while it is still down, the hold after twice as long
+    button.update(true, false, 10000);
+    TEST_ASSERT_EQUAL_UINT8(0, button.update(false, false, 11999));
+    TEST_ASSERT_EQUAL_UINT8(BUTTON_LONG_PRESS, button.update(false, false, 12000));
+    TEST_ASSERT_EQUAL_UINT8(BUTTON_HOLD, button.update(false, false, 14000));
+    TEST_ASSERT_EQUAL_UINT8(BUTTON_RELEASE, button.update(false, true, 15000));
+}
+
+int main() {
+    UNITY_BEGIN();
+    RUN_TEST(test_leading_is_the_default);
+    RUN_TEST(test_leading_ignores_bounce_for_three_samples);
+    RUN_TEST(test_stable_waits_for_four_samples);
+    RUN_TEST(test_glitch_only_gets_through_leading);
+    RUN_TEST(test_inputs_are_debounced_independently);
+    RUN_TEST(test_button_short_and_long_press);
+    return UNITY_END();
+}
@@ -0,0 +1,263 @@
+// Unit tests of the state machine on the stand-in hardware layer, in virtual
+// time (env:native_test).
+//
+//   pio test -e native_test -f test_fsm
+
+#include <Arduino.h>
+#include <unity.h>
+#include <string>
+#include <stdlib.h>
+#include <unistd.h>
+#include "native_hal.h"
+#include "FSM.h"
+#include "led_sequencer.h"
+
+static char card[] = "/tmp/fsm_test_XXXXXX";
+
+// Three states in a ring, state n moves on when sensor n closes; state 2
+// moves on after 500 ms as well
+static const char* ring_config =
+    "{\"states\":["
+    "{\"id\":0,\"audioFile\":\"\",\"repeat\":false,\"blinkCount\":1,\"transitions\":"
+    "[{\"targetState\":1,\"conditions\":[{\"type\":\"SENSOR\",\"data\":{\"sensorPin\":0,\"state\":false}}]}]},"
+    "{\"id\":1,\"audioFile\":\"\",\"repeat\":false,\"blinkCount\":2,\"transitions\":"
+    "[{\"targetState\":2,\"conditions\":[{\"type\":\"SENSOR\",\"data\":{\"sensorPin\":1,\"state\":false}}]}]},"
+    "{\"id\":2,\"audioFile\":\"\",\"repeat\":false,\"blinkCount\":3,\"transitions\":"
+    "[{\"targetState\":0,\"conditions\":[{\"type\":\"TIME_PASSED\",\"data\":{\"duration\":500}}]}]}]}";
+
+static std::string config_path() {
+    return std::string(card) + "/FSM_Config.json";
+}
+
+static void write_config(const char* json) {
+    FILE* f = fopen(config_path().c_str(), "w");
+    fputs(json, f);
+    fclose(f);
+}
+
+// Runs update() every ms of virtual time for ms
+static void run_ms(FSM& fsm, uint32_t ms) {
+    for (uint32_t i = 0; i < ms; i++) {
+        native_advance_micros(1000);
+        fsm.update();
+    }
+}
+
+void setUp() {
+    for (uint8_t pin = 0; pin < 8; pin++) {
+        native_set_pin(pin, HIGH);
+    }
+}
+
+void tearDown() {
+    unlink(config_path().c_str());
+    unlink((std::string(card) + "/FSM_Config.bin").c_str());
+}
+
+void test_sensor_and_timeout_move_the_state() {
+    write_config(ring_config);
+    FSM fsm;
+    fsm.loadConfiguration();
+    TEST_ASSERT_EQUAL_UINT8(3, fsm.getNumStates());
+    fsm.begin();
+    run_ms(fsm, 10);
+    TEST_ASSERT_EQUAL_UINT8(0, fsm.getCurrentState());
+
+    // Debounced on the leading edge: the press counts at the next update
+    native_set_pin(0, LOW);
+    run_ms(fsm, 1);
+    TEST_ASSERT_EQUAL_UINT8(1, fsm.getCurrentState());
+    native_set_pin(0, HIGH);
+    run_ms(fsm, 100);
+    TEST_ASSERT_EQUAL_UINT8(1, fsm.getCurrentState());
+
+    native_set_pin(1, LOW);
+    run_ms(fsm, 1);
+    native_set_pin(1, HIGH);
+    TEST_ASSERT_EQUAL_UINT8(2, fsm.getCurrentState());
+    run_ms(fsm, 490);
+    TEST_ASSERT_EQUAL_UINT8(2, fsm.getCurrentState());
+    run_ms(fsm, 20);
+    TEST_ASSERT_EQUAL_UINT8(0, fsm.getCurrentState());
+}
+
+void test_led_edges_do_not_wake_the_fsm() {
+    // The LEDs read back in the GPIO snapshot as they are driven: only the
+    // inputs and the reset button may keep the debouncer busy, an idle state
+    // sleeps until its own deadline however the LEDs blink
+    write_config(ring_config);
+    FSM fsm;
+    fsm.loadConfiguration();
+    fsm.begin();
+    run_ms(fsm, 50);
+    uint32_t writesBefore = native_pin_writes(led_status_pin);
+    for (uint32_t ms = 0; ms < 2000; ms++) {
+        leds.set(LED_STATUS, ms % 2);
+        native_advance_micros(1000);
+        fsm.update();
+        TEST_ASSERT_GREATER_THAN(1000000, fsm.nextDeadlineUs() - (uint32_t)native_micros());     // state 0 waits for sensor 0
+    }
+    TEST_ASSERT_GREATER_OR_EQUAL(1999, native_pin_writes(led_status_pin) - writesBefore);
+
+    // State 2 wakes for its TIME_PASSED of 500 ms and for nothing else
+    native_set_pin(0, LOW);
+    run_ms(fsm, 30);
+    native_set_pin(0, HIGH);
+    native_set_pin(1, LOW);
+    for (int ms = 0; ms < 30 && fsm.getCurrentState() != 2; ms++) {
+        run_ms(fsm, 1);
+    }
+    TEST_ASSERT_EQUAL_UINT8(2, fsm.getCurrentState());
+    uint32_t due = (uint32_t)native_micros() + 500000;
+    native_set_pin(1, HIGH);
+    run_ms(fsm, 50);                                                        // the sensors' bounce lockout
+    for (uint32_t ms = 0; ms < 400; ms++) {
+        leds.set(LED_STATUS, ms % 2);
+        native_advance_micros(1000);
+        fsm.update();
+        TEST_ASSERT_UINT32_WITHIN(1000, due, fsm.nextDeadlineUs());
+    }
+    leds.set(LED_STATUS, false);
+}
+
+void test_set_state_checks_the_state() {
+    write_config(ring_config);
+    FSM fsm;
+    fsm.loadConfiguration();
+    fsm.begin();
+    TEST_ASSERT_TRUE(fsm.setState(2));
+    TEST_ASSERT_EQUAL_UINT8(2, fsm.getCurrentState());
+    TEST_ASSERT_FALSE(fsm.setState(3));
+    TEST_ASSERT_EQUAL_UINT8(2, fsm.getCurrentState());
+}
+
+void test_boot_without_config_waits_for_one() {
+    // No config on the card: nothing to run, but the player keeps looking
+    // and starts with the one that is put there
+    FSM fsm;
+    fsm.loadConfiguration();
+    TEST_ASSERT_EQUAL_UINT8(0, fsm.getNumStates());
+    fsm.begin();
+    run_ms(fsm, 50);
+    TEST_ASSERT_EQUAL_UINT8(0, fsm.getNumStates());
+    TEST_ASSERT_GREATER_THAN(millis() + 1000, fsm.nextDeadline());
+
+    write_config(ring_config);
+    fsm.requestReload();
+    run_ms(fsm, 50);
+    TEST_ASSERT_EQUAL_UINT8(3, fsm.getNumStates());
+    TEST_ASSERT_TRUE(fsm.takeReloaded());
+
+    native_set_pin(0, LOW);
+    run_ms(fsm, 1);
+    native_set_pin(0, HIGH);
+    TEST_ASSERT_EQUAL_UINT8(1, fsm.getCurrentState());
+}
+
+void test_reload_without_the_state_enters_state_0() {
+    // The new config has two states, the FSM is in state 2: it enters state 0
+    // as a reset does, with the presses counted in state 2 forgotten
+    write_config(ring_config);
+    FSM fsm;
+    fsm.loadConfiguration();
+    fsm.begin();
+    TEST_ASSERT_TRUE(fsm.setState(2));
+    native_set_pin(0, LOW);
+    run_ms(fsm, 30);
+    native_set_pin(0, HIGH);
+    run_ms(fsm, 30);
+    TEST_ASSERT_EQUAL_UINT8(2, fsm.getCurrentState());
+
+    write_config("{\"states\":["
+                 "{\"id\":0,\"audioFile\":\"\",\"repeat\":false,\"blinkCount\":1,\"transitions\":"
+                 "[{\"targetState\":1,\"conditions\":[{\"type\":\"COUNT\",\"data\":{\"sensorPin\":0,\"edge\":\"falling\",\"count\":2}}]}]},"
+                 "{\"id\":1,\"audioFile\":\"\",\"repeat\":false,\"blinkCount\":2,\"transitions\":[]}]}");
+    fsm.requestReload();
+    run_ms(fsm, 50);
+    TEST_ASSERT_TRUE(fsm.takeReloaded());
+    TEST_ASSERT_EQUAL_UINT8(2, fsm.getNumStates());
+    TEST_ASSERT_EQUAL_UINT8(0, fsm.getCurrentState());
+
+    for (uint8_t press = 0; press < 2; press++) {
+        TEST_ASSERT_EQUAL_UINT8(0, fsm.getCurrentState());
+        native_set_pin(0, LOW);
+        run_ms(fsm, 30);
+        native_set_pin(0, HIGH);
+        run_ms(fsm, 30);
+    }
+    TEST_ASSERT_EQUAL_UINT8(1, fsm.getCurrentState());
+}
+
+void test_broken_config_is_kept_out() {
+    write_config(ring_config);
+    FSM fsm;
+    fsm.loadConfiguration();
+    fsm.begin();
+    fsm.setState(1);
+    write_config("{\"states\":[");
+    fsm.requestReload();
+    run_ms(fsm, 50);
+    TEST_ASSERT_EQUAL_UINT8(3, fsm.getNumStates());
+    TEST_ASSERT_EQUAL_UINT8(1, fsm.getCurrentState());
+    TEST_ASSERT_EQUAL_UINT16(1, fsm.getReloadFailures());
+    TEST_ASSERT_FALSE(fsm.takeReloaded());
+}
+
+void test_journal_waits_for_the_new_audio() {
+    // The flash write pauses the audio core, so it comes FSM_JOURNAL_DELAY_MS
+    // after the state change rather than on the update that starts the new
+    // state's audio; the FSM wakes up for it
+    char flash[] = "/tmp/fsm_flash_XXXXXX";
+    TEST_ASSERT_NOT_NULL(mkdtemp(flash));
+    native_flash_root(flash);
+    write_config(ring_config);
+    FSM fsm;
+    fsm.loadConfiguration();
+    StateJournal journal;
+    TEST_ASSERT_TRUE(journal.begin());
+    fsm.setJournal(&journal);
+    fsm.begin();
+    run_ms(fsm, FSM_JOURNAL_DELAY_MS + 10);
+    TEST_ASSERT_EQUAL_UINT32(1, journal.getAppends());
+
+    native_set_pin(0, LOW);
+    run_ms(fsm, 1);
+    native_set_pin(0, HIGH);
+    TEST_ASSERT_EQUAL_UINT8(1, fsm.getCurrentState());
+    TEST_ASSERT_EQUAL_UINT32(1, journal.getAppends());
+    run_ms(fsm, 50);
+    TEST_ASSERT_UINT32_WITHIN(1, FSM_JOURNAL_DELAY_MS - 50, fsm.nextDeadline() - millis());
+    run_ms(fsm, FSM_JOURNAL_DELAY_MS - 51);
+    TEST_ASSERT_EQUAL_UINT32(1, journal.getAppends());
+    run_ms(fsm, 2);
+    TEST_ASSERT_EQUAL_UINT32(2, journal.getAppends());
+    JournalRecord record;
+    TEST_ASSERT_TRUE(journal.last(record));
+    TEST_ASSERT_EQUAL_UINT8(1, record.state);
+
+    unlink((std::string(flash) + "/journal.0").c_str());
+    unlink((std::string(flash) + "/journal.1").c_str());
+    rmdir(flash);
+    native_flash_root(nullptr);
+}
+
+int main() {
+    if (!mkdtemp(card)) {
+        return 1;
+    }
+    native_sd_root(card);
+    native_serial_output(nullptr);
+    leds.begin();
+
+    UNITY_BEGIN();
+    RUN_TEST(test_sensor_and_timeout_move_the_state);
+    RUN_TEST(test_led_edges_do_not_wake_the_fsm);
+    RUN_TEST(test_set_state_checks_the_state);
+    RUN_TEST(test_boot_without_config_waits_for_one);
+    RUN_TEST(test_reload_without_the_state_enters_state_0);
+    RUN_TEST(test_broken_config_is_kept_out);
+    RUN_TEST(test_journal_waits_for_the_new_audio);
+    int failures = UNITY_END();
+    rmdir(card);
+    return failures;
+}
@@ -0,0 +1,146 @@
+// Unit tests of the FSM image compiler and check (env:native_test).
+//
+//   pio test -e native_test -f test_fsm_image
+
+#include <Arduino.h>
+#include <ArduinoJson.h>
+#include <unity.h>
+#include <string>
+#include <vector>
+#include "fsm_image.h"
+#include "debounce.h"
+#include "fsm_builtin_config.h"
+
+// Two states that go round on sensor 0, without a "debounceMode"
+static const char* two_states =
+    "{\"states\":["
+    "{\"id\":0,\"audioFile\":\"\",\"repeat\":false,\"blinkCount\":1,\"transitions\":"
+    "[{\"targetState\":1,\"conditions\":[{\"type\":\"SENSOR\",\"data\":{\"sensorPin\":0,\"state\":false}}]}]},"
+    "{\"id\":1,\"audioFile\":\"/music/\",\"repeat\":true,\"blinkCount\":2,\"transitions\":"
+    "[{\"targetState\":0,\"conditions\":[{\"type\":\"TIME_PASSED\",\"data\":{\"duration\":500}}]}]}]}";
+
+// Compiles json, an empty image if it doesn't compile
+static std::vector<uint8_t> compile(const char* json) {
+    DynamicJsonDocument doc(4096);
+    deserializeJson(doc, json);
+    const char* problem = nullptr;
+    uint32_t size = fsm_image_compile(doc.as<JsonObject>(), nullptr, 0, &problem);
+    std::vector<uint8_t> image(size);
+    if (size == 0 || !fsm_image_compile(doc.as<JsonObject>(), image.data(), size, &problem)) {
+        image.clear();
+    }
+    return image;
+}
+
+// The CRC over an image that was changed on purpose, so the check gets past it
+static void seal(std::vector<uint8_t>& image) {
+    FsmImageHeader* header = (FsmImageHeader*)image.data();
+    header->crc = fsm_crc32(image.data() + header->headerSize, image.size() - header->headerSize);
+}
+
+void setUp() {
+}
+
+void tearDown() {
+}
+
+void test_compiled_image_passes_the_check() {
+    std::vector<uint8_t> image = compile(two_states);
+    TEST_ASSERT_FALSE(image.empty());
+    TEST_ASSERT_NULL(fsm_image_check(image.data(), image.size()));
+
+    // Every state gets the skip and reset transitions on top of its own
+    const FsmImageHeader* header = fsm_image_header(image.data());
+    TEST_ASSERT_EQUAL_UINT16(2, header->numStates);
+    TEST_ASSERT_EQUAL_UINT8(3, fsm_image_states(image.data())[0].numTransitions);
+    TEST_ASSERT_EQUAL_UINT16(6, header->numTransitions);
+}
+
+void test_debounce_mode_defaults_to_leading() {
+    std::vector<uint8_t> image = compile(two_states);
+    TEST_ASSERT_FALSE(image.empty());
+    TEST_ASSERT_EQUAL_UINT8(DEBOUNCE_LEADING, fsm_image_header(image.data())->debounceMode);
+}
+
+void test_state_without_skip_and_reset_is_refused() {
+    // A state that lost its transitions would have nothing to leave it by
+    std::vector<uint8_t> image = compile(two_states);
+    TEST_ASSERT_FALSE(image.empty());
+    State* states = (State*)fsm_image_states(image.data());
+    for (uint8_t count = 0; count < 2; count++) {
+        states[1].numTransitions = count;
+        seal(image);
+        TEST_ASSERT_NOT_NULL(fsm_image_check(image.data(), image.size()));
+    }
+}
+
+void test_damaged_image_is_refused() {
+    std::vector<uint8_t> image = compile(two_states);
+    TEST_ASSERT_FALSE(image.empty());
+    image[image.size() - 1] ^= 0x01;
+    TEST_ASSERT_NOT_NULL(fsm_image_check(image.data(), image.size()));
+    image[image.size() - 1] ^= 0x01;
+    TEST_ASSERT_NOT_NULL(fsm_image_check(image.data(), image.size() - 4));
+}
+
+void test_image_of_another_version_is_refused() {
+    // Cached and precompiled images from before a format change are compiled again
+    std::vector<uint8_t> image = compile(two_states);
+    TEST_ASSERT_FALSE(image.empty());
+    ((FsmImageHeader*)image.data())->version = FSM_IMAGE_VERSION - 1;
+    TEST_ASSERT_NOT_NULL(fsm_image_check(image.data(), image.size()));
+}
+
+void test_bad_configs_do_not_compile() {
+    // A transition to a state that doesn't exist, and a sensor that isn't an input
+    TEST_ASSERT_TRUE(compile("{\"states\":[{\"id\":0,\"audioFile\":\"\",\"repeat\":false,\"blinkCount\":1,\"transitions\":"
+                             "[{\"targetState\":7,\"conditions\":[]}]}]}").empty());
+    TEST_ASSERT_TRUE(compile("{\"states\":[{\"id\":0,\"audioFile\":\"\",\"repeat\":false,\"blinkCount\":1,\"transitions\":"
+                             "[{\"targetState\":0,\"conditions\":[{\"type\":\"SENSOR\",\"data\":{\"sensorPin\":9,\"state\":false}}]}]}]}").empty());
+}
+
+void test_bad_input_timings_do_not_compile() {
+    // Given but not a whole number of ms in range: refused, not replaced by the default
+    const char* timings[] = {"\"debounceMs\":\"20\"", "\"debounceMs\":20.5", "\"debounceMs\":-20", "\"debounceMs\":null",
+                             "\"debounceMs\":2", "\"debounceMs\":5000", "\"longPressMs\":true", "\"longPressMs\":10"};
+    for (const char* timing : timings) {
+        std::string json = "{" + std::string(timing) + "," + std::string(two_states + 1);
+        TEST_ASSERT_TRUE_MESSAGE(compile(json.c_str()).empty(), timing);
+    }
+    std::string json = "{\"debounceMs\":30,\"longPressMs\":1500," + std::string(two_states + 1);
+    std::vector<uint8_t> image = compile(json.c_str());
+    TEST_ASSERT_FALSE(image.empty());
+    TEST_ASSERT_EQUAL_UINT16(30, fsm_image_header(image.data())->debounceMs);
+}
+
+void test_inputs_on_the_players_pins_do_not_compile() {
+    // Every GPIO the player drives itself is refused as an input, a free one isn't
+    for (uint8_t pin = 0; pin < FSM_NUM_GPIO; pin++) {
+        std::string json = "{\"inputs\":[" + std::to_string(pin) + "]," + std::string(two_states + 1);
+        TEST_ASSERT_EQUAL(FSM_RESERVED_GPIO & (1UL << pin) ? true : false, compile(json.c_str()).empty());
+    }
+    TEST_ASSERT_FALSE(compile("{\"inputs\":[0,12],\"states\":[{\"id\":0,\"audioFile\":\"\",\"repeat\":false,\"blinkCount\":1,"
+                              "\"transitions\":[]}]}").empty());
+}
+
+void test_builtin_table_with_an_input_on_a_players_pin_is_refused() {
+    // What keeps such a table from compiling, run here instead of at compile time
+    TEST_ASSERT_TRUE(fsm_builtin_check(fsm_builtin));
+    auto table = fsm_builtin;
+    table.header.inputPins[0] = 26;                                      // I2S BCLK
+    TEST_ASSERT_FALSE(fsm_builtin_check(table));
+}
+
+int main() {
+    UNITY_BEGIN();
+    RUN_TEST(test_compiled_image_passes_the_check);
+    RUN_TEST(test_debounce_mode_defaults_to_leading);
+    RUN_TEST(test_state_without_skip_and_reset_is_refused);
+    RUN_TEST(test_damaged_image_is_refused);
+    RUN_TEST(test_image_of_another_version_is_refused);
+    RUN_TEST(test_bad_configs_do_not_compile);
+    RUN_TEST(test_bad_input_timings_do_not_compile);
+    RUN_TEST(test_inputs_on_the_players_pins_do_not_compile);
+    RUN_TEST(test_builtin_table_with_an_input_on_a_players_pin_is_refused);
+    return UNITY_END();
+}
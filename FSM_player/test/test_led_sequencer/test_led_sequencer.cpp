@@ -0,0 +1,110 @@
+// Unit tests of the LED sequencer on the stand-in alarm (env:native_test).
+//
+//   pio test -e native_test -f test_led_sequencer
+
+#include <Arduino.h>
+#include <unity.h>
+#include "native_hal.h"
+#include "led_sequencer.h"
+#include "gpio_utils.h"
+
+#define BLINK_MS   200
+#define GAP_MS     1500
+#define LATENCY_US 40       // every alarm runs this late, as an interrupt may
+
+// Level of count blinks of BLINK_MS and a GAP_MS pause, ms after they started
+static bool blink_level(uint8_t count, uint32_t ms) {
+    ms %= count * 2 * BLINK_MS + GAP_MS;
+    return ms < count * 2 * BLINK_MS && ms % (2 * BLINK_MS) < BLINK_MS;
+}
+
+void setUp() {
+    native_alarm_latency(0);
+}
+
+void tearDown() {
+    native_alarm_latency(0);
+}
+
+void test_blink_follows_its_pattern() {
+    LedSequencer sequencer;
+    sequencer.begin();
+    uint32_t writesBefore = native_pin_writes(led_state_pin);
+    sequencer.blink(LED_STATE, 3, BLINK_MS, BLINK_MS, GAP_MS);
+
+    // Sampled in the middle of every ms
+    uint32_t edges = 0;
+    bool last = false;
+    native_advance_micros(500);
+    for (uint32_t ms = 0; ms < 10000; ms++) {
+        bool expect = blink_level(3, ms);
+        edges += expect != last;
+        last = expect;
+        TEST_ASSERT_EQUAL(expect, sequencer.isOn(LED_STATE));
+        TEST_ASSERT_EQUAL(expect ? HIGH : LOW, native_get_pin(led_state_pin));
+        native_advance_micros(1000);
+    }
+    TEST_ASSERT_EQUAL_UINT32(edges, native_pin_writes(led_state_pin) - writesBefore);
+    sequencer.set(LED_STATE, false);
+}
+
+void test_late_alarms_do_not_drift() {
+    // Each edge is timed from when the one before was due, not from when its
+    // interrupt ran: after hundreds of late edges the blink is still in step
+    LedSequencer sequencer;
+    sequencer.begin();
+    native_alarm_latency(LATENCY_US);
+    uint64_t start = native_micros();
+    sequencer.blink(LED_STATE, 1, BLINK_MS, BLINK_MS, GAP_MS);
+    uint64_t cycles = 200;
+    native_advance_micros(start + cycles * (2 * BLINK_MS + GAP_MS) * 1000ULL + LATENCY_US / 2 - native_micros());
+    TEST_ASSERT_TRUE_MESSAGE(!sequencer.isOn(LED_STATE), "edge due now came early");
+    native_advance_micros(LATENCY_US);
+    TEST_ASSERT_TRUE_MESSAGE(sequencer.isOn(LED_STATE), "edge due now came late");
+    sequencer.set(LED_STATE, false);
+}
+
+void test_pattern_that_does_not_loop_ends_off() {
+    LedSequencer sequencer;
+    sequencer.begin();
+    sequencer.play(LED_MODE, led_loaded);
+    native_advance_micros(50000);
+    TEST_ASSERT_TRUE(sequencer.isOn(LED_MODE));
+    uint32_t writes = sequencer.getWrites();
+    native_advance_micros(2000000);
+    TEST_ASSERT_FALSE(sequencer.isOn(LED_MODE));
+    TEST_ASSERT_EQUAL_UINT32(writes + 7, sequencer.getWrites());       // the other three blinks, then off
+}
+
+void test_set_stops_the_pattern() {
+    LedSequencer sequencer;
+    sequencer.begin();
+    sequencer.blink(LED_STATUS, LED_ERROR_CONFIG, BLINK_MS, BLINK_MS, GAP_MS);
+    native_advance_micros(300000);
+    sequencer.set(LED_STATUS, true);
+    uint32_t writes = sequencer.getWrites();
+    native_advance_micros(5000000);
+    TEST_ASSERT_TRUE(sequencer.isOn(LED_STATUS));
+    TEST_ASSERT_EQUAL_UINT32(writes, sequencer.getWrites());
+}
+
+void test_blink_of_zero_is_off() {
+    LedSequencer sequencer;
+    sequencer.begin();
+    sequencer.set(LED_STATE, true);
+    sequencer.blink(LED_STATE, 0, BLINK_MS, BLINK_MS, GAP_MS);
+    TEST_ASSERT_FALSE(sequencer.isOn(LED_STATE));
+    uint32_t writes = sequencer.getWrites();
+    native_advance_micros(5000000);
+    TEST_ASSERT_EQUAL_UINT32(writes, sequencer.getWrites());
+}
+
+int main() {
+    UNITY_BEGIN();
+    RUN_TEST(test_blink_follows_its_pattern);
+    RUN_TEST(test_late_alarms_do_not_drift);
+    RUN_TEST(test_pattern_that_does_not_loop_ends_off);
+    RUN_TEST(test_set_stops_the_pattern);
+    RUN_TEST(test_blink_of_zero_is_off);
+    return UNITY_END();
+}
@@ -0,0 +1,110 @@
+// Unit tests of the serial protocol's framing (env:native_test).
+//
+//   pio test -e native_test -f test_serial_protocol
+
+#include <Arduino.h>
+#include <unity.h>
+#include <vector>
+#include "serial_protocol.h"
+
+// Keeps what is written to it
+class CapturePrint : public Print {
+    public:
+        size_t write(uint8_t c) override { bytes.push_back(c); return 1; }
+        size_t write(const uint8_t* buffer, size_t size) override {
+            bytes.insert(bytes.end(), buffer, buffer + size);
+            return size;
+        }
+
+        std::vector<uint8_t> bytes;
+};
+
+// A message as it goes on the wire
+static std::vector<uint8_t> frame(uint8_t type, uint8_t seq, const std::vector<uint8_t>& body) {
+    CapturePrint out;
+    SerialWriter writer(out);
+    writer.begin(type, seq);
+    writer.write(body.data(), body.size());
+    writer.end();
+    return out.bytes;
+}
+
+// Feeds bytes, counts the messages that came through
+static int feed(SerialReader& reader, const std::vector<uint8_t>& bytes) {
+    int messages = 0;
+    for (uint8_t byte : bytes) {
+        messages += reader.feed(byte) == SERIAL_BYTE_MESSAGE;
+    }
+    return messages;
+}
+
+void setUp() {
+}
+
+void tearDown() {
+}
+
+void test_message_comes_through_as_sent() {
+    // Zeros in the body and a body long enough for the COBS codes to matter
+    std::vector<uint8_t> body = {SERIAL_PROTOCOL_VERSION, 0, 7, 0, 0, 0xFF};
+    for (int i = 0; i < 20; i++) {
+        body.push_back(i * 13);
+    }
+    std::vector<uint8_t> wire = frame(SERIAL_INPUT, 42, body);
+    TEST_ASSERT_LESS_OR_EQUAL(SerialWriter::wireSize(2 + body.size()), wire.size());
+    for (size_t i = 2; i + 1 < wire.size(); i++) {
+        TEST_ASSERT_NOT_EQUAL(0, wire[i]);
+    }
+
+    SerialReader reader;
+    TEST_ASSERT_EQUAL(1, feed(reader, wire));
+    TEST_ASSERT_EQUAL_UINT8(2 + body.size(), reader.messageLength());
+    TEST_ASSERT_EQUAL_UINT8(SERIAL_INPUT, reader.message()[0]);
+    TEST_ASSERT_EQUAL_UINT8(42, reader.message()[1]);
+    TEST_ASSERT_EQUAL_MEMORY(body.data(), reader.message() + 2, body.size());
+    TEST_ASSERT_EQUAL_UINT16(0, reader.getBadFrames());
+}
+
+void test_flipped_bit_is_dropped() {
+    std::vector<uint8_t> wire = frame(SERIAL_SET_STATE, 3, {5});
+    SerialReader reader;
+    for (size_t i = 2; i + 1 < wire.size(); i++) {
+        for (uint8_t bit = 0; bit < 8; bit++) {
+            std::vector<uint8_t> damaged = wire;
+            damaged[i] ^= 1 << bit;
+            TEST_ASSERT_EQUAL(0, feed(reader, damaged));
+        }
+    }
+    TEST_ASSERT_GREATER_THAN(0, reader.getBadFrames());
+
+    // The next message after the damaged ones comes through
+    TEST_ASSERT_EQUAL(1, feed(reader, wire));
+}
+
+void test_text_between_messages_is_text() {
+    SerialReader reader;
+    const char* line = "reload\n";
+    for (const char* c = line; *c; c++) {
+        TEST_ASSERT_EQUAL_UINT8(SERIAL_BYTE_TEXT, reader.feed(*c));
+    }
+    TEST_ASSERT_EQUAL(1, feed(reader, frame(SERIAL_PING, 1, {})));
+    for (const char* c = line; *c; c++) {
+        TEST_ASSERT_EQUAL_UINT8(SERIAL_BYTE_TEXT, reader.feed(*c));
+    }
+}
+
+void test_command_too_long_is_dropped() {
+    std::vector<uint8_t> body(SERIAL_COMMAND_MAX, 1);
+    SerialReader reader;
+    TEST_ASSERT_EQUAL(0, feed(reader, frame(SERIAL_INPUT, 1, body)));
+    TEST_ASSERT_EQUAL_UINT16(1, reader.getBadFrames());
+}
+
+int main() {
+    UNITY_BEGIN();
+    RUN_TEST(test_message_comes_through_as_sent);
+    RUN_TEST(test_flipped_bit_is_dropped);
+    RUN_TEST(test_text_between_messages_is_text);
+    RUN_TEST(test_command_too_long_is_dropped);
+    return UNITY_END();
+}
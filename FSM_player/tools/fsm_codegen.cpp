@@ -0,0 +1,201 @@
+// Writes FSM_Config.json out as a C++ header of constexpr tables built into
+// the firmware (env:fsm_codegen), see fsm_builtin.h.
+//
+//   pio run -e fsm_codegen
+//   .pio/build/fsm_codegen/program FSM_Config.json include/fsm_builtin_config.h
+//   pio run -e rpipicow_builtin -t upload
+//
+// The config is compiled and checked exactly as fsm_compile does it, a bad one
+// is reported by state and nothing is written. Run it again every time the
+// JSON changes.
+
+#include <Arduino.h>
+#include <string>
+#include <vector>
+#include "fsm_image.h"
+#include "fsm_program.h"
+#include "debounce.h"
+
+static const char* condition_name(uint8_t type) {
+    switch (type) {
+        case SENSOR:         return "SENSOR";
+        case TIME_PASSED:    return "TIME_PASSED";
+        case AUDIO_FINISHED: return "AUDIO_FINISHED";
+        case SKIP_FLAG:      return "SKIP_FLAG";
+        default:             return "RESET_FLAG";
+    }
+}
+
+static const char* select_name(uint8_t select) {
+    switch (select) {
+        case AUDIO_SELECT_FIRST:      return "AUDIO_SELECT_FIRST";
+        case AUDIO_SELECT_SEQUENTIAL: return "AUDIO_SELECT_SEQUENTIAL";
+        case AUDIO_SELECT_SHUFFLE:    return "AUDIO_SELECT_SHUFFLE";
+        default:                      return "AUDIO_SELECT_WEIGHTED";
+    }
+}
+
+// A string pool byte inside a C++ string literal. Octal escapes are always
+// three digits, so a digit after one can't run into it.
+static void put_char(FILE* out, char c) {
+    if (c == '"' || c == '\\') {
+        fprintf(out, "\\%c", c);
+    } else if (c >= 0x20 && c < 0x7F) {
+        fputc(c, out);
+    } else {
+        fprintf(out, "\\%03o", (uint8_t)c);
+    }
+}
+
+// Writes the header for a checked image
+static void write_header(FILE* out, const char* source, const uint8_t* image) {
+    const FsmImageHeader* header = fsm_image_header(image);
+    const State* states = fsm_image_states(image);
+    const Transition* transitions = fsm_image_transitions(image);
+    const Condition* conditions = fsm_image_conditions(image);
+    const uint8_t* code = fsm_image_code(image);
+    const char* strings = fsm_image_strings(image);
+    uint32_t codeBytes = header->stringsOffset - header->codeOffset;
+    uint32_t stringBytes = header->imageSize - header->stringsOffset;
+
+    fprintf(out, "// Generated from %s by tools/fsm_codegen.cpp, don't edit: change the JSON\n", source);
+    fprintf(out, "// and run it again. %u states, %u transitions, %u conditions, %lu bytes of code,\n",
+            header->numStates, header->numTransitions, header->numConditions, (unsigned long)header->codeSize);
+    fprintf(out, "// %lu bytes in flash.\n\n", (unsigned long)header->imageSize);
+    fprintf(out, "#ifndef FSM_BUILTIN_CONFIG_H\n#define FSM_BUILTIN_CONFIG_H\n\n#include \"fsm_builtin.h\"\n\n");
+
+    fprintf(out, "constexpr FsmBuiltinImage<%u, %u, %u, %lu, %lu> fsm_builtin = {\n", header->numStates,
+            header->numTransitions, header->numConditions, (unsigned long)codeBytes, (unsigned long)stringBytes);
+
+    // Header, in field order
+    fprintf(out, "    {FSM_IMAGE_MAGIC, FSM_IMAGE_VERSION, sizeof(FsmImageHeader), %lu, 0x%08lXUL,\n",
+            (unsigned long)header->imageSize, (unsigned long)header->crc);
+    fprintf(out, "     %u, %u, %u, %u, %s,\n", header->numStates, header->numTransitions, header->numConditions,
+            header->numInputs, header->debounceMode == DEBOUNCE_LEADING ? "DEBOUNCE_LEADING" : "DEBOUNCE_STABLE");
+    fprintf(out, "     %lu, %lu, %lu, %lu, %lu,\n     {", (unsigned long)header->statesOffset,
+            (unsigned long)header->transitionsOffset, (unsigned long)header->conditionsOffset,
+            (unsigned long)header->stringsOffset, (unsigned long)header->stringsSize);
+    for (uint8_t i = 0; i < header->numInputs; i++) {
+        fprintf(out, i ? ", %u" : "%u", header->inputPins[i]);
+    }
+    fprintf(out, "},\n     %u, %u, %lu, %lu},\n\n", header->debounceMs, header->longPressMs,
+            (unsigned long)header->codeOffset, (unsigned long)header->codeSize);
+
+    // id, repeat, blinkCount, numTransitions, firstTransition, audioFile, select, reserved, gain, fadeIn, fadeOut
+    fprintf(out, "    {\n");
+    for (uint16_t i = 0; i < header->numStates; i++) {
+        const State& s = states[i];
+        fprintf(out, "        {%u, %s, %u, %u, %u, %u, %s, 0, %u, %u, %u}, // \"%s\"\n", s.id, s.repeat ? "true" : "false",
+                s.blinkCount, s.numTransitions, s.firstTransition, s.audioFile, select_name(s.select), s.gain, s.fadeIn,
+                s.fadeOut, strings + s.audioFile);
+    }
+    fprintf(out, "    },\n\n");
+
+    // targetState, numConditions, firstCondition, careMask, valueMask, minElapsed, needs, reserved, program, actions
+    fprintf(out, "    {\n");
+    for (uint16_t i = 0; i < header->numStates; i++) {
+        const State& s = states[i];
+        for (uint8_t j = 0; j < s.numTransitions; j++) {
+            const Transition& t = transitions[s.firstTransition + j];
+            fprintf(out, "        {%u, %u, %u, 0x%08lX, 0x%08lX, %lu, 0x%02X, {}, %u, %u},", t.targetState, t.numConditions,
+                    t.firstCondition, (unsigned long)t.careMask, (unsigned long)t.valueMask, (unsigned long)t.minElapsed,
+                    t.needs, t.program, t.actions);
+            const char* kind = j + 2 == s.numTransitions ? " (skip)" : j + 1 == s.numTransitions ? " (reset)" : "";
+            fprintf(out, " // %u -> %u%s\n", i, t.targetState, kind);
+        }
+    }
+    fprintf(out, "    },\n\n");
+
+    fprintf(out, "    {\n");
+    for (uint16_t k = 0; k < header->numConditions; k++) {
+        const Condition& c = conditions[k];
+        if (c.type == SENSOR) {
+            fprintf(out, "        {SENSOR, {{%u, %s}}},\n", c.sensorPin, c.state ? "true" : "false");
+        } else if (c.type == TIME_PASSED) {
+            fprintf(out, "        {TIME_PASSED, {.duration = %lu}},\n", (unsigned long)c.duration);
+        } else {
+            fprintf(out, "        {%s, {}},\n", condition_name(c.type));
+        }
+    }
+    fprintf(out, "    },\n\n");
+
+    // Code, the padding after it is left to the zero fill
+    fprintf(out, "    {");
+    for (uint32_t i = 0; i < header->codeSize; i++) {
+        fprintf(out, "%s0x%02X", i == 0 ? "" : i % 16 ? ", " : ",\n     ", code[i]);
+    }
+    fprintf(out, "},\n\n");
+
+    // Strings, one literal each; the last one's NUL is the literal's own
+    fprintf(out, "    \"");
+    for (uint32_t i = 0; i + 1 < header->stringsSize; i++) {
+        put_char(out, strings[i]);
+        if (strings[i] == '\0') {
+            fprintf(out, "\"\n    \"");
+        }
+    }
+    fprintf(out, "\"\n};\n\n");
+
+    fprintf(out, "static_assert(fsm_builtin_check(fsm_builtin), \"the built-in state table is not usable\");\n\n");
+    fprintf(out, "#endif // FSM_BUILTIN_CONFIG_H\n");
+}
+
+int main(int argc, char** argv) {
+    if (argc != 3) {
+        fprintf(stderr, "usage: %s <FSM_Config.json> <fsm_builtin_config.h>\n", argv[0]);
+        return 2;
+    }
+
+    FILE* in = fopen(argv[1], "rb");
+    if (!in) {
+        perror(argv[1]);
+        return 1;
+    }
+    std::vector<char> json;
+    char chunk[4096];
+    size_t n;
+    while ((n = fread(chunk, 1, sizeof(chunk), in)) > 0) {
+        json.insert(json.end(), chunk, chunk + n);
+    }
+    fclose(in);
+
+    DynamicJsonDocument doc(json.size() * 8 + 4096);
+    DeserializationError error = deserializeJson(doc, json.data(), json.size(),
+                                                 DeserializationOption::NestingLimit(FSM_JSON_NESTING));
+    if (error) {
+        fprintf(stderr, "%s: %s\n", argv[1], error.c_str());
+        return 1;
+    }
+
+    const char* problem = nullptr;
+    uint32_t size = fsm_image_compile(doc.as<JsonObject>(), nullptr, 0, &problem);
+    std::vector<uint8_t> image(size);
+    if (size == 0 || fsm_image_compile(doc.as<JsonObject>(), image.data(), size, &problem) == 0) {
+        fprintf(stderr, "%s: %s\n", argv[1], problem);
+        return 1;
+    }
+
+    // Only the file name goes into the comment, the header shouldn't change with where it was made
+    std::string source = argv[1];
+    source = source.substr(source.find_last_of('/') + 1);
+
+    FILE* out = fopen(argv[2], "w");
+    if (!out) {
+        perror(argv[2]);
+        return 1;
+    }
+    write_header(out, source.c_str(), image.data());
+    if (fclose(out) != 0) {
+        perror(argv[2]);
+        return 1;
+    }
+
+    // What the evaluator built for it leaves out
+    const FsmImageHeader* header = fsm_image_header(image.data());
+    uint8_t uses = fsm_uses(fsm_image_transitions(image.data()), header->numTransitions);
+    printf("%s: %u states, %u transitions, %u conditions, %lu bytes of code, %lu bytes in flash, tests events%s%s%s\n",
+           argv[2], header->numStates, header->numTransitions, header->numConditions, (unsigned long)header->codeSize,
+           (unsigned long)header->imageSize, uses & FSM_USES_SENSORS ? ", sensors" : "", uses & FSM_USES_TIME ? ", time" : "",
+           uses & FSM_USES_PROGRAMS ? ", programs" : "");
+    return 0;
+}
@@ -0,0 +1,60 @@
+// Compiles FSM_Config.json into the binary FSM_Config.bin image (env:fsm_compile).
+//
+//   pio run -e fsm_compile
+//   .pio/build/fsm_compile/program FSM_Config.json FSM_Config.bin
+//
+// Copy the .bin next to the .json on the SD card. The firmware loads the image
+// when it is present and valid, and falls back to the JSON otherwise.
+
+#include <Arduino.h>
+#include <vector>
+#include "fsm_image.h"
+
+int main(int argc, char** argv) {
+    if (argc != 3) {
+        fprintf(stderr, "usage: %s <FSM_Config.json> <FSM_Config.bin>\n", argv[0]);
+        return 2;
+    }
+
+    FILE* in = fopen(argv[1], "rb");
+    if (!in) {
+        perror(argv[1]);
+        return 1;
+    }
+    std::vector<char> json;
+    char chunk[4096];
+    size_t n;
+    while ((n = fread(chunk, 1, sizeof(chunk), in)) > 0) {
+        json.insert(json.end(), chunk, chunk + n);
+    }
+    fclose(in);
+
+    // No document size limit on the host
+    DynamicJsonDocument doc(json.size() * 8 + 4096);
+    DeserializationError error = deserializeJson(doc, json.data(), json.size(),
+                                                 DeserializationOption::NestingLimit(FSM_JSON_NESTING));
+    if (error) {
+        fprintf(stderr, "%s: %s\n", argv[1], error.c_str());
+        return 1;
+    }
+
+    const char* problem = nullptr;
+    uint32_t size = fsm_image_compile(doc.as<JsonObject>(), nullptr, 0, &problem);
+    std::vector<uint8_t> image(size);
+    if (size == 0 || fsm_image_compile(doc.as<JsonObject>(), image.data(), size, &problem) == 0) {
+        fprintf(stderr, "%s: %s\n", argv[1], problem);
+        return 1;
+    }
+
+    FILE* out = fopen(argv[2], "wb");
+    if (!out || fwrite(image.data(), 1, size, out) != size || fclose(out) != 0) {
+        perror(argv[2]);
+        return 1;
+    }
+
+    const FsmImageHeader* header = fsm_image_header(image.data());
+    printf("%s: %u states, %u transitions, %u conditions, %lu bytes of code, %lu bytes of strings, %lu bytes total (v%u)\n",
+           argv[2], header->numStates, header->numTransitions, header->numConditions, (unsigned long)header->codeSize,
+           (unsigned long)header->stringsSize, (unsigned long)header->imageSize, header->version);
+    return 0;
+}
@@ -0,0 +1,884 @@
+// Runs a config on the host in virtual time, against a trace of inputs or
+// random presses, and fuzzes random configs (env:fsm_replay).
+//
+//   pio run -e fsm_replay
+//   .pio/build/fsm_replay/program <card dir> [--trace <file>] [--random <s>] [--until <s>]
+//                                 [--audio <ms>] [--seed <n>] [--quiet] [--verbose]
+//   .pio/build/fsm_replay/program --fuzz <configs> [--seed <n>] [--out <dir>]
+//
+// <card dir> is a copy of the SD card, or just a folder with its
+// FSM_Config.json (or FSM_Config.bin). The config goes through
+// FSM::loadConfiguration() and runs in FSM::update() as on the player, on the
+// virtual clock and pins of env:native with the Scheduler sleeping between
+// updates, so an hour of show takes a fraction of a second.
+//
+// A trace is a text file of events, one per line, at ms from the start:
+//
+//   500    press 2         input 2 pressed (low) for 200 ms, "press 2 1500" for 1.5 s
+//   800    low 3           input 3 goes low and stays low, "high 3" lets it go
+//   1200   button          the reset button pressed for 100 ms (a skip), "button 3000" held
+//   2000   audio           the state's audio finishes
+//   2500   state 4         go to state 4, as a show controller's SERIAL_SET_STATE
+//   # a comment
+//
+// --random plays random presses for that many seconds, after the trace,
+// mostly of the inputs the current state's transitions look at. States
+// without an audioFile finish their audio straight away, as on the player.
+// The others finish after the length of their .wav in the card dir (a
+// folder's first file by name), after --audio ms if it isn't there, or only
+// on an "audio" event of the trace without --audio.
+//
+// It prints the transitions (--quiet leaves them out), the time spent in each
+// state, the states the config's own transitions never lead to from state 0,
+// dead ends, transitions that can never fire, and the host time of an
+// update(). --verbose also prints what the loader printed.
+//
+// --fuzz writes random configs, some with a targetState, sensorPin, input or
+// duration out of range on purpose, and runs each for a minute of random
+// presses in a child process. Configs that crash it, hang it, keep the FSM
+// busy without time passing, get through the loader with a value out of
+// range, or cost far more per update than the rest are saved to --out
+// (default .) for a closer look.
+
+#include <Arduino.h>
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include "native_hal.h"
+#include "FSM.h"
+#include "wav.h"
+#include "scheduler.h"
+#include "led_sequencer.h"
+
+#define REPLAY_PRESS_MS   200           // a "press" without a length
+#define REPLAY_BUTTON_MS  100           // a "button" without a length
+#define REPLAY_NEVER      ~0ULL
+#define REPLAY_SPIN_LIMIT 10000         // updates at the same us before the FSM counts as busy
+#define FUZZ_SHOW_S       60
+#define FUZZ_TIMEOUT_S    20            // host time a child gets before it counts as hung
+#define FUZZ_SLOW_FACTOR  20            // typical update() cost this many times the median config's is a cliff
+
+typedef std::chrono::steady_clock replay_clock;
+
+static uint32_t replay_seed = 1;
+
+static uint32_t replay_random(uint32_t n) {
+    replay_seed = replay_seed * 1103515245UL + 12345UL;
+    return (replay_seed >> 8) % n;
+}
+
+enum TraceKind : uint8_t {
+    TRACE_PRESS,
+    TRACE_LOW,
+    TRACE_HIGH,
+    TRACE_BUTTON,
+    TRACE_AUDIO,
+    TRACE_STATE
+};
+
+struct TraceEvent {
+    uint64_t atUs;                  // From the start of the replay
+    TraceKind kind;
+    uint32_t arg;                   // Input or state
+    uint32_t ms;                    // How long a press or the button is held
+};
+
+struct ReplayOptions {
+    std::vector<TraceEvent> trace;
+    double randomS;                 // Random presses after the trace, for this long
+    double untilS;                  // Stop here, 0: 10 s after the trace and the random presses
+    long audioMs;                   // Length of audio that isn't in the card dir, -1: none
+    bool quiet;
+};
+
+struct ReplayStats {
+    uint64_t virtualUs;
+    double wallS;
+    unsigned long updates;
+    unsigned long transitions;
+    unsigned long presses;
+    bool busy;                      // Stopped after REPLAY_SPIN_LIMIT updates without time passing
+    uint8_t busyState;              // In this state
+    std::vector<uint64_t> stateUs;  // Virtual time in each state
+    std::vector<unsigned long> visits;
+    std::vector<double> stateNs;    // Host time of the updates in each state
+    std::vector<unsigned long> stateUpdates;
+    std::vector<float> updateNs;
+};
+
+// Reads a trace file, false with a message if a line doesn't make sense
+static bool read_trace(const char* path, std::vector<TraceEvent>& trace) {
+    FILE* f = fopen(path, "r");
+    if (!f) {
+        perror(path);
+        return false;
+    }
+    char line[256];
+    int number = 0;
+    while (fgets(line, sizeof(line), f)) {
+        number++;
+        char* hash = strchr(line, '#');
+        if (hash) {
+            *hash = '\0';
+        }
+        double ms;
+        char what[16];
+        long arg = -1, hold = -1;
+        int fields = sscanf(line, "%lf %15s %ld %ld", &ms, what, &arg, &hold);
+        if (fields <= 0) {
+            continue;                                   // blank or a comment
+        }
+        TraceEvent event = {(uint64_t)(ms * 1000), TRACE_PRESS, (uint32_t)arg, 0};
+        std::string kind = fields >= 2 ? what : "";
+        bool ok = ms >= 0;
+        if (kind == "press" || kind == "low" || kind == "high" || kind == "state") {
+            event.kind = kind == "press" ? TRACE_PRESS : kind == "low" ? TRACE_LOW : kind == "high" ? TRACE_HIGH : TRACE_STATE;
+            ok = ok && fields >= 3 && arg >= 0 && arg < 256 && (fields == 3 || kind == "press") && hold != 0;
+            event.ms = hold > 0 ? hold : REPLAY_PRESS_MS;
+        } else if (kind == "button") {
+            event.kind = TRACE_BUTTON;
+            ok = ok && fields <= 3 && arg != 0;
+            event.ms = arg > 0 ? arg : REPLAY_BUTTON_MS;
+        } else if (kind == "audio") {
+            event.kind = TRACE_AUDIO;
+            ok = ok && fields == 2;
+        } else {
+            ok = false;
+        }
+        if (!ok) {
+            fprintf(stderr, "%s:%d: expected <ms> press|low|high <input>, button [ms], audio or state <n>\n", path, number);
+            fclose(f);
+            return false;
+        }
+        trace.push_back(event);
+    }
+    fclose(f);
+    std::stable_sort(trace.begin(), trace.end(),
+                     [](const TraceEvent& a, const TraceEvent& b) { return a.atUs < b.atUs; });
+    return true;
+}
+
+// Length of a state's audio in us: 0 without an audioFile, REPLAY_NEVER
+// for a repeat or one that isn't in the card dir (without --audio)
+static uint64_t audio_us(FSM& fsm, uint8_t state, const ReplayOptions& options) {
+    const State& s = fsm_image_states(fsm.getTable())[state];
+    const char* file = fsm.getAudioFile(state);
+    if (file[0] == '\0') {
+        return 0;
+    }
+    if (s.repeat) {
+        return REPLAY_NEVER;
+    }
+    char path[128];
+    snprintf(path, sizeof(path), "%s", file);
+    bool found = file[strlen(file) - 1] != '/' || wav_find_first(sd, file, path, sizeof(path));
+    WavFormat format;
+    File32 wav;
+    if (found && (wav = sd.open(path, O_READ)) && wav_parse(wav, format) == nullptr && format.sampleRate) {
+        uint64_t frames = format.dataSize / format.blockAlign;
+        if (format.formatTag == WAV_FORMAT_IMA_ADPCM) {
+            frames *= (format.blockAlign / format.channels - 4) * 2 + 1;   // samples per block
+        }
+        wav.close();
+        return frames * 1000000ULL / format.sampleRate;
+    }
+    return options.audioMs >= 0 ? options.audioMs * 1000ULL : REPLAY_NEVER;
+}
+
+// Inputs the state's own transitions look at, the ones worth pressing
+static uint32_t inputs_of(const uint8_t* table, uint8_t state) {
+    const State& s = fsm_image_states(table)[state];
+    const Transition* transitions = fsm_image_transitions(table) + s.firstTransition;
+    uint32_t mask = 0;
+    for (uint8_t j = 0; j + 2 < s.numTransitions; j++) {
+        mask |= transitions[j].careMask;
+    }
+    return mask;
+}
+
+// Schedules a press of an input, or of the reset button with input 0xFF
+static void schedule_press(const uint8_t* table, uint64_t at, uint32_t input, uint32_t ms) {
+    uint8_t pin = input == 0xFF ? resetPin : fsm_image_header(table)->inputPins[input];
+    native_schedule_pin(at, pin, LOW);
+    native_schedule_pin(at + ms * 1000ULL, pin, HIGH);
+}
+
+// Runs the loaded config against the trace and the random presses
+static void run_replay(FSM& fsm, const ReplayOptions& options, ReplayStats& stats) {
+    const uint8_t* table = fsm.getTable();
+    const FsmImageHeader* header = fsm_image_header(table);
+    uint8_t numStates = fsm.getNumStates();
+    stats = ReplayStats();
+    stats.stateUs.resize(numStates);
+    stats.visits.resize(numStates);
+    stats.stateNs.resize(numStates);
+    stats.stateUpdates.resize(numStates);
+
+    std::vector<uint64_t> audioLength(numStates);
+    for (uint8_t i = 0; i < numStates; i++) {
+        audioLength[i] = audio_us(fsm, i, options);
+    }
+
+    // Pin events are scripted into the virtual pins up front, the rest are
+    // carried out by the loop when their time comes
+    uint64_t start = native_micros();
+    uint64_t traceEnd = 0;
+    std::vector<TraceEvent> events;
+    for (const TraceEvent& event : options.trace) {
+        traceEnd = std::max(traceEnd, event.atUs);
+        uint64_t at = start + event.atUs;
+        if ((event.kind == TRACE_PRESS || event.kind == TRACE_LOW || event.kind == TRACE_HIGH) &&
+            event.arg >= header->numInputs) {
+            fprintf(stderr, "%.3f s: the config has no input %u, left out\n", event.atUs / 1e6, event.arg);
+        } else if (event.kind == TRACE_PRESS) {
+            schedule_press(table, at, event.arg, event.ms);
+            stats.presses++;
+        } else if (event.kind == TRACE_LOW || event.kind == TRACE_HIGH) {
+            native_schedule_pin(at, header->inputPins[event.arg], event.kind == TRACE_LOW ? LOW : HIGH);
+        } else if (event.kind == TRACE_BUTTON) {
+            schedule_press(table, at, 0xFF, event.ms);
+        } else {
+            events.push_back(event);
+        }
+    }
+    uint64_t randomFrom = start + traceEnd;
+    uint64_t randomUntil = randomFrom + (uint64_t)(options.randomS * 1e6);
+    uint64_t end = options.untilS > 0 ? start + (uint64_t)(options.untilS * 1e6) : randomUntil + 10000000ULL;
+    uint64_t nextPress = options.randomS > 0 ? randomFrom + 100000 : REPLAY_NEVER;
+    size_t nextEvent = 0;
+
+    fsm.begin();
+    Scheduler scheduler;
+    scheduler.begin(fsm.getInputGpioMask());
+    uint8_t state = fsm.getCurrentState();
+    uint64_t enteredUs = start;
+    uint64_t audioAt = audioLength[state] == REPLAY_NEVER ? REPLAY_NEVER : start + audioLength[state];
+    stats.visits[state]++;
+    unsigned long spin = 0;
+    uint64_t lastUs = start;
+    replay_clock::time_point wallStart = replay_clock::now();
+
+    while (native_micros() < end) {
+        // Sleep until the FSM, the trace, the audio or a random press needs the next update
+        uint64_t now = native_micros();
+        int32_t ahead = (int32_t)(fsm.nextDeadlineUs() - (uint32_t)now);
+        uint64_t wake = ahead > 0 ? now + ahead : now;
+        uint64_t eventAt = nextEvent < events.size() ? start + events[nextEvent].atUs : REPLAY_NEVER;
+        wake = std::min(std::min(wake, end), std::min(std::min(eventAt, audioAt), nextPress));
+        if (wake > now) {
+            scheduler.sleepUntilUs((uint32_t)wake);
+        }
+        now = native_micros();
+
+        while (nextEvent < events.size() && start + events[nextEvent].atUs <= now) {
+            const TraceEvent& event = events[nextEvent++];
+            if (event.kind == TRACE_AUDIO) {
+                fsm.finishAudio();
+            } else if (!fsm.setState(event.arg)) {
+                fprintf(stderr, "%.3f s: the config has no state %u, left out\n", event.atUs / 1e6, event.arg);
+            }
+        }
+        if (audioAt <= now) {
+            fsm.finishAudio();
+            audioAt = REPLAY_NEVER;
+        }
+        if (nextPress <= now) {
+            // Mostly an input the state listens to, now and then any or the reset button.
+            // A long press reloads the config, so the table is looked up afresh.
+            table = fsm.getTable();
+            header = fsm_image_header(table);
+            uint32_t listened = inputs_of(table, fsm.getCurrentState());
+            uint32_t input = replay_random(header->numInputs);
+            if (listened && replay_random(4)) {
+                do {
+                    input = replay_random(header->numInputs);
+                } while (!(listened & (1UL << input)));
+            } else if (replay_random(20) == 0) {
+                input = 0xFF;
+            }
+            uint32_t ms = 30 + replay_random(input == 0xFF ? 2 * header->longPressMs : 1500);
+            schedule_press(table, now, input, ms);
+            stats.presses++;
+            nextPress = now + (ms + 50 + replay_random(3000)) * 1000ULL;
+            if (nextPress >= randomUntil) {
+                nextPress = REPLAY_NEVER;
+            }
+        }
+
+        replay_clock::time_point tick = replay_clock::now();
+        fsm.update();
+        float ns = std::chrono::duration<float, std::nano>(replay_clock::now() - tick).count();
+        stats.updates++;
+        stats.updateNs.push_back(ns);
+        stats.stateNs[state] += ns;
+        stats.stateUpdates[state]++;
+
+        if (fsm.getCurrentState() != state) {
+            stats.stateUs[state] += now - enteredUs;
+            if (!options.quiet) {
+                printf("%12.3f s  %3u -> %3u\n", (now - start) / 1e6, state, fsm.getCurrentState());
+            }
+            state = fsm.getCurrentState();
+            enteredUs = now;
+            audioAt = audioLength[state] == REPLAY_NEVER ? REPLAY_NEVER : now + audioLength[state];
+            stats.visits[state]++;
+            stats.transitions++;
+        }
+
+        // A config that goes round its states without waiting for anything,
+        // or back into the one it is in, keeps the player busy for good
+        spin = now == lastUs ? spin + 1 : 0;
+        lastUs = now;
+        if (spin >= REPLAY_SPIN_LIMIT) {
+            stats.busy = true;
+            stats.busyState = state;
+            break;
+        }
+    }
+    stats.stateUs[state] += native_micros() - enteredUs;
+    stats.virtualUs = native_micros() - start;
+    stats.wallS = std::chrono::duration<double>(replay_clock::now() - wallStart).count();
+}
+
+// Prints a list of states as ranges: 3, 7, 12-15
+static void print_states(const char* what, const std::vector<uint8_t>& list) {
+    printf("%-34s", what);
+    if (list.empty()) {
+        printf(" none\n");
+        return;
+    }
+    for (size_t i = 0; i < list.size();) {
+        size_t j = i;
+        while (j + 1 < list.size() && list[j + 1] == list[j] + 1) {
+            j++;
+        }
+        printf("%s %u", i ? "," : "", list[i]);
+        if (j > i) {
+            printf("-%u", list[j]);
+        }
+        i = j + 1;
+    }
+    printf("\n");
+}
+
+// What the table's own transitions allow, without running it. The skip and
+// reset transitions every state gets are left out: they only come from the
+// reset button.
+static void print_analysis(const uint8_t* table) {
+    const FsmImageHeader* header = fsm_image_header(table);
+    const State* states = fsm_image_states(table);
+    const Transition* transitions = fsm_image_transitions(table);
+    uint16_t n = header->numStates;
+    std::vector<std::vector<uint8_t>> to(n), from(n);
+    std::vector<uint8_t> deadEnds, never, shadowed;
+
+    for (uint16_t i = 0; i < n; i++) {
+        const Transition* t = transitions + states[i].firstTransition;
+        bool leaves = false, always = false;
+        for (uint8_t j = 0; j < states[i].numTransitions; j++) {
+            bool own = j + 2 < states[i].numTransitions;
+            if (always) {
+                if (own) {
+                    shadowed.push_back(i);
+                }
+                break;
+            }
+            if (!own) {
+                continue;
+            }
+            if (t[j].needs & EVENT_NEVER) {
+                never.push_back(i);
+                continue;
+            }
+            to[i].push_back(t[j].targetState);
+            from[t[j].targetState].push_back(i);
+            leaves = leaves || t[j].targetState != i;
+            // Nothing to wait for: the transitions after it never get a look in
+            always = t[j].numConditions == 0 && !t[j].program;
+        }
+        if (!leaves) {
+            deadEnds.push_back(i);
+        }
+    }
+    never.erase(std::unique(never.begin(), never.end()), never.end());
+
+    // Forwards from state 0, and backwards to it
+    std::vector<bool> reached(n), returns(n);
+    std::vector<uint8_t> work = {0};
+    reached[0] = true;
+    while (!work.empty()) {
+        uint8_t s = work.back();
+        work.pop_back();
+        for (uint8_t t : to[s]) {
+            if (!reached[t]) {
+                reached[t] = true;
+                work.push_back(t);
+            }
+        }
+    }
+    work = {0};
+    returns[0] = true;
+    while (!work.empty()) {
+        uint8_t s = work.back();
+        work.pop_back();
+        for (uint8_t t : from[s]) {
+            if (!returns[t]) {
+                returns[t] = true;
+                work.push_back(t);
+            }
+        }
+    }
+    std::vector<uint8_t> unreachable, noWayBack;
+    for (uint16_t i = 0; i < n; i++) {
+        if (!reached[i]) {
+            unreachable.push_back(i);
+        } else if (!returns[i]) {
+            noWayBack.push_back(i);
+        }
+    }
+
+    printf("\n%u states, %u inputs; the reset button's skip and reset are left out below\n", n, header->numInputs);
+    print_states("unreachable from state 0:", unreachable);
+    print_states("dead ends, no transition out:", deadEnds);
+    print_states("reached, no way back to state 0:", noWayBack);
+    print_states("a transition that never fires:", never);
+    print_states("transitions after an unconditional:", shadowed);
+}
+
+static void print_stats(const ReplayStats& stats) {
+    uint8_t n = stats.visits.size();
+    printf("\n%8s %8s %12s %8s %12s\n", "state", "visits", "time_s", "share", "update_ns");
+    std::vector<uint8_t> unvisited;
+    for (uint8_t i = 0; i < n; i++) {
+        if (!stats.visits[i]) {
+            unvisited.push_back(i);
+            continue;
+        }
+        printf("%8u %8lu %12.3f %7.1f%% %12.0f\n", i, stats.visits[i], stats.stateUs[i] / 1e6,
+               100.0 * stats.stateUs[i] / std::max<uint64_t>(stats.virtualUs, 1),
+               stats.stateUpdates[i] ? stats.stateNs[i] / stats.stateUpdates[i] : 0.0);
+    }
+    printf("\n");
+    print_states("never entered in this run:", unvisited);
+
+    std::vector<float> ns = stats.updateNs;
+    std::sort(ns.begin(), ns.end());
+    double sum = 0;
+    for (float v : ns) {
+        sum += v;
+    }
+    size_t count = std::max<size_t>(ns.size(), 1);
+    printf("\n%.1f s of show in %.3f s, %.0f times real time: %lu transitions, %lu presses, %lu updates\n",
+           stats.virtualUs / 1e6, stats.wallS, stats.virtualUs / 1e6 / std::max(stats.wallS, 1e-9), stats.transitions,
+           stats.presses, stats.updates);
+    if (!ns.empty()) {
+        printf("update(), host ns: mean %.0f, p50 %.0f, p99 %.0f, max %.0f\n", sum / count, ns[ns.size() / 2],
+               ns[ns.size() * 99 / 100], ns.back());
+    }
+    if (stats.busy) {
+        printf("busy: stopped after %d updates in state %u without time passing, a transition with nothing to wait for\n",
+               REPLAY_SPIN_LIMIT, stats.busyState);
+    }
+}
+
+// Loads the card dir's config as setup() does, what the loader printed in
+// text; false if none could be loaded
+static bool load(FSM& fsm, const char* dir, std::string& text) {
+    native_sd_root(dir);
+    native_serial_capture(true);
+    fsm.loadConfiguration();
+    uint8_t buffer[4096];
+    size_t n;
+    while ((n = native_serial_take(buffer, sizeof(buffer))) > 0) {
+        text.append((const char*)buffer, n);
+    }
+    native_serial_capture(false);
+    return fsm.getNumStates() > 0;
+}
+
+// ---- Fuzzing ----
+
+// Ways a config is made wrong on purpose, the loader must refuse each
+enum FuzzFlaw : uint8_t {
+    FLAW_NONE,
+    FLAW_TARGET_HIGH,               // targetState past the last state
+    FLAW_TARGET_NEGATIVE,
+    FLAW_TARGET_TEXT,
+    FLAW_TARGET_MISSING,
+    FLAW_SENSOR_HIGH,               // a plain SENSOR's sensorPin past the last input
+    FLAW_SENSOR_NEGATIVE,
+    FLAW_SENSOR_MISSING,
+    FLAW_GROUP_SENSOR,              // a sensorPin out of range in a group
+    FLAW_INPUT_GPIO,                // an input on a GPIO that doesn't exist
+    FLAW_DURATION,                  // a negative TIME_PASSED
+    FLAW_COUNT
+};
+
+static const char* const flaw_names[] = {"", "targetState too high", "targetState negative", "targetState text",
+                                         "targetState missing", "sensorPin too high", "sensorPin negative",
+                                         "sensorPin missing", "sensorPin in a group", "input GPIO", "duration negative"};
+
+struct FuzzConfig {
+    std::string json;
+    FuzzFlaw flaw;
+    uint16_t states;
+    uint16_t transitions;
+};
+
+// A condition on one of inputs inputs, groups down to depth levels
+static std::string fuzz_condition(uint8_t inputs, int depth) {
+    char text[160];
+    uint32_t pin = replay_random(inputs);
+    switch (replay_random(depth > 0 ? 10 : 8)) {
+        case 0:
+        case 1:
+            snprintf(text, sizeof(text), "{\"type\":\"SENSOR\",\"data\":{\"sensorPin\":%lu,\"state\":%s}}",
+                     (unsigned long)pin, replay_random(4) ? "false" : "true");
+            return text;
+        case 2:
+            snprintf(text, sizeof(text), "{\"type\":\"TIME_PASSED\",\"data\":{\"duration\":%lu}}",
+                     (unsigned long)replay_random(replay_random(4) ? 5000 : 600000));
+            return text;
+        case 3:
+            return "{\"type\":\"AUDIO_FINISHED\"}";
+        case 4:
+            snprintf(text, sizeof(text), "{\"type\":\"SENSOR_%s\",\"data\":{\"sensorPin\":%lu}}",
+                     replay_random(2) ? "ROSE" : "FELL", (unsigned long)pin);
+            return text;
+        case 5:
+            snprintf(text, sizeof(text), "{\"type\":\"SENSOR_HELD\",\"data\":{\"sensorPin\":%lu,\"state\":false,\"duration\":%lu}}",
+                     (unsigned long)pin, (unsigned long)replay_random(2000));
+            return text;
+        case 6:
+            snprintf(text, sizeof(text), "{\"type\":\"COUNT\",\"data\":{\"sensorPin\":%lu,\"edge\":\"falling\",\"count\":%lu}}",
+                     (unsigned long)pin, (unsigned long)replay_random(4) + 1);
+            return text;
+        case 7:
+            snprintf(text, sizeof(text), "{\"type\":\"VAR\",\"data\":{\"var\":%lu,\"op\":\"<\",\"value\":%lu}}",
+                     (unsigned long)replay_random(4), (unsigned long)replay_random(10));
+            return text;
+        default: {
+            std::string group = replay_random(2) ? "{\"type\":\"ANY\",\"conditions\":[" : "{\"type\":\"NOT\",\"conditions\":[";
+            uint32_t count = 1 + replay_random(3);
+            for (uint32_t i = 0; i < count; i++) {
+                group += (i ? "," : "") + fuzz_condition(inputs, depth - 1);
+            }
+            return group + "]}";
+        }
+    }
+}
+
+// A random config: mostly small, now and then with hundreds of states or
+// transitions, and one in four with a flaw
+static FuzzConfig fuzz_config() {
+    FuzzConfig config = {"", FLAW_NONE, 0, 0};
+    uint32_t size = replay_random(10);
+    config.states = size < 7 ? 1 + replay_random(16) : size < 9 ? 1 + replay_random(80) : 1 + replay_random(FSM_MAX_STATES);
+    uint32_t most = config.states <= 16 && replay_random(5) == 0 ? 200 : 6;      // not both, or it outgrows the JSON
+    uint8_t inputs = 8;
+    if (replay_random(4) == 0) {
+        config.flaw = (FuzzFlaw)(1 + replay_random(FLAW_COUNT - 1));
+    }
+
+    std::string json = "{";
+    if (replay_random(3) == 0 || config.flaw == FLAW_INPUT_GPIO) {
+        // Inputs of their own, on any GPIO the player doesn't use itself
+        inputs = 1 + replay_random(FSM_MAX_INPUTS);
+        std::vector<uint8_t> gpios;
+        for (uint8_t g = 0; g < FSM_NUM_GPIO; g++) {
+            if (!(FSM_RESERVED_GPIO & (1UL << g))) {
+                gpios.push_back(g);
+            }
+        }
+        inputs = std::min<uint8_t>(inputs, gpios.size());
+        json += "\"inputs\":[";
+        for (uint8_t i = 0; i < inputs; i++) {
+            uint32_t k = i + replay_random(gpios.size() - i);
+            std::swap(gpios[i], gpios[k]);
+            bool bad = config.flaw == FLAW_INPUT_GPIO && i == inputs - 1;
+            json += (i ? "," : "") + std::to_string(bad ? (replay_random(2) ? 256 + replay_random(1000) : -1) : gpios[i]);
+        }
+        json += "],";
+    }
+    char head[96];
+    snprintf(head, sizeof(head), "\"debounceMs\":%lu,\"debounceMode\":\"%s\",\"states\":[",
+             (unsigned long)(4 + replay_random(60)), replay_random(2) ? "stable" : "leading");
+    json += head;
+
+    // Where the flaw goes
+    uint32_t flawState = replay_random(config.states);
+    bool flawPlaced = false;
+    for (uint32_t i = 0; i < config.states; i++) {
+        char state[160];
+        snprintf(state, sizeof(state), "%s{\"id\":%lu,\"audioFile\":\"%s\",\"repeat\":%s,\"blinkCount\":%lu,\"transitions\":[",
+                 i ? "," : "", (unsigned long)i, replay_random(3) ? "/audio.wav" : "", replay_random(4) ? "false" : "true",
+                 (unsigned long)replay_random(5));
+        json += state;
+        uint32_t count = replay_random(most + 1);
+        if (i == flawState && count == 0) {
+            count = 1;
+        }
+        for (uint32_t j = 0; j < count; j++) {
+            bool flawHere = i == flawState && j == 0 && config.flaw != FLAW_NONE && config.flaw != FLAW_INPUT_GPIO;
+            std::string target = std::to_string(replay_random(config.states));
+            if (flawHere && config.flaw == FLAW_TARGET_HIGH) {
+                target = std::to_string(config.states + replay_random(300));
+            } else if (flawHere && config.flaw == FLAW_TARGET_NEGATIVE) {
+                target = "-1";
+            } else if (flawHere && config.flaw == FLAW_TARGET_TEXT) {
+                target = "\"1\"";
+            }
+            json += (j ? "," : "");
+            json += flawHere && config.flaw == FLAW_TARGET_MISSING ? "{" : "{\"targetState\":" + target + ",";
+            json += "\"conditions\":[";
+            uint32_t conditions = replay_random(20) ? 1 + replay_random(3) : 0;     // unconditional now and then
+            for (uint32_t k = 0; k < conditions; k++) {
+                json += (k ? "," : "") + fuzz_condition(inputs, 2);
+            }
+            if (flawHere && config.flaw >= FLAW_SENSOR_HIGH && config.flaw <= FLAW_DURATION) {
+                std::string bad;
+                if (config.flaw == FLAW_SENSOR_HIGH) {
+                    bad = "{\"type\":\"SENSOR\",\"data\":{\"sensorPin\":" + std::to_string(inputs + replay_random(300)) +
+                          ",\"state\":false}}";
+                } else if (config.flaw == FLAW_SENSOR_NEGATIVE) {
+                    bad = "{\"type\":\"SENSOR\",\"data\":{\"sensorPin\":-2,\"state\":false}}";
+                } else if (config.flaw == FLAW_SENSOR_MISSING) {
+                    bad = "{\"type\":\"SENSOR\",\"data\":{\"state\":false}}";
+                } else if (config.flaw == FLAW_GROUP_SENSOR) {
+                    bad = "{\"type\":\"ANY\",\"conditions\":[{\"type\":\"SENSOR\",\"data\":{\"sensorPin\":" +
+                          std::to_string(replay_random(2) ? FSM_MAX_INPUTS + replay_random(300) : inputs) + ",\"state\":true}}]}";
+                } else {
+                    bad = "{\"type\":\"TIME_PASSED\",\"data\":{\"duration\":-5}}";
+                    if (replay_random(2)) {
+                        bad = "{\"type\":\"ALL\",\"conditions\":[" + bad + "]}";
+                    }
+                }
+                json += (conditions ? "," : "") + bad;
+            }
+            json += "],\"actions\":[";
+            if (replay_random(3) == 0) {
+                json += "{\"var\":" + std::to_string(replay_random(4)) + ",\"add\":1}";
+            }
+            json += "]}";
+            config.transitions++;
+            flawPlaced = flawPlaced || flawHere;
+        }
+        json += "]}";
+    }
+    json += "]}";
+    if (config.flaw != FLAW_INPUT_GPIO && !flawPlaced) {
+        config.flaw = FLAW_NONE;
+    }
+    config.json = json;
+    return config;
+}
+
+// What a child sends back about one config
+struct FuzzResult {
+    uint8_t loaded;
+    uint8_t busy;
+    float typicalNs;                // Median host ns of an update(), a reload by the reset button doesn't move it
+    float maxNs;
+};
+
+// Loads and runs one config in a child process, so a crash or a hang is
+// caught and the next config starts from a clean slate. False if the child
+// didn't come back with a result, signal says how it ended.
+static bool fuzz_run(const char* dir, FuzzResult& result, int& signal) {
+    int pipes[2];
+    if (pipe(pipes) != 0) {
+        perror("pipe");
+        exit(1);
+    }
+    pid_t pid = fork();
+    if (pid == 0) {
+        close(pipes[0]);
+        alarm(FUZZ_TIMEOUT_S);
+        FuzzResult r = {};
+        FSM fsm;
+        std::string text;
+        if (load(fsm, dir, text)) {
+            r.loaded = 1;
+            ReplayOptions options = {{}, FUZZ_SHOW_S, FUZZ_SHOW_S, 3000, true};
+            ReplayStats stats;
+            run_replay(fsm, options, stats);
+            std::sort(stats.updateNs.begin(), stats.updateNs.end());
+            r.busy = stats.busy;
+            r.typicalNs = stats.updateNs.empty() ? 0 : stats.updateNs[stats.updateNs.size() / 2];
+            r.maxNs = stats.updateNs.empty() ? 0 : stats.updateNs.back();
+        }
+        ssize_t written = write(pipes[1], &r, sizeof(r));
+        _exit(written == sizeof(r) ? 0 : 1);
+    }
+    close(pipes[1]);
+    ssize_t got = read(pipes[0], &result, sizeof(result));
+    close(pipes[0]);
+    int status = 0;
+    waitpid(pid, &status, 0);
+    signal = WIFSIGNALED(status) ? WTERMSIG(status) : 0;
+    return got == sizeof(result) && signal == 0;
+}
+
+static void save(const std::string& out, const std::string& name, const std::string& json) {
+    std::string path = out + "/" + name;
+    FILE* f = fopen(path.c_str(), "wb");
+    if (!f || fwrite(json.data(), 1, json.size(), f) != json.size() || fclose(f) != 0) {
+        perror(path.c_str());
+        return;
+    }
+    printf("  saved %s\n", path.c_str());
+}
+
+static int fuzz(unsigned long count, const std::string& out) {
+    char dir[] = "/tmp/fsm_replay_XXXXXX";
+    if (!mkdtemp(dir)) {
+        perror("mkdtemp");
+        return 1;
+    }
+    std::string configPath = std::string(dir) + "/FSM_Config.json";
+    printf("Fuzzing %lu random configs, %d s of random presses each\n\n", count, FUZZ_SHOW_S);
+
+    unsigned long loaded = 0, refused = 0, crashes = 0, hangs = 0, acceptedFlaws = 0, busy = 0, found = 0;
+    unsigned long flawsTried[FLAW_COUNT] = {}, flawsAccepted[FLAW_COUNT] = {};
+    std::vector<std::pair<FuzzResult, FuzzConfig>> costs;  // of the configs that ran
+    replay_clock::time_point wallStart = replay_clock::now();
+
+    for (unsigned long i = 0; i < count; i++) {
+        FuzzConfig config = fuzz_config();
+        FILE* f = fopen(configPath.c_str(), "wb");
+        fputs(config.json.c_str(), f);
+        fclose(f);
+
+        FuzzResult result = {};
+        int signal = 0;
+        flawsTried[config.flaw]++;
+        if (!fuzz_run(dir, result, signal)) {
+            bool hang = signal == SIGALRM;
+            (hang ? hangs : crashes)++;
+            printf("config %lu: %s (%s), %u states, %u transitions\n", i, hang ? "hung" : "crashed",
+                   signal ? strsignal(signal) : "no result", config.states, config.transitions);
+            save(out, std::string(hang ? "fuzz_hang_" : "fuzz_crash_") + std::to_string(found++) + ".json", config.json);
+            continue;
+        }
+        if (!result.loaded) {
+            refused++;
+            if (config.flaw == FLAW_NONE) {
+                printf("config %lu: a good config was refused\n", i);
+                save(out, "fuzz_refused_" + std::to_string(found++) + ".json", config.json);
+            }
+            continue;
+        }
+        loaded++;
+        if (config.flaw != FLAW_NONE) {
+            acceptedFlaws++;
+            flawsAccepted[config.flaw]++;
+            printf("config %lu: loaded with a %s\n", i, flaw_names[config.flaw]);
+            save(out, "fuzz_accepted_" + std::to_string(found++) + ".json", config.json);
+        }
+        if (result.busy) {
+            busy++;
+            printf("config %lu: busy without time passing\n", i);
+            save(out, "fuzz_busy_" + std::to_string(found++) + ".json", config.json);
+            continue;
+        }
+        costs.push_back(std::make_pair(result, config));
+    }
+
+    // Cliffs: a typical update() far slower than most configs'
+    std::sort(costs.begin(), costs.end(), [](const std::pair<FuzzResult, FuzzConfig>& a,
+                                             const std::pair<FuzzResult, FuzzConfig>& b) {
+        return a.first.typicalNs > b.first.typicalNs;
+    });
+    float median = costs.empty() ? 0 : costs[costs.size() / 2].first.typicalNs;
+    unsigned long cliffs = 0;
+    printf("\nslowest configs, typical and longest update() in host ns (typical of all %.0f):\n", median);
+    for (size_t k = 0; k < costs.size() && k < 5; k++) {
+        bool cliff = costs[k].first.typicalNs > FUZZ_SLOW_FACTOR * median;
+        printf("%10.0f %10.0f ns  %3u states, %4u transitions%s\n", costs[k].first.typicalNs, costs[k].first.maxNs,
+               costs[k].second.states, costs[k].second.transitions, cliff ? "  << cliff" : "");
+        if (cliff) {
+            cliffs++;
+            save(out, "fuzz_slow_" + std::to_string(found++) + ".json", costs[k].second.json);
+        }
+    }
+
+    printf("\n%-22s %8s %8s\n", "flaw", "tried", "loaded");
+    for (uint8_t k = 1; k < FLAW_COUNT; k++) {
+        printf("%-22s %8lu %8lu\n", flaw_names[k], flawsTried[k], flawsAccepted[k]);
+    }
+    double wall = std::chrono::duration<double>(replay_clock::now() - wallStart).count();
+    printf("\n%lu configs in %.1f s: %lu ran, %lu refused, %lu crashed, %lu hung, %lu loaded with a flaw, "
+           "%lu busy without time passing, %lu cliffs\n",
+           count, wall, loaded, refused, crashes, hangs, acceptedFlaws, busy, cliffs);
+
+    unlink(configPath.c_str());
+    rmdir(dir);
+    return crashes || hangs || acceptedFlaws ? 1 : 0;
+}
+
+int main(int argc, char** argv) {
+    const char* dir = nullptr;
+    const char* tracePath = nullptr;
+    ReplayOptions options = {{}, 0, 0, -1, false};
+    bool verbose = false;
+    unsigned long fuzzCount = 0;
+    std::string out = ".";
+    bool ok = true;
+
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        bool more = i + 1 < argc;
+        if (arg == "--trace" && more) tracePath = argv[++i];
+        else if (arg == "--random" && more) options.randomS = atof(argv[++i]);
+        else if (arg == "--until" && more) options.untilS = atof(argv[++i]);
+        else if (arg == "--audio" && more) options.audioMs = atol(argv[++i]);
+        else if (arg == "--seed" && more) replay_seed = strtoul(argv[++i], nullptr, 10);
+        else if (arg == "--fuzz" && more) fuzzCount = strtoul(argv[++i], nullptr, 10);
+        else if (arg == "--out" && more) out = argv[++i];
+        else if (arg == "--quiet") options.quiet = true;
+        else if (arg == "--verbose") verbose = true;
+        else if (arg[0] != '-' && !dir) dir = argv[i];
+        else ok = false;
+    }
+    if (!ok || (!dir && !fuzzCount)) {
+        fprintf(stderr, "usage: %s <card dir> [--trace <file>] [--random <s>] [--until <s>] [--audio <ms>] [--seed <n>] "
+                        "[--quiet] [--verbose]\n       %s --fuzz <configs> [--seed <n>] [--out <dir>]\n",
+                argv[0], argv[0]);
+        return 2;
+    }
+    native_serial_output(nullptr);
+    leds.begin();
+
+    if (fuzzCount) {
+        return fuzz(fuzzCount, out);
+    }
+    if (tracePath && !read_trace(tracePath, options.trace)) {
+        return 1;
+    }
+    if (!tracePath && options.randomS <= 0) {
+        options.randomS = 600;                          // ten minutes of visitors
+    }
+
+    FSM fsm;
+    std::string text;
+    bool loaded = load(fsm, dir, text);
+    if (verbose || !loaded) {
+        fputs(text.c_str(), loaded ? stdout : stderr);
+    }
+    if (!loaded) {
+        fprintf(stderr, "%s: no config could be loaded\n", dir);
+        return 1;
+    }
+    print_analysis(fsm.getTable());
+    printf("\n");
+
+    ReplayStats stats;
+    run_replay(fsm, options, stats);
+    print_stats(stats);
+    return 0;
+}
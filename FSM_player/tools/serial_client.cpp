@@ -0,0 +1,187 @@
+#include <Arduino.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <termios.h>
+#include <unistd.h>
+#include <chrono>
+#include "serial_client.h"
+#include "fsm_image.h"
+
+// Print that appends to a vector, what SerialWriter encodes into
+class ByteSink : public Print {
+    public:
+        explicit ByteSink(std::vector<uint8_t>& bytes) : bytes(bytes) {}
+        size_t write(uint8_t byte) override {
+            bytes.push_back(byte);
+            return 1;
+        }
+        size_t write(const uint8_t* data, size_t size) override {
+            bytes.insert(bytes.end(), data, data + size);
+            return size;
+        }
+
+    private:
+        std::vector<uint8_t>& bytes;
+};
+
+std::vector<uint8_t> SerialClient::command(uint8_t type, const void* body, size_t size) {
+    seq = seq == 255 ? 1 : seq + 1;                 // 0 is for pushes
+    std::vector<uint8_t> bytes;
+    ByteSink sink(bytes);
+    SerialWriter writer(sink);
+    writer.begin(type, seq);
+    writer.write((const uint8_t*)body, size);
+    writer.end();
+    return bytes;
+}
+
+std::vector<uint8_t> SerialClient::input(uint8_t input, uint8_t level) {
+    SerialInputBody body = {input, level};
+    return command(SERIAL_INPUT, &body, sizeof(body));
+}
+
+std::vector<uint8_t> SerialClient::setState(uint8_t state) {
+    SerialSetStateBody body = {state};
+    return command(SERIAL_SET_STATE, &body, sizeof(body));
+}
+
+std::vector<uint8_t> SerialClient::subscribe(bool on) {
+    SerialSubscribeBody body = {(uint8_t)on};
+    return command(SERIAL_SUBSCRIBE, &body, sizeof(body));
+}
+
+// Undoes the COBS encoding of a frame, false if it is broken
+static bool cobs_decode(const std::vector<uint8_t>& in, std::vector<uint8_t>& out) {
+    out.clear();
+    size_t i = 0;
+    uint8_t lastCode = 0xFF;
+    while (i < in.size()) {
+        if (lastCode != 0xFF) {
+            out.push_back(0);
+        }
+        uint8_t code = in[i++];
+        if (i + code - 1 > in.size()) {
+            return false;
+        }
+        out.insert(out.end(), in.begin() + i, in.begin() + i + code - 1);
+        i += code - 1;
+        lastCode = code;
+    }
+    return true;
+}
+
+void SerialClient::receive(const uint8_t* data, size_t size) {
+    for (size_t i = 0; i < size; i++) {
+        uint8_t byte = data[i];
+        if (byte != 0) {
+            if (inFrame) {
+                frame.push_back(byte);
+            } else {
+                text += (char)byte;
+            }
+            continue;
+        }
+        if (!inFrame || frame.empty()) {
+            inFrame = true;                         // opens a frame, or a zero between frames
+            continue;
+        }
+        inFrame = false;
+        std::vector<uint8_t> decoded;
+        uint32_t crc;
+        if (!cobs_decode(frame, decoded) || decoded.size() < sizeof(SerialHeader) + sizeof(crc)) {
+            badFrames++;
+        } else {
+            size_t length = decoded.size() - sizeof(crc);
+            memcpy(&crc, &decoded[length], sizeof(crc));
+            if (fsm_crc32(decoded.data(), length) != crc) {
+                badFrames++;
+            } else {
+                SerialMessage message = {decoded[0], decoded[1],
+                                         std::vector<uint8_t>(decoded.begin() + sizeof(SerialHeader), decoded.begin() + length)};
+                messages.push_back(message);
+            }
+        }
+        frame.clear();
+    }
+}
+
+bool SerialClient::take(uint8_t want, SerialMessage& message) {
+    for (auto it = messages.begin(); it != messages.end(); ++it) {
+        if (it->seq == want) {
+            message = *it;
+            messages.erase(it);
+            return true;
+        }
+    }
+    return false;
+}
+
+std::string SerialClient::takeText() {
+    std::string taken;
+    taken.swap(text);
+    return taken;
+}
+
+// A body of a fixed size, copied out
+template <typename T>
+static bool body_of(const SerialMessage& message, uint8_t type, T& body) {
+    if (message.type != type || message.body.size() != sizeof(T)) {
+        return false;
+    }
+    memcpy(&body, message.body.data(), sizeof(T));
+    return true;
+}
+
+bool serial_ack(const SerialMessage& message, SerialAckBody& ack) { return body_of(message, SERIAL_ACK, ack); }
+bool serial_pong(const SerialMessage& message, SerialPongBody& pong) { return body_of(message, SERIAL_PONG, pong); }
+bool serial_status(const SerialMessage& message, SerialStatusBody& status) { return body_of(message, SERIAL_STATUS, status); }
+
+int serial_client_open(const char* path) {
+    int fd = open(path, O_RDWR | O_NOCTTY);
+    if (fd < 0) {
+        perror(path);
+        return -1;
+    }
+    struct termios tty;
+    if (tcgetattr(fd, &tty) == 0) {
+        cfmakeraw(&tty);
+        cfsetspeed(&tty, B115200);
+        tty.c_cc[VMIN] = 0;
+        tty.c_cc[VTIME] = 0;
+        tcsetattr(fd, TCSANOW, &tty);
+    }
+    tcflush(fd, TCIFLUSH);
+    return fd;
+}
+
+bool serial_client_poll(int fd, SerialClient& client, int waitMs) {
+    struct pollfd p = {fd, POLLIN, 0};
+    if (poll(&p, 1, waitMs) < 0) {
+        return false;
+    }
+    if (p.revents & POLLIN) {
+        uint8_t buffer[512];
+        ssize_t n = read(fd, buffer, sizeof(buffer));
+        if (n < 0) {
+            return false;
+        }
+        client.receive(buffer, n);
+    }
+    return true;
+}
+
+bool serial_client_call(int fd, SerialClient& client, const std::vector<uint8_t>& command, SerialMessage& reply,
+                        int timeoutMs) {
+    uint8_t seq = client.lastSeq();
+    if (write(fd, command.data(), command.size()) != (ssize_t)command.size()) {
+        return false;
+    }
+    auto end = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutMs);
+    while (!client.take(seq, reply)) {
+        int left = std::chrono::duration_cast<std::chrono::milliseconds>(end - std::chrono::steady_clock::now()).count();
+        if (left <= 0 || !serial_client_poll(fd, client, left)) {
+            return false;
+        }
+    }
+    return true;
+}
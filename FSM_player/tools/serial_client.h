@@ -0,0 +1,79 @@
+#ifndef SERIAL_CLIENT_H
+#define SERIAL_CLIENT_H
+
+// Host side of the player's binary serial protocol (src/serial_protocol.h),
+// for a show controller or a test.
+//
+// SerialClient turns commands into the bytes to send and the bytes the
+// player sends back into messages and text; how the bytes get to the player
+// is up to the caller. serial_client_open() and serial_client_call() do it
+// over a serial port, the loopback bench in bench/bench_serial.cpp through
+// the stand-in serial port of env:native.
+
+#include <stdint.h>
+#include <deque>
+#include <string>
+#include <vector>
+#include "serial_protocol.h"
+
+struct SerialMessage {
+    uint8_t type;                   // SerialMessageType
+    uint8_t seq;                    // Of the command answered, 0 for a push
+    std::vector<uint8_t> body;
+};
+
+class SerialClient {
+    public:
+        SerialClient() : seq(0), inFrame(false), badFrames(0) {}
+
+        // The bytes of a command, with the next sequence number (1 to 255, lastSeq() says which)
+        std::vector<uint8_t> command(uint8_t type, const void* body = nullptr, size_t size = 0);
+        std::vector<uint8_t> ping() { return command(SERIAL_PING); }
+        std::vector<uint8_t> input(uint8_t input, uint8_t level);
+        std::vector<uint8_t> setState(uint8_t state);
+        std::vector<uint8_t> query() { return command(SERIAL_QUERY); }
+        std::vector<uint8_t> subscribe(bool on);
+        std::vector<uint8_t> telemetry() { return command(SERIAL_TELEMETRY); }
+        std::vector<uint8_t> reload() { return command(SERIAL_RELOAD); }
+        uint8_t lastSeq() const { return seq; }
+
+        // Takes bytes the player sent, in pieces of any size. Messages that
+        // check out are queued, text outside them is kept for takeText().
+        void receive(const uint8_t* data, size_t size);
+
+        // Takes the reply to seq out of the queue, or the oldest message with seq 0
+        bool take(uint8_t seq, SerialMessage& message);
+        bool next(SerialMessage& message) { return take(0, message); }
+
+        // Text the player printed since the last call
+        std::string takeText();
+
+        // Frames that failed their CRC or didn't decode
+        uint32_t getBadFrames() const { return badFrames; }
+
+    private:
+        uint8_t seq;
+        bool inFrame;
+        std::vector<uint8_t> frame;     // Encoded bytes of the frame coming in
+        std::deque<SerialMessage> messages;
+        std::string text;
+        uint32_t badFrames;
+};
+
+// Bodies of the player's messages, false if message isn't one of that type
+bool serial_ack(const SerialMessage& message, SerialAckBody& ack);
+bool serial_pong(const SerialMessage& message, SerialPongBody& pong);
+bool serial_status(const SerialMessage& message, SerialStatusBody& status);
+
+// Opens a serial port raw at 115200 baud, -1 if it can't be
+int serial_client_open(const char* path);
+
+// Sends command, the last one client made, and waits up to timeoutMs for
+// its reply. Pushes and other replies that come in meanwhile stay queued in client.
+bool serial_client_call(int fd, SerialClient& client, const std::vector<uint8_t>& command, SerialMessage& reply,
+                        int timeoutMs = 1000);
+
+// Reads what the port has for up to waitMs into client, false on an error
+bool serial_client_poll(int fd, SerialClient& client, int waitMs);
+
+#endif // SERIAL_CLIENT_H
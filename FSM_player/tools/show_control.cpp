@@ -0,0 +1,142 @@
+// Talks to the player over its binary serial protocol (env:show_control),
+// what a show controller would do, from the command line.
+//
+//   pio run -e show_control
+//   .pio/build/show_control/program /dev/ttyACM0 <command>
+//
+//   ping                      round trip time and the player's protocol version
+//   status                    state, time in it, inputs, audio, show timers and variables
+//   state <n>                 go to state n now
+//   press <input>             hold a sensor input low, as a switch to ground pressed
+//   hold <input> low|high     hold a sensor input at a level
+//   release <input>           hand the input back to its pin
+//   reload                    reload the config from the card
+//   watch [seconds]           print the status the player pushes on every change
+//   telemetry <file>          save a telemetry dump, for telemetry_decode
+//
+// See src/serial_protocol.h for the protocol, tools/serial_client.h for the
+// client side of it.
+
+#include <Arduino.h>
+#include <chrono>
+#include <string>
+#include "serial_client.h"
+
+static const char* result_names[] = {"ok", "unknown command", "bad length", "no such input or state", "no config loaded"};
+static const char* reason_names[] = {"status", "state entered", "audio finished", "config reloaded"};
+
+static void print_status(const SerialStatusBody& s) {
+    printf("%-15s state %u of %u, %lu ms in it, audio %s %lu ms, %lu transitions\n",
+           s.reason < 4 ? reason_names[s.reason] : "?", s.state, s.numStates, (unsigned long)s.inStateMs,
+           s.audioDone ? "finished after" : "playing for", (unsigned long)s.audioMs, (unsigned long)s.transitions);
+    if (s.reason != SERIAL_REASON_QUERY) {
+        return;
+    }
+    printf("inputs 0x%08lX, held 0x%08lX, pushes dropped %u\n", (unsigned long)s.inputs, (unsigned long)s.held,
+           s.pushesDropped);
+    printf("timers (us left):");
+    for (uint8_t i = 0; i < FSM_MAX_TIMERS; i++) {
+        printf(" %lu", (unsigned long)s.timers[i]);
+    }
+    printf("\nvariables:");
+    for (uint8_t i = 0; i < FSM_MAX_VARS; i++) {
+        printf(" %ld", (long)s.vars[i]);
+    }
+    printf("\n");
+}
+
+// Sends a command that is answered with SERIAL_ACK and reports the result
+static int acked(int fd, SerialClient& client, const std::vector<uint8_t>& command) {
+    SerialMessage reply;
+    SerialAckBody ack;
+    if (!serial_client_call(fd, client, command, reply) || !serial_ack(reply, ack)) {
+        fprintf(stderr, "no answer\n");
+        return 1;
+    }
+    printf("%s\n", ack.result < 5 ? result_names[ack.result] : "?");
+    return ack.result == SERIAL_OK ? 0 : 1;
+}
+
+int main(int argc, char** argv) {
+    if (argc < 3) {
+        fprintf(stderr, "usage: %s <serial port> ping|status|state <n>|press <input>|hold <input> low|high|"
+                        "release <input>|reload|watch [seconds]|telemetry <file>\n", argv[0]);
+        return 2;
+    }
+    int fd = serial_client_open(argv[1]);
+    if (fd < 0) {
+        return 1;
+    }
+    std::string what = argv[2];
+    long arg = argc > 3 ? atol(argv[3]) : 0;
+    SerialClient client;
+    SerialMessage reply;
+
+    if (what == "ping") {
+        auto start = std::chrono::steady_clock::now();
+        SerialPongBody pong;
+        if (!serial_client_call(fd, client, client.ping(), reply) || !serial_pong(reply, pong)) {
+            fprintf(stderr, "no answer\n");
+            return 1;
+        }
+        double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        printf("protocol %u, %.2f ms round trip, %u bad frames seen by the player\n", pong.version, ms, pong.badFrames);
+        return 0;
+    }
+    if (what == "status") {
+        SerialStatusBody status;
+        if (!serial_client_call(fd, client, client.query(), reply) || !serial_status(reply, status)) {
+            fprintf(stderr, "no answer\n");
+            return 1;
+        }
+        print_status(status);
+        return 0;
+    }
+    if (what == "state" && argc > 3) {
+        return acked(fd, client, client.setState(arg));
+    }
+    if (what == "press" && argc > 3) {
+        return acked(fd, client, client.input(arg, SERIAL_LEVEL_LOW));
+    }
+    if (what == "hold" && argc > 4) {
+        return acked(fd, client, client.input(arg, strcmp(argv[4], "high") == 0 ? SERIAL_LEVEL_HIGH : SERIAL_LEVEL_LOW));
+    }
+    if (what == "release" && argc > 3) {
+        return acked(fd, client, client.input(arg, SERIAL_LEVEL_RELEASE));
+    }
+    if (what == "reload") {
+        return acked(fd, client, client.reload());
+    }
+    if (what == "watch") {
+        if (acked(fd, client, client.subscribe(true))) {
+            return 1;
+        }
+        auto end = std::chrono::steady_clock::now() + std::chrono::seconds(arg ? arg : 3600);
+        while (std::chrono::steady_clock::now() < end && serial_client_poll(fd, client, 100)) {
+            SerialStatusBody status;
+            while (client.next(reply)) {
+                if (serial_status(reply, status)) {
+                    print_status(status);
+                }
+            }
+        }
+        std::vector<uint8_t> off = client.subscribe(false);
+        return serial_client_call(fd, client, off, reply) ? 0 : 1;
+    }
+    if (what == "telemetry" && argc > 3) {
+        if (!serial_client_call(fd, client, client.telemetry(), reply) || reply.type != SERIAL_TELEMETRY_DUMP) {
+            fprintf(stderr, "no answer\n");
+            return 1;
+        }
+        FILE* f = fopen(argv[3], "wb");
+        if (!f || fwrite(reply.body.data(), 1, reply.body.size(), f) != reply.body.size()) {
+            perror(argv[3]);
+            return 1;
+        }
+        fclose(f);
+        printf("%zu bytes, decode with telemetry_decode %s\n", reply.body.size(), argv[3]);
+        return 0;
+    }
+    fprintf(stderr, "%s: unknown command\n", what.c_str());
+    return 2;
+}
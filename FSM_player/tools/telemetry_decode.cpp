@@ -0,0 +1,244 @@
+// Decodes the player's telemetry dump (env:telemetry_decode).
+//
+//   pio run -e telemetry_decode
+//   .pio/build/telemetry_decode/program /dev/ttyACM0    asks the player for a dump
+//   .pio/build/telemetry_decode/program dump.bin        a dump saved earlier
+//   add --save <file> to keep the raw frame
+//
+// Prints the counters, a summary and the buckets of every histogram and the
+// events since the last dump, oldest first. The frame is found by its magic,
+// so text the player printed before it doesn't matter, and checked against
+// its CRC. See telemetry.h for the format.
+
+#include <Arduino.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <termios.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "telemetry.h"
+#include "fsm_image.h"
+
+static const char* metric_names[TELEMETRY_METRICS] = {
+    "update_us", "jitter_us", "input_us", "sd_read_us", "audio_fill_%", "journal_us"
+};
+
+// Offset of a complete frame in bytes, -1 if there is none (yet)
+static long find_frame(const std::vector<uint8_t>& bytes) {
+    for (size_t i = 0; i + sizeof(TelemetryDumpHeader) <= bytes.size(); i++) {
+        TelemetryDumpHeader header;
+        memcpy(&header, &bytes[i], sizeof(header));
+        if (header.magic == TELEMETRY_MAGIC && i + header.size <= bytes.size()) {
+            return (long)i;
+        }
+    }
+    return -1;
+}
+
+// Sends the command to the player and reads until a frame is in, or 3 s pass
+static bool read_port(const char* path, std::vector<uint8_t>& bytes) {
+    int fd = open(path, O_RDWR | O_NOCTTY);
+    if (fd < 0) {
+        perror(path);
+        return false;
+    }
+    struct termios tty;
+    if (tcgetattr(fd, &tty) == 0) {
+        cfmakeraw(&tty);
+        cfsetspeed(&tty, B115200);
+        tty.c_cc[VMIN] = 0;
+        tty.c_cc[VTIME] = 1;            // reads return after 100 ms without data
+        tcsetattr(fd, TCSANOW, &tty);
+    }
+    tcflush(fd, TCIFLUSH);
+    const char command[] = "telemetry\n";
+    if (write(fd, command, sizeof(command) - 1) != (ssize_t)sizeof(command) - 1) {
+        perror(path);
+        close(fd);
+        return false;
+    }
+    uint8_t buffer[512];
+    for (int idle = 0; idle < 30 && find_frame(bytes) < 0;) {
+        ssize_t n = read(fd, buffer, sizeof(buffer));
+        if (n > 0) {
+            bytes.insert(bytes.end(), buffer, buffer + n);
+            idle = 0;
+        } else {
+            idle++;
+        }
+    }
+    close(fd);
+    return true;
+}
+
+static bool read_file(const char* path, std::vector<uint8_t>& bytes) {
+    FILE* f = fopen(path, "rb");
+    if (!f) {
+        perror(path);
+        return false;
+    }
+    uint8_t buffer[4096];
+    size_t n;
+    while ((n = fread(buffer, 1, sizeof(buffer), f)) > 0) {
+        bytes.insert(bytes.end(), buffer, buffer + n);
+    }
+    fclose(f);
+    return true;
+}
+
+// Upper end of bucket b, as the percentiles are given
+static std::string bucket_bound(uint8_t b) {
+    if (b == 0) {
+        return "0";
+    }
+    if (b == TELEMETRY_BUCKETS - 1) {
+        return ">=" + std::to_string(1UL << (b - 1));
+    }
+    return "<" + std::to_string(1UL << b);
+}
+
+static std::string percentile(const TelemetryHistogram& h, double p) {
+    uint64_t want = (uint64_t)(h.count * p + 0.999999);
+    uint64_t seen = 0;
+    for (uint8_t b = 0; b < TELEMETRY_BUCKETS; b++) {
+        seen += h.buckets[b];
+        if (seen >= want && h.buckets[b]) {
+            return bucket_bound(b);
+        }
+    }
+    return "-";
+}
+
+static void print_record(const TelemetryRecord& r, uint32_t now) {
+    printf("%12.6f  ", (now - r.us) / 1e6);
+    switch (r.event) {
+        case TELEMETRY_TRANSITION:
+            printf("transition %u -> %u", r.a, r.b);
+            if (r.value) {
+                printf(", %lu us after the input changed", (unsigned long)r.value);
+            }
+            break;
+        case TELEMETRY_RELOAD:
+            if (r.a) {
+                printf("config reloaded, %u states, in state %lu", r.b, (unsigned long)r.value);
+            } else {
+                printf("config reload failed, kept the running one");
+            }
+            break;
+        case TELEMETRY_AUDIO_FAILED:
+            printf("audio play %u failed", r.b);
+            break;
+        case TELEMETRY_UNDERRUN:
+            printf("audio output underrun, %lu so far", (unsigned long)r.value);
+            break;
+        case TELEMETRY_READ_FAILED:
+            printf("audio read from the card failed");
+            break;
+        case TELEMETRY_PREFETCH_FAILED:
+            printf("audio prefetch from the card failed");
+            break;
+        default:
+            printf("event %u (%u, %u, %lu)", r.event, r.a, r.b, (unsigned long)r.value);
+            break;
+    }
+    printf("\n");
+}
+
+int main(int argc, char** argv) {
+    const char* source = nullptr;
+    const char* save = nullptr;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--save") == 0 && i + 1 < argc) {
+            save = argv[++i];
+        } else {
+            source = argv[i];
+        }
+    }
+    if (!source) {
+        fprintf(stderr, "usage: %s [--save <file>] <serial port or dump file>\n", argv[0]);
+        return 2;
+    }
+
+    std::vector<uint8_t> bytes;
+    struct stat st;
+    bool port = stat(source, &st) == 0 && S_ISCHR(st.st_mode);
+    if (!(port ? read_port(source, bytes) : read_file(source, bytes))) {
+        return 1;
+    }
+    long at = find_frame(bytes);
+    if (at < 0) {
+        fprintf(stderr, "%s: no telemetry frame\n", source);
+        return 1;
+    }
+
+    const uint8_t* frame = &bytes[at];
+    TelemetryDumpHeader header;
+    memcpy(&header, frame, sizeof(header));
+    uint32_t crc;
+    memcpy(&crc, frame + header.size - sizeof(crc), sizeof(crc));
+    if (header.version != TELEMETRY_VERSION || header.headerSize != sizeof(header) ||
+        header.numMetrics != TELEMETRY_METRICS || header.numBuckets != TELEMETRY_BUCKETS ||
+        header.size != sizeof(header) + TELEMETRY_METRICS * sizeof(TelemetryHistogram) +
+                       header.numRecords * sizeof(TelemetryRecord) + sizeof(crc)) {
+        fprintf(stderr, "%s: telemetry frame of another firmware version\n", source);
+        return 1;
+    }
+    if (fsm_crc32(frame, header.size - sizeof(crc)) != crc) {
+        fprintf(stderr, "%s: telemetry frame damaged (CRC)\n", source);
+        return 1;
+    }
+    if (save) {
+        FILE* f = fopen(save, "wb");
+        if (!f || fwrite(frame, 1, header.size, f) != header.size) {
+            perror(save);
+            return 1;
+        }
+        fclose(f);
+    }
+
+    printf("Telemetry at %.6f s after boot (the clock wraps every 71 minutes)\n\n", header.us / 1e6);
+    printf("transitions %lu, reloads %lu, underruns %lu, events dropped %lu (fsm) %lu (audio)\n",
+           (unsigned long)header.counters[TELEMETRY_TRANSITIONS], (unsigned long)header.counters[TELEMETRY_RELOADS],
+           (unsigned long)header.counters[TELEMETRY_UNDERRUNS], (unsigned long)header.counters[TELEMETRY_DROPPED_FSM],
+           (unsigned long)header.counters[TELEMETRY_DROPPED_AUDIO]);
+
+    std::vector<TelemetryHistogram> histograms(TELEMETRY_METRICS);
+    memcpy(histograms.data(), frame + sizeof(header), TELEMETRY_METRICS * sizeof(TelemetryHistogram));
+    printf("\n%-14s %10s %10s %9s %9s %9s %10s\n", "metric", "count", "mean", "p50", "p90", "p99", "max");
+    for (uint8_t m = 0; m < TELEMETRY_METRICS; m++) {
+        const TelemetryHistogram& h = histograms[m];
+        printf("%-14s %10lu %10.1f %9s %9s %9s %10lu\n", metric_names[m], (unsigned long)h.count,
+               h.count ? (double)h.sum / h.count : 0.0, percentile(h, 0.5).c_str(), percentile(h, 0.9).c_str(),
+               percentile(h, 0.99).c_str(), (unsigned long)h.max);
+    }
+    for (uint8_t m = 0; m < TELEMETRY_METRICS; m++) {
+        const TelemetryHistogram& h = histograms[m];
+        if (!h.count) {
+            continue;
+        }
+        printf("\n%s\n", metric_names[m]);
+        uint32_t most = *std::max_element(h.buckets, h.buckets + TELEMETRY_BUCKETS);
+        for (uint8_t b = 0; b < TELEMETRY_BUCKETS; b++) {
+            if (h.buckets[b]) {
+                std::string low = b == 0 ? "0" : std::to_string(1UL << (b - 1));
+                printf("  %8s %-9s %10lu  %s\n", low.c_str(), bucket_bound(b).c_str(), (unsigned long)h.buckets[b],
+                       std::string((size_t)(40.0 * h.buckets[b] / most + 0.5), '#').c_str());
+            }
+        }
+    }
+
+    // Both rings, oldest first
+    std::vector<TelemetryRecord> records(header.numRecords);
+    memcpy(records.data(), frame + sizeof(header) + TELEMETRY_METRICS * sizeof(TelemetryHistogram),
+           header.numRecords * sizeof(TelemetryRecord));
+    std::stable_sort(records.begin(), records.end(), [&](const TelemetryRecord& a, const TelemetryRecord& b) {
+        return header.us - a.us > header.us - b.us;
+    });
+    printf("\n%u events since the last dump\n%12s  %s\n", header.numRecords, "s ago", "event");
+    for (const TelemetryRecord& r : records) {
+        print_record(r, header.us);
+    }
+    return 0;
+}
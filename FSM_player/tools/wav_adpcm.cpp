@@ -0,0 +1,173 @@
+// Encodes a .wav file as IMA-ADPCM for the player (env:wav_adpcm).
+//
+//   pio run -e wav_adpcm
+//   .pio/build/wav_adpcm/program [--mono] [--rate <Hz>] in.wav out.wav
+//
+// Takes any .wav the player plays (8 to 32-bit PCM, mono or stereo, any
+// rate), optionally mixed down and resampled the way the player would, and
+// writes 4-bit IMA-ADPCM: a quarter of the card space and bandwidth of
+// 16-bit PCM. Prints the signal-to-noise ratio of the encoded audio against
+// its 16-bit input, decoded the way the player decodes it.
+
+#include <Arduino.h>
+#include <math.h>
+#include <string>
+#include <vector>
+#include "native_hal.h"
+#include "wav.h"
+#include "adpcm.h"
+#include "audio_convert.h"
+#include "FSM.h"
+
+static void put16(std::vector<uint8_t>& out, uint16_t v) {
+    out.push_back(v & 0xFF);
+    out.push_back(v >> 8);
+}
+
+static void put32(std::vector<uint8_t>& out, uint32_t v) {
+    put16(out, v & 0xFFFF);
+    put16(out, v >> 16);
+}
+
+// Reads the whole file as 16-bit frames through the player's converter
+static bool read_pcm(const char* path, uint32_t rate, bool mono, WavFormat& output, std::vector<int16_t>& samples) {
+    std::string full(path);
+    size_t slash = full.find_last_of('/');
+    native_sd_root(slash == std::string::npos ? "." : full.substr(0, slash + 1).c_str());
+    std::string name = "/" + (slash == std::string::npos ? full : full.substr(slash + 1));
+
+    File32 file = sd.open(name.c_str(), O_RDONLY);
+    WavFormat format;
+    const char* problem = file ? wav_parse(file, format) : "can't open";
+    static AudioConverter converter;
+    if (!problem && !converter.begin(format, rate, mono, output)) {
+        problem = "format can't be converted";
+    }
+    if (problem) {
+        fprintf(stderr, "%s: %s\n", path, problem);
+        return false;
+    }
+
+    std::vector<uint8_t> data(format.dataSize);
+    if (!file.seekSet(format.dataOffset) || file.read(data.data(), data.size()) != (int)data.size()) {
+        fprintf(stderr, "%s: read failed\n", path);
+        return false;
+    }
+    if (converter.isPassThrough()) {
+        // 16-bit already, the samples as they are
+        samples.resize(data.size() / 2);
+        memcpy(samples.data(), data.data(), samples.size() * 2);
+        return true;
+    }
+    int16_t block[AUDIO_CONVERT_FRAMES * 2];
+    size_t pos = 0;
+    while (true) {
+        size_t used;
+        size_t frames = converter.convert(data.data() + pos, data.size() - pos, block, AUDIO_CONVERT_FRAMES, used);
+        samples.insert(samples.end(), block, block + frames * output.channels);
+        pos += used;
+        if (frames == 0 && used == 0) {
+            return true;
+        }
+    }
+}
+
+int main(int argc, char** argv) {
+    bool mono = false;
+    uint32_t rate = 0;
+    int arg = 1;
+    for (; arg < argc && argv[arg][0] == '-'; arg++) {
+        if (strcmp(argv[arg], "--mono") == 0) {
+            mono = true;
+        } else if (strcmp(argv[arg], "--rate") == 0 && arg + 1 < argc) {
+            rate = strtoul(argv[++arg], nullptr, 10);
+        } else {
+            break;
+        }
+    }
+    if (argc - arg != 2) {
+        fprintf(stderr, "usage: %s [--mono] [--rate <Hz>] <in.wav> <out.wav>\n", argv[0]);
+        return 2;
+    }
+    const char* inPath = argv[arg];
+    const char* outPath = argv[arg + 1];
+
+    WavFormat format;
+    std::vector<int16_t> samples;
+    if (!read_pcm(inPath, rate, mono, format, samples)) {
+        return 1;
+    }
+    uint16_t channels = format.channels;
+    size_t frames = samples.size() / channels;
+    if (frames == 0) {
+        fprintf(stderr, "%s: no samples\n", inPath);
+        return 1;
+    }
+
+    // Blocks of the usual size for the rate, the last one as short as it can be
+    uint16_t blockAlign = adpcm_block_align(format.sampleRate, channels);
+    uint16_t perBlock = adpcm_samples_per_block(blockAlign, channels);
+    std::vector<uint8_t> data;
+    std::vector<uint8_t> block(blockAlign);
+    AdpcmChannel state[2] = {};
+    for (size_t first = 0; first < frames; first += perBlock) {
+        size_t count = frames - first < perBlock ? frames - first : perBlock;
+        size_t bytes = adpcm_encode_block(state, channels, &samples[first * channels], count, block.data());
+        data.insert(data.end(), block.begin(), block.begin() + bytes);
+    }
+
+    // Decode it again for the SNR
+    std::vector<int16_t> decoded(samples.size() + 8 * channels);
+    AdpcmChannel decoder[2];
+    size_t at = 0;
+    size_t frame = 0;
+    while (at < data.size()) {
+        size_t end = at + blockAlign < data.size() ? at + blockAlign : data.size();
+        for (uint16_t c = 0; c < channels; c++) {
+            decoded[frame * channels + c] = adpcm_begin_block(decoder[c], &data[at + 4 * c]);
+        }
+        frame++;
+        for (at += 4 * channels; at < end; at += 4 * channels, frame += 8) {
+            for (uint16_t c = 0; c < channels; c++) {
+                adpcm_decode_word(decoder[c], &data[at + 4 * c], 0, 8, &decoded[frame * channels + c], channels);
+            }
+        }
+    }
+    double signal = 0;
+    double noise = 0;
+    for (size_t i = 0; i < samples.size(); i++) {
+        double d = (double)samples[i] - decoded[i];
+        signal += (double)samples[i] * samples[i];
+        noise += d * d;
+    }
+
+    std::vector<uint8_t> out;
+    out.insert(out.end(), {'R', 'I', 'F', 'F'});
+    put32(out, 4 + 28 + 12 + 8 + data.size());
+    out.insert(out.end(), {'W', 'A', 'V', 'E', 'f', 'm', 't', ' '});
+    put32(out, 20);
+    put16(out, WAV_FORMAT_IMA_ADPCM);
+    put16(out, channels);
+    put32(out, format.sampleRate);
+    put32(out, (uint32_t)((uint64_t)format.sampleRate * blockAlign / perBlock));
+    put16(out, blockAlign);
+    put16(out, 4);
+    put16(out, 2);
+    put16(out, perBlock);
+    out.insert(out.end(), {'f', 'a', 'c', 't'});
+    put32(out, 4);
+    put32(out, frames);
+    out.insert(out.end(), {'d', 'a', 't', 'a'});
+    put32(out, data.size());
+    out.insert(out.end(), data.begin(), data.end());
+
+    FILE* f = fopen(outPath, "wb");
+    if (!f || fwrite(out.data(), 1, out.size(), f) != out.size() || fclose(f) != 0) {
+        perror(outPath);
+        return 1;
+    }
+    printf("%s: %lu frames, %u ch, %lu Hz, %lu bytes of samples (%.1fx smaller than 16-bit), SNR %.1f dB\n",
+           outPath, (unsigned long)frames, channels, (unsigned long)format.sampleRate, (unsigned long)data.size(),
+           (double)frames * channels * 2 / data.size(), noise > 0 ? 10 * log10(signal / noise) : 99.0);
+    return 0;
+}